@@ -40,6 +40,11 @@ int main(int pArgumentCount, char **pArguments)
     bool noDaemon = false;
     bool stop = false;
     bool testnet = false;
+    bool exportOutputs = false;
+    bool importOutputs = false;
+    bool nextIsCommitment = false;
+    NextCash::String snapshotFileName;
+    NextCash::Hash commitment;
 
     if(pArgumentCount < 2)
     {
@@ -52,6 +57,22 @@ int main(int pArgumentCount, char **pArguments)
         start = true;
     else if(std::strcmp(pArguments[1], "stop") == 0)
         stop = true;
+    else if(std::strcmp(pArguments[1], "export_outputs") == 0 ||
+      std::strcmp(pArguments[1], "import_outputs") == 0)
+    {
+        if(pArgumentCount < 3)
+        {
+            std::cerr << "Missing snapshot file name" << std::endl;
+            printHelp(path);
+            return 1;
+        }
+
+        if(std::strcmp(pArguments[1], "export_outputs") == 0)
+            exportOutputs = true;
+        else
+            importOutputs = true;
+        snapshotFileName = pArguments[2];
+    }
     else if(std::strcmp(pArguments[1], "help") == 0)
     {
         printHelp(path);
@@ -63,7 +84,7 @@ int main(int pArgumentCount, char **pArguments)
         return 1;
     }
 
-    for(int i=2;i<pArgumentCount;i++)
+    for(int i=((exportOutputs || importOutputs) ? 3 : 2);i<pArgumentCount;i++)
         if(nextIsPath)
         {
             path = pArguments[i];
@@ -71,6 +92,11 @@ int main(int pArgumentCount, char **pArguments)
                 path += "/";
             nextIsPath = false;
         }
+        else if(nextIsCommitment)
+        {
+            commitment.setHex(pArguments[i]);
+            nextIsCommitment = false;
+        }
         else if(std::strcmp(pArguments[i], "-v") == 0)
             NextCash::Log::setLevel(NextCash::Log::VERBOSE);
         else if(std::strcmp(pArguments[i], "-vv") == 0)
@@ -81,6 +107,8 @@ int main(int pArgumentCount, char **pArguments)
             nextIsPath = true;
         else if(std::strcmp(pArguments[i], "--testnet") == 0)
             testnet = true;
+        else if(std::strcmp(pArguments[i], "--commitment") == 0)
+            nextIsCommitment = true;
         else if(std::strcmp(pArguments[i], "--help") == 0 ||
           std::strcmp(pArguments[i], "-h") == 0)
         {
@@ -138,6 +166,56 @@ int main(int pArgumentCount, char **pArguments)
 
         return 0;
     }
+    else if(exportOutputs || importOutputs)
+    {
+        // Outputs files can't be used by a running daemon at the same time.
+        if(daemonPID(pidFilePath.text()) != 0)
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, MAIN_LOG_NAME,
+              "Daemon is running. Call with \"stop\" command first");
+            return 1;
+        }
+
+        BitCoin::Outputs outputs;
+        unsigned int height;
+        if(exportOutputs)
+        {
+            // Load applies the journal and save puts everything in the data files. The cache is
+            //   loaded at its configured size and not trimmed so the node's cache files are
+            //   saved as they were.
+            BitCoin::Info &info = BitCoin::Info::instance();
+            if(!outputs.load(BitCoin::Info::path(), info.outputsCacheSize,
+              info.outputsCacheDelta) || !outputs.saveFull(1, false) ||
+              !outputs.exportSnapshot(snapshotFileName, commitment))
+            {
+                NextCash::Log::add(NextCash::Log::ERROR, MAIN_LOG_NAME,
+                  "Failed to export outputs snapshot");
+                return 1;
+            }
+
+            height = outputs.height();
+            std::cout << "Outputs snapshot at height " << height << " commitment : " <<
+              commitment.hex().text() << std::endl;
+        }
+        else
+        {
+            if(!outputs.importSnapshot(snapshotFileName, BitCoin::Info::path(), commitment,
+              height))
+            {
+                NextCash::Log::add(NextCash::Log::ERROR, MAIN_LOG_NAME,
+                  "Failed to import outputs snapshot");
+                return 1;
+            }
+
+            std::cout << "Imported outputs snapshot at height " << height << std::endl;
+        }
+
+        // Multiset hash of the unspent outputs to compare with other nodes at this height.
+        if(outputs.commitment(height, commitment))
+            std::cout << "Outputs commitment : " << commitment.hex().text() << std::endl;
+
+        return 0;
+    }
     else if(!start)
     {
         printHelp(path);
@@ -233,10 +311,13 @@ void printHelp(const char *pPath)
     std::cerr << "    help                            -> Display this message" << std::endl;
     std::cerr << "    start                           -> Start daemon" << std::endl;
     std::cerr << "    stop                            -> Stop active daemon" << std::endl;
+    std::cerr << "    export_outputs FILE             -> Write unspent outputs snapshot to FILE" << std::endl;
+    std::cerr << "    import_outputs FILE             -> Create outputs in an empty data directory from snapshot FILE" << std::endl;
     std::cerr << "Options :" << std::endl;
     std::cerr << "    --help or -h                    -> Display this message" << std::endl;
     std::cerr << "    --path PATH                     -> Specify directory for daemon files. Default : " << pPath << std::endl;
     std::cerr << "    --testnet                       -> Run on testnet instead of mainnet" << std::endl;
+    std::cerr << "    --commitment HASH               -> Expected snapshot commitment for import_outputs" << std::endl;
     std::cerr << "    --nodaemon                      -> Don't do daemon fork. (i.e. run in this process)" << std::endl;
     std::cerr << "    -v                              -> Verbose logging" << std::endl;
     std::cerr << "    -vv                             -> Debug logging" << std::endl;
@@ -52,8 +52,43 @@
 #define OUTPUTS_SET_COUNT 1024
 #endif
 
-#ifndef OUTPUTS_SAMPLE_COUNT
-#define OUTPUTS_SAMPLE_COUNT 1024
+// Number of blocks below the tip that keep exact spent heights in the outputs cache. Deeper
+//   spends are kept as a bitmap since they can't be reverted.
+#ifndef OUTPUTS_EXACT_SPENT_DEPTH
+#define OUTPUTS_EXACT_SPENT_DEPTH 2016
+#endif
+
+// Number of recent blocks that outputs commitments are kept for.
+#ifndef OUTPUTS_COMMITMENT_HISTORY
+#define OUTPUTS_COMMITMENT_HISTORY 2016
+#endif
+
+// Size of the outputs journal that triggers a full save of outputs.
+#ifndef OUTPUTS_JOURNAL_MAX_SIZE
+#define OUTPUTS_JOURNAL_MAX_SIZE 67108864 // 64 MiB
+#endif
+
+// Seconds an outputs subset keeps unsaved changes before the flush threads save it, unless
+//   the outputs cache is over its target size.
+#ifndef OUTPUTS_FLUSH_DELAY
+#define OUTPUTS_FLUSH_DELAY 60
+#endif
+
+// Percent of an outputs subset's index entries that are appended out of hash order or removed
+//   that triggers online compaction of the subset.
+#ifndef OUTPUTS_COMPACT_PERCENT
+#define OUTPUTS_COMPACT_PERCENT 25
+#endif
+
+// Bytes per second of outputs data that online compaction can rewrite.
+#ifndef OUTPUTS_COMPACT_RATE
+#define OUTPUTS_COMPACT_RATE 4194304 // 4 MiB
+#endif
+
+// Number of successful signature verifications remembered so transactions that were verified
+//   for the mempool aren't verified again when they are in a block.
+#ifndef SIGNATURE_CACHE_COUNT
+#define SIGNATURE_CACHE_COUNT 524288 // About 50 MiB including hash set nodes and buckets
 #endif
 
 
@@ -21,6 +21,11 @@
 #include "header.hpp"
 #include "chain.hpp"
 
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+
 #define BITCOIN_BLOCK_LOG_NAME "Block"
 
 
@@ -417,6 +422,159 @@ namespace BitCoin
         return true;
     }
 
+    void Block::ProcessThreadData::buildChunks(unsigned int pThreadCount)
+    {
+        // Weigh each transaction by the work to process it. Inputs need an output lookup and
+        //   usually a signature check, and larger transactions take longer to hash.
+        std::vector<unsigned int> weights;
+        std::vector<TransactionOffset> ids;
+        uint64_t totalWeight = 0L;
+        unsigned int offset = 0;
+        weights.reserve(count);
+        ids.reserve(count);
+        for(TransactionList::iterator transaction = block->transactions.begin();
+          transaction != block->transactions.end(); ++transaction, ++offset)
+        {
+            weights.push_back(1 + (*transaction)->inputs.size() + ((*transaction)->size() / 1000));
+            totalWeight += weights.back();
+            ids.emplace_back((*transaction)->hash(), offset);
+        }
+        std::sort(ids.begin(), ids.end());
+
+        // Several chunks per thread so threads that finish early can take more.
+        if(pThreadCount == 0)
+            pThreadCount = 1;
+        uint64_t chunkWeight = totalWeight / (pThreadCount * 8);
+        if(chunkWeight == 0)
+            chunkWeight = 1;
+
+        // Find spends of outputs from the same block. Transactions connected by them are
+        //   grouped with union-find and their edges are kept to order the groups.
+        std::vector<unsigned int> groups(count), parentCounts(count, 0), childStarts(count + 1, 0);
+        std::vector<std::pair<unsigned int, unsigned int> > edges; // Parent, child
+        std::vector<TransactionOffset>::iterator found;
+        unsigned int parent, child;
+        for(offset = 0; offset < count; ++offset)
+            groups[offset] = offset;
+        offset = 0;
+        for(TransactionList::iterator transaction = block->transactions.begin() + 1;
+          transaction != block->transactions.end(); ++transaction)
+        {
+            ++offset;
+            for(std::vector<Input>::iterator input = (*transaction)->inputs.begin();
+              input != (*transaction)->inputs.end(); ++input)
+            {
+                found = std::lower_bound(ids.begin(), ids.end(), input->outpoint.transactionID);
+                if(found == ids.end() || found->id != input->outpoint.transactionID ||
+                  found->offset == offset)
+                    continue;
+
+                edges.emplace_back(found->offset, offset);
+                ++parentCounts[offset];
+                ++childStarts[found->offset + 1];
+
+                // Union the groups
+                parent = found->offset;
+                while(groups[parent] != parent)
+                    parent = groups[parent] = groups[groups[parent]];
+                child = offset;
+                while(groups[child] != child)
+                    child = groups[child] = groups[groups[child]];
+                if(parent < child)
+                    groups[child] = parent;
+                else if(child < parent)
+                    groups[parent] = child;
+            }
+        }
+
+        // Topological order, parents before children. The block order can't be used because
+        //   blocks with canonical transaction order are sorted by ID.
+        std::vector<unsigned int> sorted;
+        sorted.reserve(count);
+        if(edges.size() == 0)
+            for(offset = 0; offset < count; ++offset)
+                sorted.push_back(offset);
+        else
+        {
+            std::vector<unsigned int> children(edges.size());
+            for(offset = 0; offset < count; ++offset)
+                childStarts[offset + 1] += childStarts[offset];
+            std::vector<unsigned int> childOffsets(childStarts.begin(), childStarts.end() - 1);
+            for(std::vector<std::pair<unsigned int, unsigned int> >::iterator edge = edges.begin();
+              edge != edges.end(); ++edge)
+                children[childOffsets[edge->first]++] = edge->second;
+
+            for(offset = 0; offset < count; ++offset)
+                if(parentCounts[offset] == 0)
+                    sorted.push_back(offset);
+            for(unsigned int i = 0; i < sorted.size(); ++i)
+                for(unsigned int j = childStarts[sorted[i]]; j < childStarts[sorted[i] + 1]; ++j)
+                    if(--parentCounts[children[j]] == 0)
+                        sorted.push_back(children[j]);
+
+            // A cycle isn't possible in a valid block. Add what is left so it fails validation.
+            if(sorted.size() < count)
+                for(offset = 0; offset < count; ++offset)
+                    if(parentCounts[offset] > 0)
+                        sorted.push_back(offset);
+        }
+
+        // Group sizes and weights indexed by the group's lowest offset.
+        std::vector<unsigned int> groupSizes(count, 0), groupStarts(count, 0);
+        std::vector<uint64_t> groupWeights(count, 0L);
+        for(offset = 0; offset < count; ++offset)
+        {
+            parent = offset;
+            while(groups[parent] != parent)
+                parent = groups[parent];
+            groups[offset] = parent;
+            ++groupSizes[parent];
+            groupWeights[parent] += weights[offset];
+        }
+
+        // Lay out groups that are at least a chunk first, then the rest in block order.
+        unsigned int position = 0, heavyEnd;
+        for(offset = 0; offset < count; ++offset)
+            if(groupSizes[offset] > 0 && groupWeights[offset] >= chunkWeight)
+            {
+                groupStarts[offset] = position;
+                position += groupSizes[offset];
+            }
+        heavyEnd = position;
+        for(offset = 0; offset < count; ++offset)
+            if(groupSizes[offset] > 0 && groupWeights[offset] < chunkWeight)
+            {
+                groupStarts[offset] = position;
+                position += groupSizes[offset];
+            }
+
+        order.resize(count);
+        for(std::vector<unsigned int>::iterator item = sorted.begin(); item != sorted.end();
+          ++item)
+            order[groupStarts[groups[*item]]++] = *item;
+
+        // Chunks only end at group boundaries so each group is checked by one thread in order.
+        //   Heavy groups are a chunk each and light groups are packed together.
+        unsigned int begin = 0;
+        uint64_t weight = 0L;
+        for(position = 0; position < count; ++position)
+        {
+            weight += weights[order[position]];
+            if(position + 1 < count && groups[order[position + 1]] == groups[order[position]])
+                continue; // Not the end of a group
+
+            if(weight >= chunkWeight || position < heavyEnd)
+            {
+                chunks.push_back(Chunk(begin, position + 1));
+                begin = position + 1;
+                weight = 0L;
+            }
+        }
+
+        if(begin < count)
+            chunks.push_back(Chunk(begin, count));
+    }
+
     void Block::updateOutputsThreadRun(void *pParameter)
     {
         ProcessThreadData *data = (ProcessThreadData *)pParameter;
@@ -428,32 +586,32 @@ namespace BitCoin
         }
 
         Transaction *transaction;
-        unsigned int offset;
+        unsigned int position, offset, end;
         NextCash::Timer fullTime;
         Transaction::CheckStats stats;
-        while(true)
+        while(data->getNext(position, end))
         {
-            transaction = data->getNext(offset);
-            if(transaction == NULL)
-            {
-                NextCash::Log::add(NextCash::Log::DEBUG, BITCOIN_BLOCK_LOG_NAME,
-                  "No more transactions to process");
-                break;
-            }
-
             fullTime.start();
-            if(transaction->updateOutputs(data->chain, data->height, offset == 0, stats))
-                data->markComplete(offset, true);
-            else
+            for(; position < end && data->success; ++position)
             {
-                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_BLOCK_LOG_NAME,
-                  "Transaction %d failed", offset);
-                transaction->print(data->chain->forks(), NextCash::Log::WARNING);
-                data->markComplete(offset, false);
+                offset = data->order[position];
+                transaction = data->block->transactions[offset].pointer();
+                if(transaction->updateOutputs(data->chain, data->height, offset == 0, stats))
+                    data->markComplete(true);
+                else
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_BLOCK_LOG_NAME,
+                      "Transaction %d failed", offset);
+                    transaction->print(data->chain->forks(), NextCash::Log::WARNING);
+                    data->markComplete(false);
+                }
             }
             fullTime.stop();
         }
 
+        NextCash::Log::add(NextCash::Log::DEBUG, BITCOIN_BLOCK_LOG_NAME,
+          "No more transactions to process");
+
         data->statsLock.lock();
         data->fullTime += fullTime.microseconds();
         data->stats += stats;
@@ -478,84 +636,27 @@ namespace BitCoin
             return false;
         addTime.stop();
 
-        ProcessThreadData threadData(pChain, this, pHeight, transactions.begin(),
-          transactions.size());
-        NextCash::Thread *threads[pThreadCount];
-        int32_t lastReport = getTime();
-        unsigned int i;
-        NextCash::String threadName;
-
-        // Start threads
-        for(i = 0; i < pThreadCount; ++i)
-        {
-            threadName.writeFormatted("Update Block %d", i);
-            threads[i] = new NextCash::Thread(threadName, updateOutputsThreadRun, &threadData);
-        }
-
-        NextCash::Thread::sleep(1);
-
-        // Monitor threads
-        unsigned int completedCount;
-        bool report;
-        bool *complete;
-        unsigned int checkCount = 0;
-        while(threadData.success)
-        {
-            if(threadData.offset == threadData.count)
-            {
-                if(++checkCount > 50)
-                {
-                    checkCount = 0;
-                    report = getTime() - lastReport > 10;
-                }
-                else
-                    report = false;
-                completedCount = 0;
-                complete = threadData.complete;
-                for(i = 0; i < threadData.count; ++i, ++complete)
-                    if(*complete)
-                        ++completedCount;
-                    else if(report)
-                        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_BLOCK_LOG_NAME,
-                          "Update block %d waiting for transaction %d", pHeight, i);
-
-                if(report)
-                    lastReport = getTime();
-
-                if(completedCount == threadData.count)
-                    break;
-            }
-            else if(++checkCount > 50)
-            {
-                checkCount = 0;
-                if(getTime() - lastReport > 10)
-                {
-                    completedCount = 0;
-                    complete = threadData.complete;
-                    for(i = 0; i < threadData.count; ++i, ++complete)
-                        if(*complete)
-                            ++completedCount;
-
-                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_BLOCK_LOG_NAME,
-                      "Update block %d is %2d%% Complete", pHeight,
-                      (int)(((float)completedCount / (float)threadData.count) * 100.0f));
+        // Pull spent outputs into the cache in file order so the update doesn't wait on reads.
+        pChain->outputs().prefetch(transactions, pThreadCount);
 
-                    lastReport = getTime();
-                }
-            }
+        ProcessThreadData threadData(pChain, this, pHeight, pThreadCount);
 
-            NextCash::Thread::sleep(10);
-        }
-
-        // Delete threads
-        NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_BLOCK_LOG_NAME,
-          "Deleting update block %d threads", pHeight);
-        for(i = 0; i < pThreadCount; ++i)
-            delete threads[i];
+        // Threads of the chain's worker pool and this thread take transactions until there are none
+        //   left, so run returns when they are all complete or one has failed. It waits on a
+        //   condition instead of polling so the block is done as soon as the last one is.
+        pChain->workers().run(updateOutputsThreadRun, &threadData, pThreadCount);
 
         if(!threadData.success)
             return false;
 
+        if(threadData.completeCount != threadData.count)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_BLOCK_LOG_NAME,
+              "Update block %d completed %d of %d transactions", pHeight,
+              (unsigned int)threadData.completeCount, threadData.count);
+            return false;
+        }
+
         for(TransactionList::iterator transaction = transactions.begin() + 1;
           transaction != transactions.end(); ++transaction)
             mFees += (*transaction)->fee();
@@ -660,37 +761,40 @@ namespace BitCoin
         }
 
         Transaction *transaction;
-        unsigned int offset;
+        unsigned int position, offset, end;
         NextCash::Timer fullTime, processTime;
         Transaction::CheckStats stats;
+        SignatureQueue::EntryList signatures;
 
         fullTime.start();
-        while(true)
+        while(data->getNext(position, end))
         {
-            transaction = data->getNext(offset);
-            if(transaction == NULL)
-            {
-                NextCash::Log::add(NextCash::Log::DEBUG, BITCOIN_BLOCK_LOG_NAME,
-                  "No more transactions to process");
-                break;
-            }
-
             processTime.start();
-            transaction->check(data->chain, data->block->header.hash(), data->height, offset == 0,
-              data->block->header.version, stats);
-            if(transaction->isVerified())
-                data->markComplete(offset, true);
-            else
+            for(; position < end && data->success; ++position)
             {
-                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_BLOCK_LOG_NAME,
-                  "Transaction %d failed : %s", offset, transaction->hash().hex().text());
-                transaction->print(data->chain->forks(), NextCash::Log::WARNING);
-                data->markComplete(offset, false);
+                offset = data->order[position];
+                transaction = data->block->transactions[offset].pointer();
+                transaction->check(data->chain, data->block->header.hash(), data->height,
+                  offset == 0, data->block->header.version, stats, &signatures);
+                if(transaction->isVerified())
+                    data->markComplete(true);
+                else
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_BLOCK_LOG_NAME,
+                      "Transaction %d failed : %s", offset, transaction->hash().hex().text());
+                    transaction->print(data->chain->forks(), NextCash::Log::WARNING);
+                    data->markComplete(false);
+                }
             }
             processTime.stop();
         }
         fullTime.stop();
 
+        NextCash::Log::add(NextCash::Log::DEBUG, BITCOIN_BLOCK_LOG_NAME,
+          "No more transactions to process");
+
+        data->signatures.add(signatures);
+
         data->statsLock.lock();
         data->stats += stats;
         data->processTime += processTime.microseconds();
@@ -727,91 +831,47 @@ namespace BitCoin
 #endif
         addTime.stop();
 
-        ProcessThreadData threadData(pChain, this, pHeight, transactions.begin(),
-          transactions.size());
-        NextCash::Thread *threads[pThreadCount];
-        int32_t lastReport = getTime();
-        unsigned int i;
-        NextCash::String threadName;
+        // Pull spent outputs into the cache in file order so validation doesn't wait on reads.
+        NextCash::Timer prefetchTime(true);
+        unsigned int prefetchCount = pChain->outputs().prefetch(transactions, pThreadCount);
+        prefetchTime.stop();
 
-        // Start threads
-        for(i = 0; i < pThreadCount; ++i)
-        {
-            threadName.writeFormatted("Process Block %d", i);
-            threads[i] = new NextCash::Thread(threadName, processThreadRun, &threadData);
-        }
+        ProcessThreadData threadData(pChain, this, pHeight, pThreadCount);
 
-        NextCash::Thread::sleep(1);
+        // Threads of the chain's worker pool and this thread take transactions until there are none
+        //   left, so run returns when they are all complete or one has failed. It waits on a
+        //   condition instead of polling so the block is done as soon as the last one is.
+        pChain->workers().run(processThreadRun, &threadData, pThreadCount);
 
-        // Monitor threads
-        unsigned int completedCount;
-        bool report;
-        bool *complete;
-        unsigned int checkCount = 0;
-        while(threadData.success)
-        {
-            if(threadData.offset == threadData.count)
-            {
-                if(++checkCount > 50)
-                {
-                    checkCount = 0;
-                    report = getTime() - lastReport > 10;
-                }
-                else
-                    report = false;
-                completedCount = 0;
-                complete = threadData.complete;
-                for(i = 0; i < threadData.count; ++i, ++complete)
-                    if(*complete)
-                        ++completedCount;
-                    else if(report)
-                        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_BLOCK_LOG_NAME,
-                          "Process block %d waiting for transaction %d", pHeight, i);
-
-                if(report)
-                    lastReport = getTime();
-
-                if(completedCount == threadData.count)
-                    break;
-            }
-            else if(++checkCount > 50)
-            {
-                checkCount = 0;
-                if(getTime() - lastReport > 10)
-                {
-                    completedCount = 0;
-                    complete = threadData.complete;
-                    for(i = 0; i < threadData.count; ++i, ++complete)
-                        if(*complete)
-                            ++completedCount;
-
-                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_BLOCK_LOG_NAME,
-                      "Process block %d is %2d%% Complete", pHeight,
-                      (int)(((float)completedCount / (float)threadData.count) * 100.0f));
-
-                    lastReport = getTime();
-                }
-            }
+        if(!threadData.success)
+            return false;
 
-            NextCash::Thread::sleep(10);
+        if(threadData.completeCount != threadData.count)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_BLOCK_LOG_NAME,
+              "Process block %d completed %d of %d transactions", pHeight,
+              (unsigned int)threadData.completeCount, threadData.count);
+            return false;
         }
 
-        // Delete threads
-        NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_BLOCK_LOG_NAME,
-          "Deleting process block %d threads", pHeight);
-        for(i = 0; i < pThreadCount; ++i)
-            delete threads[i];
-
-        if(!threadData.success)
+        // Verify the signatures deferred while processing scripts.
+        NextCash::Timer signatureTime(true);
+        if(!threadData.signatures.verify(pChain->workers(), pThreadCount))
+        {
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_BLOCK_LOG_NAME,
+              "Block %d has invalid signatures", pHeight);
             return false;
+        }
+        signatureTime.stop();
 
         elapsed.stop();
 
         NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_BLOCK_LOG_NAME,
-          "Multi threaded block times Threads %d,Add %d,TXO %d,Scr %d,Proc %d,Full %d,Elapsed %d",
-          pThreadCount, addTime.milliseconds(),
+          "Multi threaded block times Threads %d,Add %d,Pre %d,TXO %d,Scr %d,Proc %d,Full %d,Sig %d (%d),Elapsed %d",
+          pThreadCount, addTime.milliseconds(), prefetchTime.milliseconds(),
           threadData.stats.outputsTimer.milliseconds(), threadData.stats.scriptTimer.milliseconds(),
-          threadData.processTime / 1000L, threadData.fullTime / 1000L, elapsed.milliseconds());
+          threadData.processTime / 1000L, threadData.fullTime / 1000L,
+          signatureTime.milliseconds(), threadData.signatures.size(), elapsed.milliseconds());
 
         if(threadData.stats.spentAges.size() > 0)
         {
@@ -821,8 +881,9 @@ namespace BitCoin
                 totalSpentAge += *spentAge;
             unsigned int averageSpentAge = totalSpentAge / threadData.stats.spentAges.size();
             NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_BLOCK_LOG_NAME,
-              "Average spent age for block %d is %d for %d inputs (%d pulled)", pHeight, averageSpentAge,
-              threadData.stats.spentAges.size(), threadData.stats.outputPulls);
+              "Average spent age for block %d is %d for %d inputs (%d prefetched, %d pulled)",
+              pHeight, averageSpentAge, threadData.stats.spentAges.size(), prefetchCount,
+              threadData.stats.outputPulls);
         }
 
         for(TransactionList::iterator transaction = transactions.begin() + 1;
@@ -1064,8 +1125,37 @@ namespace BitCoin
         bool readOutput(unsigned int pBlockOffset, unsigned int pTransactionOffset,
           unsigned int pOutputIndex, NextCash::Hash &pTransactionID, Output &pOutput);
 
+        // Outputs undo data for blocks in the file. Writing undo data for a block replaces
+        //   any undo data for it and the blocks after it.
+        bool writeUndo(unsigned int pOffset, const OutputsUndo &pUndo);
+        bool readUndo(unsigned int pOffset, OutputsUndo &pUndo);
+
     private:
 
+        /* Undo file format
+         *   Block records in block order
+         *     Block offset in file (uint32)
+         *     Data size (uint32)
+         *     Data (OutputsUndo)
+         *     CRC32 of data (uint32)
+         */
+        static NextCash::String undoFilePathName(unsigned int pID)
+          { return filePathName(pID) + ".undo"; }
+
+        // Returns the file offset of the undo record for the block at pOffset or the first block
+        //   after it. Returns the end of the valid records if there isn't one.
+        // If pData is not NULL and the record is for the block at pOffset then its data is read
+        //   into pData.
+        NextCash::stream_size findUndo(unsigned int pOffset, NextCash::Buffer *pData = NULL);
+        bool truncateUndo(NextCash::stream_size pSize);
+
+        // Undo file offsets of the records by block offset so each block's record is found
+        //   without reading the records before it. The file is scanned once on first use.
+        void loadUndoOffsets();
+        bool mUndoLoaded;
+        NextCash::stream_size mUndoOffsets[MAX_COUNT];
+        NextCash::stream_size mUndoSize; // End of valid records
+
         /* File format
          *   Start string
          *   CRC32 of data after CRC in file
@@ -1202,6 +1292,9 @@ namespace BitCoin
                 }
         }
 
+        if(NextCash::fileExists(undoFilePathName(pFileID)))
+            NextCash::removeFile(undoFilePathName(pFileID));
+
         if(NextCash::removeFile(filePathName(pFileID)))
         {
             NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_BLOCK_LOG_NAME,
@@ -1278,6 +1371,8 @@ namespace BitCoin
         mID = pID;
         mModified = false;
         mCount = INVALID_COUNT;
+        mUndoLoaded = false;
+        mUndoSize = 0;
 
         if(!openFile(pCreate))
         {
@@ -1701,7 +1796,7 @@ namespace BitCoin
         return true;
     }
 
-    bool Block::add(unsigned int pHeight, Block *pBlock)
+    bool Block::add(unsigned int pHeight, Block *pBlock, const OutputsUndo *pUndo)
     {
         BlockFile *file = BlockFile::get(BlockFile::fileID(pHeight), true, true);
         if(file == NULL)
@@ -1757,10 +1852,198 @@ namespace BitCoin
         }
 
         bool success = file->writeBlock(pBlock);
+        if(success && pUndo != NULL && !file->writeUndo(BlockFile::fileOffset(pHeight), *pUndo))
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_BLOCK_LOG_NAME,
+              "Block file %08x failed to write undo data for block (%d)", file->id(), pHeight);
         file->unlock(true);
         return success;
     }
 
+    bool Block::getUndo(unsigned int pHeight, OutputsUndo &pUndo)
+    {
+        BlockFile *file = BlockFile::get(BlockFile::fileID(pHeight), false);
+        if(file == NULL)
+            return false;
+
+        bool success = file->readUndo(BlockFile::fileOffset(pHeight), pUndo);
+        file->unlock(false);
+        return success;
+    }
+
+    void BlockFile::loadUndoOffsets()
+    {
+        if(mUndoLoaded)
+            return;
+
+        mUndoLoaded = true;
+        mUndoSize = 0;
+        for(unsigned int i = 0; i < MAX_COUNT; ++i)
+            mUndoOffsets[i] = NextCash::INVALID_STREAM_SIZE;
+
+        NextCash::String undoPathName = undoFilePathName(mID);
+        if(!NextCash::fileExists(undoPathName))
+            return;
+
+        NextCash::FileInputStream file(undoPathName);
+        if(!file.isValid())
+            return;
+        file.setInputEndian(NextCash::Endian::LITTLE);
+        file.setReadOffset(0);
+
+        NextCash::Buffer data, crc;
+        data.setEndian(NextCash::Endian::LITTLE);
+        crc.setEndian(NextCash::Endian::LITTLE);
+        NextCash::stream_size recordOffset;
+        unsigned int blockOffset, dataSize, lastBlockOffset = 0;
+        while(file.remaining() >= 8)
+        {
+            recordOffset = file.readOffset();
+            blockOffset = file.readUnsignedInt();
+            dataSize = file.readUnsignedInt();
+            if(file.remaining() < dataSize + 4)
+                break; // Partially written record
+
+            data.clear();
+            data.writeStream(&file, dataSize);
+
+            NextCash::Digest digest(NextCash::Digest::CRC32);
+            digest.setOutputEndian(NextCash::Endian::LITTLE);
+            digest.writeStream(&data, data.remaining());
+            crc.clear();
+            digest.getResult(&crc);
+            if(crc.readUnsignedInt() != file.readUnsignedInt())
+            {
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_BLOCK_LOG_NAME,
+                  "Block file %08x undo data failed CRC check for offset %d", mID, blockOffset);
+                break;
+            }
+
+            // Records are in block order.
+            if(blockOffset >= MAX_COUNT || (mUndoSize > 0 && blockOffset <= lastBlockOffset))
+                break;
+
+            mUndoOffsets[blockOffset] = recordOffset;
+            lastBlockOffset = blockOffset;
+            mUndoSize = file.readOffset();
+        }
+    }
+
+    NextCash::stream_size BlockFile::findUndo(unsigned int pOffset, NextCash::Buffer *pData)
+    {
+        loadUndoOffsets();
+
+        for(unsigned int i = pOffset; i < MAX_COUNT; ++i)
+            if(mUndoOffsets[i] != NextCash::INVALID_STREAM_SIZE)
+            {
+                if(pData != NULL && i == pOffset)
+                {
+                    NextCash::FileInputStream file(undoFilePathName(mID));
+                    if(!file.isValid())
+                        return mUndoOffsets[i];
+                    file.setInputEndian(NextCash::Endian::LITTLE);
+                    file.setReadOffset(mUndoOffsets[i] + 4);
+                    unsigned int dataSize = file.readUnsignedInt();
+
+                    NextCash::Buffer data, crc;
+                    data.setEndian(NextCash::Endian::LITTLE);
+                    crc.setEndian(NextCash::Endian::LITTLE);
+                    data.writeStream(&file, dataSize);
+
+                    NextCash::Digest digest(NextCash::Digest::CRC32);
+                    digest.setOutputEndian(NextCash::Endian::LITTLE);
+                    digest.writeStream(&data, data.remaining());
+                    digest.getResult(&crc);
+                    if(crc.readUnsignedInt() == file.readUnsignedInt())
+                    {
+                        data.setReadOffset(0);
+                        pData->clear();
+                        pData->writeStream(&data, data.remaining());
+                    }
+                    else
+                        NextCash::Log::addFormatted(NextCash::Log::WARNING,
+                          BITCOIN_BLOCK_LOG_NAME,
+                          "Block file %08x undo data failed CRC check for offset %d", mID,
+                          pOffset);
+                }
+                return mUndoOffsets[i];
+            }
+
+        return mUndoSize;
+    }
+
+    bool BlockFile::truncateUndo(NextCash::stream_size pSize)
+    {
+        loadUndoOffsets();
+        for(unsigned int i = 0; i < MAX_COUNT; ++i)
+            if(mUndoOffsets[i] != NextCash::INVALID_STREAM_SIZE && mUndoOffsets[i] >= pSize)
+                mUndoOffsets[i] = NextCash::INVALID_STREAM_SIZE;
+        if(mUndoSize > pSize)
+            mUndoSize = pSize;
+
+        NextCash::String undoPathName = undoFilePathName(mID);
+        if(!NextCash::fileExists(undoPathName))
+            return true;
+
+        if(truncate(undoPathName.text(), pSize) != 0)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_BLOCK_LOG_NAME,
+              "Block file %08x failed to truncate undo file : %s", mID, std::strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    bool BlockFile::writeUndo(unsigned int pOffset, const OutputsUndo &pUndo)
+    {
+        if(pOffset >= MAX_COUNT)
+            return false;
+
+        NextCash::Buffer data;
+        data.setEndian(NextCash::Endian::LITTLE);
+        pUndo.write(&data);
+
+        NextCash::Digest digest(NextCash::Digest::CRC32);
+        digest.setOutputEndian(NextCash::Endian::LITTLE);
+        digest.writeStream(&data, data.remaining());
+        data.setReadOffset(0);
+
+        // Replace undo data for this block and any after it.
+        NextCash::stream_size writeOffset = findUndo(pOffset);
+        if(!truncateUndo(writeOffset))
+            return false;
+
+        NextCash::FileOutputStream file(undoFilePathName(mID));
+        if(!file.isValid())
+            return false;
+        file.setOutputEndian(NextCash::Endian::LITTLE);
+        file.setWriteOffset(writeOffset);
+        file.writeUnsignedInt(pOffset);
+        file.writeUnsignedInt(data.length());
+        file.writeStream(&data, data.length());
+        digest.getResult(&file);
+        file.flush();
+
+        mUndoOffsets[pOffset] = writeOffset;
+        mUndoSize = file.writeOffset();
+        return true;
+    }
+
+    bool BlockFile::readUndo(unsigned int pOffset, OutputsUndo &pUndo)
+    {
+        if(pOffset >= MAX_COUNT)
+            return false;
+
+        NextCash::Buffer data;
+        data.setEndian(NextCash::Endian::LITTLE);
+        findUndo(pOffset, &data);
+        if(data.length() == 0)
+            return false;
+
+        data.setReadOffset(0);
+        return pUndo.read(&data);
+    }
+
     bool BlockFile::removeBlocksAbove(unsigned int pOffset)
     {
         if(!openFile())
@@ -1836,6 +2119,8 @@ namespace BitCoin
         mCount = pOffset + 1;
         mModified = true;
 
+        truncateUndo(findUndo(pOffset + 1));
+
         if(!NextCash::renameFile(swapFilePathName, mFilePathName))
         {
             NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_BLOCK_LOG_NAME,
@@ -20,6 +20,8 @@
 #include "outputs.hpp"
 #include "bloom_filter.hpp"
 
+#include <atomic>
+
 
 namespace BitCoin
 {
@@ -88,8 +90,12 @@ namespace BitCoin
         static bool getOutput(unsigned int pHeight, unsigned int pTransactionOffset,
           unsigned int pOutputIndex, NextCash::Hash &pTransactionID, Output &pOutput);
 
-        // Add block to appropriate block file.
-        static bool add(unsigned int pHeight, Block *pBlock);
+        // Add block to appropriate block file. Outputs undo data is saved with the block when
+        //   pUndo is provided.
+        static bool add(unsigned int pHeight, Block *pBlock, const OutputsUndo *pUndo = NULL);
+
+        // Read outputs undo data saved with a block. Returns false if there isn't any.
+        static bool getUndo(unsigned int pHeight, OutputsUndo &pUndo);
 
         static bool revertToHeight(unsigned int pHeight);
 
@@ -114,59 +120,90 @@ namespace BitCoin
         public:
 
             ProcessThreadData(Chain *pChain, Block *pBlock, unsigned int pHeight,
-              TransactionList::iterator pTransactionsBegin, unsigned int pCount) :
-              mutex("ProcessThreadData"), statsLock("Stats")
+              unsigned int pThreadCount) : statsLock("Stats")
             {
                 chain = pChain;
                 block = pBlock;
                 height = pHeight;
-                transaction = pTransactionsBegin;
-                count = pCount;
-                offset = 0;
+                count = pBlock->transactions.size();
+                nextChunk = 0;
                 success = true;
-                complete = new bool[count];
-                std::memset(complete, 0, count);
+                completeCount = 0;
                 processTime = 0L;
                 fullTime = 0L;
+                buildChunks(pThreadCount);
             }
-            ~ProcessThreadData()
+
+            // Range of order claimed by one thread at a time.
+            class Chunk
             {
-                delete[] complete;
-            }
+            public:
+
+                Chunk(unsigned int pBegin, unsigned int pEnd) { begin = pBegin; end = pEnd; }
+
+                unsigned int begin, end;
+
+            };
+
+            // Used to find the spends of outputs from the same block.
+            class TransactionOffset
+            {
+            public:
+
+                TransactionOffset(const NextCash::Hash &pID, unsigned int pOffset) : id(pID)
+                  { offset = pOffset; }
+
+                NextCash::Hash id;
+                unsigned int offset;
+
+                bool operator <(const TransactionOffset &pRight) const
+                  { return id.compare(pRight.id) < 0; }
+                bool operator <(const NextCash::Hash &pRight) const
+                  { return id.compare(pRight) < 0; }
+            };
 
-            NextCash::Mutex mutex;
             Chain *chain;
             Block *block;
-            unsigned int height, offset, count;
-            TransactionList::iterator transaction;
-            bool success;
-            bool *complete;
+            unsigned int height, count;
+            // Transaction offsets with transactions that spend outputs from the same block
+            //   grouped together, parents first.
+            std::vector<unsigned int> order;
+            std::vector<Chunk> chunks;
+            std::atomic<unsigned int> nextChunk;
+            std::atomic<bool> success; // Cleared by the first failure so the rest are skipped.
+            std::atomic<unsigned int> completeCount;
             NextCash::Mutex statsLock;
             uint64_t processTime, fullTime;
             Transaction::CheckStats stats;
+            SignatureQueue signatures; // Verified after all scripts are processed.
 
-            Transaction *getNext(unsigned int &pOffset)
+            // Group transactions that depend on each other through in block spends, order each
+            //   group parents first, and pack whole groups into chunks of about the same amount
+            //   of work so each group is checked by one thread in order. Groups that are at least
+            //   a chunk are a chunk each and are first so they don't finish after the rest.
+            void buildChunks(unsigned int pThreadCount);
+
+            // Claim the next range of order. Returns false when there are none left or a
+            //   transaction has failed.
+            bool getNext(unsigned int &pBegin, unsigned int &pEnd)
             {
-                Transaction *result = NULL;
-                mutex.lock();
-                if(success && offset < count)
-                {
-                    pOffset = offset;
-                    result = transaction->pointer();
-                    ++transaction;
-                    ++offset;
-                }
-                else
-                    pOffset = 0xffffffff;
-                mutex.unlock();
-                return result;
+                if(!success)
+                    return false;
+
+                unsigned int offset = nextChunk.fetch_add(1);
+                if(offset >= chunks.size())
+                    return false;
+
+                pBegin = chunks[offset].begin;
+                pEnd = chunks[offset].end;
+                return true;
             }
 
-            void markComplete(unsigned int pOffset, bool pValid)
+            void markComplete(bool pValid)
             {
-                complete[pOffset] = true;
                 if(!pValid)
                     success = false;
+                ++completeCount;
             }
 
         };
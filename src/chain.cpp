@@ -28,7 +28,7 @@
 
 namespace BitCoin
 {
-    Chain::Chain() : mInfo(Info::instance()), mPendingLock("Chain Pending"),
+    Chain::Chain() : mWorkers("Chain"), mInfo(Info::instance()), mPendingLock("Chain Pending"),
       mProcessMutex("Chain Process"), mHeadersLock("Chain Headers"), mMemPool(this),
       mBranchLock("Chain Branches"), mBlockStatLock("Block Stat")
     {
@@ -563,6 +563,7 @@ namespace BitCoin
             }
 
         NextCash::Hash hash;
+        bool outputsReverted = false;
         while(headerHeight() >= pHeight)
         {
             if(!getHash(headerHeight(), hash,
@@ -592,8 +593,21 @@ namespace BitCoin
                 NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_CHAIN_LOG_NAME,
                   "Reverting block (%d) : %s", blockHeight(), hash.hex().text());
 
+                // Outputs are reverted with the undo data saved with the block when it is
+                //   available, so the block is only required without it. It is still read to
+                //   return its transactions to the mempool.
+                OutputsUndo undo;
+                bool undoFound = Block::getUndo(blockHeight(), undo);
+                bool blockNeeded = !undoFound;
+#ifndef DISABLE_ADDRESSES
+                blockNeeded = true; // Addresses are removed with the block's transactions.
+#endif
                 BlockReference block = getBlock(blockHeight());
-                if(!block)
+                if(!block && !blockNeeded)
+                    NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_CHAIN_LOG_NAME,
+                      "Failed to get block (%d) to return transactions to mempool",
+                      blockHeight());
+                if(blockNeeded && !block)
                 {
                     NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_CHAIN_LOG_NAME,
                       "Failed to get block (%d) to revert", blockHeight());
@@ -608,7 +622,8 @@ namespace BitCoin
                     return false;
                 }
 
-                if(!mOutputs.revert(block->transactions, blockHeight()))
+                if(undoFound ? !mOutputs.revert(undo, blockHeight()) :
+                  !mOutputs.revert(block->transactions, blockHeight()))
                 {
                     NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_CHAIN_LOG_NAME,
                       "Failed to revert outputs from block (%d) to revert", blockHeight());
@@ -623,7 +638,10 @@ namespace BitCoin
                     return false;
                 }
 
-                mMemPool.revert(block->transactions, false);
+                outputsReverted = true;
+
+                if(block)
+                    mMemPool.revert(block->transactions, false);
 
 #ifndef DISABLE_ADDRESSES
                 mAddresses.remove(block->transactions, blockHeight());
@@ -655,6 +673,12 @@ namespace BitCoin
         saveAccumulatedWork();
 
         bool success = true;
+
+        // Reverts are journaled so blocks that flushes already saved are undone again after a
+        //   crash. Only save when the journal couldn't record them.
+        if(outputsReverted && mOutputs.journalNeedsSave() &&
+          !mOutputs.saveFull(mInfo.threadCount))
+            success = false;
 #ifdef LOW_MEM
         // Rebuild recent header hashes
         mLastHashes.clear();
@@ -1475,10 +1499,14 @@ namespace BitCoin
 
         NextCash::Timer timer(true);
         bool success = true, fullyValidated = true;
+
+        // Flushes wait until the block is journaled or reverted.
+        mOutputs.beginBlock();
+
         if(mApprovedBlockHeight >= mNextBlockHeight) // Just update transaction outputs
         {
             fullyValidated = false;
-            if(pBlock->size() > 500000) // Enough to cover overhead of creating threads.
+            if(mWorkers.threadCount() > 0 && pBlock->transactions.size() > 1)
                 success = pBlock->updateOutputsMultiThreaded(this, mNextBlockHeight,
                   mInfo.threadCount);
             else
@@ -1504,7 +1532,7 @@ namespace BitCoin
             }
 #endif
 
-            if(pBlock->size() > 250000) // Enough to cover overhead of creating threads.
+            if(mWorkers.threadCount() > 0 && pBlock->transactions.size() > 1)
                 success = pBlock->processMultiThreaded(this, mNextBlockHeight, mInfo.threadCount);
             else
                 success = pBlock->processSingleThreaded(this, mNextBlockHeight);
@@ -1522,16 +1550,23 @@ namespace BitCoin
         {
             mMemPool.revert(pBlock->transactions, true);
             mOutputs.revert(pBlock->transactions, mNextBlockHeight);
+            mOutputs.endBlock();
             revert(mNextBlockHeight - 1, LOCK_PROCESS);
             mProcessMutex.unlock();
             return false;
         }
 
-        // Add the block to the chain
-        if(!Block::add(mNextBlockHeight, pBlock.pointer()))
+        // Add the block to the chain with undo data so it can be reverted without reading it.
+        OutputsUndo undo;
+        bool undoValid = mOutputs.getUndo(pBlock->transactions, undo);
+        if(!undoValid)
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_CHAIN_LOG_NAME,
+              "Failed to get outputs undo data for block (%d)", mNextBlockHeight);
+        if(!Block::add(mNextBlockHeight, pBlock.pointer(), undoValid ? &undo : NULL))
         {
             mMemPool.revert(pBlock->transactions, true);
             mOutputs.revert(pBlock->transactions, mNextBlockHeight);
+            mOutputs.endBlock();
 #ifndef DISABLE_ADDRESSES
             mAddresses.remove(pBlock->transactions, mNextBlockHeight);
 #endif
@@ -1540,6 +1575,26 @@ namespace BitCoin
             return false;
         }
 
+        // Without a journal record nothing recovers the block's outputs after a crash, so save
+        //   them before flushes are allowed to write part of the block.
+        if(!mOutputs.journal(pBlock->transactions, mNextBlockHeight))
+        {
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_CHAIN_LOG_NAME,
+              "Failed to journal outputs for block (%d). Saving outputs", mNextBlockHeight);
+            if(!mOutputs.saveFull(mInfo.threadCount))
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_CHAIN_LOG_NAME,
+                  "Failed to save outputs for block (%d)", mNextBlockHeight);
+                mMemPool.revert(pBlock->transactions, true);
+                mOutputs.revert(pBlock->transactions, mNextBlockHeight);
+                mOutputs.endBlock();
+                revert(mNextBlockHeight - 1, LOCK_PROCESS);
+                mProcessMutex.unlock();
+                return false;
+            }
+        }
+        mOutputs.endBlock();
+
         mMemPool.finalize(pBlock->transactions);
 
 #ifndef DISABLE_ADDRESSES
@@ -2210,8 +2265,11 @@ namespace BitCoin
             block = Block::getBlock(0);
             if(block)
             {
+                mOutputs.beginBlock();
                 if(block->updateOutputsSingleThreaded(this, 0))
                 {
+                    mOutputs.journal(block->transactions, 0);
+                    mOutputs.endBlock();
                     timer.stop();
                     NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_CHAIN_LOG_NAME,
                       "Updated outputs for genesis block (%d trans) (%d KB) (%d ms)",
@@ -2223,6 +2281,7 @@ namespace BitCoin
                       "Failed to update outputs for genesis block : %s",
                       block->header.hash().hex().text());
                     mOutputs.revert(block->transactions, 0);
+                    mOutputs.endBlock();
                     mOutputs.saveFull(mInfo.threadCount);
                     return false;
                 }
@@ -2254,12 +2313,20 @@ namespace BitCoin
             block = Block::getBlock(currentHeight);
             if(block)
             {
-                if(block->size() > 500000) // Enough to cover overhead of creating threads.
+                mOutputs.beginBlock();
+                if(mWorkers.threadCount() > 0 && block->transactions.size() > 1)
                     success = block->updateOutputsMultiThreaded(this, currentHeight,
                       mInfo.threadCount);
                 else
                     success = block->updateOutputsSingleThreaded(this, currentHeight);
 
+                // Save when the journal fails since nothing else would recover the block.
+                if(success && !mOutputs.journal(block->transactions, currentHeight))
+                    success = mOutputs.saveFull(mInfo.threadCount);
+                if(!success)
+                    mOutputs.revert(block->transactions, currentHeight);
+                mOutputs.endBlock();
+
                 timer.stop();
                 if(success)
                 {
@@ -2272,7 +2339,6 @@ namespace BitCoin
                     NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_CHAIN_LOG_NAME,
                       "Failed to update outputs for block %d : %s", currentHeight,
                       block->header.hash().hex().text());
-                    mOutputs.revert(block->transactions, currentHeight);
                     mOutputs.saveFull(mInfo.threadCount);
                     return false;
                 }
@@ -2287,7 +2353,8 @@ namespace BitCoin
 
             if(getTime() - lastCheckTime > 60)
             {
-                if(mOutputs.cacheNeedsTrim())
+                // Flush threads save and trim in the background.
+                if(!mOutputs.isFlushing() && mOutputs.cacheNeedsTrim())
                 {
                     if(!mOutputs.saveFull(mInfo.threadCount))
                         return false;
@@ -2413,6 +2480,9 @@ namespace BitCoin
     {
         bool success = true;
 
+        // Stop background output flushes so nothing is written after this save.
+        mOutputs.stopFlush();
+
         if(!saveAccumulatedWork())
             success = false;
         if(!mForks.save())
@@ -2437,6 +2507,8 @@ namespace BitCoin
         bool success;
         if(pFast)
             success = mOutputs.saveCache();
+        else if(mOutputs.isFlushing() && !mOutputs.journalNeedsSave())
+            success = true; // Flush threads are saving outputs and the journal covers the rest.
         else
             success = mOutputs.saveFull(mInfo.threadCount);
 #ifndef DISABLE_ADDRESSES
@@ -2920,9 +2992,19 @@ namespace BitCoin
                     return false;
 #endif
 
+                // Threads shared by block processing and outputs. The thread that submits work
+                //   to them also works so start one less than the thread count.
+                if(mInfo.threadCount > 1)
+                    mWorkers.start(mInfo.threadCount - 1);
+                mOutputs.setWorkers(&mWorkers);
+
                 // Load transaction outputs
                 success = success && mOutputs.load(mInfo.path(), mInfo.outputsCacheSize,
-                  mInfo.outputsCacheDelta);
+                  mInfo.outputsCacheDelta, mInfo.threadCount);
+
+                // Save modified outputs in the background while blocks are processed.
+                if(success)
+                    mOutputs.startFlush(mInfo.threadCount);
 
                 // Update transaction outputs if they aren't up to current chain block height
                 success = success && updateOutputs();
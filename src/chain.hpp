@@ -18,6 +18,7 @@
 #include "block.hpp"
 #include "outputs.hpp"
 #include "mem_pool.hpp"
+#include "worker_pool.hpp"
 #ifndef DISABLE_ADDRESSES
 #include "addresses.hpp"
 #endif
@@ -209,6 +210,7 @@ namespace BitCoin
           { return mLastFullPendingOffset + mNextBlockHeight - 1; }
 
         Outputs &outputs() { return mOutputs; }
+        WorkerPool &workers() { return mWorkers; }
         Forks &forks() { return mForks; }
         MemPool &memPool() { return mMemPool; }
 #ifndef DISABLE_ADDRESSES
@@ -331,9 +333,14 @@ namespace BitCoin
         // Save transaction outputs and addresses databases.
         bool saveData(bool pFast);
 #ifndef DISABLE_ADDRESSES
-        bool saveDataNeeded() { return mOutputs.cacheNeedsTrim() || mAddresses.needsPurge(); }
+        bool saveDataNeeded()
+        {
+            return mOutputs.cacheNeedsTrim() || mOutputs.journalNeedsSave() ||
+              mAddresses.needsPurge();
+        }
 #else
-        bool saveDataNeeded() { return mOutputs.cacheNeedsTrim(); }
+        bool saveDataNeeded()
+          { return mOutputs.cacheNeedsTrim() || mOutputs.journalNeedsSave(); }
 #endif
         bool saveDataInProgress() const { return mSaveDataInProgress; }
 
@@ -358,6 +365,8 @@ namespace BitCoin
 
     private:
 
+        // Declared before the data sets that use it so it is destroyed after them.
+        WorkerPool mWorkers;
         Outputs mOutputs;
 #ifndef DISABLE_ADDRESSES
         Addresses mAddresses;
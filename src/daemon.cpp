@@ -485,6 +485,7 @@ namespace BitCoin
         NextCash::printProfilerDataToLog(NextCash::Log::VERBOSE);
         NextCash::resetProfilers();
 #endif
+        mChain.outputs().printStats(NextCash::Log::VERBOSE);
 
         mRunning = false;
         mStopping = false;
@@ -1998,6 +1999,7 @@ namespace BitCoin
             {
                 NextCash::printProfilerDataToLog(NextCash::Log::VERBOSE);
                 NextCash::resetProfilers();
+                mChain.outputs().printStats(NextCash::Log::VERBOSE);
                 lastProfilerWrite = time;
             }
 #endif
@@ -14,10 +14,59 @@
 
 #include "digest.hpp"
 #include "key.hpp"
+#include "signature_cache.hpp"
 
 
 namespace BitCoin
 {
+    StackItemPool::~StackItemPool()
+    {
+        for(std::vector<NextCash::Buffer *>::iterator item = mItems.begin(); item != mItems.end();
+          ++item)
+            delete *item;
+    }
+
+    StackItemPool &StackItemPool::local()
+    {
+        static thread_local StackItemPool sPool;
+        return sPool;
+    }
+
+    NextCash::Buffer *StackItemPool::get()
+    {
+        NextCash::Buffer *result;
+        if(mItems.size() == 0)
+            result = new NextCash::Buffer();
+        else
+        {
+            result = mItems.back();
+            mItems.pop_back();
+        }
+        result->setInputEndian(NextCash::Endian::LITTLE); // Needed for arithmetic op codes to work
+        return result;
+    }
+
+    void StackItemPool::release(NextCash::Buffer *pItem)
+    {
+        if(mItems.size() < MAX_ITEMS)
+        {
+            pItem->clear();
+            mItems.push_back(pItem);
+        }
+        else
+            delete pItem;
+    }
+
+    NextCash::Buffer *ScriptInterpreter::copyItem(NextCash::Buffer *pItem)
+    {
+        NextCash::Buffer *result = newItem();
+        NextCash::stream_size previousReadOffset = pItem->readOffset();
+        pItem->setReadOffset(0);
+        result->writeStream(pItem, pItem->length());
+        pItem->setReadOffset(previousReadOffset);
+        return result;
+    }
+
     bool ScriptInterpreter::bufferIsZero(NextCash::Buffer *pBuffer)
     {
         pBuffer->setReadOffset(0);
@@ -482,8 +531,7 @@ namespace BitCoin
             NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_INTERPRETER_LOG_NAME,
               "Stack : %s", pText);
             index = 1;
-            for(std::list<NextCash::Buffer *>::reverse_iterator i = mStack.rbegin();
-              i != mStack.rend(); ++i, ++index)
+            for(Stack::reverse_iterator i = mStack.rbegin(); i != mStack.rend(); ++i, ++index)
             {
                 (*i)->setReadOffset(0);
                 NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_INTERPRETER_LOG_NAME,
@@ -500,8 +548,7 @@ namespace BitCoin
             NextCash::Log::add(NextCash::Log::VERBOSE, BITCOIN_INTERPRETER_LOG_NAME,
               "Alt Stack :");
             index = 1;
-            for(std::list<NextCash::Buffer *>::reverse_iterator i = mAltStack.rbegin();
-              i != mAltStack.rend(); ++i, ++index)
+            for(Stack::reverse_iterator i = mAltStack.rbegin(); i != mAltStack.rend(); ++i, ++index)
             {
                 (*i)->setReadOffset(0);
                 NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_INTERPRETER_LOG_NAME,
@@ -655,7 +702,7 @@ namespace BitCoin
       int64_t pOutputAmount, const uint8_t *pPublicKeyData, unsigned int pPublicKeyDataSize,
       const uint8_t *pSignatureData, unsigned int pSignatureDataSize, bool pStrictSignatures,
       NextCash::Buffer &pCurrentOutputScript, unsigned int pSignatureStartOffset,
-      const Forks &pForks, unsigned int pBlockHeight)
+      const Forks &pForks, unsigned int pBlockHeight, SignatureQueue::EntryList *pDeferred)
     {
         if(pSignatureDataSize < 2)
         {
@@ -681,9 +728,32 @@ namespace BitCoin
           pCurrentOutputScript, pOutputAmount, pSignatureData[pSignatureDataSize-1]);
         pCurrentOutputScript.setReadOffset(previousOffset);
 
+        // Signatures verified for the mempool are remembered so they aren't verified again when
+        //   the transaction is in a block. Block heights are never Chain::INVALID_HEIGHT.
+        bool forMemPool = pBlockHeight == 0xffffffff;
+        SignatureCache &cache = SignatureCache::instance();
+        SignatureCache::Entry entry;
+        cache.calculate(signatureHash, pPublicKeyData, pPublicKeyDataSize, pSignatureData,
+          pSignatureDataSize - 1, pStrictSignatures, entry);
+        if(cache.contains(entry, !forMemPool))
+            return true;
+
+        if(pDeferred != NULL)
+        {
+            pDeferred->emplace_back();
+            if(pDeferred->back().set(&pTransaction, pInputOffset, signatureHash, pPublicKeyData,
+              pPublicKeyDataSize, pSignatureData, pSignatureDataSize - 1, pStrictSignatures))
+                return true;
+            pDeferred->pop_back(); // Too large to defer
+        }
+
         if(Key::verify(pPublicKeyData, pPublicKeyDataSize, pSignatureData, pSignatureDataSize - 1,
           pStrictSignatures, signatureHash))
+        {
+            if(forMemPool)
+                cache.add(entry);
             return true;
+        }
         else
             return false;
     }
@@ -1119,7 +1189,7 @@ namespace BitCoin
         }
 
         // Compare top 2 stack entries
-        std::list<NextCash::Buffer *>::iterator secondToLast = mStack.end();
+        Stack::iterator secondToLast = mStack.end();
         --secondToLast;
         --secondToLast;
         mStack.back()->setReadOffset(0);
@@ -1255,14 +1325,20 @@ namespace BitCoin
         signatureData->setReadOffset(0);
         pop(false);
 
+        // Defer the check when a failure fails the script. Either this verifies or the result
+        //   is left on top of the stack at the end of the last script.
+        SignatureQueue::EntryList *deferred = NULL;
+        if(pOpCode == OP_CHECKSIGVERIFY || mScript->remaining() == 0)
+            deferred = mDeferredSignatures;
+
         // Check the signature with the public key
         if(!failed && checkSignature(*mTransaction, mInputOffset, mOutputAmount,
           publicKeyData->begin(), publicKeyData->length(), signatureData->begin(),
           signatureData->length(), strictSigs, *mScript, mSigStartOffset, *mForks,
-          mBlockHeight))
+          mBlockHeight, deferred))
         {
-            delete publicKeyData;
-            delete signatureData;
+            deleteItem(publicKeyData);
+            deleteItem(signatureData);
             if(pOpCode == OP_CHECKSIG)
                 push()->writeByte(1); // Push true onto the stack
         }
@@ -1270,8 +1346,8 @@ namespace BitCoin
         {
             NextCash::Log::add(NextCash::Log::VERBOSE, BITCOIN_INTERPRETER_LOG_NAME,
               "Signature check failed");
-            delete publicKeyData;
-            delete signatureData;
+            deleteItem(publicKeyData);
+            deleteItem(signatureData);
             if(pOpCode == OP_CHECKSIG)
                 push(); // Push false onto the stack
             else
@@ -1323,7 +1399,7 @@ namespace BitCoin
               "Stack not large enough for OP_CHECKMULTISIG signatures");
             mValid = false;
             for(unsigned int i = 0; i < publicKeyCount; ++i)
-                delete publicKeys[i];
+                deleteItem(publicKeys[i]);
             return false;
         }
 
@@ -1373,9 +1449,9 @@ namespace BitCoin
 
         // Destroy public key and signature buffers.
         for(unsigned int i = 0; i < publicKeyCount; ++i)
-            delete publicKeys[i];
+            deleteItem(publicKeys[i]);
         for(unsigned int i = 0; i < signatureCount; ++i)
-            delete signatures[i];
+            deleteItem(signatures[i]);
 
         if(failed)
         {
@@ -1438,15 +1514,15 @@ namespace BitCoin
         if(!failed && Key::verify(publicKey->begin(), publicKey->length(),
           signature->begin(), signature->length(), true, messageHash))
         {
-            delete publicKey;
-            delete signature;
+            deleteItem(publicKey);
+            deleteItem(signature);
             if(pOpCode == OP_CHECKDATASIG)
                 push()->writeByte(1); // Push true onto the stack
         }
         else
         {
-            delete publicKey;
-            delete signature;
+            deleteItem(publicKey);
+            deleteItem(signature);
             if(pOpCode == OP_CHECKDATASIG)
                 push(); // Push false onto the stack
             else
@@ -2656,7 +2732,7 @@ namespace BitCoin
         }
 
         top()->setReadOffset(0);
-        push(new NextCash::Buffer(*top()));
+        push(copyItem(top()));
         return true;
     }
 
@@ -2676,7 +2752,7 @@ namespace BitCoin
         if(!bufferIsZero(top()))
         {
             top()->setReadOffset(0);
-            push(new NextCash::Buffer(*top(), true));
+            push(copyItem(top()));
         }
         return true;
     }
@@ -2720,10 +2796,10 @@ namespace BitCoin
             return false;
         }
 
-        std::list<NextCash::Buffer *>::iterator secondToLast = mStack.end();
+        Stack::iterator secondToLast = mStack.end();
         --secondToLast;
         --secondToLast;
-        delete *secondToLast;
+        deleteItem(*secondToLast);
         mStack.erase(secondToLast);
         return true;
     }
@@ -2742,11 +2818,11 @@ namespace BitCoin
             return false;
         }
 
-        std::list<NextCash::Buffer *>::iterator secondToLast = mStack.end();
+        Stack::iterator secondToLast = mStack.end();
         --secondToLast;
         --secondToLast;
 
-        push(new NextCash::Buffer(**secondToLast));
+        push(copyItem(*secondToLast));
         return true;
     }
 
@@ -2780,13 +2856,13 @@ namespace BitCoin
             return false;
         }
 
-        std::list<NextCash::Buffer *>::iterator item = mStack.end();
+        Stack::iterator item = mStack.end();
         --item; // get last item
 
         for(unsigned int i=0;i<n;i++)
             --item;
 
-        push(new NextCash::Buffer(**item));
+        push(copyItem(*item));
         return true;
     }
 
@@ -2820,14 +2896,15 @@ namespace BitCoin
             return false;
         }
 
-        std::list<NextCash::Buffer *>::iterator item = mStack.end();
+        Stack::iterator item = mStack.end();
         --item; // get last item
 
         for(unsigned int i = 0; i < n; ++i)
             --item;
 
-        push(*item);
+        NextCash::Buffer *value = *item;
         mStack.erase(item);
+        push(value);
         return true;
     }
 
@@ -2901,7 +2978,7 @@ namespace BitCoin
         NextCash::Buffer *one = top();
         pop(false);
 
-        push(new NextCash::Buffer(*two));
+        push(copyItem(two));
         push(one);
         push(two);
         return true;
@@ -2940,13 +3017,16 @@ namespace BitCoin
             return false;
         }
 
-        std::list<NextCash::Buffer *>::iterator two = mStack.end();
+        Stack::iterator two = mStack.end();
         --two; // get last item
-        std::list<NextCash::Buffer *>::iterator one = two;
+        Stack::iterator one = two;
         --one; // get the second to last item
 
-        push(new NextCash::Buffer(**one));
-        push(new NextCash::Buffer(**two));
+        // Copy before pushing since pushing can move the stack.
+        NextCash::Buffer *copyOne = copyItem(*one);
+        NextCash::Buffer *copyTwo = copyItem(*two);
+        push(copyOne);
+        push(copyTwo);
         return true;
     }
 
@@ -2964,16 +3044,20 @@ namespace BitCoin
             return false;
         }
 
-        std::list<NextCash::Buffer *>::iterator three = mStack.end();
+        Stack::iterator three = mStack.end();
         --three; // get last item
-        std::list<NextCash::Buffer *>::iterator two = three;
+        Stack::iterator two = three;
         --two; // get second to last item
-        std::list<NextCash::Buffer *>::iterator one = two;
+        Stack::iterator one = two;
         --one; // get the third to last item
 
-        push(new NextCash::Buffer(**one));
-        push(new NextCash::Buffer(**two));
-        push(new NextCash::Buffer(**three));
+        // Copy before pushing since pushing can move the stack.
+        NextCash::Buffer *copyOne = copyItem(*one);
+        NextCash::Buffer *copyTwo = copyItem(*two);
+        NextCash::Buffer *copyThree = copyItem(*three);
+        push(copyOne);
+        push(copyTwo);
+        push(copyThree);
         return true;
     }
 
@@ -2991,15 +3075,18 @@ namespace BitCoin
             return false;
         }
 
-        std::list<NextCash::Buffer *>::iterator two = mStack.end();
+        Stack::iterator two = mStack.end();
         --two; // 4
         --two; // 3
         --two; // 2
-        std::list<NextCash::Buffer *>::iterator one = two;
+        Stack::iterator one = two;
         --one; // 1
 
-        push(new NextCash::Buffer(**one));
-        push(new NextCash::Buffer(**two));
+        // Copy before pushing since pushing can move the stack.
+        NextCash::Buffer *copyOne = copyItem(*one);
+        NextCash::Buffer *copyTwo = copyItem(*two);
+        push(copyOne);
+        push(copyTwo);
         return true;
     }
 
@@ -3017,20 +3104,21 @@ namespace BitCoin
             return false;
         }
 
-        std::list<NextCash::Buffer *>::iterator two = mStack.end();
+        Stack::iterator two = mStack.end();
         --two; // 6
         --two; // 5
         --two; // 4
         --two; // 3
         --two; // 2
-        std::list<NextCash::Buffer *>::iterator one = two;
+        Stack::iterator one = two;
         --one; // 1
 
         NextCash::Buffer *itemTwo = *two;
         NextCash::Buffer *itemOne = *one;
 
-        mStack.erase(one);
+        // Erase the later item first so the other is still valid.
         mStack.erase(two);
+        mStack.erase(one);
 
         push(itemOne);
         push(itemTwo);
@@ -3051,18 +3139,19 @@ namespace BitCoin
             return false;
         }
 
-        std::list<NextCash::Buffer *>::iterator two = mStack.end();
+        Stack::iterator two = mStack.end();
         --two; // 4
         --two; // 3
         --two; // 2
-        std::list<NextCash::Buffer *>::iterator one = two;
+        Stack::iterator one = two;
         --one; // 1
 
         NextCash::Buffer *itemTwo = *two;
         NextCash::Buffer *itemOne = *one;
 
-        mStack.erase(one);
+        // Erase the later item first so the other is still valid.
         mStack.erase(two);
+        mStack.erase(one);
 
         push(itemOne);
         push(itemTwo);
@@ -3107,7 +3196,7 @@ namespace BitCoin
             one->writeStream(two, two->length());
 
             // Delete two
-            delete two;
+            deleteItem(two);
         }
         else
         {
@@ -3173,7 +3262,7 @@ namespace BitCoin
             }
 
             // Split x after n bytes leaving first part in x and putting second part in two.
-            NextCash::Buffer *two = new NextCash::Buffer();
+            NextCash::Buffer *two = newItem();
 
             if(n == 0)
             {
@@ -3472,7 +3561,7 @@ namespace BitCoin
                 while(two->remaining())
                     one->writeByte(one->readByte() & two->readByte());
 
-                delete two;
+                deleteItem(two);
             }
         }
         else
@@ -3524,7 +3613,7 @@ namespace BitCoin
                 while(two->remaining())
                     one->writeByte(one->readByte() | two->readByte());
 
-                delete two;
+                deleteItem(two);
             }
         }
         else
@@ -3576,7 +3665,7 @@ namespace BitCoin
                 while(two->remaining())
                     one->writeByte(one->readByte() ^ two->readByte());
 
-                delete two;
+                deleteItem(two);
             }
         }
         else
@@ -5366,6 +5455,227 @@ namespace BitCoin
             success = false;
         }
 
+        /***********************************************************************************************
+         * OP_2DUP
+         *   Each stack item is checked with OP_EQUALVERIFY from the top down. OP_1ADD on
+         *   a copied item checks that the copy doesn't share data with the original.
+         ***********************************************************************************************/
+        interpreter.clear();
+        testScript.clear();
+
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_2DUP);
+        testScript.writeByte(OP_1ADD);
+
+        // Check 3 1 2 1 from the top
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_EQUAL);
+
+        if(interpreter.process(testScript, 4, forks, 2) && interpreter.isValid() &&
+          interpreter.isVerified() && interpreter.stackIsClean())
+            NextCash::Log::add(NextCash::Log::INFO, BITCOIN_INTERPRETER_LOG_NAME,
+              "Passed OP_2DUP");
+        else
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_INTERPRETER_LOG_NAME,
+              "Failed to process OP_2DUP");
+            interpreter.printStack("Should be 1 2 1 3");
+            success = false;
+        }
+
+        /***********************************************************************************************
+         * OP_3DUP
+         ***********************************************************************************************/
+        interpreter.clear();
+        testScript.clear();
+
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_3DUP);
+        testScript.writeByte(OP_1ADD);
+
+        // Check 4 2 1 3 2 1 from the top
+        testScript.writeByte(OP_4);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_EQUAL);
+
+        if(interpreter.process(testScript, 4, forks, 2) && interpreter.isValid() &&
+          interpreter.isVerified() && interpreter.stackIsClean())
+            NextCash::Log::add(NextCash::Log::INFO, BITCOIN_INTERPRETER_LOG_NAME,
+              "Passed OP_3DUP");
+        else
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_INTERPRETER_LOG_NAME,
+              "Failed to process OP_3DUP");
+            interpreter.printStack("Should be 1 2 3 1 2 4");
+            success = false;
+        }
+
+        /***********************************************************************************************
+         * OP_2OVER
+         ***********************************************************************************************/
+        interpreter.clear();
+        testScript.clear();
+
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_4);
+        testScript.writeByte(OP_2OVER);
+        testScript.writeByte(OP_1ADD);
+
+        // Check 3 1 4 3 2 1 from the top
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_4);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_EQUAL);
+
+        if(interpreter.process(testScript, 4, forks, 2) && interpreter.isValid() &&
+          interpreter.isVerified() && interpreter.stackIsClean())
+            NextCash::Log::add(NextCash::Log::INFO, BITCOIN_INTERPRETER_LOG_NAME,
+              "Passed OP_2OVER");
+        else
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_INTERPRETER_LOG_NAME,
+              "Failed to process OP_2OVER");
+            interpreter.printStack("Should be 1 2 3 4 1 3");
+            success = false;
+        }
+
+        /***********************************************************************************************
+         * OP_2ROT
+         ***********************************************************************************************/
+        interpreter.clear();
+        testScript.clear();
+
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_4);
+        testScript.writeByte(OP_5);
+        testScript.writeByte(OP_6);
+        testScript.writeByte(OP_2ROT);
+
+        // Check 2 1 6 5 4 3 from the top
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_6);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_5);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_4);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_EQUAL);
+
+        if(interpreter.process(testScript, 4, forks, 2) && interpreter.isValid() &&
+          interpreter.isVerified() && interpreter.stackIsClean())
+            NextCash::Log::add(NextCash::Log::INFO, BITCOIN_INTERPRETER_LOG_NAME,
+              "Passed OP_2ROT");
+        else
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_INTERPRETER_LOG_NAME,
+              "Failed to process OP_2ROT");
+            interpreter.printStack("Should be 3 4 5 6 1 2");
+            success = false;
+        }
+
+        /***********************************************************************************************
+         * OP_2SWAP
+         ***********************************************************************************************/
+        interpreter.clear();
+        testScript.clear();
+
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_4);
+        testScript.writeByte(OP_2SWAP);
+
+        // Check 2 1 4 3 from the top
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_4);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_EQUAL);
+
+        if(interpreter.process(testScript, 4, forks, 2) && interpreter.isValid() &&
+          interpreter.isVerified() && interpreter.stackIsClean())
+            NextCash::Log::add(NextCash::Log::INFO, BITCOIN_INTERPRETER_LOG_NAME,
+              "Passed OP_2SWAP");
+        else
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_INTERPRETER_LOG_NAME,
+              "Failed to process OP_2SWAP");
+            interpreter.printStack("Should be 3 4 1 2");
+            success = false;
+        }
+
+        /***********************************************************************************************
+         * OP_ROLL
+         ***********************************************************************************************/
+        interpreter.clear();
+        testScript.clear();
+
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_4);
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_ROLL);
+
+        // Check 2 4 3 1 from the top
+        testScript.writeByte(OP_2);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_4);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_3);
+        testScript.writeByte(OP_EQUALVERIFY);
+        testScript.writeByte(OP_1);
+        testScript.writeByte(OP_EQUAL);
+
+        if(interpreter.process(testScript, 4, forks, 2) && interpreter.isValid() &&
+          interpreter.isVerified() && interpreter.stackIsClean())
+            NextCash::Log::add(NextCash::Log::INFO, BITCOIN_INTERPRETER_LOG_NAME,
+              "Passed OP_ROLL");
+        else
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_INTERPRETER_LOG_NAME,
+              "Failed to process OP_ROLL");
+            interpreter.printStack("Should be 1 3 4 2");
+            success = false;
+        }
+
         /***********************************************************************************************
          * TODO OP_CHECKDATASIG
          ***********************************************************************************************/
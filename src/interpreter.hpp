@@ -17,6 +17,7 @@
 #include "transaction.hpp"
 
 #include <list>
+#include <vector>
 
 #define BITCOIN_INTERPRETER_LOG_NAME "Interpreter"
 
@@ -200,6 +201,31 @@ namespace BitCoin
         OP_CHECKDATASIGVERIFY  = 0xbb
     };
 
+    // Stack items released by script interpreters on a thread. They are reused for new stack
+    //   items so that, once a thread has processed a few scripts, processing scripts doesn't
+    //   allocate. Released items keep their allocated data, so item contents up to the max
+    //   element size are written without allocating either.
+    class StackItemPool
+    {
+    public:
+
+        ~StackItemPool();
+
+        // The pool for the current thread.
+        static StackItemPool &local();
+
+        // Returns an empty item.
+        NextCash::Buffer *get();
+        void release(NextCash::Buffer *pItem);
+
+    private:
+
+        static const unsigned int MAX_ITEMS = 1024;
+
+        std::vector<NextCash::Buffer *> mItems;
+
+    };
+
     class ScriptInterpreter
     {
     public:
@@ -213,6 +239,8 @@ namespace BitCoin
             mInputOffset   = 0;
             mInputSequence = 0xffffffff;
             mOutputAmount  = 0;
+            mDeferredSignatures = NULL;
+            mStack.reserve(STACK_RESERVE);
         }
         ~ScriptInterpreter() { clear(); }
 
@@ -227,6 +255,11 @@ namespace BitCoin
             mOutputAmount = pOutputAmount;
         }
 
+        // Signature checks that make the script fail when they fail are added to pDeferred
+        //   instead of verified. Only set before processing the last script.
+        void setDeferredSignatures(SignatureQueue::EntryList *pDeferred)
+          { mDeferredSignatures = pDeferred; }
+
         // Process script
         bool process(NextCash::Buffer &pScript, int32_t pBlockVersion, Forks &pForks,
           unsigned int pBlockHeight);
@@ -278,15 +311,19 @@ namespace BitCoin
             mInputOffset   = 0;
             mInputSequence = 0xffffffff;
             mOutputAmount  = 0;
+            mDeferredSignatures = NULL;
             mHash.clear();
 
-            std::list<NextCash::Buffer *>::iterator iter;
+            // Return items to the pool. The stacks keep their capacity so the interpreter can be
+            //   reused without allocating.
+            StackItemPool &pool = StackItemPool::local();
+            Stack::iterator iter;
             for(iter = mStack.begin(); iter != mStack.end(); ++iter)
-                delete *iter;
+                pool.release(*iter);
             mStack.clear();
 
             for(iter = mAltStack.begin(); iter != mAltStack.end(); ++iter)
-                delete *iter;
+                pool.release(*iter);
             mAltStack.clear();
 
             mIfStack.clear();
@@ -371,7 +408,8 @@ namespace BitCoin
           int64_t pOutputAmount, const uint8_t *pPublicKeyData, unsigned int pPublicKeyDataSize,
           const uint8_t *pSignatureData, unsigned int pSignatureDataSize, bool pStrictSignatures,
           NextCash::Buffer &pCurrentOutputScript, unsigned int pSignatureStartOffset,
-          const Forks &pForks, unsigned int pBlockHeight);
+          const Forks &pForks, unsigned int pBlockHeight,
+          SignatureQueue::EntryList *pDeferred = NULL);
 
         static bool writeP2PKHOutputScript(NextCash::Buffer &pOutputScript,
           const NextCash::Hash &pPubKeyHash);
@@ -384,7 +422,7 @@ namespace BitCoin
             if(pOffsetFromTop < 0 || (unsigned int)pOffsetFromTop > mStack.size())
                 return NULL;
 
-            std::list<NextCash::Buffer *>::iterator result = mStack.end();
+            Stack::iterator result = mStack.end();
 
             for(int i=0;i<=(int)pOffsetFromTop;++i)
                 --result;
@@ -409,8 +447,12 @@ namespace BitCoin
         unsigned int mInputOffset;
         uint32_t mInputSequence;
         int64_t mOutputAmount;
+        SignatureQueue::EntryList *mDeferredSignatures;
 
-        std::list<NextCash::Buffer *> mStack, mAltStack;
+        static const unsigned int STACK_RESERVE = 32;
+
+        typedef std::vector<NextCash::Buffer *> Stack;
+        Stack mStack, mAltStack;
         std::list<bool> mIfStack, mAltIfStack;
 
         bool ifStackTrue()
@@ -443,27 +485,40 @@ namespace BitCoin
             return result;
         }
 
+        // Stack items come from the thread's pool and must be deleted with deleteItem.
+        NextCash::Buffer *newItem() { return StackItemPool::local().get(); }
+        NextCash::Buffer *copyItem(NextCash::Buffer *pItem);
+        void deleteItem(NextCash::Buffer *pItem) { StackItemPool::local().release(pItem); }
+
         // Stack manipulation
         NextCash::Buffer *push()
         {
-            mStack.push_back(new NextCash::Buffer());
-            mStack.back()->setInputEndian(NextCash::Endian::LITTLE); // Needed for arithmetic op codes to work
+            mStack.push_back(newItem());
             return mStack.back();
         }
         void push(NextCash::Buffer *pValue) { mStack.push_back(pValue); }
-        void pop(bool pDelete = true) { if(pDelete) delete mStack.back(); mStack.pop_back(); }
+        void pop(bool pDelete = true)
+        {
+            if(pDelete)
+                deleteItem(mStack.back());
+            mStack.pop_back();
+        }
         NextCash::Buffer *top() { return mStack.back(); }
         bool stackIsEmpty() { return mStack.size() == 0; }
 
         // Alt Stack manipulation
         NextCash::Buffer *pushAlt()
         {
-            mAltStack.push_back(new NextCash::Buffer());
-            mAltStack.back()->setInputEndian(NextCash::Endian::LITTLE); // Needed for arithmetic op codes to work
+            mAltStack.push_back(newItem());
             return mAltStack.back();
         }
         void pushAlt(NextCash::Buffer *pValue) { mAltStack.push_back(pValue); }
-        void popAlt(bool pDelete = true) { if(pDelete) delete mAltStack.back(); mAltStack.pop_back(); }
+        void popAlt(bool pDelete = true)
+        {
+            if(pDelete)
+                deleteItem(mAltStack.back());
+            mAltStack.pop_back();
+        }
         NextCash::Buffer *topAlt() { return mAltStack.back(); }
         bool stackAltIsEmpty() { return mAltStack.size() == 0; }
 
@@ -17,15 +17,19 @@
 #include "digest.hpp"
 #include "encrypt.hpp"
 #include "interpreter.hpp"
+#include "signature_cache.hpp"
+#include "signature_queue.hpp"
+#include "worker_pool.hpp"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define BITCOIN_KEY_LOG_NAME "Key"
 
 
 namespace BitCoin
 {
-    secp256k1_context *Key::sContext = NULL;
-    unsigned int Key::sContextFlags = 0;
-    NextCash::MutexWithConstantName Key::sMutex("SECP256K1");
     const unsigned int Key::DEFAULT_GAP = 20;
     const uint32_t Key::HARDENED = 0x80000000;
     const uint32_t Key::PURPOSE_44 = HARDENED + 44;
@@ -33,58 +37,82 @@ namespace BitCoin
     const uint32_t Key::COIN_BITCOIN_CASH = HARDENED + 145;
     const uint32_t Key::COIN_BITCOIN_SV = HARDENED + 236;
 
-    void randomizeContext(secp256k1_context *pContext)
+    void Key::getEntropy(uint8_t *pData, unsigned int pSize)
     {
-        bool finished = false;
-        uint8_t entropy[32];
-        uint32_t random;
-        while(!finished)
+        unsigned int offset = 0;
+        int file = open("/dev/urandom", O_RDONLY);
+        if(file >= 0)
         {
-            // Generate entropy
-            for(unsigned int i=0;i<32;i+=4)
+            ssize_t bytesRead;
+            while(offset < pSize)
+            {
+                bytesRead = read(file, pData + offset, pSize - offset);
+                if(bytesRead <= 0)
+                {
+                    if(bytesRead < 0 && errno == EINTR)
+                        continue;
+                    break;
+                }
+                offset += bytesRead;
+            }
+            close(file);
+        }
+
+        if(offset < pSize)
+        {
+            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_KEY_LOG_NAME,
+              "Failed to read /dev/urandom. Using non-secure random numbers");
+            uint32_t random;
+            for(; offset < pSize; offset += 4)
             {
                 random = NextCash::Math::randomInt();
-                std::memcpy(entropy + i, &random, 4);
+                if(pSize - offset < 4)
+                    std::memcpy(pData + offset, &random, pSize - offset);
+                else
+                    std::memcpy(pData + offset, &random, 4);
             }
-            finished = secp256k1_context_randomize(pContext, entropy);
         }
     }
 
-    secp256k1_context *Key::context(unsigned int pFlags)
+    void randomizeContext(secp256k1_context *pContext)
     {
-        sMutex.lock();
-        if(sContext == NULL)
+        bool finished = false;
+        uint8_t entropy[32];
+        while(!finished)
         {
-            // Create context
-            NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_KEY_LOG_NAME,
-              "Creating initial context : %08x", pFlags);
-            sContext = secp256k1_context_create(pFlags);
-            // sContext = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
-            sContextFlags = pFlags;
-            if(pFlags & SECP256K1_FLAGS_BIT_CONTEXT_SIGN)
-                randomizeContext(sContext);
-            std::atexit(destroyContext);
+            Key::getEntropy(entropy, 32);
+            finished = secp256k1_context_randomize(pContext, entropy);
         }
-        else if((sContextFlags & pFlags) != pFlags)
+    }
+
+    // Owns the signing context of a thread.
+    class SignContext
+    {
+    public:
+
+        SignContext()
         {
-            // Recreate context with new flags
-            NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_KEY_LOG_NAME,
-              "Recreating context : %08x", pFlags);
-            secp256k1_context_destroy(sContext);
-            sContextFlags |= pFlags;
-            sContext = secp256k1_context_create(sContextFlags);
-            if(sContextFlags & SECP256K1_FLAGS_BIT_CONTEXT_SIGN)
-                randomizeContext(sContext);
+            context = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
+            randomizeContext(context);
         }
-        sMutex.unlock();
+        ~SignContext() { secp256k1_context_destroy(context); }
 
-        return sContext;
-    }
+        secp256k1_context *context;
+
+    };
 
-    void Key::destroyContext()
+    secp256k1_context *Key::context(unsigned int pFlags)
     {
-        secp256k1_context_destroy(sContext);
-        sContext = NULL;
+        if(pFlags & SECP256K1_FLAGS_BIT_CONTEXT_SIGN)
+        {
+            static thread_local SignContext sSignContext;
+            return sSignContext.context;
+        }
+
+        // Created once and never modified, so threads can use it at the same time.
+        static secp256k1_context *sVerifyContext =
+          secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+        return sVerifyContext;
     }
 
     NextCash::String Signature::hex() const
@@ -2016,17 +2044,33 @@ namespace BitCoin
             return false;
         }
 
-        // Parse public key data.
-        secp256k1_context *thisContext = context(SECP256K1_CONTEXT_VERIFY);
         secp256k1_pubkey publicKey;
-        if(!secp256k1_ec_pubkey_parse(thisContext, &publicKey, pPublicKeyData,
-          pPublicKeyDataSize))
+        if(!parsePublicKey(pPublicKeyData, pPublicKeyDataSize, publicKey))
+            return false;
+
+        return verify(publicKey, pSignatureData, pSignatureDataSize, pStrictSignatures,
+          pHash.data());
+    }
+
+    bool Key::parsePublicKey(const uint8_t *pPublicKeyData, unsigned int pPublicKeyDataSize,
+      secp256k1_pubkey &pPublicKey)
+    {
+        if(!secp256k1_ec_pubkey_parse(context(SECP256K1_CONTEXT_VERIFY), &pPublicKey,
+          pPublicKeyData, pPublicKeyDataSize))
         {
             NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_KEY_LOG_NAME,
               "Failed to parse public key");
             return false;
         }
 
+        return true;
+    }
+
+    bool Key::verify(const secp256k1_pubkey &pPublicKey, const uint8_t *pSignatureData,
+      unsigned int pSignatureDataSize, bool pStrictSignatures, const uint8_t *pHash)
+    {
+        secp256k1_context *thisContext = context(SECP256K1_CONTEXT_VERIFY);
+
         // Parse signature data
         secp256k1_ecdsa_signature signature;
         if(pStrictSignatures)
@@ -2057,12 +2101,12 @@ namespace BitCoin
         }
 
         // Verify signature
-        if(secp256k1_ecdsa_verify(thisContext, &signature, pHash.data(), &publicKey))
+        if(secp256k1_ecdsa_verify(thisContext, &signature, pHash, &pPublicKey))
             return true;
 
         // Normalize and attempt verify again if it wasn't normalized.
         if(secp256k1_ecdsa_signature_normalize(thisContext, &signature, &signature) &&
-          secp256k1_ecdsa_verify(thisContext, &signature, pHash.data(), &publicKey))
+          secp256k1_ecdsa_verify(thisContext, &signature, pHash, &pPublicKey))
             return true;
 
         NextCash::String hex;
@@ -5374,6 +5418,188 @@ namespace BitCoin
         else
             success = false;
 
+        /******************************************************************************************
+         * Signature Cache
+         *****************************************************************************************/
+        SignatureCache &cache = SignatureCache::instance();
+        SignatureCache::Entry cacheEntry, otherCacheEntry;
+        NextCash::Hash cacheSigHash(32);
+        uint8_t cachePublicKey[33], cacheSignature[72];
+        bool cacheSuccess = true;
+
+        cacheSigHash.randomize();
+        getEntropy(cachePublicKey, 33);
+        getEntropy(cacheSignature, 72);
+
+        cache.calculate(cacheSigHash, cachePublicKey, 33, cacheSignature, 72, true, cacheEntry);
+        cache.calculate(cacheSigHash, cachePublicKey, 33, cacheSignature, 72, true,
+          otherCacheEntry);
+        if(!(cacheEntry == otherCacheEntry))
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Signature Cache : same signature has different entries");
+            cacheSuccess = false;
+        }
+
+        cache.calculate(cacheSigHash, cachePublicKey, 33, cacheSignature, 72, false,
+          otherCacheEntry);
+        if(cacheEntry == otherCacheEntry)
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Signature Cache : strict flag doesn't change entry");
+            cacheSuccess = false;
+        }
+
+        if(cache.contains(cacheEntry, false))
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Signature Cache : contains entry before add");
+            cacheSuccess = false;
+        }
+
+        cache.add(cacheEntry);
+        if(!cache.contains(cacheEntry, false))
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Signature Cache : entry not found after add");
+            cacheSuccess = false;
+        }
+
+        // A block lookup removes the entry.
+        if(!cache.contains(cacheEntry, true) || cache.contains(cacheEntry, false))
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Signature Cache : entry not removed");
+            cacheSuccess = false;
+        }
+
+        // Fill one shard twice over so all of the first entries are replaced.
+        unsigned int shardCapacity = SIGNATURE_CACHE_COUNT / 256;
+        if(shardCapacity == 0)
+            shardCapacity = 1;
+        otherCacheEntry = cacheEntry;
+        for(unsigned int i = 0; i < shardCapacity * 2; ++i)
+        {
+            otherCacheEntry.values[1] = cacheEntry.values[1] + i;
+            cache.add(otherCacheEntry);
+        }
+
+        otherCacheEntry.values[1] = cacheEntry.values[1];
+        if(cache.contains(otherCacheEntry, false))
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Signature Cache : oldest entry not replaced");
+            cacheSuccess = false;
+        }
+
+        otherCacheEntry.values[1] = cacheEntry.values[1] + (shardCapacity * 2) - 1;
+        if(!cache.contains(otherCacheEntry, false))
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Signature Cache : newest entry replaced");
+            cacheSuccess = false;
+        }
+
+        // An entry removed by a block lookup and added again, as after a reorg, must not be
+        //   replaced early when its old slot is reused.
+        if(shardCapacity > 1)
+        {
+            cache.contains(otherCacheEntry, true);
+            cache.add(otherCacheEntry);
+            for(unsigned int i = 0; i < shardCapacity - 1; ++i)
+            {
+                cacheEntry.values[1] = otherCacheEntry.values[1] + 1 + i;
+                cache.add(cacheEntry);
+            }
+
+            if(!cache.contains(otherCacheEntry, false))
+            {
+                NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+                  "Failed Signature Cache : re-added entry replaced early");
+                cacheSuccess = false;
+            }
+        }
+
+        if(cacheSuccess)
+            NextCash::Log::add(NextCash::Log::INFO, BITCOIN_KEY_LOG_NAME,
+              "Passed Signature Cache");
+        else
+            success = false;
+
+        /******************************************************************************************
+         * Deferred Signatures
+         *****************************************************************************************/
+        Key queueKey;
+        Signature queueSignature;
+        NextCash::Hash queueSigHash(32), queueWrongSigHash(32);
+        NextCash::Buffer queueData;
+        uint8_t queuePublicKey[33], queueSignatureData[73];
+        unsigned int queueSignatureSize;
+        Transaction queueTransaction;
+        SignatureQueue::EntryList queueEntries;
+        SignatureQueue validQueue, invalidQueue;
+        WorkerPool queueWorkers("Test");
+        bool queueSuccess = true;
+
+        queueKey.generatePrivate(MAINNET);
+        queueSigHash.randomize();
+        queueWrongSigHash.randomize();
+        queueKey.sign(queueSigHash, queueSignature);
+
+        queueKey.publicKey()->writePublic(&queueData, false);
+        queueData.read(queuePublicKey, 33);
+        queueData.clear();
+        queueSignature.write(&queueData, false);
+        queueSignatureSize = queueData.length() - 1; // Without hash type
+        queueData.read(queueSignatureData, queueSignatureSize);
+
+        queueWorkers.start(1);
+        queueTransaction.inputs.resize(2);
+        queueTransaction.inputs[0].signatureStatus = Input::VERIFIED;
+        queueTransaction.inputs[1].signatureStatus = Input::VERIFIED;
+
+        queueEntries.resize(1);
+        queueEntries[0].set(&queueTransaction, 0, queueSigHash, queuePublicKey, 33,
+          queueSignatureData, queueSignatureSize, true);
+        validQueue.add(queueEntries);
+        if(!validQueue.verify(queueWorkers, 2) ||
+          !(queueTransaction.inputs[0].signatureStatus & Input::VERIFIED))
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Deferred Signatures : valid signature not verified");
+            queueSuccess = false;
+        }
+
+        // The same signature for the wrong hash fails the whole queue.
+        queueEntries.resize(2);
+        queueEntries[0].set(&queueTransaction, 0, queueSigHash, queuePublicKey, 33,
+          queueSignatureData, queueSignatureSize, true);
+        queueEntries[1].set(&queueTransaction, 1, queueWrongSigHash, queuePublicKey, 33,
+          queueSignatureData, queueSignatureSize, true);
+        invalidQueue.add(queueEntries);
+        if(invalidQueue.verify(queueWorkers, 2))
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Deferred Signatures : invalid signature verified");
+            queueSuccess = false;
+        }
+        else if((queueTransaction.inputs[0].signatureStatus & Input::VERIFIED) ||
+          (queueTransaction.inputs[1].signatureStatus & Input::VERIFIED) ||
+          (queueTransaction.status() & Transaction::SIGS_VERIFIED))
+        {
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_KEY_LOG_NAME,
+              "Failed Deferred Signatures : inputs still marked verified");
+            queueSuccess = false;
+        }
+
+        queueWorkers.stop();
+
+        if(queueSuccess)
+            NextCash::Log::add(NextCash::Log::INFO, BITCOIN_KEY_LOG_NAME,
+              "Passed Deferred Signatures");
+        else
+            success = false;
+
         return success;
     }
 }
@@ -239,6 +239,13 @@ namespace BitCoin
           const uint8_t *pSignatureData, unsigned int pSignatureDataSize, bool pStrictSignatures,
           const NextCash::Hash &pHash);
 
+        // Verify in two steps so a parsed public key can be used for more than one signature.
+        //   pHash must be SIGNATURE_HASH_SIZE bytes.
+        static bool parsePublicKey(const uint8_t *pPublicKeyData, unsigned int pPublicKeyDataSize,
+          secp256k1_pubkey &pPublicKey);
+        static bool verify(const secp256k1_pubkey &pPublicKey, const uint8_t *pSignatureData,
+          unsigned int pSignatureDataSize, bool pStrictSignatures, const uint8_t *pHash);
+
         // Read/Write public key in script format
         bool readPublic(NextCash::InputStream *pStream);
         bool writePublic(NextCash::OutputStream *pStream, bool pScriptFormat) const;
@@ -384,11 +391,12 @@ namespace BitCoin
         void writeTree(NextCash::OutputStream *pStream);
         bool readTree(NextCash::InputStream *pStream);
 
+        // Contexts without SECP256K1_CONTEXT_SIGN are one read only context shared by all
+        //   threads, so verifying doesn't lock. Signing contexts are randomized per thread.
         static secp256k1_context *context(unsigned int pFlags);
-        static void destroyContext();
-        static secp256k1_context *sContext;
-        static unsigned int sContextFlags;
-        static NextCash::MutexWithConstantName sMutex;
+
+        // Fill pData with random bytes from the operating system's secure random source.
+        static void getEntropy(uint8_t *pData, unsigned int pSize);
 
         static bool test();
 
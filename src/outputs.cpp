@@ -11,63 +11,174 @@
 #include "profiler.hpp"
 #endif
 
-#include "distributed_vector.hpp"
 #include "info.hpp"
 #include "interpreter.hpp"
 #include "block.hpp"
 #include "transaction.hpp"
 
 #include <cstring>
+#include <cerrno>
+#include <cinttypes>
+#include <algorithm>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 
 namespace BitCoin
 {
+    bool TransactionOutputs::setOutputCount(uint32_t pCount)
+    {
+        if(!spentDataInline())
+            delete[] mSpentHeights;
+        mOutputCount = 0;
+        mSpentHeights = NULL; // Also clears inline spent heights
+        cacheFlags &= ~SPENT_BITMAP_CACHE_FLAG;
+
+        if(pCount > INLINE_OUTPUT_COUNT)
+        {
+            try
+            {
+                mSpentHeights = new uint32_t[pCount];
+            }
+            catch(std::bad_alloc &pBadAlloc)
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Bad allocation (Allocate %d Spent Heights) : %s", pCount, pBadAlloc.what());
+                mSpentHeights = NULL;
+                return false;
+            }
+        }
+
+        mOutputCount = pCount;
+        return true;
+    }
+
     bool TransactionOutputs::allocateOutputs(uint32_t pCount)
     {
         // Allocate the number of outputs needed
         if(mOutputCount != pCount)
+            return setOutputCount(pCount);
+        return true;
+    }
+
+    void TransactionOutputs::clearSpends()
+    {
+        // Nothing is spent afterward so the exact heights aren't needed from the data file.
+        if(isSpentBitmap())
+            setOutputCount(mOutputCount);
+
+        uint32_t *spentHeight = spentData();
+        uint32_t count = spentDataCount();
+        for(unsigned int i = 0; i < count; ++i, ++spentHeight)
+            *spentHeight = 0;
+    }
+
+    bool TransactionOutputs::collapseSpends(uint32_t pExactHeight)
+    {
+        // The data file must have the exact heights since they are read back from it.
+        if(isSpentBitmap() || isModified() || mOutputCount <= INLINE_OUTPUT_COUNT)
+            return false;
+
+        const uint32_t *spentHeight = spentHeights();
+        for(uint32_t i = 0; i < mOutputCount; ++i, ++spentHeight)
+            if(*spentHeight >= pExactHeight)
+                return false;
+
+        uint32_t wordCount = (mOutputCount + 31) / 32;
+        uint32_t *bitmap;
+        uint32_t inlineBitmap[INLINE_OUTPUT_COUNT];
+        if(wordCount > INLINE_OUTPUT_COUNT)
         {
-            if(mSpentHeights != NULL)
-                delete[] mSpentHeights;
-            mOutputCount = pCount;
-            if(mOutputCount == 0)
-                mSpentHeights = NULL;
-            else
+            try
             {
-                try
-                {
-                    mSpentHeights = new uint32_t[mOutputCount];
-                }
-                catch(std::bad_alloc &pBadAlloc)
-                {
-                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                      "Bad allocation (Allocate %d Spent Heights) : %s", mOutputCount,
-                      pBadAlloc.what());
-                    return false;
-                }
+                bitmap = new uint32_t[wordCount];
+            }
+            catch(std::bad_alloc &pBadAlloc)
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Bad allocation (Allocate %d Spent Bits) : %s", mOutputCount, pBadAlloc.what());
+                return false;
             }
         }
+        else
+            bitmap = inlineBitmap;
+
+        std::memset(bitmap, 0, sizeof(uint32_t) * wordCount);
+        spentHeight = spentHeights();
+        for(uint32_t i = 0; i < mOutputCount; ++i, ++spentHeight)
+            if(*spentHeight != 0)
+                bitmap[i >> 5] |= 0x01 << (i & 0x1f);
 
+        // Heights are always on the heap since output count is above inline count.
+        delete[] mSpentHeights;
+        if(bitmap == inlineBitmap)
+            std::memcpy(mInlineSpentHeights, inlineBitmap, sizeof(inlineBitmap));
+        else
+            mSpentHeights = bitmap;
+        cacheFlags |= SPENT_BITMAP_CACHE_FLAG;
         return true;
     }
 
-    void TransactionOutputs::clearSpends()
+    bool TransactionOutputs::readSpentHeights(NextCash::InputStream *pStream)
     {
-        uint32_t *spentHeight = mSpentHeights;
-        for(unsigned int i = 0; i < mOutputCount; ++i, ++spentHeight)
-            *spentHeight = 0;
+        if(!isSpentBitmap())
+            return true;
+
+        pStream->setReadOffset(mDataOffset + TRANSACTION_HASH_SIZE + mBaseSize);
+        if(pStream->remaining() < sizeof(uint32_t) * mOutputCount)
+            return false;
+
+        // Heights are always on the heap since output count is above inline count.
+        uint32_t *heights;
+        try
+        {
+            heights = new uint32_t[mOutputCount];
+        }
+        catch(std::bad_alloc &pBadAlloc)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Bad allocation (Allocate %d Spent Heights) : %s", mOutputCount, pBadAlloc.what());
+            return false;
+        }
+
+        pStream->read(heights, sizeof(uint32_t) * mOutputCount);
+
+        if(!spentDataInline())
+            delete[] mSpentHeights;
+        mSpentHeights = heights;
+        cacheFlags &= ~SPENT_BITMAP_CACHE_FLAG;
+        return true;
+    }
+
+    void TransactionOutputs::writeSpentHeights(NextCash::OutputStream *pStream)
+    {
+        if(!isSpentBitmap())
+        {
+            pStream->write(spentHeights(), sizeof(uint32_t) * mOutputCount);
+            return;
+        }
+
+        // Only reached for the cache file. Items with spent bitmaps are never modified, so
+        //   changes written to the data file always have exact heights.
+        for(uint32_t i = 0; i < mOutputCount; ++i)
+            pStream->writeUnsignedInt(spentBit(i) ? SPENT_BITMAP_HEIGHT : 0);
     }
 
     void TransactionOutputs::clearOutputs()
     {
-        if(mSpentHeights != NULL)
-            delete[] mSpentHeights;
-        mOutputCount = 0;
-        mSpentHeights = NULL;
+        setOutputCount(0);
     }
 
     bool TransactionOutputs::read(NextCash::InputStream *pStream)
     {
+        // Spent heights are always read from files, so drop any spent bitmap.
+        if(isSpentBitmap())
+            setOutputCount(0);
+
         if(pStream->remaining() < 9)
             return false;
 
@@ -81,25 +192,13 @@ namespace BitCoin
             return false;
         }
 
-        if(mSpentHeights != NULL)
-        {
-            if(newOutputCount != mOutputCount)
-            {
-                delete[] mSpentHeights;
-                mOutputCount = newOutputCount;
-                mSpentHeights = new uint32_t[mOutputCount];
-            }
-        }
-        else
-        {
-            mOutputCount = newOutputCount;
-            mSpentHeights = new uint32_t[mOutputCount];
-        }
+        if(newOutputCount != mOutputCount && !setOutputCount(newOutputCount))
+            return false;
 
         if(pStream->remaining() < sizeof(uint32_t) * mOutputCount)
             return false;
 
-        pStream->read(mSpentHeights, sizeof(uint32_t) * mOutputCount);
+        pStream->read(spentHeights(), sizeof(uint32_t) * mOutputCount);
         return true;
     }
 
@@ -108,7 +207,7 @@ namespace BitCoin
         pStream->writeByte(dataFlags);
         pStream->writeUnsignedInt(blockHeight);
         pStream->writeUnsignedInt(mOutputCount);
-        pStream->write(mSpentHeights, sizeof(uint32_t) * mOutputCount);
+        writeSpentHeights(pStream);
     }
 
     bool TransactionOutputs::readData(NextCash::InputStream *pStream)
@@ -148,16 +247,19 @@ namespace BitCoin
             mDataOffset = pStream->writeOffset();
             pHash.write(pStream);
 
+            // Mark unspendable outputs spent before the spent heights are written.
+            uint32_t *currentSpent = spentHeights();
+            std::vector<Output>::iterator output;
+            for(output = pTransaction->outputs.begin(); output != pTransaction->outputs.end();
+              ++output, ++currentSpent)
+                if(ScriptInterpreter::isOPReturn(output->script))
+                    *currentSpent = pBlockHeight;
+
             write(pStream);
 
-            uint32_t *currentSpent = mSpentHeights;
-            for(std::vector<Output>::iterator output = pTransaction->outputs.begin();
-              output != pTransaction->outputs.end(); ++output, ++currentSpent)
-            {
+            for(output = pTransaction->outputs.begin(); output != pTransaction->outputs.end();
+              ++output)
                 output->write(pStream, true);
-                if(ScriptInterpreter::isOPReturn(output->script))
-                    *currentSpent = pBlockHeight;
-            }
 
             clearModified();
             setNew();
@@ -169,32 +271,50 @@ namespace BitCoin
 
         // Only spent heights will be modified.
         pStream->setWriteOffset(mDataOffset + TRANSACTION_HASH_SIZE + mBaseSize);
-        pStream->write(mSpentHeights, sizeof(uint32_t) * mOutputCount);
+        writeSpentHeights(pStream);
 
         clearModified();
     }
 
-    void TransactionOutputs::writeModifiedData(NextCash::OutputStream *pStream)
+    NextCash::stream_size TransactionOutputs::copyModifiedData(NextCash::OutputStream *pStream)
     {
         // Only spent heights will be modified.
-        pStream->setWriteOffset(mDataOffset + TRANSACTION_HASH_SIZE + mBaseSize);
-        pStream->write(mSpentHeights, sizeof(uint32_t) * mOutputCount);
+        writeSpentHeights(pStream);
 
         clearModified();
+        return mDataOffset + TRANSACTION_HASH_SIZE + mBaseSize;
+    }
+
+    void TransactionOutputs::writeSnapshot(NextCash::OutputStream *pStream)
+    {
+        pStream->writeByte(dataFlags);
+        pStream->writeUnsignedInt(blockHeight);
+        pStream->writeUnsignedInt(mOutputCount);
+        for(uint32_t i = 0; i < mOutputCount; ++i)
+            pStream->writeUnsignedInt(isUnspent(i) ? 0 : SPENT_BITMAP_HEIGHT);
     }
 
     NextCash::stream_size TransactionOutputs::memorySize() const
     {
-        // Add spent height array size
-        return mBaseMemorySize + (sizeof(uint32_t) * mOutputCount);
+        // Add spent height array size if it isn't inline.
+        if(spentDataInline())
+            return mBaseMemorySize;
+        return mBaseMemorySize + (sizeof(uint32_t) * spentDataCount());
     }
 
     uint32_t TransactionOutputs::spentOutputCount() const
     {
-        if(mSpentHeights == NULL)
-            return 0;
         uint32_t result = 0;
-        uint32_t *spentHeight = mSpentHeights;
+        if(isSpentBitmap())
+        {
+            const uint32_t *spentBits = spentData();
+            uint32_t count = spentDataCount();
+            for(uint32_t i = 0; i < count; ++i, ++spentBits)
+                result += __builtin_popcount(*spentBits);
+            return result;
+        }
+
+        const uint32_t *spentHeight = spentHeights();
         for(uint32_t i = 0; i < mOutputCount; ++i, ++spentHeight)
             if(*spentHeight != 0)
                 ++result;
@@ -206,10 +326,11 @@ namespace BitCoin
         if(blockHeight >= pBlockHeight)
             return true;
 
-        if(mOutputCount == 0 || mSpentHeights == NULL)
+        // Spends in a bitmap are all below the exact height.
+        if(mOutputCount == 0 || isSpentBitmap())
             return false;
 
-        uint32_t *spentHeight = mSpentHeights;
+        const uint32_t *spentHeight = spentHeights();
         for(uint32_t i = 0; i < mOutputCount; ++i, ++spentHeight)
             if(*spentHeight >= pBlockHeight)
                 return true;
@@ -219,8 +340,11 @@ namespace BitCoin
 
     uint32_t TransactionOutputs::spentBlockHeight() const
     {
+        if(isSpentBitmap())
+            return hasUnspent() ? MAX_BLOCK_HEIGHT : SPENT_BITMAP_HEIGHT;
+
         uint32_t result = 0;
-        uint32_t *spentHeight = mSpentHeights;
+        const uint32_t *spentHeight = spentHeights();
         for(uint32_t i = 0; i < mOutputCount; ++i, ++spentHeight)
         {
             if(*spentHeight == 0)
@@ -239,7 +363,15 @@ namespace BitCoin
         if(isCoinBase())
             NextCash::Log::add(pLevel, BITCOIN_OUTPUTS_LOG_NAME, "  Is CoinBase");
 
-        uint32_t *spentHeight = mSpentHeights;
+        if(isSpentBitmap())
+        {
+            for(uint32_t i = 0; i < mOutputCount; ++i)
+                NextCash::Log::add(pLevel, BITCOIN_OUTPUTS_LOG_NAME,
+                  spentBit(i) ? "    Spent" : "    Unspent");
+            return;
+        }
+
+        const uint32_t *spentHeight = spentHeights();
         for(uint32_t i = 0; i < mOutputCount; ++i, ++spentHeight)
         {
             if(*spentHeight == 0)
@@ -250,6 +382,158 @@ namespace BitCoin
         }
     }
 
+    secp256k1_context *OutputsCommitment::context()
+    {
+        // Multiset operations don't use the precomputed tables, so one context without any
+        //   flags is shared by all threads.
+        static secp256k1_context *sContext = secp256k1_context_create(SECP256K1_CONTEXT_NONE);
+        return sContext;
+    }
+
+    void OutputsCommitment::clear()
+    {
+        secp256k1_multiset_init(context(), &mSet);
+    }
+
+    // Transaction ID, output index (uint32 little endian), block height (uint32 little endian),
+    //   output (amount and script as written to the data file)
+    static void commitmentElement(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+      uint32_t pBlockHeight, Output &pOutput, NextCash::Buffer &pElement)
+    {
+        pElement.setEndian(NextCash::Endian::LITTLE);
+        pTransactionID.write(&pElement);
+        pElement.writeUnsignedInt(pIndex);
+        pElement.writeUnsignedInt(pBlockHeight);
+        pOutput.write(&pElement, true);
+    }
+
+    void OutputsCommitment::add(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+      uint32_t pBlockHeight, Output &pOutput)
+    {
+        NextCash::Buffer element;
+        commitmentElement(pTransactionID, pIndex, pBlockHeight, pOutput, element);
+        secp256k1_multiset_add(context(), &mSet, element.begin(), element.length());
+    }
+
+    void OutputsCommitment::remove(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+      uint32_t pBlockHeight, Output &pOutput)
+    {
+        NextCash::Buffer element;
+        commitmentElement(pTransactionID, pIndex, pBlockHeight, pOutput, element);
+        secp256k1_multiset_remove(context(), &mSet, element.begin(), element.length());
+    }
+
+    void OutputsCommitment::combine(const OutputsCommitment &pChanges)
+    {
+        secp256k1_multiset_combine(context(), &mSet, &pChanges.mSet);
+    }
+
+    void OutputsCommitment::getHash(NextCash::Hash &pHash) const
+    {
+        uint8_t result[32];
+        secp256k1_multiset_finalize(context(), result, &mSet);
+
+        NextCash::Buffer buffer;
+        buffer.write(result, 32);
+        pHash.setSize(32);
+        pHash.read(&buffer, 32);
+    }
+
+    void OutputsCommitment::write(NextCash::OutputStream *pStream) const
+    {
+        pStream->write(mSet.d, SIZE);
+    }
+
+    bool OutputsCommitment::read(NextCash::InputStream *pStream)
+    {
+        if(pStream->remaining() < SIZE)
+            return false;
+        pStream->read(mSet.d, SIZE);
+        return true;
+    }
+
+    static const uint64_t sPullTimeLimits[OutputsStats::PULL_TIME_BUCKETS - 1] =
+      { 16, 64, 256, 1024, 4096, 16384, 65536 };
+    static const uint32_t sSpentAgeLimits[OutputsStats::SPENT_AGE_BUCKETS - 1] =
+      { 1, 6, 144, 1008, 4320, 52560, 210240 };
+
+    void OutputsStats::clear()
+    {
+        hits = 0;
+        misses = 0;
+        pulls = 0;
+        evictions = 0;
+        bytesRead = 0;
+        std::memset(pullTimes, 0, sizeof(pullTimes));
+        std::memset(spentAges, 0, sizeof(spentAges));
+    }
+
+    void OutputsStats::operator += (const OutputsStats &pRight)
+    {
+        hits += pRight.hits;
+        misses += pRight.misses;
+        pulls += pRight.pulls;
+        evictions += pRight.evictions;
+        bytesRead += pRight.bytesRead;
+        for(unsigned int i = 0; i < PULL_TIME_BUCKETS; ++i)
+            pullTimes[i] += pRight.pullTimes[i];
+        for(unsigned int i = 0; i < SPENT_AGE_BUCKETS; ++i)
+            spentAges[i] += pRight.spentAges[i];
+    }
+
+    void OutputsStats::addPull(uint64_t pMicroseconds, NextCash::stream_size pBytesRead)
+    {
+        unsigned int bucket = 0;
+        while(bucket < PULL_TIME_BUCKETS - 1 && pMicroseconds >= sPullTimeLimits[bucket])
+            ++bucket;
+        ++pullTimes[bucket];
+        ++pulls;
+        bytesRead += pBytesRead;
+    }
+
+    void OutputsStats::addSpend(uint32_t pAge)
+    {
+        unsigned int bucket = 0;
+        while(bucket < SPENT_AGE_BUCKETS - 1 && pAge >= sSpentAgeLimits[bucket])
+            ++bucket;
+        ++spentAges[bucket];
+    }
+
+    void OutputsStats::write(NextCash::OutputStream *pStream) const
+    {
+        pStream->writeUnsignedLong(hits);
+        pStream->writeUnsignedLong(misses);
+        pStream->writeUnsignedLong(pulls);
+        pStream->writeUnsignedLong(evictions);
+        pStream->writeUnsignedLong(bytesRead);
+        pStream->writeUnsignedInt(PULL_TIME_BUCKETS);
+        for(unsigned int i = 0; i < PULL_TIME_BUCKETS; ++i)
+            pStream->writeUnsignedLong(pullTimes[i]);
+        pStream->writeUnsignedInt(SPENT_AGE_BUCKETS);
+        for(unsigned int i = 0; i < SPENT_AGE_BUCKETS; ++i)
+            pStream->writeUnsignedLong(spentAges[i]);
+    }
+
+    void OutputsStats::print(NextCash::Log::Level pLevel) const
+    {
+        NextCash::Log::addFormatted(pLevel, BITCOIN_OUTPUTS_LOG_NAME,
+          "Cache : %" PRIu64 " hits, %" PRIu64 " misses (%d%% hits), %" PRIu64 " pulls, "
+          "%" PRIu64 " evictions, %" PRIu64 " KB read",
+          hits, misses, hitPercent(), pulls, evictions, bytesRead / 1000);
+        NextCash::Log::addFormatted(pLevel, BITCOIN_OUTPUTS_LOG_NAME,
+          "Pull times (us) : <16 %" PRIu64 ", <64 %" PRIu64 ", <256 %" PRIu64 ", "
+          "<1024 %" PRIu64 ", <4096 %" PRIu64 ", <16384 %" PRIu64 ", <65536 %" PRIu64 ", "
+          "more %" PRIu64,
+          pullTimes[0], pullTimes[1], pullTimes[2], pullTimes[3], pullTimes[4], pullTimes[5],
+          pullTimes[6], pullTimes[7]);
+        NextCash::Log::addFormatted(pLevel, BITCOIN_OUTPUTS_LOG_NAME,
+          "Spent ages (blocks) : <1 %" PRIu64 ", <6 %" PRIu64 ", <144 %" PRIu64 ", "
+          "<1008 %" PRIu64 ", <4320 %" PRIu64 ", <52560 %" PRIu64 ", <210240 %" PRIu64 ", "
+          "more %" PRIu64,
+          spentAges[0], spentAges[1], spentAges[2], spentAges[3], spentAges[4], spentAges[5],
+          spentAges[6], spentAges[7]);
+    }
+
     const uint32_t Outputs::BIP0030_HEIGHTS[BIP0030_HASH_COUNT] = { 91842, 91880 };
     const NextCash::Hash Outputs::BIP0030_HASHES[BIP0030_HASH_COUNT] =
     {
@@ -257,6 +541,54 @@ namespace BitCoin
         NextCash::Hash("00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")
     };
 
+    void Outputs::getStats(OutputsStats &pStats)
+    {
+        SubSet *subSet = mSubSets;
+        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i, ++subSet)
+            subSet->getStats(pStats);
+    }
+
+    void Outputs::printStats(NextCash::Log::Level pLevel)
+    {
+        static const unsigned int HOT_COUNT = 8;
+        OutputsStats total, subSetStats;
+        unsigned int hotIDs[HOT_COUNT];
+        uint64_t hotMisses[HOT_COUNT];
+        unsigned int i, j;
+
+        std::memset(hotMisses, 0, sizeof(hotMisses));
+        std::memset(hotIDs, 0, sizeof(hotIDs));
+
+        SubSet *subSet = mSubSets;
+        for(i = 0; i < OUTPUTS_SET_COUNT; ++i, ++subSet)
+        {
+            subSetStats.clear();
+            subSet->getStats(subSetStats);
+            total += subSetStats;
+
+            // Keep the subsets with the most misses, most first.
+            for(j = 0; j < HOT_COUNT; ++j)
+                if(subSetStats.misses > hotMisses[j])
+                {
+                    std::memmove(hotMisses + j + 1, hotMisses + j,
+                      (HOT_COUNT - j - 1) * sizeof(uint64_t));
+                    std::memmove(hotIDs + j + 1, hotIDs + j,
+                      (HOT_COUNT - j - 1) * sizeof(unsigned int));
+                    hotMisses[j] = subSetStats.misses;
+                    hotIDs[j] = i;
+                    break;
+                }
+        }
+
+        NextCash::Log::addFormatted(pLevel, BITCOIN_OUTPUTS_LOG_NAME,
+          "Statistics (%d K, %d KB cached)", cacheSize() / 1000, cacheDataSize() / 1000);
+        total.print(pLevel);
+
+        for(j = 0; j < HOT_COUNT && hotMisses[j] > 0; ++j)
+            NextCash::Log::addFormatted(pLevel, BITCOIN_OUTPUTS_LOG_NAME,
+              "Set %04x has %" PRIu64 " misses", hotIDs[j], hotMisses[j]);
+    }
+
     unsigned int Outputs::getBlockHeight(const NextCash::Hash &pTransactionID)
     {
         mLock.readLock();
@@ -295,6 +627,63 @@ namespace BitCoin
         return Iterator(subSet, result);
     }
 
+    void Outputs::updateCommitment(const OutputsCommitment &pChanges)
+    {
+        mCommitmentLock.lock();
+        mCommitment.combine(pChanges);
+        mCommitmentLock.unlock();
+    }
+
+    void Outputs::addCommitmentHeight(uint32_t pBlockHeight)
+    {
+        NextCash::Hash hash;
+        mCommitmentLock.lock();
+        mCommitment.getHash(hash);
+        while(mCommitments.size() > 0 && mCommitments.back().height >= pBlockHeight)
+            mCommitments.pop_back();
+        mCommitments.push_back(CommitmentHeight(pBlockHeight, hash));
+        if(mCommitments.size() > OUTPUTS_COMMITMENT_HISTORY)
+            mCommitments.erase(mCommitments.begin());
+        mCommitmentLock.unlock();
+    }
+
+    bool Outputs::commitment(unsigned int pHeight, NextCash::Hash &pCommitment)
+    {
+        bool result = false;
+        mCommitmentLock.lock();
+        for(std::vector<CommitmentHeight>::reverse_iterator commitment = mCommitments.rbegin();
+          commitment != mCommitments.rend() && commitment->height >= pHeight; ++commitment)
+            if(commitment->height == pHeight)
+            {
+                pCommitment = commitment->commitment;
+                result = true;
+                break;
+            }
+        mCommitmentLock.unlock();
+        return result;
+    }
+
+    bool Outputs::buildCommitment()
+    {
+        NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+          "Building outputs commitment");
+
+        OutputsCommitment commitment;
+        SubSet *subSet = mSubSets;
+        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i, ++subSet)
+            if(!subSet->buildCommitment(commitment))
+            {
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed to build outputs commitment for set %04x", i);
+                return false;
+            }
+
+        mCommitmentLock.lock();
+        mCommitment = commitment;
+        mCommitmentLock.unlock();
+        return true;
+    }
+
     bool Outputs::add(TransactionList &pBlockTransactions, unsigned int pBlockHeight)
     {
 #ifdef PROFILER_ON
@@ -311,8 +700,13 @@ namespace BitCoin
         }
 #endif
 
+        // Block flushes so they don't save part of the block.
+        bool flushLocked = !mBlockLocked;
+        if(flushLocked)
+            mFlushLock.writeLock("Add");
+
         TransactionOutputs *transactionReference;
-        Iterator item;
+        OutputsCommitment commitmentChanges;
         unsigned int count = 0;
         bool success = true, valid;
         for(TransactionList::iterator transaction = pBlockTransactions.begin();
@@ -322,34 +716,26 @@ namespace BitCoin
             transactionReference = new TransactionOutputs((*transaction)->hash(), count == 0,
               pBlockHeight, (*transaction)->outputs.size());
 
-            valid = true;
-            if(!insert(transactionReference, *transaction, pBlockHeight))
+            // A matching transaction marked for removal is used instead when it can't be
+            //   inserted.
+            valid = insert(transactionReference, *transaction, pBlockHeight);
+            if(!valid && mSubSets[subSetOffset((*transaction)->hash())].reverseRemove(
+              transactionReference, *transaction, pBlockHeight))
             {
-                // Check for matching transaction marked for removal.
-                Iterator item = get((*transaction)->hash());
-
-                valid = false;
-                while(item && (*item)->getHash() == (*transaction)->hash())
-                {
-                    if(transactionReference->valueEquals(*item) && (*item)->markedRemove())
-                    {
-                        // Unmark the matching item for removal
-                        NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Reversing removal of transaction output for block height %d : %s",
-                          pBlockHeight, (*transaction)->hash().hex().text());
-                        (*item)->clearRemove();
-                        (*item)->clearSpends();
-                        valid = true;
-                        delete transactionReference;
-                        transactionReference = (TransactionOutputs *)*item;
-                        break;
-                    }
-                    ++item;
-                }
+                delete transactionReference;
+                valid = true;
             }
 
             if(valid)
+            {
+                // Either way every output is unspent except the unspendable ones. They are
+                //   taken from the transaction since the item isn't locked here.
+                for(uint32_t i = 0; i < (*transaction)->outputs.size(); ++i)
+                    if(!ScriptInterpreter::isOPReturn((*transaction)->outputs[i].script))
+                        commitmentChanges.add((*transaction)->hash(), i, pBlockHeight,
+                          (*transaction)->outputs[i]);
                 ++count;
+            }
             else
             {
 #ifndef TEST
@@ -362,10 +748,28 @@ namespace BitCoin
             }
         }
 
+        updateCommitment(commitmentChanges);
+
         ++mNextBlockHeight;
+        if(flushLocked)
+            mFlushLock.writeUnlock();
         return success;
     }
 
+    void Outputs::beginBlock()
+    {
+        mFlushLock.writeLock("Block");
+        mBlockLocked = true;
+    }
+
+    void Outputs::endBlock()
+    {
+        if(!mBlockLocked)
+            return;
+        mBlockLocked = false;
+        mFlushLock.writeUnlock();
+    }
+
     bool Outputs::revert(TransactionList &pBlockTransactions, unsigned int pHeight)
     {
         if(!mIsValid)
@@ -383,9 +787,8 @@ namespace BitCoin
         }
 
         std::vector<Input>::const_iterator input;
-        Iterator reference;
+        OutputsUndo undo; // Journaled without the heights of spent transactions.
         bool success = true;
-        bool found;
 
         for(TransactionList::reverse_iterator transaction = pBlockTransactions.rbegin();
           transaction != pBlockTransactions.rend(); ++transaction)
@@ -394,71 +797,331 @@ namespace BitCoin
             for(input = (*transaction)->inputs.begin(); input != (*transaction)->inputs.end();
               ++input)
                 if(input->outpoint.index != 0xffffffff) // Coinbase input
-                {
-                    reference = get(input->outpoint.transactionID, true);
-                    found = false;
-                    while(reference && reference.hash() == input->outpoint.transactionID)
-                    {
-                        if(!(*reference)->markedRemove())
-                        {
-                            if((*reference)->revertSpend(input->outpoint.index, pHeight))
-                            {
-                                NextCash::Log::addFormatted(NextCash::Log::DEBUG,
-                                  BITCOIN_OUTPUTS_LOG_NAME,
-                                  "Reverted spend on input transaction : %s index %d",
-                                  input->outpoint.transactionID.hex().text(),
-                                  input->outpoint.index);
-                            }
-
-                            found = true;
-                            break;
-                        }
-
-                        ++reference;
-                    }
-
-                    // if(!found)
-                    // {
-                        // NextCash::Log::addFormatted(NextCash::Log::WARNING,
-                          // BITCOIN_OUTPUTS_LOG_NAME,
-                          // "Input transaction not found to revert spend : %s index %d",
-                          // input->outpoint.transactionID.hex().text(), input->outpoint.index);
-                    // }
-                }
+                    revertSpend(input->outpoint.transactionID, input->outpoint.index, pHeight,
+                      0xffffffff);
 
             // Remove transaction
-            reference = get((*transaction)->hash(), true);
-            found = false;
-            while(reference && reference.hash() == (*transaction)->hash())
-            {
-                if(!((TransactionOutputs *)(*reference))->markedRemove())
-                {
-                    NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
-                      "Removing transaction : %s", (*transaction)->hash().hex().text());
-                    reference->setRemove();
-                    found = true;
-                    break;
-                }
-
-                ++reference;
-            }
+            revertInsert((*transaction)->hash(), pHeight);
+        }
 
-            if(!found)
-            {
-                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Transaction not found to remove for revert : %s",
-                  (*transaction)->hash().hex().text());
-            }
+        for(TransactionList::iterator transaction = pBlockTransactions.begin();
+          transaction != pBlockTransactions.end(); ++transaction)
+        {
+            undo.insertIDs.push_back((*transaction)->hash());
+            for(input = (*transaction)->inputs.begin(); input != (*transaction)->inputs.end();
+              ++input)
+                if(input->outpoint.index != 0xffffffff) // Coinbase input
+                    undo.spends.push_back(OutputsUndo::Spend(input->outpoint.transactionID,
+                      input->outpoint.index, 0xffffffff));
         }
 
-        --mNextBlockHeight;
+        revertComplete(undo, pHeight);
         mLock.writeUnlock();
         return success;
     }
 
-    // bool Outputs::revertToHeight(unsigned int pBlockHeight)
-    // {
-        // mLock.writeLock("Revert");
+    bool Outputs::revert(const OutputsUndo &pUndo, unsigned int pHeight)
+    {
+        if(!mIsValid)
+            return false;
+
+        mLock.writeLock("Revert");
+
+        if(mNextBlockHeight != 0 && pHeight != mNextBlockHeight - 1)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Can't revert non-matching block height %d. Should be %d", pHeight,
+              mNextBlockHeight - 1);
+            mLock.writeUnlock();
+            return false;
+        }
+
+        // Unspend inputs. Every spend in undo data was applied by the block, so a failure means
+        //   the outputs don't match the block.
+        bool success = true;
+        for(std::vector<OutputsUndo::Spend>::const_reverse_iterator spend =
+          pUndo.spends.rbegin(); spend != pUndo.spends.rend(); ++spend)
+            if(!revertSpend(spend->transactionID, spend->index, pHeight,
+              spend->previousBlockHeight))
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed to revert spend for block height %d : %s index %d", pHeight,
+                  spend->transactionID.hex().text(), spend->index);
+                success = false;
+            }
+
+        // Remove transactions
+        for(std::vector<NextCash::Hash>::const_reverse_iterator insertID =
+          pUndo.insertIDs.rbegin(); insertID != pUndo.insertIDs.rend(); ++insertID)
+            revertInsert(*insertID, pHeight);
+
+        revertComplete(pUndo, pHeight);
+
+        if(!success)
+        {
+            // Don't save outputs that no longer match any block.
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed revert of block height %d. Outputs invalid until reloaded", pHeight);
+            mIsValid = false;
+        }
+
+        mLock.writeUnlock();
+        return success;
+    }
+
+    void Outputs::revertComplete(const OutputsUndo &pUndo, uint32_t pBlockHeight)
+    {
+        // Reverted spends and removals are spread across subsets.
+        SubSet *subSet = mSubSets;
+        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i, ++subSet)
+            subSet->markDirty();
+
+        /* Revert record data
+         *   Undo data of the block (OutputsUndo)
+         *   Outputs commitment after the revert (OutputsCommitment::SIZE)
+         */
+        NextCash::Buffer data;
+        data.setEndian(NextCash::Endian::LITTLE);
+        pUndo.write(&data);
+
+        mCommitmentLock.lock();
+        while(mCommitments.size() > 0 && mCommitments.back().height >= pBlockHeight)
+            mCommitments.pop_back();
+        mCommitment.write(&data);
+        mCommitmentLock.unlock();
+
+        // Flushes may already have saved the block to some subsets, so the revert is journaled
+        //   for recovery to undo it again. Blocks that failed before they were journaled were
+        //   held back from flushes. A failure leaves journalNeedsSave set.
+        if(pBlockHeight < mJournalHeight &&
+          !writeJournal(pBlockHeight, JOURNAL_REVERT_TYPE, data))
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to journal revert of block height %d", pBlockHeight);
+
+        --mNextBlockHeight;
+    }
+
+    bool Outputs::revertSpend(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+      uint32_t pBlockHeight, uint32_t pPreviousBlockHeight)
+    {
+        Iterator reference = get(pTransactionID, true);
+        while(reference && reference.hash() == pTransactionID)
+        {
+            if(!reference->markedRemove() && (pPreviousBlockHeight == 0xffffffff ||
+              reference->blockHeight == pPreviousBlockHeight))
+            {
+                // The output is needed to add it back to the commitment.
+                Output output;
+                if(!mSubSets[subSetOffset(pTransactionID)].readOutput(*reference, pIndex,
+                  output))
+                    return false;
+
+                if(reference->revertSpend(pIndex, pBlockHeight))
+                {
+                    OutputsCommitment commitmentChanges;
+                    commitmentChanges.add(pTransactionID, pIndex, reference->blockHeight, output);
+                    updateCommitment(commitmentChanges);
+
+                    NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Reverted spend on input transaction : %s index %d",
+                      pTransactionID.hex().text(), pIndex);
+                    return true;
+                }
+
+                return false;
+            }
+
+            ++reference;
+        }
+
+        return false;
+    }
+
+    bool Outputs::revertInsert(const NextCash::Hash &pTransactionID, uint32_t pBlockHeight)
+    {
+        Iterator reference = get(pTransactionID, true);
+        while(reference && reference.hash() == pTransactionID)
+        {
+            if(!reference->markedRemove() && reference->blockHeight == pBlockHeight)
+            {
+                NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Removing transaction : %s", pTransactionID.hex().text());
+
+                std::vector<Output> outputs;
+                if(!mSubSets[subSetOffset(pTransactionID)].readOutputs(*reference, outputs))
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed to read outputs of transaction to remove for revert : %s",
+                      pTransactionID.hex().text());
+                    return false;
+                }
+
+                OutputsCommitment commitmentChanges;
+                for(uint32_t i = 0; i < reference->outputCount(); ++i)
+                    if(reference->isUnspent(i))
+                        commitmentChanges.remove(pTransactionID, i, pBlockHeight, outputs[i]);
+                updateCommitment(commitmentChanges);
+
+                reference->setRemove();
+                return true;
+            }
+
+            ++reference;
+        }
+
+        NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+          "Transaction not found to remove for revert : %s", pTransactionID.hex().text());
+        return false;
+    }
+
+    bool Outputs::getUndo(TransactionList &pBlockTransactions, OutputsUndo &pUndo)
+    {
+        pUndo.clear();
+
+        std::vector<Input>::iterator input;
+        unsigned int previousBlockHeight;
+        for(TransactionList::iterator transaction = pBlockTransactions.begin();
+          transaction != pBlockTransactions.end(); ++transaction)
+        {
+            pUndo.insertIDs.push_back((*transaction)->hash());
+
+            for(input = (*transaction)->inputs.begin(); input != (*transaction)->inputs.end();
+              ++input)
+                if(input->outpoint.index != 0xffffffff) // Coinbase input
+                {
+                    // Spent transactions were just used by the block so they are cached.
+                    previousBlockHeight = getBlockHeight(input->outpoint.transactionID);
+                    if(previousBlockHeight == 0xffffffff)
+                        return false;
+                    pUndo.spends.push_back(OutputsUndo::Spend(input->outpoint.transactionID,
+                      input->outpoint.index, previousBlockHeight));
+                }
+        }
+
+        return true;
+    }
+
+    void OutputsUndo::write(NextCash::OutputStream *pStream) const
+    {
+        pStream->writeUnsignedInt(insertIDs.size());
+        for(std::vector<NextCash::Hash>::const_iterator insertID = insertIDs.begin();
+          insertID != insertIDs.end(); ++insertID)
+            insertID->write(pStream);
+
+        pStream->writeUnsignedInt(spends.size());
+        for(std::vector<Spend>::const_iterator spend = spends.begin(); spend != spends.end();
+          ++spend)
+        {
+            spend->transactionID.write(pStream);
+            pStream->writeUnsignedInt(spend->index);
+            pStream->writeUnsignedInt(spend->previousBlockHeight);
+        }
+    }
+
+    bool OutputsUndo::read(NextCash::InputStream *pStream)
+    {
+        clear();
+
+        if(pStream->remaining() < 4)
+            return false;
+        uint32_t count = pStream->readUnsignedInt();
+        if(pStream->remaining() < (NextCash::stream_size)count * TRANSACTION_HASH_SIZE)
+            return false;
+        insertIDs.resize(count, NextCash::Hash(TRANSACTION_HASH_SIZE));
+        for(std::vector<NextCash::Hash>::iterator insertID = insertIDs.begin();
+          insertID != insertIDs.end(); ++insertID)
+            if(!insertID->read(pStream))
+                return false;
+
+        if(pStream->remaining() < 4)
+            return false;
+        count = pStream->readUnsignedInt();
+        if(pStream->remaining() < (NextCash::stream_size)count * (TRANSACTION_HASH_SIZE + 8))
+            return false;
+        spends.resize(count);
+        for(std::vector<Spend>::iterator spend = spends.begin(); spend != spends.end(); ++spend)
+        {
+            if(!spend->transactionID.read(pStream))
+                return false;
+            spend->index = pStream->readUnsignedInt();
+            spend->previousBlockHeight = pStream->readUnsignedInt();
+        }
+
+        return true;
+    }
+
+    void Outputs::prefetchThreadRun(void *pParameter)
+    {
+        PrefetchThreadData *data = (PrefetchThreadData *)pParameter;
+        if(data == NULL)
+        {
+            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Thread parameter is null. Stopping");
+            return;
+        }
+
+        SubSet *subSet;
+        std::vector<NextCash::Hash> *transactionIDs;
+        while(true)
+        {
+            subSet = data->getNext(transactionIDs);
+            if(subSet == NULL)
+                break;
+
+            data->markComplete(subSet->prefetch(*transactionIDs));
+        }
+    }
+
+    void Outputs::runWorkers(WorkerPool::Function pFunction, void *pParameter,
+      unsigned int pThreadCount)
+    {
+        if(pThreadCount < 2)
+            pFunction(pParameter);
+        else if(mWorkers != NULL)
+            mWorkers->run(pFunction, pParameter, pThreadCount);
+        else
+        {
+            WorkerPool workers(BITCOIN_OUTPUTS_LOG_NAME);
+            workers.start(pThreadCount - 1);
+            workers.run(pFunction, pParameter, pThreadCount);
+        }
+    }
+
+    unsigned int Outputs::prefetch(TransactionList &pBlockTransactions, unsigned int pThreadCount)
+    {
+#ifdef PROFILER_ON
+        NextCash::ProfilerReference profiler(NextCash::getProfiler(PROFILER_SET,
+          PROFILER_OUTPUTS_PREFETCH_ID, PROFILER_OUTPUTS_PREFETCH_NAME), true);
+#endif
+        if(!mIsValid)
+            return 0;
+
+        // Group outpoint transaction IDs by subset
+        std::vector<NextCash::Hash> *transactionIDs =
+          new std::vector<NextCash::Hash>[OUTPUTS_SET_COUNT];
+        std::vector<Input>::const_iterator input;
+        for(TransactionList::iterator transaction = pBlockTransactions.begin();
+          transaction != pBlockTransactions.end(); ++transaction)
+            for(input = (*transaction)->inputs.begin(); input != (*transaction)->inputs.end();
+              ++input)
+                if(input->outpoint.index != 0xffffffff) // Coinbase input
+                    transactionIDs[subSetOffset(input->outpoint.transactionID)].push_back(
+                      input->outpoint.transactionID);
+
+        mLock.readLock();
+
+        PrefetchThreadData threadData(mSubSets, transactionIDs);
+        runWorkers(prefetchThreadRun, &threadData, pThreadCount);
+
+        mLock.readUnlock();
+
+        delete[] transactionIDs;
+        return threadData.pulledCount;
+    }
+
+    // bool Outputs::revertToHeight(unsigned int pBlockHeight)
+    // {
+        // mLock.writeLock("Revert");
 
         // if(!mIsValid)
         // {
@@ -507,8 +1170,15 @@ namespace BitCoin
 
         mLock.readLock();
         SubSet *subSet = mSubSets + subSetOffset(pTransactionID);
+        bool spent;
         bool result = subSet->getOutput(pTransactionID, pIndex, pFlags, pSpentBlockHeight,
-          pOutput, pPreviousBlockHeight, pPulled);
+          pOutput, pPreviousBlockHeight, pPulled, spent);
+        if(spent)
+        {
+            OutputsCommitment commitmentChanges;
+            commitmentChanges.remove(pTransactionID, pIndex, pPreviousBlockHeight, pOutput);
+            updateCommitment(commitmentChanges);
+        }
         mLock.readUnlock();
         return result;
     }
@@ -558,8 +1228,16 @@ namespace BitCoin
 
         mLock.readLock();
         SubSet *subSet = mSubSets + subSetOffset(pTransactionID);
+        bool spent;
+        Output output;
         bool result = subSet->spend(pTransactionID, pIndex, pSpentBlockHeight,
-          pPreviousBlockHeight, pRequireUnspent, pPulled);
+          pPreviousBlockHeight, pRequireUnspent, pPulled, spent, output);
+        if(spent)
+        {
+            OutputsCommitment commitmentChanges;
+            commitmentChanges.remove(pTransactionID, pIndex, pPreviousBlockHeight, output);
+            updateCommitment(commitmentChanges);
+        }
         mLock.readUnlock();
         return result;
     }
@@ -598,16 +1276,20 @@ namespace BitCoin
     }
 
     bool Outputs::load(const char *pFilePath, NextCash::stream_size pTargetCacheSize,
-      NextCash::stream_size pCacheDelta)
+      NextCash::stream_size pCacheDelta, unsigned int pThreadCount)
     {
         NextCash::String filePath = pFilePath;
         filePath.pathAppend("outputs");
 
-        if(!loadSubSets(filePath))
+        if(!loadSubSets(filePath, pThreadCount))
             return false;
 
         NextCash::String filePathName = filePath;
         filePathName.pathAppend("height");
+        bool commitmentLoaded = true;
+        mCommitment.clear();
+        mCommitments.clear();
+        mJournalID = 0;
         if(!NextCash::fileExists(filePathName))
             mNextBlockHeight = 0;
         else
@@ -623,14 +1305,28 @@ namespace BitCoin
 
             // Read block height
             mNextBlockHeight = file.readUnsignedInt();
+
+            // Saved before outputs commitments were added.
+            commitmentLoaded = mCommitment.read(&file);
+
+            if(file.remaining() >= 4)
+                mJournalID = file.readUnsignedInt();
         }
 
         if(mIsValid)
         {
+            if(!commitmentLoaded)
+                buildCommitment();
+            if(mNextBlockHeight > 0)
+                addCommitmentHeight(mNextBlockHeight - 1);
+
+            mSavedBlockHeight = mNextBlockHeight;
+            recoverJournal();
+            mJournalHeight = mNextBlockHeight;
+
             NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
               "Loaded outputs at height %d (%d K trans) (%d K, %d KB cached)",
               mNextBlockHeight - 1, size() / 1000, cacheSize() / 1000, cacheDataSize() / 1000);
-            mSavedBlockHeight = mNextBlockHeight;
 
             setTargetCacheSize(pTargetCacheSize);
             setCacheDelta(pCacheDelta);
@@ -639,6 +1335,18 @@ namespace BitCoin
         return mIsValid;
     }
 
+    // Write a file's data through to the disk so it survives a power loss and not just a crash
+    //   of the process.
+    static bool syncFile(const NextCash::String &pFilePathName)
+    {
+        int file = ::open(pFilePathName.text(), O_WRONLY);
+        if(file < 0)
+            return false;
+        bool result = ::fdatasync(file) == 0;
+        ::close(file);
+        return result;
+    }
+
     bool Outputs::saveBlockHeight()
     {
         NextCash::String filePathName = path();
@@ -653,174 +1361,444 @@ namespace BitCoin
 
         // Block Height
         file.writeUnsignedInt(mNextBlockHeight);
+
+        // Commitment
+        mCommitmentLock.lock();
+        mCommitment.write(&file);
+        mCommitmentLock.unlock();
+
+        // A new journal ID so records already in the journal aren't recovered if the truncate
+        //   below doesn't happen.
+        mJournalLock.lock();
+        file.writeUnsignedInt(mJournalID + 1);
+
         file.flush();
+        if(!syncFile(filePathName))
+        {
+            // The journal is still needed until the height is on the disk.
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to sync height file : %s", std::strerror(errno));
+            mJournalLock.unlock();
+            return false;
+        }
         mSavedBlockHeight = mNextBlockHeight;
+
+        // Everything in the journal is now saved.
+        ++mJournalID;
+        mJournalHeight = mNextBlockHeight;
+        mJournalFailed = false;
+        truncateJournal(0);
+        mJournalLock.unlock();
         return true;
     }
 
-    bool Outputs::saveFull(unsigned int pThreadCount, bool pAutoTrimCache)
+    bool Outputs::journal(TransactionList &pBlockTransactions, unsigned int pBlockHeight)
     {
-        mLock.writeLock("Save Cache");
+        /* Block record data
+         *   Insert count (uint32)
+         *   Inserts (transaction ID, data offset (uint64))
+         *   Spend count (uint32)
+         *   Spends (transaction ID, output index (uint32))
+         *   Outputs commitment after the block (OutputsCommitment::SIZE)
+         */
+        NextCash::Buffer data;
+        data.setEndian(NextCash::Endian::LITTLE);
 
-        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-          "Saving outputs at height %d (%d K trans) (%d K, %d KB cached)", mNextBlockHeight - 1,
-          size() / 1000, cacheSize() / 1000, cacheDataSize() / 1000);
+        mLock.readLock();
 
-#ifdef SINGLE_THREAD
-        if(!Outputs::saveSingleThreaded(pAutoTrimCache))
-#else
-        if(!Outputs::saveMultiThreaded(pThreadCount, pAutoTrimCache))
-#endif
+        // Inserts
+        NextCash::stream_size dataOffset;
+        std::vector<NextCash::Hash> insertIDs;
+        std::vector<NextCash::stream_size> insertOffsets;
+        for(TransactionList::iterator transaction = pBlockTransactions.begin();
+          transaction != pBlockTransactions.end(); ++transaction)
         {
-            mLock.writeUnlock();
-            return false;
+            dataOffset = mSubSets[subSetOffset((*transaction)->hash())].dataOffset(
+              (*transaction)->hash(), pBlockHeight);
+            if(dataOffset == NextCash::INVALID_STREAM_SIZE)
+            {
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed to find transaction to journal for block height %d : %s",
+                  pBlockHeight, (*transaction)->hash().hex().text());
+                mLock.readUnlock();
+                mJournalLock.lock();
+                mJournalFailed = true;
+                mJournalLock.unlock();
+                return false;
+            }
+
+            insertIDs.push_back((*transaction)->hash());
+            insertOffsets.push_back(dataOffset);
         }
 
-        if(!saveBlockHeight())
+        mLock.readUnlock();
+
+        data.writeUnsignedInt(insertIDs.size());
+        std::vector<NextCash::stream_size>::iterator insertOffset = insertOffsets.begin();
+        for(std::vector<NextCash::Hash>::iterator insertID = insertIDs.begin();
+          insertID != insertIDs.end(); ++insertID, ++insertOffset)
         {
-            mLock.writeUnlock();
-            return false;
+            insertID->write(&data);
+            data.writeUnsignedLong(*insertOffset);
         }
 
-        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-          "Saved outputs at height %d (%d K trans) (%d K, %d KB cached)", mNextBlockHeight - 1,
-          size() / 1000, cacheSize() / 1000, cacheDataSize() / 1000);
-        mLock.writeUnlock();
-        return true;
+        // Spends
+        unsigned int spendCount = 0;
+        std::vector<Input>::iterator input;
+        for(TransactionList::iterator transaction = pBlockTransactions.begin();
+          transaction != pBlockTransactions.end(); ++transaction)
+            for(input = (*transaction)->inputs.begin(); input != (*transaction)->inputs.end();
+              ++input)
+                if(input->outpoint.index != 0xffffffff) // Coinbase input
+                    ++spendCount;
+
+        data.writeUnsignedInt(spendCount);
+        for(TransactionList::iterator transaction = pBlockTransactions.begin();
+          transaction != pBlockTransactions.end(); ++transaction)
+            for(input = (*transaction)->inputs.begin(); input != (*transaction)->inputs.end();
+              ++input)
+                if(input->outpoint.index != 0xffffffff) // Coinbase input
+                {
+                    input->outpoint.transactionID.write(&data);
+                    data.writeUnsignedInt(input->outpoint.index);
+                }
+
+        // Commitment
+        addCommitmentHeight(pBlockHeight);
+        mCommitmentLock.lock();
+        mCommitment.write(&data);
+        mCommitmentLock.unlock();
+
+        return writeJournal(pBlockHeight, JOURNAL_ADD_TYPE, data);
     }
 
-    bool Outputs::saveCache()
+    bool Outputs::writeJournal(uint32_t pBlockHeight, uint8_t pType, NextCash::Buffer &pData)
     {
-        mLock.writeLock("Save Cache");
+        /* Record
+         *   Block height (uint32)
+         *   Data size (uint32)
+         *   Data
+         *     Journal ID (uint32)
+         *     Type (uint8)
+         *     Block or revert record data
+         *   CRC32 of data (uint32)
+         */
+        mJournalLock.lock();
+
+        NextCash::Buffer data;
+        data.setEndian(NextCash::Endian::LITTLE);
+        data.writeUnsignedInt(mJournalID);
+        data.writeByte(pType);
+        pData.setReadOffset(0);
+        data.writeStream(&pData, pData.length());
+
+        NextCash::Digest digest(NextCash::Digest::CRC32);
+        digest.setOutputEndian(NextCash::Endian::LITTLE);
+        digest.writeStream(&data, data.remaining());
+        data.setReadOffset(0);
 
-        if(!mIsValid)
+        NextCash::String filePathName = path();
+        filePathName.pathAppend("journal");
+        NextCash::FileOutputStream file(filePathName);
+        if(!file.isValid())
         {
             NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-              "Can't save invalid data set");
-            mLock.writeUnlock();
+              "Failed to open journal file");
+            mJournalFailed = true;
+            mJournalLock.unlock();
             return false;
         }
 
-        SubSet *subSet = mSubSets;
-        Time lastReport = getTime();
-        bool success = true;
-        unsigned int savedCount = 0;
-        unsigned int totalSavedCount = 0;
-        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
+        // Write at the end of the valid records to overwrite anything left by a truncate that
+        //   failed.
+        file.setOutputEndian(NextCash::Endian::LITTLE);
+        file.setWriteOffset(mJournalSize);
+        file.writeUnsignedInt(pBlockHeight);
+        file.writeUnsignedInt(data.length());
+        file.writeStream(&data, data.length());
+        digest.getResult(&file);
+        file.flush();
+
+        // The record must be on the disk before the change is relied on or a power loss could
+        //   lose it after flushes saved it to some subsets.
+        if(!syncFile(filePathName))
         {
-            if(getTime() - lastReport >= 10)
-            {
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Save cache is %2d%% Complete", (int)(((float)i / (float)OUTPUTS_SET_COUNT) * 100.0f));
-                lastReport = getTime();
-            }
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to sync journal file : %s", std::strerror(errno));
+            mJournalFailed = true;
+            mJournalLock.unlock();
+            return false;
+        }
 
-            if(!subSet->saveCache(savedCount))
-            {
-                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed set %d save cache", subSet->id());
-                success = false;
-            }
+        mJournalSize = file.writeOffset();
+        if(pType == JOURNAL_REVERT_TYPE)
+            mJournalHeight = pBlockHeight;
+        else
+            mJournalHeight = pBlockHeight + 1;
 
-            totalSavedCount += savedCount;
-            ++subSet;
+        mJournalLock.unlock();
+        return true;
+    }
+
+    bool Outputs::truncateJournal(NextCash::stream_size pSize)
+    {
+        NextCash::String filePathName = path();
+        filePathName.pathAppend("journal");
+
+        mJournalSize = pSize;
+
+        if(!NextCash::fileExists(filePathName))
+            return true;
+
+        if(truncate(filePathName.text(), pSize) != 0)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to truncate journal file : %s", std::strerror(errno));
+            return false;
         }
 
-        if(!saveBlockHeight())
+        if(!syncFile(filePathName))
         {
-            mLock.writeUnlock();
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to sync journal file : %s", std::strerror(errno));
             return false;
         }
 
-        NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
-          "Saved %d cache items", totalSavedCount);
-        mLock.writeUnlock();
-        return success;
+        return true;
     }
 
-    bool Outputs::insert(TransactionOutputs *pValue, TransactionReference &pTransaction,
-      unsigned int pBlockHeight)
+    bool Outputs::recoverJournal()
     {
-#ifdef PROFILER_ON
-        NextCash::ProfilerReference profiler(NextCash::getProfiler(PROFILER_SET,
-          PROFILER_OUTPUTS_INSERT_ID, PROFILER_OUTPUTS_INSERT_NAME), true);
-#endif
-        mLock.readLock();
-        bool result = mSubSets[subSetOffset(pValue->getHash())].insert(pValue, pTransaction,
-          pBlockHeight);
-        mLock.readUnlock();
-        return result;
+        NextCash::String filePathName = path();
+        filePathName.pathAppend("journal");
+
+        mJournalSize = 0;
+        if(!NextCash::fileExists(filePathName))
+            return true;
+
+        NextCash::FileInputStream file(filePathName);
+        if(!file.isValid())
+        {
+            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open journal file to recover");
+            return false;
+        }
+
+        file.setInputEndian(NextCash::Endian::LITTLE);
+        file.setReadOffset(0);
+
+        NextCash::Timer timer(true);
+        NextCash::Buffer data, crc;
+        NextCash::Hash transactionID(TRANSACTION_HASH_SIZE);
+        NextCash::stream_size dataOffset;
+        uint32_t blockHeight, dataSize, count, index;
+        uint8_t type;
+        OutputsCommitment commitment;
+        OutputsUndo undo;
+        unsigned int recoveredCount = 0, revertedCount = 0;
+        bool valid = true;
+        data.setEndian(NextCash::Endian::LITTLE);
+        crc.setEndian(NextCash::Endian::LITTLE);
+        while(valid && file.remaining() >= 8)
+        {
+            blockHeight = file.readUnsignedInt();
+            dataSize = file.readUnsignedInt();
+            if(dataSize < 5 || file.remaining() < dataSize + 4)
+                break; // Partially written record
+
+            data.clear();
+            data.writeStream(&file, dataSize);
+
+            NextCash::Digest digest(NextCash::Digest::CRC32);
+            digest.setOutputEndian(NextCash::Endian::LITTLE);
+            digest.writeStream(&data, data.remaining());
+            crc.clear();
+            digest.getResult(&crc);
+            if(crc.readUnsignedInt() != file.readUnsignedInt())
+            {
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Journal block %d failed CRC check", blockHeight);
+                break;
+            }
+            data.setReadOffset(0);
+
+            // Records from before the height was saved are already included in saved data.
+            //   They are only left when the journal wasn't truncated after the save, so they
+            //   are always the last records.
+            if(data.readUnsignedInt() != mJournalID)
+                break;
+
+            type = data.readByte();
+            if(type == JOURNAL_REVERT_TYPE)
+            {
+                if(blockHeight + 1 != mNextBlockHeight)
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Journal revert of block height %d doesn't match outputs height %d",
+                      blockHeight, mNextBlockHeight - 1);
+                    break;
+                }
+
+                // Undo again since flushes may have saved the block before it was reverted.
+                valid = undo.read(&data);
+                for(std::vector<OutputsUndo::Spend>::reverse_iterator spend =
+                  undo.spends.rbegin(); spend != undo.spends.rend() && valid; ++spend)
+                    valid = mSubSets[subSetOffset(spend->transactionID)].recoverRevertSpend(
+                      spend->transactionID, spend->index, spend->previousBlockHeight,
+                      blockHeight);
+                for(std::vector<NextCash::Hash>::reverse_iterator insertID =
+                  undo.insertIDs.rbegin(); insertID != undo.insertIDs.rend() && valid; ++insertID)
+                    valid = mSubSets[subSetOffset(*insertID)].recoverRevertInsert(*insertID,
+                      blockHeight);
+            }
+            else if(type == JOURNAL_ADD_TYPE)
+            {
+                if(blockHeight != mNextBlockHeight)
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Journal block height %d doesn't follow outputs height %d", blockHeight,
+                      mNextBlockHeight - 1);
+                    break;
+                }
+
+                // Inserts
+                count = data.readUnsignedInt();
+                for(unsigned int i = 0; i < count && valid; ++i)
+                {
+                    if(!transactionID.read(&data))
+                        valid = false;
+                    else
+                    {
+                        dataOffset = data.readUnsignedLong();
+                        valid = mSubSets[subSetOffset(transactionID)].recoverInsert(
+                          transactionID, dataOffset, blockHeight);
+                    }
+                }
+
+                // Spends
+                count = data.readUnsignedInt();
+                for(unsigned int i = 0; i < count && valid; ++i)
+                {
+                    if(!transactionID.read(&data))
+                        valid = false;
+                    else
+                    {
+                        index = data.readUnsignedInt();
+                        valid = mSubSets[subSetOffset(transactionID)].recoverSpend(
+                          transactionID, index, blockHeight);
+                    }
+                }
+            }
+            else
+                valid = false;
+
+            // Commitment
+            if(valid)
+                valid = commitment.read(&data);
+
+            if(!valid)
+            {
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed to recover journal block %d", blockHeight);
+                break;
+            }
+
+            mCommitmentLock.lock();
+            mCommitment = commitment;
+            mCommitmentLock.unlock();
+
+            if(type == JOURNAL_REVERT_TYPE)
+            {
+                mCommitmentLock.lock();
+                while(mCommitments.size() > 0 && mCommitments.back().height >= blockHeight)
+                    mCommitments.pop_back();
+                mCommitmentLock.unlock();
+                --mNextBlockHeight;
+                ++revertedCount;
+            }
+            else
+            {
+                addCommitmentHeight(blockHeight);
+                ++mNextBlockHeight;
+                ++recoveredCount;
+            }
+
+            mJournalSize = file.readOffset();
+        }
+
+        // Remove anything after the last recovered record so new records follow it.
+        if(file.length() > mJournalSize)
+            truncateJournal(mJournalSize);
+
+        timer.stop();
+        if(recoveredCount > 0 || revertedCount > 0)
+            NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+              "Recovered %d blocks and %d reverts from journal to height %d (%d ms)",
+              recoveredCount, revertedCount, mNextBlockHeight - 1, timer.milliseconds());
+        return true;
     }
 
-    bool Outputs::loadSubSets(const char *pFilePath)
+    bool Outputs::saveFull(unsigned int pThreadCount, bool pAutoTrimCache)
     {
-        mLock.writeLock("Load");
+        mLock.writeLock("Save Cache");
 
-        mIsValid = true;
-        mFilePath = pFilePath;
-        if(!createDirectory(mFilePath))
+        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+          "Saving outputs at height %d (%d K trans) (%d K, %d KB cached)", mNextBlockHeight - 1,
+          size() / 1000, cacheSize() / 1000, cacheDataSize() / 1000);
+
+#ifdef SINGLE_THREAD
+        if(!Outputs::saveSingleThreaded(pAutoTrimCache))
+#else
+        if(!Outputs::saveMultiThreaded(pThreadCount, pAutoTrimCache))
+#endif
         {
-            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-              "Failed to create directory : %s", mFilePath.text());
-            mIsValid = false;
             mLock.writeUnlock();
             return false;
         }
 
-        SubSet *subSet = mSubSets;
-        Time lastReport = getTime();
-        unsigned int loadedCount;
-        unsigned int totalLoadedCount = 0;
-        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
+        if(!saveBlockHeight())
         {
-            if(getTime() - lastReport >= 10)
-            {
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Load is %2d%% Complete", (int)(((float)i / (float)OUTPUTS_SET_COUNT) * 100.0f));
-                lastReport = getTime();
-            }
-            if(!subSet->load(mFilePath, i, loadedCount))
-                mIsValid = false;
-            totalLoadedCount += loadedCount;
-            ++subSet;
+            mLock.writeUnlock();
+            return false;
         }
 
+        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+          "Saved outputs at height %d (%d K trans) (%d K, %d KB cached)", mNextBlockHeight - 1,
+          size() / 1000, cacheSize() / 1000, cacheDataSize() / 1000);
         mLock.writeUnlock();
-        NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
-          "Loaded %d cache items", totalLoadedCount);
-        return mIsValid;
+        return true;
     }
 
-    bool Outputs::saveSingleThreaded(bool pAutoTrimCache)
+    bool Outputs::saveCache()
     {
+        mLock.writeLock("Save Cache");
+
         if(!mIsValid)
         {
             NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
               "Can't save invalid data set");
+            mLock.writeUnlock();
             return false;
         }
 
         SubSet *subSet = mSubSets;
         Time lastReport = getTime();
-        NextCash::stream_size maxSetCacheDataSize = 0;
-        unsigned int savedCount;
-        unsigned int totalSavedCount = 0;
         bool success = true;
-        if(mTargetCacheSize > 0)
-            maxSetCacheDataSize = mTargetCacheSize / OUTPUTS_SET_COUNT;
+        unsigned int savedCount = 0;
+        unsigned int totalSavedCount = 0;
         for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
         {
             if(getTime() - lastReport >= 10)
             {
                 NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Save is %2d%% Complete", (int)(((float)i / (float)OUTPUTS_SET_COUNT) * 100.0f));
+                  "Save cache is %2d%% Complete", (int)(((float)i / (float)OUTPUTS_SET_COUNT) * 100.0f));
                 lastReport = getTime();
             }
 
-            if(!subSet->save(maxSetCacheDataSize, pAutoTrimCache, savedCount))
+            if(!subSet->saveCache(savedCount))
             {
                 NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed set %d save", subSet->id());
+                  "Failed set %d save cache", subSet->id());
                 success = false;
             }
 
@@ -828,1398 +1806,2778 @@ namespace BitCoin
             ++subSet;
         }
 
+        if(!saveBlockHeight())
+        {
+            mLock.writeUnlock();
+            return false;
+        }
+
         NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
           "Saved %d cache items", totalSavedCount);
+        mLock.writeUnlock();
         return success;
     }
 
-    void Outputs::saveThreadRun(void *pParameter)
+    void Outputs::startFlush(unsigned int pThreadCount)
     {
-        SaveThreadData *data = (SaveThreadData *)pParameter;
-        if(data == NULL)
-        {
-            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-              "Thread parameter is null. Stopping");
+        if(mFlushThreads != NULL || pThreadCount == 0)
             return;
+
+        mFlushStopping = false;
+        mFlushThreads = new NextCash::Thread*[pThreadCount];
+        NextCash::String threadName;
+        for(unsigned int i = 0; i < pThreadCount; ++i)
+        {
+            threadName.writeFormatted("%s Flush %d", BITCOIN_OUTPUTS_LOG_NAME, i);
+            mFlushThreads[i] = new NextCash::Thread(threadName, flushThreadRun, this);
         }
+        mFlushThreadCount = pThreadCount;
+    }
 
-        SubSet *subSet;
-        unsigned int savedCount;
-        while(true)
+    void Outputs::stopFlush()
+    {
+        if(mFlushThreads == NULL)
+            return;
+
+        mFlushStopping = true;
+        for(unsigned int i = 0; i < mFlushThreadCount; ++i)
+            delete mFlushThreads[i];
+        delete[] mFlushThreads;
+        mFlushThreads = NULL;
+        mFlushThreadCount = 0;
+    }
+
+    Outputs::SubSet *Outputs::nextFlushSubSet()
+    {
+        NextCash::stream_size maxSetCacheDataSize = 0;
+        bool needsTrim = mTargetCacheSize > 0 && cacheNeedsTrim();
+        if(needsTrim)
+            maxSetCacheDataSize = mTargetCacheSize / OUTPUTS_SET_COUNT;
+
+        // Changes are left to collect for a while so each save writes more of them, unless
+        //   the cache needs to be trimmed.
+        Time now = getTime();
+        SubSet *result = NULL;
+        mFlushOffsetLock.lock();
+        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
         {
-            subSet = data->getNext();
-            if(subSet == NULL)
+            SubSet *subSet = mSubSets + mNextFlushOffset;
+            if(++mNextFlushOffset == OUTPUTS_SET_COUNT)
+                mNextFlushOffset = 0;
+
+            // The fingerprints count toward the cache size but can't be trimmed, so an empty
+            //   cache doesn't need a save.
+            if(((subSet->isDirty() && now - subSet->dirtyTime() >= OUTPUTS_FLUSH_DELAY) ||
+              (needsTrim && subSet->cacheSize() > 0 &&
+              subSet->cacheDataSize() > maxSetCacheDataSize)) && subSet->claim())
             {
-                NextCash::Log::add(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
-                  "No more save tasks remaining");
+                result = subSet;
                 break;
             }
-
-            if(subSet->save(data->maxSetCacheDataSize, data->autoTrimCache, savedCount))
-                data->markComplete(subSet->id(), true, savedCount);
-            else
-            {
-                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed save of set %d", subSet->id());
-                data->markComplete(subSet->id(), false, savedCount);
-            }
         }
+        mFlushOffsetLock.unlock();
+        return result;
     }
 
-    bool Outputs::saveMultiThreaded(unsigned int pThreadCount, bool pAutoTrimCache)
+    bool Outputs::flushSubSet(SubSet *pSubSet)
     {
+        // Flush lock is first so add can't wait on the main lock while holding it.
+        mFlushLock.readLock();
+        mLock.readLock();
+
         if(!mIsValid)
         {
-            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-              "Can't save invalid data set");
+            mLock.readUnlock();
+            mFlushLock.readUnlock();
             return false;
         }
 
+        // The flush lock is only needed while the subset's changes are copied, so save
+        //   releases it before writing them.
         NextCash::stream_size maxSetCacheDataSize = 0;
         if(mTargetCacheSize > 0)
             maxSetCacheDataSize = mTargetCacheSize / OUTPUTS_SET_COUNT;
-        SaveThreadData threadData(mSubSets, maxSetCacheDataSize, pAutoTrimCache);
-        NextCash::Thread *threads[pThreadCount];
-        Time lastReport = getTime();
-        unsigned int i;
-        NextCash::String threadName;
+        unsigned int savedCount;
+        bool success = pSubSet->save(maxSetCacheDataSize, cacheNeedsTrim(), exactSpentHeight(),
+          savedCount, &mFlushLock);
 
-        // Start threads
-        for(i = 0; i < pThreadCount; ++i)
-        {
-            threadName.writeFormatted("%s Save %d", BITCOIN_OUTPUTS_LOG_NAME, i);
-            threads[i] = new NextCash::Thread(threadName, saveThreadRun, &threadData);
-        }
+        mLock.readUnlock();
 
-        // Monitor threads
-        unsigned int completedCount;
-        bool report;
-        while(true)
-        {
-            if(threadData.offset == OUTPUTS_SET_COUNT)
-            {
-                report = getTime() - lastReport >= 10;
-                completedCount = 0;
-                for(i = 0; i < OUTPUTS_SET_COUNT; ++i)
-                    if(threadData.setComplete[i])
-                        ++completedCount;
-                    else if(report)
-                        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Save waiting for set %d", i);
+        if(!success)
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed flush of set %d", pSubSet->id());
+        return success;
+    }
 
-                if(report)
-                    lastReport = getTime();
+    Outputs::SubSet *Outputs::nextCompactSubSet()
+    {
+        SubSet *result = NULL;
+        mCompactLock.lock();
+
+        // Refill the budget, keeping at most a few seconds of it. It goes negative after
+        //   a large set is defragmented and delays the next one until it is repaid.
+        Time now = getTime();
+        mCompactBudget += (int64_t)(now - mCompactTime) * OUTPUTS_COMPACT_RATE;
+        mCompactTime = now;
+        if(mCompactBudget > OUTPUTS_COMPACT_RATE * 10)
+            mCompactBudget = OUTPUTS_COMPACT_RATE * 10;
+
+        if(mCompactBudget > 0)
+            for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
+            {
+                SubSet *subSet = mSubSets + mNextCompactOffset;
+                if(++mNextCompactOffset == OUTPUTS_SET_COUNT)
+                    mNextCompactOffset = 0;
 
-                if(completedCount == OUTPUTS_SET_COUNT)
+                if(subSet->needsDefragment() && subSet->claim())
+                {
+                    result = subSet;
                     break;
+                }
             }
-            else if(getTime() - lastReport >= 10)
-            {
-                completedCount = 0;
-                for(i = 0; i < OUTPUTS_SET_COUNT; ++i)
-                    if(threadData.setComplete[i])
-                        ++completedCount;
 
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Save is %2d%% Complete",
-                  (int)(((float)completedCount / (float)OUTPUTS_SET_COUNT) * 100.0f));
+        mCompactLock.unlock();
+        return result;
+    }
 
-                lastReport = getTime();
-            }
+    bool Outputs::compactSubSet(SubSet *pSubSet)
+    {
+        // Same locks as a flush since it only changes data offsets of cached items.
+        mFlushLock.readLock();
+        mLock.readLock();
 
-            NextCash::Thread::sleep(500);
+        if(!mIsValid)
+        {
+            mLock.readUnlock();
+            mFlushLock.readUnlock();
+            return false;
         }
 
-        // Delete threads
-        NextCash::Log::add(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME, "Deleting save threads");
-        for(i = 0; i < pThreadCount; ++i)
-            delete threads[i];
+        NextCash::stream_size dataSize;
+        bool replaced;
+        bool success = pSubSet->defragment(dataSize, replaced);
 
-        NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
-          "Saved %d cache items", threadData.savedCount);
-        return threadData.success;
-    }
+        mLock.readUnlock();
+        mFlushLock.readUnlock();
 
-    Outputs::SubSet::SubSet() : mLock("OutputsSubSet")
-    {
-        mSamples = NULL;
-        mIndexSize = 0;
-        mNewSize = 0;
-        mCacheRawDataSize = 0;
-    }
+        // Data was read and written.
+        mCompactLock.lock();
+        mCompactBudget -= (int64_t)dataSize * 2;
+        mCompactLock.unlock();
 
-    Outputs::SubSet::~SubSet()
-    {
-        if(mSamples != NULL)
-            delete[] mSamples;
-    }
+        if(success)
+            return true;
 
-    unsigned int Outputs::SubSet::getBlockHeight(const NextCash::Hash &pTransactionID)
-    {
-        mLock.lock();
-
-        unsigned int result = 0xffffffff;
-        SubSetIterator item = mCache.find(pTransactionID);
-        if(item == mCache.end() && pull(pTransactionID))
-            item = mCache.find(pTransactionID);
-        if(item != mCache.end())
-            result = ((TransactionOutputs *)*item)->blockHeight;
-
-        mLock.unlock();
-        return result;
+        if(replaced)
+        {
+            // The subset files may be only partially replaced. Stop saving until they are
+            //   reloaded, which finishes the replacement.
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed defragment of set %d. Outputs invalid until reloaded", pSubSet->id());
+            mIsValid = false;
+        }
+        else
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed defragment of set %d before its files were replaced", pSubSet->id());
+        return success;
     }
 
-    typename Outputs::SubSetIterator Outputs::SubSet::get(const NextCash::Hash &pTransactionID)
+    void Outputs::flushThreadRun(void *pParameter)
     {
-        mLock.lock();
+        Outputs *outputs = (Outputs *)pParameter;
+        if(outputs == NULL)
+        {
+            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Flush thread parameter is null. Stopping");
+            return;
+        }
 
-        SubSetIterator result = mCache.find(pTransactionID);
-        if(result == mCache.end() && pull(pTransactionID))
-            result = mCache.find(pTransactionID);
+        SubSet *subSet;
+        bool success;
+        while(!outputs->mFlushStopping)
+        {
+            subSet = outputs->nextFlushSubSet();
+            if(subSet == NULL)
+            {
+                if(outputs->mFlushStopping)
+                    break;
 
-        mLock.unlock();
-        return result;
+                // Defragment when there is nothing to flush.
+                subSet = outputs->nextCompactSubSet();
+                success = subSet != NULL && outputs->compactSubSet(subSet);
+                if(subSet != NULL)
+                    subSet->release();
+                if(!success)
+                    NextCash::Thread::sleep(500);
+                continue;
+            }
+
+            success = outputs->flushSubSet(subSet);
+            subSet->release();
+            if(!success)
+                NextCash::Thread::sleep(500); // Don't spin on a failing set
+        }
     }
 
-    bool Outputs::SubSet::insert(TransactionOutputs *pReference,
-      TransactionReference &pTransaction, unsigned int pBlockHeight)
+    bool Outputs::exportSnapshot(const char *pFileName, NextCash::Hash &pCommitment)
     {
-        mLock.lock();
-
-        if(!mCache.insert(pReference, true))
+        /* File format
+         *   Start string
+         *   Height of last block (uint32)
+         *   For each set
+         *     Item count (uint64)
+         *     Items sorted by transaction ID
+         *       Transaction ID
+         *       Same data as data file with spent outputs at SPENT_BITMAP_HEIGHT
+         *   SHA256 of everything after the start string
+         */
+        mLock.writeLock("Export");
+
+        if(mNextBlockHeight == 0)
         {
-            mLock.unlock();
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "No outputs to export");
+            mLock.writeUnlock();
             return false;
         }
 
-        pReference->clearDataOffset();
-
-#ifdef PROFILER_ON
-        NextCash::ProfilerReference profiler(NextCash::getProfiler(PROFILER_SET,
-          PROFILER_OUTPUTS_WRITE_ID, PROFILER_OUTPUTS_WRITE_NAME), true);
-#endif
-        NextCash::String filePathName;
-        filePathName.writeFormatted("%s%s%04x.data", mFilePath, NextCash::PATH_SEPARATOR, mID);
-        NextCash::FileOutputStream *dataOutFile = new NextCash::FileOutputStream(filePathName);
-        if(!dataOutFile->isValid())
+        NextCash::FileOutputStream file(pFileName, true);
+        if(!file.isValid())
         {
-            delete dataOutFile;
-            mCache.remove(pReference->getHash());
-            mLock.unlock();
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open snapshot file : %s", pFileName);
+            mLock.writeUnlock();
             return false;
         }
 
-        pReference->writeInitialData(pReference->getHash(), dataOutFile, pTransaction,
-          pBlockHeight);
-        delete dataOutFile;
-
-        ++mNewSize;
-        mCacheRawDataSize += pReference->memorySize();
-
-        mLock.unlock();
-        return true;
-    }
+        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+          "Exporting outputs snapshot at height %d", mNextBlockHeight - 1);
 
-    bool Outputs::SubSet::getOutput(const NextCash::Hash &pTransactionID,
-      uint32_t pIndex, uint8_t pFlags, uint32_t pSpentBlockHeight, Output &pOutput,
-      uint32_t &pPreviousBlockHeight, bool &pPulled)
-    {
-        mLock.lock();
+        file.setOutputEndian(NextCash::Endian::LITTLE);
+        file.writeString(SNAPSHOT_START_STRING);
 
-        bool result = false;
-        SubSetIterator item = mCache.find(pTransactionID);
-        if(item == mCache.end())
-        {
-            pPulled = true;
-            if(pull(pTransactionID))
-                item = mCache.find(pTransactionID);
-        }
-        else
-            pPulled = false;
+        NextCash::Digest digest(NextCash::Digest::SHA256);
+        digest.setOutputEndian(NextCash::Endian::LITTLE);
+        NextCash::Buffer data;
+        data.setEndian(NextCash::Endian::LITTLE);
+        data.writeUnsignedInt(mNextBlockHeight - 1);
 
-        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        // Sets are written one at a time so the whole snapshot is never in memory.
+        SubSet *subSet = mSubSets;
+        uint64_t count, totalCount = 0;
+        bool success = true;
+        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i, ++subSet)
         {
-            if(!((TransactionOutputs *)*item)->markedRemove())
+            if(!subSet->exportSnapshot(&data, count))
             {
-                pPreviousBlockHeight = ((TransactionOutputs *)*item)->blockHeight;
+                success = false;
+                break;
+            }
 
-                if(pFlags & MARK_SPENT)
-                    result =
-                      ((TransactionOutputs *)*item)->spendInternal(pSpentBlockHeight, pIndex) ||
-                      !(pFlags & REQUIRE_UNSPENT);
-                else if(pFlags & REQUIRE_UNSPENT)
-                    result = ((TransactionOutputs *)*item)->isUnspent(pIndex);
-                else
-                    result = true;
+            totalCount += count;
+            digest.writeStream(&data, data.remaining());
+            data.setReadOffset(0);
+            file.writeStream(&data, data.length());
+            data.clear();
+        }
 
-                if(result)
-                {
-                    NextCash::String filePathName;
-                    filePathName.writeFormatted("%s%s%04x.data", mFilePath,
-                      NextCash::PATH_SEPARATOR, mID);
-                    NextCash::FileInputStream *dataInFile =
-                      new NextCash::FileInputStream(filePathName);
-                    result = dataInFile->isValid() &&
-                      ((TransactionOutputs *)*item)->readOutput(dataInFile, pIndex, pOutput);
-                    delete dataInFile;
-                }
+        if(success)
+        {
+            pCommitment.setSize(32);
+            digest.getResult(&pCommitment);
+            pCommitment.write(&file);
+            file.flush();
 
-                break;
-            }
+            NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+              "Exported outputs snapshot at height %d (%d K trans) : %s", mNextBlockHeight - 1,
+              (int)(totalCount / 1000), pCommitment.hex().text());
 
-            ++item;
+            NextCash::Hash outputsCommitment;
+            mCommitmentLock.lock();
+            mCommitment.getHash(outputsCommitment);
+            mCommitmentLock.unlock();
+            NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+              "Outputs commitment at height %d : %s", mNextBlockHeight - 1,
+              outputsCommitment.hex().text());
         }
+        else
+            NextCash::removeFile(pFileName);
 
-        mLock.unlock();
-        return result;
+        mLock.writeUnlock();
+        return success;
     }
 
-    bool Outputs::SubSet::isUnspent(const NextCash::Hash &pTransactionID, uint32_t pIndex,
-      bool &pPulled)
+    bool Outputs::importSnapshot(const char *pFileName, const char *pFilePath,
+      const NextCash::Hash &pCommitment, unsigned int &pHeight)
     {
-        mLock.lock();
+        mLock.writeLock("Import");
 
-        bool result = false;
-        SubSetIterator item = mCache.find(pTransactionID);
-        if(item == mCache.end())
+        mIsValid = false;
+        mFilePath = pFilePath;
+        mFilePath.pathAppend("outputs");
+
+        NextCash::String filePathName = mFilePath;
+        filePathName.pathAppend("height");
+        if(NextCash::fileExists(filePathName))
         {
-            pPulled = true;
-            if(pull(pTransactionID))
-                item = mCache.find(pTransactionID);
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Outputs already exist : %s", mFilePath.text());
+            mLock.writeUnlock();
+            return false;
         }
-        else
-            pPulled = false;
 
-        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        if(!createDirectory(mFilePath))
         {
-            if(!((TransactionOutputs *)*item)->markedRemove())
-            {
-                result = ((TransactionOutputs *)*item)->isUnspent(pIndex);
-                break;
-            }
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to create directory : %s", mFilePath.text());
+            mLock.writeUnlock();
+            return false;
+        }
 
-            ++item;
+        NextCash::FileInputStream file(pFileName);
+        if(!file.isValid() || file.length() < 12 + 32)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open snapshot file : %s", pFileName);
+            mLock.writeUnlock();
+            return false;
         }
 
-        mLock.unlock();
-        return result;
-    }
+        file.setInputEndian(NextCash::Endian::LITTLE);
+        if(file.readString(8) != SNAPSHOT_START_STRING)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Snapshot file missing start string : %s", pFileName);
+            mLock.writeUnlock();
+            return false;
+        }
 
-    uint8_t Outputs::SubSet::unspentStatus(const NextCash::Hash &pTransactionID, uint32_t pIndex)
-    {
-        mLock.lock();
+        NextCash::Digest digest(NextCash::Digest::SHA256);
+        digest.setOutputEndian(NextCash::Endian::LITTLE);
+        NextCash::Buffer data;
+        data.setEndian(NextCash::Endian::LITTLE);
+        data.writeStream(&file, 4);
+        digest.writeStream(&data, data.remaining());
+        data.setReadOffset(0);
+        pHeight = data.readUnsignedInt();
 
-        uint8_t result = 0;
-        SubSetIterator item = mCache.find(pTransactionID);
-        if(item == mCache.end() && pull(pTransactionID))
-            item = mCache.find(pTransactionID);
+        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+          "Importing outputs snapshot at height %d", pHeight);
+        if(pCommitment.isEmpty())
+            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "No commitment given. The snapshot is only checked against its own hash, so it is "
+              "not authenticated");
 
-        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        SubSet *subSet = mSubSets;
+        Time lastReport = getTime();
+        OutputsCommitment commitmentSet;
+        uint64_t count, totalCount = 0;
+        bool success = true;
+        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i, ++subSet)
         {
-            if(!((TransactionOutputs *)*item)->markedRemove())
+            if(getTime() - lastReport >= 10)
             {
-                result |= UNSPENT_STATUS_EXISTS;
-                if(((TransactionOutputs *)*item)->isUnspent(pIndex))
-                    result |= UNSPENT_STATUS_UNSPENT;
-                break;
+                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Import is %2d%% Complete",
+                  (int)(((float)i / (float)OUTPUTS_SET_COUNT) * 100.0f));
+                lastReport = getTime();
             }
 
-            ++item;
+            if(!subSet->importSnapshot(mFilePath, i, &file, &digest, commitmentSet, count))
+            {
+                success = false;
+                break;
+            }
+            totalCount += count;
         }
 
-        mLock.unlock();
-        return result;
-    }
+        NextCash::Hash commitment(32);
+        if(success)
+        {
+            NextCash::Hash storedCommitment(32);
+            digest.getResult(&commitment);
+            if(file.remaining() != 32 || !storedCommitment.read(&file, 32) ||
+              storedCommitment != commitment)
+            {
+                NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Snapshot doesn't match its commitment");
+                success = false;
+            }
+            else if(!pCommitment.isEmpty() && pCommitment != commitment)
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Snapshot commitment %s doesn't match %s", commitment.hex().text(),
+                  pCommitment.hex().text());
+                success = false;
+            }
+        }
 
-    bool Outputs::SubSet::spend(const NextCash::Hash &pTransactionID, uint32_t pIndex,
-      uint32_t pSpentBlockHeight, uint32_t &pPreviousBlockHeight, bool pRequireUnspent,
-      bool &pPulled)
-    {
-        mLock.lock();
+        if(success)
+        {
+            mNextBlockHeight = pHeight + 1;
+            mCommitmentLock.lock();
+            mCommitment = commitmentSet;
+            mCommitmentLock.unlock();
+            addCommitmentHeight(pHeight);
+            success = saveBlockHeight();
+        }
 
-        bool result = false;
-        SubSetIterator item = mCache.find(pTransactionID);
-        if(item == mCache.end())
+        if(success)
         {
-            pPulled = true;
-            if(pull(pTransactionID))
-                item = mCache.find(pTransactionID);
+            NextCash::Hash outputsCommitment;
+            commitmentSet.getHash(outputsCommitment);
+            NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+              "Imported outputs snapshot at height %d (%d K trans) : %s", pHeight,
+              (int)(totalCount / 1000), commitment.hex().text());
+            NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+              "Outputs commitment at height %d : %s", pHeight, outputsCommitment.hex().text());
         }
         else
-            pPulled = false;
-
-        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
         {
-            if(!((TransactionOutputs *)*item)->markedRemove())
-            {
-                pPreviousBlockHeight = ((TransactionOutputs *)*item)->blockHeight;
-                result =
-                  ((TransactionOutputs *)*item)->spendInternal(pSpentBlockHeight, pIndex) ||
-                  !pRequireUnspent;
-                break;
-            }
-
-            ++item;
+            // Don't leave partial sets to be loaded.
+            static const char *extensions[] = { "data", "index", "fingerprint", "cache" };
+            for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
+                for(unsigned int j = 0; j < 4; ++j)
+                {
+                    filePathName.writeFormatted("%s%s%04x.%s", mFilePath.text(),
+                      NextCash::PATH_SEPARATOR, i, extensions[j]);
+                    NextCash::removeFile(filePathName);
+                }
         }
 
-        mLock.unlock();
+        mLock.writeUnlock();
+        return success;
+    }
+
+    bool Outputs::insert(TransactionOutputs *pValue, TransactionReference &pTransaction,
+      unsigned int pBlockHeight)
+    {
+#ifdef PROFILER_ON
+        NextCash::ProfilerReference profiler(NextCash::getProfiler(PROFILER_SET,
+          PROFILER_OUTPUTS_INSERT_ID, PROFILER_OUTPUTS_INSERT_NAME), true);
+#endif
+        mLock.readLock();
+        bool result = mSubSets[subSetOffset(pValue->getHash())].insert(pValue, pTransaction,
+          pBlockHeight);
+        mLock.readUnlock();
         return result;
     }
 
-    bool Outputs::SubSet::hasUnspent(const NextCash::Hash &pTransactionID,
-      uint32_t pSpentBlockHeight)
+    void Outputs::loadThreadRun(void *pParameter)
     {
-        mLock.lock();
+        LoadThreadData *data = (LoadThreadData *)pParameter;
+        if(data == NULL)
+        {
+            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Thread parameter is null. Stopping");
+            return;
+        }
 
-        bool result = false;
-        SubSetIterator item = mCache.find(pTransactionID);
-        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        SubSet *subSet;
+        unsigned int id, loadedCount;
+        while(true)
         {
-            if(!((TransactionOutputs *)*item)->markedRemove() &&
-              (pSpentBlockHeight == 0xffffffff || pSpentBlockHeight !=
-              ((TransactionOutputs *)*item)->blockHeight))
-            {
-                result = ((TransactionOutputs *)*item)->hasUnspent();
+            subSet = data->getNext(id);
+            if(subSet == NULL)
                 break;
-            }
 
-            ++item;
+            if(subSet->load(data->filePath, id, loadedCount))
+                data->markComplete(true, loadedCount);
+            else
+            {
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed load of set %d", id);
+                data->markComplete(false, loadedCount);
+            }
         }
-
-        mLock.unlock();
-        return result;
     }
 
-    bool Outputs::SubSet::checkDuplicate(const NextCash::Hash &pTransactionID,
-      unsigned int pBlockHeight, const NextCash::Hash &pBlockHash)
+    bool Outputs::loadSubSets(const char *pFilePath, unsigned int pThreadCount)
     {
-        mLock.lock();
-
-        // Force pull because we know there is already one in the cache since this is called during
-        //   block validation after the blocks transactions have already been added to the output set.
-        pull(pTransactionID);
+        mLock.writeLock("Load");
 
-        bool result = true;
-        SubSetIterator item = mCache.find(pTransactionID);
-        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        mIsValid = true;
+        mFilePath = pFilePath;
+        if(!createDirectory(mFilePath))
         {
-            if(!((TransactionOutputs *)*item)->markedRemove() &&
-              ((TransactionOutputs *)*item)->blockHeight != pBlockHeight &&
-              ((TransactionOutputs *)*item)->hasUnspent())
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to create directory : %s", mFilePath.text());
+            mIsValid = false;
+            mLock.writeUnlock();
+            return false;
+        }
+
+        // Each subset keeps its data file open between lookups so make sure the process is
+        //   allowed enough file descriptors.
+        struct rlimit fileLimit;
+        if(::getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 &&
+          fileLimit.rlim_cur < OUTPUTS_SET_COUNT + 512)
+        {
+            rlim_t previousLimit = fileLimit.rlim_cur;
+            fileLimit.rlim_cur = OUTPUTS_SET_COUNT + 512;
+            if(fileLimit.rlim_max != RLIM_INFINITY && fileLimit.rlim_cur > fileLimit.rlim_max)
+                fileLimit.rlim_cur = fileLimit.rlim_max;
+            if(::setrlimit(RLIMIT_NOFILE, &fileLimit) != 0 ||
+              fileLimit.rlim_cur < OUTPUTS_SET_COUNT + 512)
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Open file limit %d may be too low for %d output sets",
+                  (int)previousLimit, OUTPUTS_SET_COUNT);
+        }
+
+        Time lastReport = getTime();
+        unsigned int totalLoadedCount = 0;
+#ifdef SINGLE_THREAD
+        pThreadCount = 0;
+#endif
+        if(pThreadCount <= 1)
+        {
+            SubSet *subSet = mSubSets;
+            unsigned int loadedCount;
+            for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
             {
-                bool exceptionFound = false;
-                for(unsigned int i = 0; i < BIP0030_HASH_COUNT; ++i)
-                    if(BIP0030_HEIGHTS[i] == pBlockHeight && BIP0030_HASHES[i] == pBlockHash)
-                        exceptionFound = true;
-                if(exceptionFound)
+                if(getTime() - lastReport >= 10)
                 {
                     NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                      "BIP-0030 Exception for duplicate transaction ID in block %d : %s",
-                      ((TransactionOutputs *)*item)->blockHeight, pTransactionID.hex().text());
-                }
-                else
-                {
-                    NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-                      "Matching transaction hash from block %d has unspent outputs : %s",
-                      ((TransactionOutputs *)*item)->blockHeight, pTransactionID.hex().text());
-                    result = false;
-                    break;
+                      "Load is %2d%% Complete",
+                      (int)(((float)i / (float)OUTPUTS_SET_COUNT) * 100.0f));
+                    lastReport = getTime();
                 }
+                if(!subSet->load(mFilePath, i, loadedCount))
+                    mIsValid = false;
+                totalLoadedCount += loadedCount;
+                ++subSet;
             }
-
-            ++item;
         }
-
-        mLock.unlock();
-        return result;
-    }
-
-    bool Outputs::SubSet::exists(const NextCash::Hash &pTransactionID, bool pPullIfNeeded)
-    {
-        mLock.lock();
-
-        bool result = false;
-        SubSetIterator item = mCache.find(pTransactionID);
-        if(item == mCache.end() && pPullIfNeeded && pull(pTransactionID))
-            item = mCache.find(pTransactionID);
-
-        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        else
         {
-            if(!((TransactionOutputs *)*item)->markedRemove())
-            {
-                result = true;
-                break;
-            }
+            // Subsets don't share anything while loading so they can be loaded in parallel.
+            LoadThreadData threadData(mSubSets, mFilePath);
+            runWorkers(loadThreadRun, &threadData, pThreadCount);
 
-            ++item;
+            if(!threadData.success)
+                mIsValid = false;
+            totalLoadedCount = threadData.loadedCount;
         }
 
-        mLock.unlock();
-        return result;
+        mLock.writeUnlock();
+        NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
+          "Loaded %d cache items", totalLoadedCount);
+        return mIsValid;
     }
 
-    bool Outputs::SubSet::pull(const NextCash::Hash &pTransactionID,
-      TransactionOutputs *pMatching)
+    bool Outputs::saveSingleThreaded(bool pAutoTrimCache)
     {
-#ifdef PROFILER_ON
-        NextCash::ProfilerReference profiler(NextCash::getProfiler(PROFILER_SET,
-          PROFILER_OUTPUTS_PULL_ID, PROFILER_OUTPUTS_PULL_NAME), true);
-#endif
-        if(mIndexSize == 0)
-            return false;
-
-        int compare;
-        NextCash::stream_size dataOffset;
-        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
-        NextCash::stream_size first = 0, last = (mIndexSize - 1) * sizeof(NextCash::stream_size),
-          begin, end, current;
-        NextCash::String filePathName;
-        filePathName.writeFormatted("%s%s%04x.index", mFilePath, NextCash::PATH_SEPARATOR, mID);
-        NextCash::FileInputStream indexFile(filePathName);
-        filePathName.writeFormatted("%s%s%04x.data", mFilePath, NextCash::PATH_SEPARATOR, mID);
-        NextCash::FileInputStream dataFile(filePathName);
-
-        if(!indexFile.isValid())
-        {
-            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-              "Failed to open index file in pull");
-            return false;
-        }
-
-        if(!dataFile.isValid())
+        if(!mIsValid)
         {
             NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-              "Failed to open index file in pull");
+              "Can't save invalid data set");
             return false;
         }
 
-        if(mSamples != NULL)
-        {
-            if(!findSample(pTransactionID, &indexFile, &dataFile, begin, end))
-                return false; // Failed
-
-            if(begin == NextCash::INVALID_STREAM_SIZE)
-                return false; // Not within subset
-        }
-        else // Not enough items for a full sample set
+        SubSet *subSet = mSubSets;
+        Time lastReport = getTime();
+        NextCash::stream_size maxSetCacheDataSize = 0;
+        uint32_t exactHeight = exactSpentHeight();
+        unsigned int savedCount;
+        unsigned int totalSavedCount = 0;
+        bool success = true;
+        if(mTargetCacheSize > 0)
+            maxSetCacheDataSize = mTargetCacheSize / OUTPUTS_SET_COUNT;
+        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
         {
-            // Setup index binary search on all indices
-            begin = first;
-            end = last;
-
-            // Check first item
-            indexFile.setReadOffset(begin);
-            indexFile.read(&dataOffset, sizeof(NextCash::stream_size));
-            dataFile.setReadOffset(dataOffset);
-            if(!hash.read(&dataFile))
-                return false;
-
-            compare = hash.compare(pTransactionID);
-            if(compare > 0)
-                return false; // Lookup is before first item
-            else if(compare == 0)
-                end = begin;
-            else if(mIndexSize > 1)
-            {
-                // Check last item
-                indexFile.setReadOffset(end);
-                indexFile.read(&dataOffset, sizeof(NextCash::stream_size));
-                dataFile.setReadOffset(dataOffset);
-                if(!hash.read(&dataFile))
-                    return false;
-
-                compare = hash.compare(pTransactionID);
-                if(compare < 0)
-                    return false; // Lookup is after last item
-                else if(compare == 0)
-                    begin = end;
+            if(getTime() - lastReport >= 10)
+            {
+                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Save is %2d%% Complete", (int)(((float)i / (float)OUTPUTS_SET_COUNT) * 100.0f));
+                lastReport = getTime();
             }
-            else
-                return false; // Not within subset
-        }
 
-        if(begin == end)
-            current = begin; // Lookup matches a sample
-        else
-        {
-            // Binary search the file indices
-            while(true)
+            if(!subSet->save(maxSetCacheDataSize, pAutoTrimCache, exactHeight, savedCount))
             {
-                // Break the set in two halves (set current to the middle)
-                current = (end - begin) / 2;
-                current -= current % sizeof(NextCash::stream_size);
-                if(current == 0) // Begin and end are next to each other and have already been checked
-                    return false;
-                current += begin;
-
-                // Read the middle item
-                indexFile.setReadOffset(current);
-                indexFile.read(&dataOffset, sizeof(NextCash::stream_size));
-                dataFile.setReadOffset(dataOffset);
-                if(!hash.read(&dataFile))
-                    return false;
-
-                // Determine which half the desired item is in
-                compare = hash.compare(pTransactionID);
-                if(compare < 0)
-                    begin = current;
-                else if(compare > 0)
-                    end = current;
-                else
-                    break;
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed set %d save", subSet->id());
+                success = false;
             }
+
+            totalSavedCount += savedCount;
+            ++subSet;
         }
 
-        // Match likely found
-        // Loop backwards to find the first matching
-        while(current > first)
-        {
-            current -= sizeof(NextCash::stream_size);
-            indexFile.setReadOffset(current);
-            indexFile.read(&dataOffset, sizeof(NextCash::stream_size));
-            dataFile.setReadOffset(dataOffset);
-            if(!hash.read(&dataFile))
-                return false;
+        NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
+          "Saved %d cache items", totalSavedCount);
+        return success;
+    }
 
-            if(hash != pTransactionID)
-            {
-                current += sizeof(NextCash::stream_size);
-                break;
-            }
+    void Outputs::saveThreadRun(void *pParameter)
+    {
+        SaveThreadData *data = (SaveThreadData *)pParameter;
+        if(data == NULL)
+        {
+            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Thread parameter is null. Stopping");
+            return;
         }
 
-        // Read in all matching
-        bool result = false;
-        TransactionOutputs *next;
-        while(current <= last)
+        SubSet *subSet;
+        unsigned int savedCount;
+        while(true)
         {
-            indexFile.setReadOffset(current);
-            indexFile.read(&dataOffset, sizeof(NextCash::stream_size));
-            dataFile.setReadOffset(dataOffset);
-            if(!hash.read(&dataFile))
-                return result;
-
-            if(hash != pTransactionID)
-                break;
-
-            next = new TransactionOutputs(hash);
-            if(!next->readData(&dataFile))
+            subSet = data->getNext();
+            if(subSet == NULL)
             {
-                delete next;
+                NextCash::Log::add(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
+                  "No more save tasks remaining");
                 break;
             }
 
-            if((pMatching == NULL || pMatching->valueEquals(next)) && mCache.insert(next, true))
+            if(subSet->save(data->maxSetCacheDataSize, data->autoTrimCache, data->exactHeight,
+              savedCount))
+                data->markComplete(subSet->id(), true, savedCount);
+            else
             {
-                mCacheRawDataSize += next->memorySize();
-                result = true;
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed save of set %d", subSet->id());
+                data->markComplete(subSet->id(), false, savedCount);
             }
-            else
-                delete next;
-
-            current += sizeof(NextCash::stream_size);
         }
-
-        return result;
     }
 
-    void Outputs::SubSet::loadSamples(NextCash::InputStream *pIndexFile)
+    bool Outputs::saveMultiThreaded(unsigned int pThreadCount, bool pAutoTrimCache)
     {
-        NextCash::stream_size delta = mIndexSize / OUTPUTS_SAMPLE_COUNT;
-        if(delta < 4)
+        if(!mIsValid)
         {
-            if(mSamples != NULL)
-                delete[] mSamples;
-            mSamples = NULL;
-            return;
+            NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Can't save invalid data set");
+            return false;
         }
 
-        if(mSamples == NULL)
-            mSamples = new SampleEntry[OUTPUTS_SAMPLE_COUNT];
+        NextCash::stream_size maxSetCacheDataSize = 0;
+        if(mTargetCacheSize > 0)
+            maxSetCacheDataSize = mTargetCacheSize / OUTPUTS_SET_COUNT;
+        SaveThreadData threadData(mSubSets, maxSetCacheDataSize, pAutoTrimCache,
+          exactSpentHeight());
+        runWorkers(saveThreadRun, &threadData, pThreadCount);
+
+        NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
+          "Saved %d cache items", threadData.savedCount);
+        return threadData.success;
+    }
 
-        // Load samples
-        NextCash::stream_size offset = 0;
-        SampleEntry *sample = mSamples;
-        for(unsigned int i = 0; i < OUTPUTS_SAMPLE_COUNT - 1; ++i)
-        {
-            sample->hash.clear();
-            sample->offset = offset;
-            offset += (delta * sizeof(NextCash::stream_size));
-            ++sample;
-        }
+    Outputs::SubSet::SubSet() : mLock("OutputsSubSet"), mDataFileLock("OutputsSubSetData"),
+      mStatsLock("OutputsSubSetStats")
+    {
+        mIndex = NULL;
+        mDataFile = NULL;
+        mIndexSize = 0;
+        mNewSize = 0;
+        mCacheRawDataSize = 0;
+        mSortedCount = 0;
+        mRemovedCount = 0;
+        mIsDirty = false;
+        mDirtyTime = 0;
+        mClaimed = false;
+    }
 
-        // Load last sample
-        sample->hash.clear();
-        sample->offset = pIndexFile->length() - sizeof(NextCash::stream_size);
+    Outputs::SubSet::~SubSet()
+    {
+        closeDataFile();
+        unmapIndex();
     }
 
-    bool Outputs::SubSet::findSample(const NextCash::Hash &pHash,
-      NextCash::InputStream *pIndexFile, NextCash::InputStream *pDataFile,
-      NextCash::stream_size &pBegin, NextCash::stream_size &pEnd)
+    bool Outputs::SubSet::fingerprintMatches(const NextCash::Hash &pTransactionID) const
     {
-#ifdef PROFILER_ON
-        NextCash::ProfilerReference profiler(NextCash::getProfiler(PROFILER_SET,
-          PROFILER_OUTPUTS_SAMPLE_ID, PROFILER_OUTPUTS_SAMPLE_NAME), true);
-#endif
-        // Check first entry
-        SampleEntry *sample = mSamples;
-        if(!sample->load(pIndexFile, pDataFile))
-            return false;
-        int compare = sample->hash.compare(pHash);
-        if(compare > 0)
-        {
-            // Hash is before the first entry of subset
-            pBegin = NextCash::INVALID_STREAM_SIZE;
-            pEnd   = NextCash::INVALID_STREAM_SIZE;
-            return true;
-        }
-        else if(compare == 0)
-        {
-            // Hash is the first entry of subset
-            pBegin = sample->offset;
-            pEnd   = sample->offset;
-            return true;
-        }
-        // NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_OUTPUTS_LOG_NAME,
-          // "First : %s", mSamples[0].hash.hex().text());
+        FingerprintEntry lookup(fingerprint(pTransactionID), 0);
+        std::vector<FingerprintEntry>::const_iterator entry =
+          std::lower_bound(mFingerprints.begin(), mFingerprints.end(), lookup);
+        return entry != mFingerprints.end() && entry->fingerprint == lookup.fingerprint;
+    }
 
-        // Check last entry
-        sample = mSamples + (OUTPUTS_SAMPLE_COUNT - 1);
-        if(!sample->load(pIndexFile, pDataFile))
-            return false;
-        compare = sample->hash.compare(pHash);
-        if(compare < 0)
-        {
-            // Hash is after the last entry of subset
-            pBegin = NextCash::INVALID_STREAM_SIZE;
-            pEnd   = NextCash::INVALID_STREAM_SIZE;
-            return true;
-        }
-        else if(compare == 0)
+    typename Outputs::SubSetIterator Outputs::SubSet::lockFind(
+      const NextCash::Hash &pTransactionID, bool pPull, bool &pWriteLocked, bool &pPulled)
+    {
+        // Cached items and transaction IDs rejected by the fingerprints don't change the cache
+        //   so the lock is shared.
+        mLock.readLock();
+        pWriteLocked = false;
+        SubSetIterator result = mCache.find(pTransactionID);
+        pPulled = result == mCache.end();
+        countLookup(!pPulled);
+        if(!pPulled)
         {
-            // Hash is the after last entry of subset
-            pBegin = sample->offset;
-            pEnd   = sample->offset;
-            return true;
+            // The referenced flag is atomic since other shared lock holders can set it at the
+            //   same time. Only store when clear so repeated lookups don't write to the item.
+            if(!((TransactionOutputs *)*result)->isReferenced())
+                ((TransactionOutputs *)*result)->setReferenced();
+            return result;
         }
-        // NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_OUTPUTS_LOG_NAME,
-          // "Last : %s", mSamples[OUTPUTS_SAMPLE_COUNT - 1].hash.hex().text());
-
-        // Binary search the samples
-        unsigned int sampleBegin = 0;
-        unsigned int sampleEnd = OUTPUTS_SAMPLE_COUNT - 1;
-        unsigned int sampleCurrent;
-        bool done = false;
+        if(!pPull || !fingerprintMatches(pTransactionID))
+            return result;
+        mLock.readUnlock();
 
-        while(!done)
-        {
-            sampleCurrent = (sampleBegin + sampleEnd) / 2;
-            // NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_OUTPUTS_LOG_NAME,
-              // "Sample : %s", mSamples[sampleCurrent].hash.hex().text());
+        // Pulling inserts into the cache.
+        mLock.writeLock("Pull");
+        pWriteLocked = true;
+        result = mCache.find(pTransactionID);
+        if(result == mCache.end() && pull(pTransactionID))
+            result = mCache.find(pTransactionID);
+        return result;
+    }
 
-            if(sampleCurrent == sampleBegin || sampleCurrent == sampleEnd)
-                done = true;
+    bool Outputs::SubSet::reverseRemove(TransactionOutputs *pReference,
+      TransactionReference &pTransaction, unsigned int pBlockHeight)
+    {
+        // Write locked since lookups can be reading the item.
+        mLock.writeLock("Reverse Remove");
 
-            sample = mSamples + sampleCurrent;
-            if(!sample->load(pIndexFile, pDataFile))
-                return false;
+        SubSetIterator item = mCache.find(pReference->getHash());
+        if(item == mCache.end() && pull(pReference->getHash()))
+            item = mCache.find(pReference->getHash());
 
-            // Determine which half the desired item is in
-            compare = sample->hash.compare(pHash);
-            if(compare < 0)
-                sampleBegin = sampleCurrent;
-            else if(compare > 0)
-                sampleEnd = sampleCurrent;
-            else
+        TransactionOutputs *reference;
+        while(item != mCache.end() && (*item)->getHash() == pReference->getHash())
+        {
+            reference = (TransactionOutputs *)*item;
+            if(pReference->valueEquals(reference) && reference->markedRemove())
             {
-                sampleBegin = sampleCurrent;
-                sampleEnd = sampleCurrent;
-                break;
+                // Unmark the matching item for removal
+                NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Reversing removal of transaction output for block height %d : %s",
+                  pBlockHeight, pReference->getHash().hex().text());
+                mCacheRawDataSize -= reference->memorySize();
+                reference->clearRemove();
+                reference->clearSpends();
+
+                // Unspendable outputs are spent when inserted.
+                for(uint32_t i = 0; i < pTransaction->outputs.size(); ++i)
+                    if(ScriptInterpreter::isOPReturn(pTransaction->outputs[i].script))
+                        reference->spendInternal(pBlockHeight, i);
+                mCacheRawDataSize += reference->memorySize();
+
+                markDirty();
+                mLock.writeUnlock();
+                return true;
             }
+
+            ++item;
         }
 
-        // Setup index binary search on sample subset of indices
-        pBegin = mSamples[sampleBegin].offset;
-        pEnd = mSamples[sampleEnd].offset;
-        return true;
+        mLock.writeUnlock();
+        return false;
     }
 
-    bool Outputs::SubSet::loadCache(unsigned int &pLoadedCount)
+    unsigned int Outputs::SubSet::getBlockHeight(const NextCash::Hash &pTransactionID)
     {
-        pLoadedCount = 0;
-
-        mCache.clear();
-        mCacheRawDataSize = 0UL;
+        bool writeLocked, pulled;
+        SubSetIterator item = lockFind(pTransactionID, true, writeLocked, pulled);
 
-        // Open cache file
-        NextCash::String filePathName;
-        filePathName.writeFormatted("%s%s%04x.cache", mFilePath, NextCash::PATH_SEPARATOR, mID);
-        NextCash::FileInputStream *cacheFile = new NextCash::FileInputStream(filePathName);
+        unsigned int result = 0xffffffff;
+        if(item != mCache.end())
+            result = ((TransactionOutputs *)*item)->blockHeight;
 
-        if(!cacheFile->isValid())
-        {
-            delete cacheFile;
-            return true; // Assume empty file
-        }
+        unlock(writeLocked);
+        return result;
+    }
 
-        bool success = true;
-        TransactionOutputs *next;
-        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
-        cacheFile->setReadOffset(0);
-        while(cacheFile->remaining())
-        {
-            // Read data from cache file
-            next = new TransactionOutputs();
-
-            // Read data offset from cache file
-            next->setDataOffset(cacheFile->readUnsignedLong());
-
-            next->cacheFlags = cacheFile->readByte();
-
-            // Read hash from cache file
-            if(!hash.read(cacheFile))
-            {
-                NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed to read subset cache item hash");
-                delete next;
-                success = false;
-                break;
-            }
-
-            next->setHash(hash);
-
-            if(!next->read(cacheFile))
-            {
-                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed to load/read subset cache item : %s", hash.hex().text());
-                delete next;
-                success = false;
-                break;
-            }
-
-            if(!mCache.insert(next, true))
-            {
-                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed to load/insert subset cache item : %s", hash.hex().text());
-                delete next;
-            }
-            else
-            {
-                ++pLoadedCount;
-                if(next->isNew())
-                    ++mNewSize;
-                mCacheRawDataSize += next->memorySize();
-            }
-        }
-
-        delete cacheFile;
-        return success;
+    typename Outputs::SubSetIterator Outputs::SubSet::get(const NextCash::Hash &pTransactionID)
+    {
+        bool writeLocked, pulled;
+        SubSetIterator result = lockFind(pTransactionID, true, writeLocked, pulled);
+        unlock(writeLocked);
+        return result;
     }
 
-    bool Outputs::SubSet::saveCache(unsigned int &pSavedCount)
+    bool Outputs::SubSet::insert(TransactionOutputs *pReference,
+      TransactionReference &pTransaction, unsigned int pBlockHeight)
     {
-        pSavedCount = 0;
-
-        // Open cache file
-        NextCash::String filePathName;
-        filePathName.writeFormatted("%s%s%04x.cache", mFilePath, NextCash::PATH_SEPARATOR, mID);
-        NextCash::FileOutputStream *cacheFile = new NextCash::FileOutputStream(filePathName, true);
+        mLock.writeLock("Insert");
 
-        if(!cacheFile->isValid())
+        if(!mCache.insert(pReference, true))
         {
-            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-              "Failed to open subset cache file %04x for writing : %s", mID, filePathName.text());
-            delete cacheFile;
+            mLock.writeUnlock();
             return false;
         }
 
-        for(SubSetIterator item = mCache.begin(); item != mCache.end(); ++item)
+        pReference->clearDataOffset();
+
+#ifdef PROFILER_ON
+        NextCash::ProfilerReference profiler(NextCash::getProfiler(PROFILER_SET,
+          PROFILER_OUTPUTS_WRITE_ID, PROFILER_OUTPUTS_WRITE_NAME), true);
+#endif
+        closeDataFile();
+        NextCash::String filePathName;
+        filePathName.writeFormatted("%s%s%04x.data", mFilePath, NextCash::PATH_SEPARATOR, mID);
+        NextCash::FileOutputStream *dataOutFile = new NextCash::FileOutputStream(filePathName);
+        if(!dataOutFile->isValid())
         {
-            cacheFile->writeUnsignedLong(((TransactionOutputs *)*item)->dataOffset());
-            cacheFile->writeByte(((TransactionOutputs *)*item)->cacheFlags);
-            (*item)->getHash().write(cacheFile);
-            ((TransactionOutputs *)*item)->write(cacheFile);
-            ++pSavedCount;
+            delete dataOutFile;
+            mCache.remove(pReference->getHash());
+            mLock.writeUnlock();
+            return false;
         }
 
-        if(pSavedCount != mCache.size())
-            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-              "Subset cache size doesn't match count %d != %d", mCache.size(), pSavedCount);
+        pReference->writeInitialData(pReference->getHash(), dataOutFile, pTransaction,
+          pBlockHeight);
+        delete dataOutFile;
 
-        delete cacheFile;
+        // New outputs are likely to be spent soon so give them a pass in the next sweep.
+        pReference->setReferenced();
+
+        ++mNewSize;
+        mCacheRawDataSize += pReference->memorySize();
+        markDirty();
+
+        mLock.writeUnlock();
         return true;
     }
 
-    // Insert sorted, oldest first
-    inline void insertOldest(TransactionOutputs *pItem,
-      std::vector<TransactionOutputs *> &pList, unsigned int pMaxCount)
+    bool Outputs::SubSet::getOutput(const NextCash::Hash &pTransactionID,
+      uint32_t pIndex, uint8_t pFlags, uint32_t pSpentBlockHeight, Output &pOutput,
+      uint32_t &pPreviousBlockHeight, bool &pPulled, bool &pSpent)
     {
-        if(pList.size() == 0)
+        bool result = false;
+        bool writeLocked = true;
+        SubSetIterator item;
+        pSpent = false;
+        if(pFlags & MARK_SPENT)
         {
-            // Add as first item
-            pList.push_back(pItem);
-            return;
+            mLock.writeLock("Get Output");
+            item = mCache.find(pTransactionID);
+            if(item == mCache.end())
+            {
+                pPulled = true;
+                if(pull(pTransactionID))
+                    item = mCache.find(pTransactionID);
+            }
+            else
+                pPulled = false;
+            countLookup(!pPulled);
         }
+        else
+            item = lockFind(pTransactionID, true, writeLocked, pPulled);
 
-        if((*--pList.end())->compareAge(pItem) < 0)
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
         {
-            if(pList.size() < pMaxCount)
-                pList.push_back(pItem); // Add as last item
-            return;
-        }
-
-        // Insert sorted
-        bool inserted = false;
-        for(std::vector<TransactionOutputs *>::iterator item = pList.begin();
-          item != pList.end(); ++item)
-            if(((TransactionOutputs *)*item)->compareAge(pItem) > 0)
+            if(!((TransactionOutputs *)*item)->markedRemove())
             {
-                inserted = true;
-                pList.insert(item, pItem);
+                pPreviousBlockHeight = ((TransactionOutputs *)*item)->blockHeight;
+
+                if(pFlags & MARK_SPENT)
+                {
+                    // Read the output first so a spend always has the output to remove from
+                    //   the commitment.
+                    result = readOutput((TransactionOutputs *)*item, pIndex, pOutput);
+                    if(result)
+                    {
+                        pSpent = spendItem((TransactionOutputs *)*item, pSpentBlockHeight,
+                          pIndex);
+                        result = pSpent || !(pFlags & REQUIRE_UNSPENT);
+                        referenceSpent((TransactionOutputs *)*item);
+                        if(pSpent)
+                            countSpend(pSpentBlockHeight, pPreviousBlockHeight);
+                        markDirty();
+                    }
+                }
+                else
+                {
+                    if(pFlags & REQUIRE_UNSPENT)
+                        result = ((TransactionOutputs *)*item)->isUnspent(pIndex);
+                    else
+                        result = true;
+
+                    if(result)
+                        result = readOutput((TransactionOutputs *)*item, pIndex, pOutput);
+                }
+
                 break;
             }
 
-        if(!inserted)
-            pList.push_back(pItem);
+            ++item;
+        }
 
-        if(pList.size() > pMaxCount)
-            pList.pop_back();
+        unlock(writeLocked);
+        return result;
     }
 
-    bool Outputs::SubSet::load(const char *pFilePath, unsigned int pID, unsigned int &pLoadedCount)
+    bool Outputs::SubSet::readOutput(TransactionOutputs *pItem, uint32_t pIndex,
+      Output &pOutput)
     {
-        mLock.lock();
+        // Readers sharing the lock share the data file.
+        mDataFileLock.lock();
+        NextCash::FileInputStream *dataInFile = dataFile();
+        bool result = dataInFile != NULL && pItem->readOutput(dataInFile, pIndex, pOutput);
+        if(result)
+            countRead(dataInFile->readOffset() - pItem->dataOffset());
+        mDataFileLock.unlock();
+        return result;
+    }
 
-        NextCash::String filePathName;
-        bool created = false;
+    bool Outputs::SubSet::readOutputs(TransactionOutputs *pItem,
+      std::vector<Output> &pOutputs)
+    {
+        pOutputs.clear();
+        if(pItem->outputCount() == 0)
+            return true;
 
-        mFilePath = pFilePath;
-        mID = pID;
+        // Outputs follow each other so only the first needs located.
+        pOutputs.resize(pItem->outputCount());
+        mDataFileLock.lock();
+        NextCash::FileInputStream *dataInFile = dataFile();
+        bool result = dataInFile != NULL && pItem->readOutput(dataInFile, 0, pOutputs.front());
+        for(std::vector<Output>::iterator output = pOutputs.begin() + 1;
+          result && output != pOutputs.end(); ++output)
+            result = output->read(dataInFile);
+        if(result)
+            countRead(dataInFile->readOffset() - pItem->dataOffset());
+        mDataFileLock.unlock();
+        return result;
+    }
 
-        // Open index file
-        filePathName.writeFormatted("%s%s%04x.index", mFilePath, NextCash::PATH_SEPARATOR, mID);
-        if(!fileExists(filePathName))
-        {
-            // Create index file
-            NextCash::FileOutputStream indexOutFile(filePathName, true);
-            created = true;
-        }
-        NextCash::FileInputStream indexFile(filePathName);
-        indexFile.setReadOffset(0);
+    bool Outputs::SubSet::isUnspent(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+      bool &pPulled)
+    {
+        bool result = false;
+        bool writeLocked;
+        SubSetIterator item = lockFind(pTransactionID, true, writeLocked, pPulled);
 
-        if(!indexFile.isValid())
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
         {
-            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-              "Failed to open index file : %s", filePathName.text());
-            mLock.unlock();
-            return false;
-        }
-
-        mIndexSize = indexFile.length() / sizeof(NextCash::stream_size);
-        mNewSize = 0;
+            if(!((TransactionOutputs *)*item)->markedRemove())
+            {
+                result = ((TransactionOutputs *)*item)->isUnspent(pIndex);
+                break;
+            }
 
-        // Open data file
-        if(created)
-        {
-            filePathName.writeFormatted("%s%s%04x.data", mFilePath,
-              NextCash::PATH_SEPARATOR, mID);
-            NextCash::FileOutputStream dataOutFile(filePathName, true); // Create data file
+            ++item;
         }
 
-        bool success = true;
-        loadSamples(&indexFile);
-        if(!loadCache(pLoadedCount))
-            success = false;
-
-        mLock.unlock();
-        return success;
+        unlock(writeLocked);
+        return result;
     }
 
-    //TODO This operation is expensive. Try to find a better algorithm.
-    void Outputs::SubSet::markOld(NextCash::stream_size pDataSize)
+    uint8_t Outputs::SubSet::unspentStatus(const NextCash::Hash &pTransactionID, uint32_t pIndex)
     {
-        if(pDataSize == 0)
-        {
-            for(SubSetIterator item = mCache.begin(); item != mCache.end(); ++item)
-                ((TransactionOutputs *)*item)->setOld();
-            return;
-        }
-
-        NextCash::stream_size currentSize = cacheDataSize();
-        if(currentSize <= pDataSize)
-            return;
+        uint8_t result = 0;
+        bool writeLocked, pulled;
+        SubSetIterator item = lockFind(pTransactionID, true, writeLocked, pulled);
 
-        double targetPercent = ((double)currentSize - ((double)pDataSize * 0.9)) /
-          (double)currentSize;
-        unsigned int targetCount = (unsigned int)((double)mCache.size() * targetPercent);
-        std::vector<TransactionOutputs *> oldestList;
-        if(targetCount == 0)
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
         {
-            NextCash::Log::addFormatted(NextCash::Log::DEBUG, BITCOIN_OUTPUTS_LOG_NAME,
-              "Set %d has no items to mark old", mID);
-            return;
+            if(!((TransactionOutputs *)*item)->markedRemove())
+            {
+                result |= UNSPENT_STATUS_EXISTS;
+                if(((TransactionOutputs *)*item)->isUnspent(pIndex))
+                    result |= UNSPENT_STATUS_UNSPENT;
+                break;
+            }
+
+            ++item;
         }
 
-        // Build list of oldest items.
-        for(SubSetIterator item = mCache.begin(); item != mCache.end(); ++item)
-            insertOldest((TransactionOutputs *)*item, oldestList, targetCount);
+        unlock(writeLocked);
+        return result;
+    }
+
+    bool Outputs::SubSet::spend(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+      uint32_t pSpentBlockHeight, uint32_t &pPreviousBlockHeight, bool pRequireUnspent,
+      bool &pPulled, bool &pSpent, Output &pOutput)
+    {
+        mLock.writeLock("Spend");
 
-        // Remove all items below age of newest item in old list.
-        if(oldestList.size() == 0)
+        bool result = false;
+        pSpent = false;
+        SubSetIterator item = mCache.find(pTransactionID);
+        if(item == mCache.end())
         {
-            NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_OUTPUTS_LOG_NAME,
-              "Set %d has mark old list is empty", mID);
-            return;
+            pPulled = true;
+            if(pull(pTransactionID))
+                item = mCache.find(pTransactionID);
         }
+        else
+            pPulled = false;
+        countLookup(!pPulled);
 
-        unsigned int markedCount = 0;
-        TransactionOutputs *cutoff = oldestList.back();
-        NextCash::stream_size markedSize = 0;
-        for(SubSetIterator item = mCache.begin(); item != mCache.end(); ++item)
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
         {
-            if(((TransactionOutputs *)*item)->isOld())
-            {
-                ++markedCount;
-                markedSize += ((TransactionOutputs *)*item)->memorySize() + staticCacheItemSize;
-                if(currentSize - markedSize < pDataSize)
-                    break;
-            }
-            else if(((TransactionOutputs *)*item)->compareAge(cutoff) < 0)
+            if(!((TransactionOutputs *)*item)->markedRemove())
             {
-                ((TransactionOutputs *)*item)->setOld();
-                ++markedCount;
-                markedSize += ((TransactionOutputs *)*item)->memorySize() + staticCacheItemSize;
-                if(currentSize - markedSize < pDataSize)
+                pPreviousBlockHeight = ((TransactionOutputs *)*item)->blockHeight;
+
+                // Read the output first so a spend always has the output to remove from the
+                //   commitment.
+                if(((TransactionOutputs *)*item)->isUnspent(pIndex) &&
+                  !readOutput((TransactionOutputs *)*item, pIndex, pOutput))
                     break;
-            }
-        }
 
-        if(currentSize - markedSize > pDataSize)
-        {
-            // Mark every other item as old.
-            bool markThisOld = false;
-            for(SubSetIterator item = mCache.begin(); item != mCache.end(); ++item)
-            {
-                if(markThisOld && !((TransactionOutputs *)*item)->isOld())
-                {
-                    ++markedCount;
-                    ((TransactionOutputs *)*item)->setOld();
-                    markedSize += ((TransactionOutputs *)*item)->memorySize() +
-                      staticCacheItemSize;
-                    if(currentSize - markedSize < pDataSize)
-                        break;
-                    markThisOld = false;
-                }
-                else
-                    markThisOld = true;
+                pSpent = spendItem((TransactionOutputs *)*item, pSpentBlockHeight, pIndex);
+                result = pSpent || !pRequireUnspent;
+                referenceSpent((TransactionOutputs *)*item);
+                if(pSpent)
+                    countSpend(pSpentBlockHeight, pPreviousBlockHeight);
+                markDirty();
+                break;
             }
+
+            ++item;
         }
 
-        if(currentSize - markedSize > pDataSize)
-            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-              "Set %d failed to mark enough old. Marked %d/%d items (%d/%d)", mID, markedCount,
-              mCache.size(), markedSize, currentSize);
+        mLock.writeUnlock();
+        return result;
     }
 
-    bool Outputs::SubSet::trimCache(NextCash::stream_size pMaxCacheDataSize,
-      bool pAutoTrimCache)
+    bool Outputs::SubSet::hasUnspent(const NextCash::Hash &pTransactionID,
+      uint32_t pSpentBlockHeight)
     {
-        // Mark items as old to keep cache data size under max.
-        if(pAutoTrimCache)
-            markOld(pMaxCacheDataSize);
+        bool result = false;
+        bool writeLocked, pulled;
+        SubSetIterator item = lockFind(pTransactionID, true, writeLocked, pulled);
 
-        // Remove old items from the cache.
-        for(SubSetIterator item = mCache.begin(); item != mCache.end();)
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
         {
-            if(((TransactionOutputs *)*item)->isOld())
+            if(!((TransactionOutputs *)*item)->markedRemove() &&
+              (pSpentBlockHeight == 0xffffffff || pSpentBlockHeight !=
+              ((TransactionOutputs *)*item)->blockHeight))
             {
-                mCacheRawDataSize -= ((TransactionOutputs *)*item)->memorySize();
-                item = mCache.eraseDelete(item);
+                result = ((TransactionOutputs *)*item)->hasUnspent();
+                break;
             }
-            else
-                ++item;
+
+            ++item;
         }
 
-        mCache.shrink();
-        return true;
+        unlock(writeLocked);
+        return result;
     }
 
-    bool Outputs::SubSet::save(NextCash::stream_size pMaxCacheDataSize, bool pAutoTrimCache,
-      unsigned int &pSavedCount)
+    bool Outputs::SubSet::checkDuplicate(const NextCash::Hash &pTransactionID,
+      unsigned int pBlockHeight, const NextCash::Hash &pBlockHash)
     {
-        mLock.lock();
-
-        if(mCache.size() == 0)
+        // New transaction IDs are rejected by the fingerprint table without reading the data file
+        //   so only cached items need to be checked and the lock can be shared.
+        bool writeLocked = false;
+        mLock.readLock();
+        if(fingerprintMatches(pTransactionID))
         {
-            mLock.unlock();
-            return true;
-        }
+            mLock.readUnlock();
+            mLock.writeLock("Check Duplicate");
+            writeLocked = true;
 
-        // Open data file as an output stream
-        NextCash::String filePathName;
-        filePathName.writeFormatted("%s%s%04x.data", mFilePath, NextCash::PATH_SEPARATOR, mID);
-        NextCash::FileOutputStream *dataOutFile = new NextCash::FileOutputStream(filePathName);
-        SubSetIterator item;
-        uint64_t newCount = 0;
-        bool indexNeedsUpdated = false;
+            // Force pull because we know there is already one in the cache since this is called
+            //   during block validation after the blocks transactions have already been added to
+            //   the output set.
+            pull(pTransactionID);
+        }
 
-        // Write all cached/modified data to file.
-        for(item = mCache.begin(); item != mCache.end();)
+        bool result = true;
+        SubSetIterator item = mCache.find(pTransactionID);
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
         {
-            if(((TransactionOutputs *)*item)->markedRemove())
+            if(!((TransactionOutputs *)*item)->markedRemove() &&
+              ((TransactionOutputs *)*item)->blockHeight != pBlockHeight &&
+              ((TransactionOutputs *)*item)->hasUnspent())
             {
-                if(!((TransactionOutputs *)*item)->isNew())
+                bool exceptionFound = false;
+                for(unsigned int i = 0; i < BIP0030_HASH_COUNT; ++i)
+                    if(BIP0030_HEIGHTS[i] == pBlockHeight && BIP0030_HASHES[i] == pBlockHash)
+                        exceptionFound = true;
+                if(exceptionFound)
                 {
-                    indexNeedsUpdated = true;
-                    ++item;
+                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "BIP-0030 Exception for duplicate transaction ID in block %d : %s",
+                      ((TransactionOutputs *)*item)->blockHeight, pTransactionID.hex().text());
                 }
                 else
                 {
-                    mCacheRawDataSize -= ((TransactionOutputs *)*item)->memorySize();
-                    item = mCache.eraseDelete(item);
+                    NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Matching transaction hash from block %d has unspent outputs : %s",
+                      ((TransactionOutputs *)*item)->blockHeight, pTransactionID.hex().text());
+                    result = false;
+                    break;
                 }
             }
-            else
-            {
-                if(((TransactionOutputs *)*item)->isModified())
-                    ((TransactionOutputs *)*item)->writeModifiedData(dataOutFile);
-                if(((TransactionOutputs *)*item)->isNew())
-                {
-                    ++newCount;
-                    indexNeedsUpdated = true;
-                }
 
-                ++item;
-            }
+            ++item;
         }
 
-        delete dataOutFile;
+        unlock(writeLocked);
+        return result;
+    }
+
+    bool Outputs::SubSet::exists(const NextCash::Hash &pTransactionID, bool pPullIfNeeded)
+    {
+        bool result = false;
+        bool writeLocked, pulled;
+        SubSetIterator item = lockFind(pTransactionID, pPullIfNeeded, writeLocked, pulled);
 
-        if(!indexNeedsUpdated)
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
         {
-            bool success = trimCache(pMaxCacheDataSize, pAutoTrimCache);
-            if(success)
-                success = saveCache(pSavedCount);
+            if(!((TransactionOutputs *)*item)->markedRemove())
+            {
+                result = true;
+                break;
+            }
 
-            // NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_OUTPUTS_LOG_NAME,
-              // "Set %d save index not updated", mID);
-            mLock.unlock();
-            return success;
+            ++item;
         }
 
-        // Read entire index file
-        filePathName.writeFormatted("%s%s%04x.index", mFilePath, NextCash::PATH_SEPARATOR,
-          mID);
-        NextCash::FileInputStream *indexFile = new NextCash::FileInputStream(filePathName);
-        NextCash::stream_size previousSize = indexFile->length() / sizeof(NextCash::stream_size);
-        NextCash::DistributedVector<NextCash::stream_size> indices(OUTPUTS_SET_COUNT);
-        NextCash::DistributedVector<NextCash::Hash> hashes(OUTPUTS_SET_COUNT);
-        unsigned int indicesPerSet = (previousSize / OUTPUTS_SET_COUNT) + 1;
-        unsigned int readIndices = 0;
-        std::vector<NextCash::stream_size> *indiceSet;
-        std::vector<NextCash::Hash> *hashSet;
-        unsigned int setOffset = 0;
-        NextCash::stream_size reserveSize = previousSize + mCache.size();
-
-        if(reserveSize < OUTPUTS_SET_COUNT * 32)
-            reserveSize = OUTPUTS_SET_COUNT * 32;
-
-        indices.reserve(reserveSize);
-        hashes.reserve(reserveSize);
-        indexFile->setReadOffset(0);
-        while(indexFile->remaining())
-        {
-            if(previousSize - readIndices < indicesPerSet)
-                indicesPerSet = previousSize - readIndices;
-
-            // Read set of indices
-            indiceSet = indices.dataSet(setOffset);
-            indiceSet->resize(indicesPerSet);
-            indexFile->read(indiceSet->data(), indicesPerSet * sizeof(NextCash::stream_size));
-
-            // Allocate empty hashes
-            hashSet = hashes.dataSet(setOffset);
-            hashSet->resize(indicesPerSet);
-
-            readIndices += indicesPerSet;
-            ++setOffset;
-        }
-
-        delete indexFile;
-        indices.refresh();
-        hashes.refresh();
-
-        // Update indices
-        NextCash::DistributedVector<NextCash::Hash>::Iterator hash;
-        NextCash::DistributedVector<NextCash::stream_size>::Iterator index;
-        int compare;
-        bool found;
-        Time lastReport = getTime();
-        unsigned int cacheOffset = 0, initialCacheSize = mCache.size();
-        unsigned int begin, end, current;
-        unsigned int readHeadersCount = 0;
-        NextCash::stream_size dataOffset;
-        bool success = true;
+        unlock(writeLocked);
+        return result;
+    }
 
-        filePathName.writeFormatted("%s%s%04x.data", mFilePath, NextCash::PATH_SEPARATOR,
-          mID);
-        NextCash::FileInputStream dataFile(filePathName);
+    NextCash::stream_size Outputs::SubSet::dataOffset(const NextCash::Hash &pTransactionID,
+      uint32_t pBlockHeight)
+    {
+        NextCash::stream_size result = NextCash::INVALID_STREAM_SIZE;
+        bool writeLocked, pulled;
+        SubSetIterator item = lockFind(pTransactionID, true, writeLocked, pulled);
 
-        for(item = mCache.begin(); item != mCache.end() && success; ++cacheOffset)
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
         {
-            if(getTime() - lastReport >= 10)
+            if(!((TransactionOutputs *)*item)->markedRemove() &&
+              ((TransactionOutputs *)*item)->blockHeight == pBlockHeight)
             {
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Set %d save index update is %2d%% Complete", mID,
-                  (int)(((float)cacheOffset / (float)initialCacheSize) * 100.0f));
-
-                lastReport = getTime();
+                result = ((TransactionOutputs *)*item)->dataOffset();
+                break;
             }
 
-            if(((TransactionOutputs *)*item)->markedRemove())
-            {
-                // Check that it was previously added to the index and data file.
-                // Otherwise it isn't in current indices and doesn't need removed.
-                if(!((TransactionOutputs *)*item)->isNew())
-                {
-                    // Remove from indices.
-                    // They aren't sorted by file offset so in this scenario a linear search is
-                    //   required since not all hashes are read and reading them for a binary
-                    //   search would presumably be more expensive since it requires reading hashes.
-                    found = false;
-                    dataOffset = ((TransactionOutputs *)*item)->dataOffset();
-                    hash = hashes.begin();
-                    for(index = indices.begin(); index != indices.end(); ++index, ++hash)
-                        if(*index == dataOffset)
-                        {
-                            indices.erase(index);
-                            hashes.erase(hash);
-                            found = true;
-                            break;
-                        }
+            ++item;
+        }
 
-                    if(!found)
-                    {
-                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Failed to find index to remove for file offset %d : %s",
-                          dataOffset, (*item)->getHash().hex().text());
-                        success = false;
-                        break;
-                    }
-                }
+        unlock(writeLocked);
+        return result;
+    }
 
-                mCacheRawDataSize -= ((TransactionOutputs *)*item)->memorySize();
-                item = mCache.eraseDelete(item);
-            }
-            else if(((TransactionOutputs *)*item)->isNew())
+    bool Outputs::SubSet::spendItem(TransactionOutputs *pItem, uint32_t pBlockHeight,
+      uint32_t pIndex)
+    {
+        if(pItem->hasSpentBitmap() && pItem->isUnspent(pIndex))
+        {
+            NextCash::stream_size previousSize = pItem->memorySize();
+            NextCash::FileInputStream *dataInFile = dataFile();
+            if(dataInFile == NULL || !pItem->readSpentHeights(dataInFile))
             {
-                // For new items perform insert sort into existing indices.
-                // This costs more processor time to do the insert for every new item.
-                // This saves file reads by not requiring a read of every existing indice like a
-                //   merge sort would.
-                if(indices.size () == 0)
-                {
-                    // Add as only item
-                    indices.push_back(((TransactionOutputs *)*item)->dataOffset());
-                    hashes.push_back((*item)->getHash());
-                    ((TransactionOutputs *)*item)->clearNew();
-                    ++item;
-                    continue;
-                }
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Set %d failed to read spent heights : %s", mID,
+                  pItem->getHash().hex().text());
+                return false;
+            }
+            mCacheRawDataSize -= previousSize;
+            mCacheRawDataSize += pItem->memorySize();
+        }
 
-                // Check first entry
-                hash = hashes.begin();
-                index = indices.begin();
-                if(hash->isEmpty())
-                {
-                    // Fetch data
-                    if(!pullHash(&dataFile, *index, *hash))
-                    {
-                        success = false;
-                        break;
-                    }
-                    ++readHeadersCount;
-                }
+        return pItem->spendInternal(pBlockHeight, pIndex);
+    }
 
-                compare = (*item)->getHash().compare(*hash);
-                if(compare <= 0)
-                {
-                    // Insert as first
-                    indices.insert(index, ((TransactionOutputs *)*item)->dataOffset());
-                    hashes.insert(hash, (*item)->getHash());
-                    ((TransactionOutputs *)*item)->clearNew();
-                    ++item;
-                    continue;
-                }
+    bool Outputs::SubSet::recoverInsert(const NextCash::Hash &pTransactionID,
+      NextCash::stream_size pDataOffset, uint32_t pBlockHeight)
+    {
+        mLock.writeLock("Recover Insert");
 
-                // Check last entry
-                hash = hashes.end() - 1;
-                index = indices.end() - 1;
-                if(hash->isEmpty())
-                {
-                    // Fetch data
-                    if(!pullHash(&dataFile, *index, *hash))
-                    {
-                        success = false;
-                        break;
-                    }
-                    ++readHeadersCount;
-                }
+        // Check if it is already cached or was saved to the index. Saved items can be at a
+        //   different data offset if the set was defragmented after the block was journaled.
+        SubSetIterator item = mCache.find(pTransactionID);
+        if(item == mCache.end() && pull(pTransactionID))
+            item = mCache.find(pTransactionID);
 
-                compare = (*item)->getHash().compare(*hash);
-                if(compare >= 0)
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        {
+            if(((TransactionOutputs *)*item)->dataOffset() == pDataOffset ||
+              ((TransactionOutputs *)*item)->blockHeight == pBlockHeight)
+            {
+                // Removed by a journaled revert before the block was added again.
+                if(((TransactionOutputs *)*item)->markedRemove())
                 {
-                    // Add to end
-                    indices.push_back(((TransactionOutputs *)*item)->dataOffset());
-                    hashes.push_back((*item)->getHash());
-                    ((TransactionOutputs *)*item)->clearNew();
-                    ++item;
-                    continue;
+                    ((TransactionOutputs *)*item)->clearRemove();
+                    markDirty();
                 }
+                mLock.writeUnlock();
+                return true;
+            }
 
-                // Binary insert sort
-                begin = 0;
-                end = indices.size() - 1;
-                while(true)
-                {
-                    // Divide data set in half
-                    current = (begin + end) / 2;
+            ++item;
+        }
 
-                    // Pull "current" entry (if it isn't already)
-                    hash = hashes.begin() + current;
-                    index = indices.begin() + current;
-                    if(hash->isEmpty())
-                    {
-                        // Fetch data
-                        if(!pullHash(&dataFile, *index, *hash))
-                        {
-                            success = false;
-                            break;
-                        }
-                        ++readHeadersCount;
-                    }
+        // Insert wrote it to the end of the data file, but it isn't in the index yet.
+        NextCash::FileInputStream *dataInFile = dataFile();
+        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
+        if(dataInFile == NULL || !pullHash(dataInFile, pDataOffset, hash) ||
+          hash != pTransactionID)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Set %d failed to recover insert at data offset %d : %s", mID, pDataOffset,
+              pTransactionID.hex().text());
+            mLock.writeUnlock();
+            return false;
+        }
 
-                    compare = (*item)->getHash().compare(*hash);
-                    if(current == begin || compare == 0)
-                    {
-                        if(compare < 0)
-                        {
-                            // Insert before current
-                            indices.insert(index, ((TransactionOutputs *)*item)->dataOffset());
-                            hashes.insert(hash, (*item)->getHash());
-                            ((TransactionOutputs *)*item)->clearNew();
-                            break;
-                        }
-                        else //if(compare >= 0)
-                        {
-                            // Insert after current
-                            ++index;
-                            ++hash;
-                            indices.insert(index, ((TransactionOutputs *)*item)->dataOffset());
-                            hashes.insert(hash, (*item)->getHash());
-                            ((TransactionOutputs *)*item)->clearNew();
-                            break;
-                        }
-                    }
+        TransactionOutputs *next = new TransactionOutputs(hash);
+        if(!next->readData(dataInFile) || !mCache.insert(next, true))
+        {
+            delete next;
+            mLock.writeUnlock();
+            return false;
+        }
 
-                    if(compare > 0)
-                        begin = current;
-                    else //if(compare < 0)
-                        end = current;
-                }
+        next->setNew();
+        ++mNewSize;
+        mCacheRawDataSize += next->memorySize();
+        markDirty();
 
-                ++item;
+        mLock.writeUnlock();
+        return true;
+    }
 
-            }
-            else
-                ++item;
-        }
+    bool Outputs::SubSet::recoverSpend(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+      uint32_t pBlockHeight)
+    {
+        mLock.writeLock("Recover Spend");
 
-        if(success)
-        {
-            // Open index file as an output stream
-            filePathName.writeFormatted("%s%s%04x.index", mFilePath,
-              NextCash::PATH_SEPARATOR, mID);
-            NextCash::FileOutputStream *indexOutFile = new NextCash::FileOutputStream(filePathName,
-              true);
+        bool result = false;
+        SubSetIterator item = mCache.find(pTransactionID);
+        if(item == mCache.end() && pull(pTransactionID))
+            item = mCache.find(pTransactionID);
 
-            // Write the new index
-            for(setOffset = 0; setOffset < OUTPUTS_SET_COUNT; ++setOffset)
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        {
+            if(!((TransactionOutputs *)*item)->markedRemove())
             {
-                // Write set of indices
-                indiceSet = indices.dataSet(setOffset);
-                indexOutFile->write(indiceSet->data(), indiceSet->size() *
-                  sizeof(NextCash::stream_size));
+                // Already spent when this set was saved after the spend.
+                if(!((TransactionOutputs *)*item)->isUnspent(pIndex))
+                    result = true;
+                else
+                {
+                    result = spendItem((TransactionOutputs *)*item, pBlockHeight, pIndex);
+                    markDirty();
+                }
+                break;
             }
 
-            // Update size
-            mIndexSize = indexOutFile->length() / sizeof(NextCash::stream_size);
-            mNewSize = 0;
+            ++item;
+        }
 
-            delete indexOutFile;
+        mLock.writeUnlock();
+        return result;
+    }
 
-            // Open index file
-            filePathName.writeFormatted("%s%s%04x.index", mFilePath, NextCash::PATH_SEPARATOR,
-              mID);
-            NextCash::FileInputStream indexFile(filePathName);
+    bool Outputs::SubSet::recoverRevertSpend(const NextCash::Hash &pTransactionID,
+      uint32_t pIndex, uint32_t pPreviousBlockHeight, uint32_t pBlockHeight)
+    {
+        mLock.writeLock("Recover Revert Spend");
 
-            // Reload samples
-            loadSamples(&indexFile);
+        bool result = false;
+        SubSetIterator item = mCache.find(pTransactionID);
+        if(item == mCache.end() && pull(pTransactionID))
+            item = mCache.find(pTransactionID);
 
-            success = trimCache(pMaxCacheDataSize, pAutoTrimCache);
-            if(success)
-                success = saveCache(pSavedCount);
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        {
+            if(!((TransactionOutputs *)*item)->markedRemove() &&
+              (pPreviousBlockHeight == 0xffffffff ||
+              ((TransactionOutputs *)*item)->blockHeight == pPreviousBlockHeight))
+            {
+                // Already unspent when this set wasn't saved with the spend.
+                if(((TransactionOutputs *)*item)->revertSpend(pIndex, pBlockHeight))
+                    markDirty();
+                result = true;
+                break;
+            }
+
+            ++item;
         }
 
-        mLock.unlock();
-        return success;
+        mLock.writeUnlock();
+        return result;
     }
 
-    bool Outputs::SubSet::defragment()
+    bool Outputs::SubSet::recoverRevertInsert(const NextCash::Hash &pTransactionID,
+      uint32_t pBlockHeight)
     {
-        // Open current index file.
-        // Create new temp index file.
-        // Open current data file.
-        // Create new temp data file.
-        // Parse through index file.
-        //   Pull each associated item from the current data file and append it to the temp data
-        //     file.
-        //   Append new data offset to the temp index file.
-        // Remove current files and replace with temp files.
-        return false;
+        mLock.writeLock("Recover Revert Insert");
+
+        SubSetIterator item = mCache.find(pTransactionID);
+        if(item == mCache.end() && pull(pTransactionID))
+            item = mCache.find(pTransactionID);
+
+        // Not finding it means the removal was already saved.
+        while(item != mCache.end() && (*item)->getHash() == pTransactionID)
+        {
+            if(!((TransactionOutputs *)*item)->markedRemove() &&
+              ((TransactionOutputs *)*item)->blockHeight == pBlockHeight)
+            {
+                ((TransactionOutputs *)*item)->setRemove();
+                markDirty();
+                break;
+            }
+
+            ++item;
+        }
+
+        mLock.writeUnlock();
+        return true;
     }
 
-    bool Outputs::test()
+    unsigned int Outputs::SubSet::prefetch(std::vector<NextCash::Hash> &pTransactionIDs)
     {
-        NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-          "------------- Starting Outputs Tests -------------");
+        mLock.writeLock("Prefetch");
+
+        // Sort the transaction IDs that aren't cached so items read can be matched to them.
+        std::vector<NextCash::Hash> missing;
+        missing.reserve(pTransactionIDs.size());
+        for(std::vector<NextCash::Hash>::iterator transactionID = pTransactionIDs.begin();
+          transactionID != pTransactionIDs.end(); ++transactionID)
+            if(mCache.find(*transactionID) == mCache.end())
+                missing.push_back(*transactionID);
+
+        std::sort(missing.begin(), missing.end());
+        missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+        // Find the data file offsets of all items with matching fingerprints
+        std::vector<NextCash::stream_size> dataOffsets;
+        std::vector<FingerprintEntry>::iterator entry;
+        FingerprintEntry lookup;
+        for(std::vector<NextCash::Hash>::iterator transactionID = missing.begin();
+          transactionID != missing.end(); ++transactionID)
+        {
+            lookup.fingerprint = fingerprint(*transactionID);
+            lookup.position = 0;
+            for(entry = std::lower_bound(mFingerprints.begin(), mFingerprints.end(), lookup);
+              entry != mFingerprints.end() && entry->fingerprint == lookup.fingerprint; ++entry)
+                if(entry->position < mIndexSize &&
+                  mIndex[entry->position] != NextCash::INVALID_STREAM_SIZE)
+                    dataOffsets.push_back(mIndex[entry->position]);
+        }
 
-        bool success = true;
-        NextCash::Hash hash(32);
-        TransactionOutputs *data;
-        NextCash::Digest digest(NextCash::Digest::SHA256);
-        Outputs::Iterator found;
-        TransactionReference transaction;
-        bool checkSuccess;
-        unsigned int markedOldCount = 0;
-        unsigned int removedSize = 0;
-        const unsigned int testSize = 50000;
-        const unsigned int testSizeLarger = 75000;
-        uint32_t dupValue, nonDupValue;
-        NextCash::stream_size cacheTargetSize = 5000000;
+        if(dataOffsets.size() == 0)
+        {
+            mLock.writeUnlock();
+            return 0;
+        }
 
-        NextCash::removeDirectory("test_outputs");
+        NextCash::FileInputStream *dataInFile = dataFile();
+        if(dataInFile == NULL)
+        {
+            mLock.writeUnlock();
+            return 0;
+        }
 
-        if(success)
+        // Read items in file order
+        std::sort(dataOffsets.begin(), dataOffsets.end());
+        dataOffsets.erase(std::unique(dataOffsets.begin(), dataOffsets.end()),
+          dataOffsets.end());
+
+        unsigned int result = 0;
+        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
+        TransactionOutputs *next;
+        for(std::vector<NextCash::stream_size>::iterator dataOffset = dataOffsets.begin();
+          dataOffset != dataOffsets.end(); ++dataOffset)
         {
-            Outputs testOutputs;
-            TransactionOutputs *lowest = NULL, *highest = NULL;
-            NextCash::Hash lowestHash, highestHash;
+            if(!pullHash(dataInFile, *dataOffset, hash))
+                break;
 
-            testOutputs.load("test_outputs", 5000000UL, 5000000UL);
-            testOutputs.setTargetCacheSize(cacheTargetSize);
+            if(!std::binary_search(missing.begin(), missing.end(), hash))
+                continue; // Different transaction with the same fingerprint
 
-            for(unsigned int i = 0; i < testSize; ++i)
+            next = new TransactionOutputs(hash);
+            if(!next->readData(dataInFile))
+            {
+                delete next;
+                break;
+            }
+
+            if(mCache.insert(next, true))
+            {
+                mCacheRawDataSize += next->memorySize();
+                ++result;
+            }
+            else
+                delete next;
+        }
+
+        mLock.writeUnlock();
+        return result;
+    }
+
+    bool Outputs::SubSet::pull(const NextCash::Hash &pTransactionID,
+      TransactionOutputs *pMatching)
+    {
+#ifdef PROFILER_ON
+        NextCash::ProfilerReference profiler(NextCash::getProfiler(PROFILER_SET,
+          PROFILER_OUTPUTS_PULL_ID, PROFILER_OUTPUTS_PULL_NAME), true);
+#endif
+        // Find the first entry with a matching fingerprint. If there isn't one then the
+        //   transaction ID is definitely not in the data file.
+        FingerprintEntry lookup(fingerprint(pTransactionID), 0);
+        std::vector<FingerprintEntry>::iterator entry =
+          std::lower_bound(mFingerprints.begin(), mFingerprints.end(), lookup);
+        if(entry == mFingerprints.end() || entry->fingerprint != lookup.fingerprint)
+            return false; // Not within subset
+
+        NextCash::FileInputStream *dataInFile = dataFile();
+        if(dataInFile == NULL)
+            return false;
+
+        // Read in all matching. Usually only one entry matches the fingerprint and it is the
+        //   item with this transaction ID.
+        NextCash::Timer timer(true);
+        NextCash::stream_size bytesRead = 0;
+        bool result = false;
+        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
+        NextCash::stream_size dataOffset;
+        TransactionOutputs *next;
+        for(; entry != mFingerprints.end() && entry->fingerprint == lookup.fingerprint; ++entry)
+        {
+            if(entry->position >= mIndexSize)
+                continue; // Index isn't mapped
+            dataOffset = mIndex[entry->position];
+            if(dataOffset == NextCash::INVALID_STREAM_SIZE)
+                continue; // Removed from the index
+
+            if(!pullHash(dataInFile, dataOffset, hash))
+                break;
+
+            bytesRead += TRANSACTION_HASH_SIZE;
+            if(hash != pTransactionID)
+                continue; // Different transaction with the same fingerprint
+
+            next = new TransactionOutputs(hash);
+            if(!next->readData(dataInFile))
+            {
+                delete next;
+                break;
+            }
+            bytesRead += dataInFile->readOffset() - dataOffset - TRANSACTION_HASH_SIZE;
+
+            if((pMatching == NULL || pMatching->valueEquals(next)) && mCache.insert(next, true))
+            {
+                mCacheRawDataSize += next->memorySize();
+                result = true;
+            }
+            else
+                delete next;
+        }
+
+        timer.stop();
+        mStatsLock.lock();
+        mStats.addPull(timer.microseconds(), bytesRead);
+        mStatsLock.unlock();
+        return result;
+    }
+
+    bool Outputs::SubSet::mapIndex()
+    {
+        unmapIndex();
+
+        NextCash::String filePathName;
+        filePathName.writeFormatted("%s%s%04x.index", mFilePath, NextCash::PATH_SEPARATOR, mID);
+        int file = ::open(filePathName.text(), O_RDONLY);
+        if(file < 0)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open index file %04x to map : %s", mID, std::strerror(errno));
+            return false;
+        }
+
+        struct stat fileStatus;
+        if(::fstat(file, &fileStatus) != 0)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to get index file %04x size : %s", mID, std::strerror(errno));
+            ::close(file);
+            return false;
+        }
+
+        mIndexSize = fileStatus.st_size / sizeof(NextCash::stream_size);
+        if(mIndexSize > 0)
+        {
+            void *map = ::mmap(NULL, mIndexSize * sizeof(NextCash::stream_size), PROT_READ,
+              MAP_SHARED, file, 0);
+            if(map == MAP_FAILED)
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed to map index file %04x : %s", mID, std::strerror(errno));
+                mIndexSize = 0;
+                ::close(file);
+                return false;
+            }
+
+            // Lookups read single entries so read ahead just wastes page cache.
+            ::madvise(map, mIndexSize * sizeof(NextCash::stream_size), MADV_RANDOM);
+            mIndex = (const NextCash::stream_size *)map;
+        }
+
+        // The mapping stays valid after the descriptor is closed.
+        ::close(file);
+        return true;
+    }
+
+    void Outputs::SubSet::unmapIndex()
+    {
+        if(mIndex != NULL)
+        {
+            ::munmap((void *)mIndex, mIndexSize * sizeof(NextCash::stream_size));
+            mIndex = NULL;
+        }
+        mIndexSize = 0; // Fingerprint positions are checked against this before reading mIndex.
+    }
+
+    NextCash::FileInputStream *Outputs::SubSet::dataFile()
+    {
+        if(mDataFile != NULL)
+            return mDataFile;
+
+        NextCash::String filePathName;
+        filePathName.writeFormatted("%s%s%04x.data", mFilePath, NextCash::PATH_SEPARATOR, mID);
+        mDataFile = new NextCash::FileInputStream(filePathName);
+        if(!mDataFile->isValid())
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open data file %04x", mID);
+            delete mDataFile;
+            mDataFile = NULL;
+        }
+
+        return mDataFile;
+    }
+
+    void Outputs::SubSet::closeDataFile()
+    {
+        if(mDataFile != NULL)
+        {
+            delete mDataFile;
+            mDataFile = NULL;
+        }
+    }
+
+    bool Outputs::SubSet::loadFingerprints()
+    {
+        /* File format
+         *   Count of leading index entries that are in hash order (stream_size)
+         *   Fingerprint of each index entry in index order (uint32_t)
+         */
+        mFingerprints.clear();
+        mSortedCount = 0;
+        mRemovedCount = 0;
+
+        NextCash::String filePathName;
+        filePathName.writeFormatted("%s%s%04x.fingerprint", mFilePath, NextCash::PATH_SEPARATOR,
+          mID);
+        NextCash::FileInputStream *file = new NextCash::FileInputStream(filePathName);
+
+        // Entries are appended to the index and fingerprint files by each save, so the file
+        //   matches the index when it has a fingerprint for each entry.
+        if(file->isValid() && file->length() == sizeof(NextCash::stream_size) +
+          (mIndexSize * sizeof(uint32_t)))
+        {
+            // Read the whole file with one read and parse it from memory.
+            NextCash::Buffer data;
+            data.setEndian(NextCash::Endian::LITTLE);
+            file->setReadOffset(0);
+            data.writeStream(file, file->length());
+            delete file;
+
+            NextCash::stream_size sortedCount = data.readUnsignedLong();
+            if(sortedCount <= mIndexSize)
+            {
+                const NextCash::stream_size *index = mIndex;
+                uint32_t value;
+                mFingerprints.reserve(mIndexSize);
+                for(NextCash::stream_size i = 0; i < mIndexSize; ++i, ++index)
+                {
+                    value = data.readUnsignedInt();
+                    if(*index == NextCash::INVALID_STREAM_SIZE)
+                        ++mRemovedCount;
+                    else
+                        mFingerprints.push_back(FingerprintEntry(value, i));
+                }
+
+                std::sort(mFingerprints.begin(), mFingerprints.end());
+                mSortedCount = sortedCount;
+                return true;
+            }
+        }
+        else
+            delete file;
+
+        NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+          "Rebuilding fingerprints for set %04x", mID);
+        return buildFingerprints();
+    }
+
+    bool Outputs::SubSet::buildFingerprints()
+    {
+        mFingerprints.clear();
+        mSortedCount = 0;
+        mRemovedCount = 0;
+
+        std::vector<uint32_t> fingerprints;
+        if(mIndexSize > 0)
+        {
+            if(mIndex == NULL)
+                return false;
+
+            NextCash::FileInputStream *dataInFile = dataFile();
+            if(dataInFile == NULL)
+                return false;
+
+            NextCash::Hash hash(TRANSACTION_HASH_SIZE), previousHash;
+            NextCash::stream_size previousOffset = 0;
+            const NextCash::stream_size *index = mIndex;
+            bool sorted = true;
+            fingerprints.reserve(mIndexSize);
+            mFingerprints.reserve(mIndexSize);
+            for(NextCash::stream_size i = 0; i < mIndexSize; ++i, ++index)
+            {
+                if(*index == NextCash::INVALID_STREAM_SIZE)
+                {
+                    fingerprints.push_back(0);
+                    ++mRemovedCount;
+                }
+                else
+                {
+                    if(!pullHash(dataInFile, *index, hash))
+                    {
+                        mFingerprints.clear();
+                        mRemovedCount = 0;
+                        return false;
+                    }
+                    fingerprints.push_back(fingerprint(hash));
+                    mFingerprints.push_back(FingerprintEntry(fingerprints.back(), i));
+
+                    // Sorted entries are in hash order in both the index and the data file.
+                    if(sorted)
+                    {
+                        if(!previousHash.isEmpty() && (hash.compare(previousHash) <= 0 ||
+                          *index < previousOffset))
+                            sorted = false;
+                        else
+                        {
+                            previousHash = hash;
+                            previousOffset = *index;
+                        }
+                    }
+                }
+
+                if(sorted)
+                    mSortedCount = i + 1;
+            }
+
+            std::sort(mFingerprints.begin(), mFingerprints.end());
+        }
+
+        return writeFingerprints(fingerprints);
+    }
+
+    bool Outputs::SubSet::writeFingerprints(const std::vector<uint32_t> &pFingerprints)
+    {
+        NextCash::String filePathName;
+        filePathName.writeFormatted("%s%s%04x.fingerprint", mFilePath, NextCash::PATH_SEPARATOR,
+          mID);
+        NextCash::FileOutputStream *file = new NextCash::FileOutputStream(filePathName, true);
+        if(!file->isValid())
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open fingerprint file for set %04x", mID);
+            delete file;
+            return false;
+        }
+
+        file->setOutputEndian(NextCash::Endian::LITTLE);
+        file->writeUnsignedLong(mSortedCount);
+        for(std::vector<uint32_t>::const_iterator value = pFingerprints.begin();
+          value != pFingerprints.end(); ++value)
+            file->writeUnsignedInt(*value);
+        delete file;
+        return true;
+    }
+
+    bool Outputs::SubSet::appendFingerprints(std::vector<SaveChange> &pAdded,
+      NextCash::stream_size pIndexSize)
+    {
+        NextCash::String filePathName;
+        filePathName.writeFormatted("%s%s%04x.fingerprint", mFilePath, NextCash::PATH_SEPARATOR,
+          mID);
+
+        // A missing file is rebuilt when the set is loaded.
+        struct stat fileStatus;
+        if(::stat(filePathName.text(), &fileStatus) != 0)
+            return true;
+
+        // Anything after the fingerprints of the mapped index entries is from a save that
+        //   failed part way. If fingerprints are missing then remove the file so it is rebuilt.
+        NextCash::stream_size size = sizeof(NextCash::stream_size) +
+          (pIndexSize * sizeof(uint32_t));
+        if((NextCash::stream_size)fileStatus.st_size != size &&
+          ((NextCash::stream_size)fileStatus.st_size < size ||
+          truncate(filePathName.text(), size) != 0))
+        {
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Fingerprint file for set %04x doesn't match index. Removing", mID);
+            return NextCash::removeFile(filePathName);
+        }
+
+        if(pAdded.size() == 0)
+            return true;
+
+        NextCash::FileOutputStream *file = new NextCash::FileOutputStream(filePathName);
+        if(!file->isValid())
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open fingerprint file for set %04x", mID);
+            delete file;
+            return false;
+        }
+
+        file->setOutputEndian(NextCash::Endian::LITTLE);
+        file->setWriteOffset(size);
+        for(std::vector<SaveChange>::iterator change = pAdded.begin(); change != pAdded.end();
+          ++change)
+            file->writeUnsignedInt(fingerprint(change->transactionID));
+        delete file;
+        return true;
+    }
+
+    void Outputs::SubSet::updateFingerprints(std::vector<FingerprintEntry> &pAdded,
+      std::vector<FingerprintEntry> &pRemoved)
+    {
+        std::vector<FingerprintEntry> remaining;
+
+        std::sort(pAdded.begin(), pAdded.end());
+        std::sort(pRemoved.begin(), pRemoved.end());
+
+        remaining.reserve(mFingerprints.size());
+        std::set_difference(mFingerprints.begin(), mFingerprints.end(), pRemoved.begin(),
+          pRemoved.end(), std::back_inserter(remaining));
+
+        mFingerprints.clear();
+        mFingerprints.reserve(remaining.size() + pAdded.size());
+        std::merge(remaining.begin(), remaining.end(), pAdded.begin(), pAdded.end(),
+          std::back_inserter(mFingerprints));
+    }
+
+    bool Outputs::SubSet::loadCache(unsigned int &pLoadedCount)
+    {
+        pLoadedCount = 0;
+
+        mCache.clear();
+        mCacheRawDataSize = 0UL;
+
+        // Open cache file
+        NextCash::String filePathName;
+        filePathName.writeFormatted("%s%s%04x.cache", mFilePath, NextCash::PATH_SEPARATOR, mID);
+        NextCash::FileInputStream *cacheFile = new NextCash::FileInputStream(filePathName);
+
+        if(!cacheFile->isValid())
+        {
+            delete cacheFile;
+            return true; // Assume empty file
+        }
+
+        // Read the whole file with one read and parse it from memory.
+        NextCash::Buffer cacheData;
+        cacheFile->setReadOffset(0);
+        cacheData.writeStream(cacheFile, cacheFile->length());
+        delete cacheFile;
+
+        bool success = true, spentBitmap;
+        TransactionOutputs *next;
+        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
+        while(cacheData.remaining())
+        {
+            // Read data from cache file
+            next = new TransactionOutputs();
+
+            // Read data offset from cache file
+            next->setDataOffset(cacheData.readUnsignedLong());
+
+            next->cacheFlags = cacheData.readByte();
+            spentBitmap = next->hasSpentBitmap();
+
+            // Read hash from cache file
+            if(!hash.read(&cacheData))
+            {
+                NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed to read subset cache item hash");
+                delete next;
+                success = false;
+                break;
+            }
+
+            next->setHash(hash);
+
+            if(!next->read(&cacheData))
+            {
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed to load/read subset cache item : %s", hash.hex().text());
+                delete next;
+                success = false;
+                break;
+            }
+
+            // Spent bitmaps are saved as SPENT_BITMAP_HEIGHT, which must not be written to the
+            //   data file, so collapse them again.
+            if(spentBitmap)
+                next->collapseSpends(0xffffffff);
+
+            if(!mCache.insert(next, true))
+            {
+                NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed to load/insert subset cache item : %s", hash.hex().text());
+                delete next;
+            }
+            else
+            {
+                ++pLoadedCount;
+                if(next->isNew())
+                    ++mNewSize;
+                mCacheRawDataSize += next->memorySize();
+            }
+        }
+
+        return success;
+    }
+
+    bool Outputs::SubSet::saveCache(unsigned int &pSavedCount)
+    {
+        pSavedCount = 0;
+
+        // Open cache file
+        NextCash::String filePathName;
+        filePathName.writeFormatted("%s%s%04x.cache", mFilePath, NextCash::PATH_SEPARATOR, mID);
+        NextCash::FileOutputStream *cacheFile = new NextCash::FileOutputStream(filePathName, true);
+
+        if(!cacheFile->isValid())
+        {
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open subset cache file %04x for writing : %s", mID, filePathName.text());
+            delete cacheFile;
+            return false;
+        }
+
+        for(SubSetIterator item = mCache.begin(); item != mCache.end(); ++item)
+        {
+            cacheFile->writeUnsignedLong(((TransactionOutputs *)*item)->dataOffset());
+            cacheFile->writeByte(((TransactionOutputs *)*item)->cacheFlags);
+            (*item)->getHash().write(cacheFile);
+            ((TransactionOutputs *)*item)->write(cacheFile);
+            ++pSavedCount;
+        }
+
+        if(pSavedCount != mCache.size())
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Subset cache size doesn't match count %d != %d", mCache.size(), pSavedCount);
+
+        delete cacheFile;
+        return true;
+    }
+
+    bool Outputs::SubSet::load(const char *pFilePath, unsigned int pID, unsigned int &pLoadedCount)
+    {
+        mLock.writeLock("Load");
+
+        NextCash::String filePathName;
+        bool created = false;
+
+        mFilePath = pFilePath;
+        mID = pID;
+
+        // Finish or discard a defragment that was interrupted. The data file is replaced
+        //   before the index file, so a temporary index file without a temporary data file
+        //   means only the index file still needs to be replaced.
+        NextCash::String tempFilePathName;
+        tempFilePathName.writeFormatted("%s%s%04x.index.temp", mFilePath,
+          NextCash::PATH_SEPARATOR, mID);
+        if(fileExists(tempFilePathName))
+        {
+            filePathName.writeFormatted("%s%s%04x.data.temp", mFilePath,
+              NextCash::PATH_SEPARATOR, mID);
+            if(fileExists(filePathName))
+            {
+                NextCash::removeFile(filePathName);
+                NextCash::removeFile(tempFilePathName);
+            }
+            else
+            {
+                filePathName.writeFormatted("%s%s%04x.index", mFilePath,
+                  NextCash::PATH_SEPARATOR, mID);
+                if(!NextCash::renameFile(tempFilePathName, filePathName))
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed to replace defragmented index file : %s", filePathName.text());
+                    mLock.writeUnlock();
+                    return false;
+                }
+            }
+        }
+
+        // Open index file
+        filePathName.writeFormatted("%s%s%04x.index", mFilePath, NextCash::PATH_SEPARATOR, mID);
+        if(!fileExists(filePathName))
+        {
+            // Create index file
+            NextCash::FileOutputStream indexOutFile(filePathName, true);
+            created = true;
+        }
+
+        closeDataFile();
+        if(!mapIndex())
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open index file : %s", filePathName.text());
+            mLock.writeUnlock();
+            return false;
+        }
+
+        mNewSize = 0;
+
+        // Open data file
+        if(created)
+        {
+            filePathName.writeFormatted("%s%s%04x.data", mFilePath,
+              NextCash::PATH_SEPARATOR, mID);
+            NextCash::FileOutputStream dataOutFile(filePathName, true); // Create data file
+        }
+
+        bool success = true;
+        if(!loadFingerprints())
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to load fingerprints for set %04x", mID);
+            success = false;
+        }
+        if(!loadCache(pLoadedCount))
+            success = false;
+
+        mLock.writeUnlock();
+        return success;
+    }
+
+    void Outputs::SubSet::sweepCache(NextCash::stream_size pDataSize)
+    {
+        if(cacheDataSize() <= pDataSize)
+            return;
+
+        // Trim below the max so the next few saves don't need to sweep again.
+        NextCash::stream_size targetSize = (pDataSize * 9) / 10;
+
+        SubSetIterator item = mCache.end();
+        if(!mClockHand.isEmpty())
+            item = mCache.find(mClockHand);
+        if(item == mCache.end())
+            item = mCache.begin();
+
+        // Referenced items are passed over once so two revolutions reach every item.
+        NextCash::stream_size remaining = mCache.size() * 2;
+        unsigned int removedCount = 0;
+        while(cacheDataSize() > targetSize && remaining > 0)
+        {
+            if(item == mCache.end())
+            {
+                item = mCache.begin();
+                continue;
+            }
+
+            --remaining;
+            if(((TransactionOutputs *)*item)->isUnsaved())
+                ++item;
+            else if(((TransactionOutputs *)*item)->isReferenced())
+            {
+                ((TransactionOutputs *)*item)->clearReferenced();
+                ++item;
+            }
+            else
+            {
+                mCacheRawDataSize -= ((TransactionOutputs *)*item)->memorySize();
+                item = mCache.eraseDelete(item);
+                ++removedCount;
+            }
+        }
+
+        if(item != mCache.end())
+            mClockHand = (*item)->getHash();
+        else
+            mClockHand.clear();
+
+        mStatsLock.lock();
+        mStats.evictions += removedCount;
+        mStatsLock.unlock();
+
+        if(cacheDataSize() > targetSize)
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Set %d failed to sweep enough from cache. Removed %d items (%d/%d)", mID,
+              removedCount, cacheDataSize(), targetSize);
+    }
+
+    bool Outputs::SubSet::trimCache(NextCash::stream_size pMaxCacheDataSize,
+      bool pAutoTrimCache, uint32_t pExactHeight)
+    {
+        // A max of zero drops the whole cache.
+        bool removeAll = pAutoTrimCache && pMaxCacheDataSize == 0;
+
+        // Remove old items from the cache.
+        NextCash::stream_size previousSize;
+        unsigned int removedCount = 0;
+        for(SubSetIterator item = mCache.begin(); item != mCache.end();)
+        {
+            // Changed while save was writing the files.
+            if(((TransactionOutputs *)*item)->isUnsaved())
+                ++item;
+            else if(removeAll || ((TransactionOutputs *)*item)->isOld())
+            {
+                mCacheRawDataSize -= ((TransactionOutputs *)*item)->memorySize();
+                item = mCache.eraseDelete(item);
+                ++removedCount;
+            }
+            else
+            {
+                // Spends too deep to revert don't need exact heights.
+                previousSize = ((TransactionOutputs *)*item)->memorySize();
+                if(((TransactionOutputs *)*item)->collapseSpends(pExactHeight))
+                {
+                    mCacheRawDataSize -= previousSize;
+                    mCacheRawDataSize += ((TransactionOutputs *)*item)->memorySize();
+                }
+                ++item;
+            }
+        }
+
+        mStatsLock.lock();
+        mStats.evictions += removedCount;
+        mStatsLock.unlock();
+
+        // Remove items to keep cache data size under max.
+        if(pAutoTrimCache && !removeAll)
+            sweepCache(pMaxCacheDataSize);
+
+        mCache.shrink();
+        return true;
+    }
+
+    bool Outputs::SubSet::save(NextCash::stream_size pMaxCacheDataSize, bool pAutoTrimCache,
+      uint32_t pExactHeight, unsigned int &pSavedCount, NextCash::ReadersLock *pFlushLock)
+    {
+        pSavedCount = 0;
+        mLock.writeLock("Save");
+        mIsDirty = false;
+
+        // Copy the changes so the files can be written after the lock is released.
+        NextCash::Buffer modifiedData;
+        std::vector<SaveChange> modified, added, removed;
+        NextCash::stream_size indexSize = mIndexSize, position, start;
+        TransactionOutputs *outputs;
+        for(SubSetIterator item = mCache.begin(); item != mCache.end();)
+        {
+            outputs = (TransactionOutputs *)*item;
+            if(outputs->markedRemove())
+            {
+                position = NextCash::INVALID_STREAM_SIZE;
+                if(!outputs->isNew())
+                    position = indexPosition(outputs->getHash(), outputs->dataOffset());
+
+                if(position != NextCash::INVALID_STREAM_SIZE)
+                {
+                    removed.push_back(SaveChange(outputs->getHash(), outputs->dataOffset(),
+                      position));
+                    ++item;
+                    continue;
+                }
+
+                // Not in the index. Either it was never added or a save since the cache file
+                //   was written already removed it.
+                if(outputs->isNew())
+                    --mNewSize;
+                mCacheRawDataSize -= outputs->memorySize();
+                item = mCache.eraseDelete(item);
+                continue;
+            }
+
+            if(outputs->isModified())
+            {
+                start = modifiedData.writeOffset();
+                position = outputs->copyModifiedData(&modifiedData);
+                modified.push_back(SaveChange(outputs->getHash(), outputs->dataOffset(), position,
+                  modifiedData.writeOffset() - start));
+            }
+
+            if(outputs->isNew())
+            {
+                // Items loaded from a cache file written before the last save can already be
+                //   in the index.
+                outputs->clearNew();
+                --mNewSize;
+                if(indexPosition(outputs->getHash(), outputs->dataOffset()) ==
+                  NextCash::INVALID_STREAM_SIZE)
+                    added.push_back(SaveChange(outputs->getHash(), outputs->dataOffset()));
+            }
+
+            ++item;
+        }
+
+        mLock.writeUnlock();
+        if(pFlushLock != NULL)
+            pFlushLock->readUnlock();
+
+        bool success = writeChanges(modifiedData, modified, added, removed, indexSize);
+
+        mLock.writeLock("Save");
+
+        if(!success)
+        {
+            // Restore the changes so they are written by the next save.
+            std::vector<SaveChange>::iterator change;
+            SubSetIterator item;
+            for(change = modified.begin(); change != modified.end(); ++change)
+            {
+                item = findItem(change->transactionID, change->dataOffset);
+                if(item != mCache.end())
+                    ((TransactionOutputs *)*item)->setModified();
+            }
+            for(change = added.begin(); change != added.end(); ++change)
+            {
+                item = findItem(change->transactionID, change->dataOffset);
+                if(item != mCache.end())
+                {
+                    ((TransactionOutputs *)*item)->setNew();
+                    ++mNewSize;
+                }
+            }
+
+            markDirty();
+            mLock.writeUnlock();
+            return false;
+        }
+
+        // Reads buffered while the files were written can be from before the changes.
+        closeDataFile();
+
+        if(added.size() > 0 || removed.size() > 0)
+        {
+            std::vector<FingerprintEntry> addedFingerprints, removedFingerprints;
+            std::vector<SaveChange>::iterator change;
+            SubSetIterator item;
+            uint32_t addedPosition = (uint32_t)indexSize;
+            addedFingerprints.reserve(added.size());
+            for(change = added.begin(); change != added.end(); ++change, ++addedPosition)
+                addedFingerprints.push_back(FingerprintEntry(fingerprint(change->transactionID),
+                  addedPosition));
+
+            removedFingerprints.reserve(removed.size());
+            for(change = removed.begin(); change != removed.end(); ++change)
+            {
+                removedFingerprints.push_back(FingerprintEntry(
+                  fingerprint(change->transactionID), (uint32_t)change->position));
+
+                item = findItem(change->transactionID, change->dataOffset);
+                if(item == mCache.end())
+                    continue;
+
+                outputs = (TransactionOutputs *)*item;
+                if(outputs->markedRemove())
+                {
+                    mCacheRawDataSize -= outputs->memorySize();
+                    mCache.eraseDelete(item);
+                    continue;
+                }
+
+                // The removal was reversed while the files were written so it has to be added
+                //   to the index again with its spends cleared.
+                outputs->setNew();
+                outputs->setModified();
+                ++mNewSize;
+                markDirty();
+            }
+
+            updateFingerprints(addedFingerprints, removedFingerprints);
+            mRemovedCount += removed.size();
+
+            // Map the index file again to include the appended entries.
+            success = mapIndex();
+        }
+
+        if(success)
+            success = trimCache(pMaxCacheDataSize, pAutoTrimCache, pExactHeight);
+        if(success && pFlushLock == NULL)
+            success = saveCache(pSavedCount);
+
+        if(!success)
+            markDirty();
+        mLock.writeUnlock();
+        return success;
+    }
+
+    bool Outputs::SubSet::writeChanges(NextCash::Buffer &pModifiedData,
+      std::vector<SaveChange> &pModified, std::vector<SaveChange> &pAdded,
+      std::vector<SaveChange> &pRemoved, NextCash::stream_size pIndexSize)
+    {
+        NextCash::String filePathName;
+        std::vector<SaveChange>::iterator change;
+
+        if(pModified.size() > 0)
+        {
+            filePathName.writeFormatted("%s%s%04x.data", mFilePath, NextCash::PATH_SEPARATOR,
+              mID);
+            NextCash::FileOutputStream *dataOutFile =
+              new NextCash::FileOutputStream(filePathName);
+            if(!dataOutFile->isValid())
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed to open data file for set %04x", mID);
+                delete dataOutFile;
+                return false;
+            }
+
+            pModifiedData.setReadOffset(0);
+            for(change = pModified.begin(); change != pModified.end(); ++change)
+            {
+                dataOutFile->setWriteOffset(change->position);
+                dataOutFile->writeStream(&pModifiedData, change->size);
+            }
+            delete dataOutFile;
+        }
+
+        if(pAdded.size() == 0 && pRemoved.size() == 0)
+            return true;
+
+        // The index file is written last since its entries are what make the changes saved.
+        if(!appendFingerprints(pAdded, pIndexSize))
+            return false;
+
+        // Anything after the mapped entries is from a save that failed part way.
+        filePathName.writeFormatted("%s%s%04x.index", mFilePath, NextCash::PATH_SEPARATOR, mID);
+        if(truncate(filePathName.text(), pIndexSize * sizeof(NextCash::stream_size)) != 0)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to truncate index file for set %04x : %s", mID, std::strerror(errno));
+            return false;
+        }
+
+        NextCash::FileOutputStream *indexOutFile = new NextCash::FileOutputStream(filePathName);
+        if(!indexOutFile->isValid())
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to open index file for set %04x", mID);
+            delete indexOutFile;
+            return false;
+        }
+
+        NextCash::stream_size invalid = NextCash::INVALID_STREAM_SIZE;
+        for(change = pRemoved.begin(); change != pRemoved.end(); ++change)
+        {
+            indexOutFile->setWriteOffset(change->position * sizeof(NextCash::stream_size));
+            indexOutFile->write(&invalid, sizeof(NextCash::stream_size));
+        }
+
+        indexOutFile->setWriteOffset(pIndexSize * sizeof(NextCash::stream_size));
+        for(change = pAdded.begin(); change != pAdded.end(); ++change)
+            indexOutFile->write(&change->dataOffset, sizeof(NextCash::stream_size));
+
+        delete indexOutFile;
+        return true;
+    }
+
+    typename Outputs::SubSetIterator Outputs::SubSet::findItem(
+      const NextCash::Hash &pTransactionID, NextCash::stream_size pDataOffset)
+    {
+        SubSetIterator item = mCache.find(pTransactionID);
+        for(; item != mCache.end() && (*item)->getHash() == pTransactionID; ++item)
+            if(((TransactionOutputs *)*item)->dataOffset() == pDataOffset)
+                return item;
+        return mCache.end();
+    }
+
+    NextCash::stream_size Outputs::SubSet::indexPosition(const NextCash::Hash &pTransactionID,
+      NextCash::stream_size pDataOffset)
+    {
+        FingerprintEntry lookup(fingerprint(pTransactionID), 0);
+        for(std::vector<FingerprintEntry>::iterator entry =
+          std::lower_bound(mFingerprints.begin(), mFingerprints.end(), lookup);
+          entry != mFingerprints.end() && entry->fingerprint == lookup.fingerprint; ++entry)
+            if(entry->position < mIndexSize && mIndex[entry->position] == pDataOffset)
+                return entry->position;
+        return NextCash::INVALID_STREAM_SIZE;
+    }
+
+    bool Outputs::SubSet::readHashOrder(
+      std::vector<std::pair<NextCash::Hash, NextCash::stream_size> > &pItems)
+    {
+        pItems.clear();
+        if(mIndexSize == 0)
+            return true;
+
+        NextCash::FileInputStream *dataInFile = dataFile();
+        if(dataInFile == NULL)
+            return false;
+
+        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
+        const NextCash::stream_size *index = mIndex;
+        pItems.reserve(mIndexSize - mRemovedCount);
+        for(NextCash::stream_size i = 0; i < mIndexSize; ++i, ++index)
+        {
+            if(*index == NextCash::INVALID_STREAM_SIZE)
+                continue;
+            if(!pullHash(dataInFile, *index, hash))
+                return false;
+            pItems.push_back(std::pair<NextCash::Hash, NextCash::stream_size>(hash, *index));
+        }
+
+        std::sort(pItems.begin(), pItems.end());
+        return true;
+    }
+
+    bool Outputs::SubSet::defragment(NextCash::stream_size &pDataSize, bool &pReplaced)
+    {
+        mLock.writeLock("Defragment");
+        pDataSize = 0;
+        pReplaced = false;
+
+        // Only saved items are in the index so it can't be done with unsaved changes.
+        if(!needsDefragment())
+        {
+            mLock.writeUnlock();
+            return true;
+        }
+
+        // The index is in the order items were saved so sort them into hash order.
+        std::vector<std::pair<NextCash::Hash, NextCash::stream_size> > items;
+        NextCash::FileInputStream *dataInFile = dataFile();
+        if(dataInFile == NULL || !readHashOrder(items))
+        {
+            mLock.writeUnlock();
+            return false;
+        }
+
+        NextCash::String dataFilePathName, indexFilePathName, tempDataFilePathName,
+          tempIndexFilePathName;
+        dataFilePathName.writeFormatted("%s%s%04x.data", mFilePath, NextCash::PATH_SEPARATOR,
+          mID);
+        indexFilePathName.writeFormatted("%s%s%04x.index", mFilePath, NextCash::PATH_SEPARATOR,
+          mID);
+        tempDataFilePathName.writeFormatted("%s.temp", dataFilePathName.text());
+        tempIndexFilePathName.writeFormatted("%s.temp", indexFilePathName.text());
+
+        NextCash::FileOutputStream *dataOutFile =
+          new NextCash::FileOutputStream(tempDataFilePathName, true);
+        NextCash::FileOutputStream *indexOutFile =
+          new NextCash::FileOutputStream(tempIndexFilePathName, true);
+        bool success = dataOutFile->isValid() && indexOutFile->isValid();
+
+        // Copy items in hash order.
+        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
+        TransactionOutputs item;
+        NextCash::stream_size previousDataSize = dataInFile->length();
+        NextCash::stream_size previousIndexSize = mIndexSize;
+        NextCash::stream_size itemOffset, itemSize, newOffset;
+        std::vector<FingerprintEntry> fingerprints;
+        std::vector<uint32_t> fileFingerprints;
+        std::vector<std::pair<NextCash::stream_size, NextCash::stream_size> > offsets;
+
+        fingerprints.reserve(items.size());
+        fileFingerprints.reserve(items.size());
+        offsets.reserve(items.size());
+        for(std::vector<std::pair<NextCash::Hash, NextCash::stream_size> >::iterator entry =
+          items.begin(); entry != items.end() && success; ++entry)
+        {
+            itemOffset = entry->second;
+            if(!pullHash(dataInFile, itemOffset, hash) || !item.read(dataInFile))
+            {
+                success = false;
+                break;
+            }
+
+            for(uint32_t j = 0; j < item.outputCount(); ++j)
+                if(!Output::skip(dataInFile))
+                {
+                    success = false;
+                    break;
+                }
+
+            if(!success)
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Set %04x failed to read item to defragment at data offset %d", mID,
+                  itemOffset);
+                break;
+            }
+
+            itemSize = dataInFile->readOffset() - itemOffset;
+            dataInFile->setReadOffset(itemOffset);
+            newOffset = dataOutFile->writeOffset();
+            dataOutFile->writeStream(dataInFile, itemSize);
+            indexOutFile->write(&newOffset, sizeof(NextCash::stream_size));
+
+            fileFingerprints.push_back(fingerprint(hash));
+            fingerprints.push_back(FingerprintEntry(fileFingerprints.back(),
+              (uint32_t)offsets.size()));
+            offsets.push_back(std::pair<NextCash::stream_size, NextCash::stream_size>(itemOffset,
+              newOffset));
+        }
+
+        pDataSize = dataOutFile->length();
+        delete dataOutFile;
+        delete indexOutFile;
+
+        if(!success)
+        {
+            NextCash::removeFile(tempDataFilePathName);
+            NextCash::removeFile(tempIndexFilePathName);
+            mLock.writeUnlock();
+            return false;
+        }
+
+        // The cache file has data offsets of cached items and the fingerprint file is in index
+        //   order. Remove them before they change so they can't be loaded with the old index
+        //   if this is interrupted. They are saved again after the index is replaced.
+        NextCash::String cacheFilePathName, fingerprintFilePathName;
+        cacheFilePathName.writeFormatted("%s%s%04x.cache", mFilePath, NextCash::PATH_SEPARATOR,
+          mID);
+        fingerprintFilePathName.writeFormatted("%s%s%04x.fingerprint", mFilePath,
+          NextCash::PATH_SEPARATOR, mID);
+        unsigned int savedCount;
+        if((NextCash::fileExists(cacheFilePathName) &&
+          !NextCash::removeFile(cacheFilePathName)) ||
+          (NextCash::fileExists(fingerprintFilePathName) &&
+          !NextCash::removeFile(fingerprintFilePathName)))
+        {
+            NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+              "Set %04x failed to remove cache files to defragment", mID);
+            NextCash::removeFile(tempDataFilePathName);
+            NextCash::removeFile(tempIndexFilePathName);
+            mLock.writeUnlock();
+            return false;
+        }
+
+        // Replace the data file and then the index file. If interrupted then load finishes it.
+        closeDataFile();
+        unmapIndex();
+        if(!NextCash::renameFile(tempDataFilePathName, dataFilePathName))
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Set %04x failed to replace data file with defragmented file", mID);
+            NextCash::removeFile(tempDataFilePathName);
+            NextCash::removeFile(tempIndexFilePathName);
+            mapIndex();
+            saveCache(savedCount);
+            mLock.writeUnlock();
+            return false;
+        }
+        pReplaced = true;
+        if(!NextCash::renameFile(tempIndexFilePathName, indexFilePathName))
+        {
+            // The index doesn't match the data file until load replaces it, so leave the
+            //   index unmapped to fail lookups instead of reading the wrong items.
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Set %04x failed to replace index file with defragmented file", mID);
+            mFingerprints.clear();
+            mLock.writeUnlock();
+            return false;
+        }
+
+        success = mapIndex();
+
+        // Update fingerprints and cached items to the new data offsets.
+        std::sort(fingerprints.begin(), fingerprints.end());
+        mFingerprints.swap(fingerprints);
+        mSortedCount = mIndexSize;
+        mRemovedCount = 0;
+        if(success)
+            success = writeFingerprints(fileFingerprints);
+
+        std::sort(offsets.begin(), offsets.end());
+        std::vector<std::pair<NextCash::stream_size, NextCash::stream_size> >::iterator offset;
+        for(SubSetIterator cacheItem = mCache.begin(); cacheItem != mCache.end(); ++cacheItem)
+        {
+            offset = std::lower_bound(offsets.begin(), offsets.end(),
+              std::pair<NextCash::stream_size, NextCash::stream_size>(
+              ((TransactionOutputs *)*cacheItem)->dataOffset(), 0));
+            if(offset != offsets.end() &&
+              offset->first == ((TransactionOutputs *)*cacheItem)->dataOffset())
+                ((TransactionOutputs *)*cacheItem)->setDataOffset(offset->second);
+            else
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Set %04x cached item not found in defragmented index : %s", mID,
+                  (*cacheItem)->getHash().hex().text());
+                success = false;
+            }
+        }
+
+        // Without the cache file the cache is only empty when loaded, so failing to save it
+        //   doesn't fail the defragment.
+        if(success)
+            saveCache(savedCount);
+
+        NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_OUTPUTS_LOG_NAME,
+          "Set %04x defragmented %d -> %d index entries (%d KB -> %d KB)", mID,
+          previousIndexSize, mIndexSize, previousDataSize / 1000, pDataSize / 1000);
+
+        mLock.writeUnlock();
+        return success;
+    }
+
+    bool Outputs::SubSet::exportSnapshot(NextCash::OutputStream *pStream, uint64_t &pCount)
+    {
+        mLock.writeLock("Export Snapshot");
+        pCount = 0;
+
+        // Items are read from the data file so it must contain everything.
+        if(mIsDirty)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Set %04x has changes that aren't saved", mID);
+            mLock.writeUnlock();
+            return false;
+        }
+
+        NextCash::Buffer items;
+        items.setEndian(NextCash::Endian::LITTLE);
+        NextCash::FileInputStream *file = NULL;
+        std::vector<std::pair<NextCash::Hash, NextCash::stream_size> > entries;
+        if((mIndexSize > 0 && (file = dataFile()) == NULL) || !readHashOrder(entries))
+        {
+            mLock.writeUnlock();
+            return false;
+        }
+
+        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
+        TransactionOutputs item;
+        std::vector<Output> outputs;
+        std::vector<Output>::iterator output;
+        std::vector<std::pair<NextCash::Hash, NextCash::stream_size> >::iterator entry;
+        bool success = true;
+        for(entry = entries.begin(); entry != entries.end(); ++entry)
+        {
+            if(!pullHash(file, entry->second, hash) || !item.read(file))
+            {
+                success = false;
+                break;
+            }
+
+            outputs.resize(item.outputCount());
+            for(uint32_t j = 0; success && j < item.outputCount(); ++j)
+            {
+                if(!outputs[j].read(file))
+                    success = false;
+                else if(ScriptInterpreter::isOPReturn(outputs[j].script) && item.isUnspent(j))
+                    item.spendInternal(item.blockHeight, j); // Not always written by insert
+            }
+            if(!success)
+                break;
+
+            if(!item.hasUnspent())
+                continue;
+
+            hash.write(&items);
+            item.writeSnapshot(&items);
+            for(output = outputs.begin(); output != outputs.end(); ++output)
+                output->write(&items, true);
+            ++pCount;
+        }
+
+        if(success)
+        {
+            pStream->writeUnsignedLong(pCount);
+            pStream->writeStream(&items, items.length());
+        }
+        else
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to read item at offset %d in set %04x", entry->second, mID);
+
+        mLock.writeUnlock();
+        return success;
+    }
+
+    bool Outputs::SubSet::importSnapshot(const char *pFilePath, unsigned int pID,
+      NextCash::InputStream *pStream, NextCash::OutputStream *pDigest,
+      OutputsCommitment &pCommitment, uint64_t &pCount)
+    {
+        mLock.writeLock("Import Snapshot");
+
+        mFilePath = pFilePath;
+        mID = pID;
+        closeDataFile();
+
+        NextCash::String filePathName;
+        filePathName.writeFormatted("%s%s%04x.data", mFilePath, NextCash::PATH_SEPARATOR, mID);
+        NextCash::FileOutputStream dataOutFile(filePathName, true);
+        if(!dataOutFile.isValid())
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to create data file for set %04x", mID);
+            mLock.writeUnlock();
+            return false;
+        }
+
+        NextCash::Buffer record;
+        record.setEndian(NextCash::Endian::LITTLE);
+        bool success = pStream->remaining() >= 8;
+        if(success)
+        {
+            record.writeStream(pStream, 8);
+            pDigest->writeStream(&record, record.remaining());
+            record.setReadOffset(0);
+            pCount = record.readUnsignedLong();
+        }
+
+        // Items are already sorted so the index is just the data offsets in order.
+        std::vector<NextCash::stream_size> indices;
+        NextCash::Hash hash(TRANSACTION_HASH_SIZE), previousHash;
+        TransactionOutputs item;
+        Output output;
+        NextCash::stream_size outputsOffset;
+        for(uint64_t i = 0; success && i < pCount; ++i)
+        {
+            if(!hash.read(pStream, TRANSACTION_HASH_SIZE) || subSetOffset(hash) != mID ||
+              (!previousHash.isEmpty() && hash.compare(previousHash) <= 0) || !item.read(pStream))
+            {
+                success = false;
+                break;
+            }
+
+            record.clear();
+            hash.write(&record);
+            item.write(&record);
+            outputsOffset = record.length();
+            for(uint32_t j = 0; success && j < item.outputCount(); ++j)
+                success = Output::skip(pStream, &record);
+            if(!success)
+                break;
+
+            // Read the outputs back from the record for the commitment.
+            record.setReadOffset(outputsOffset);
+            for(uint32_t j = 0; success && j < item.outputCount(); ++j)
+            {
+                success = output.read(&record);
+                if(success && item.isUnspent(j))
+                    pCommitment.add(hash, j, item.blockHeight, output);
+            }
+            if(!success)
+                break;
+            record.setReadOffset(0);
+
+            pDigest->writeStream(&record, record.remaining());
+            record.setReadOffset(0);
+            indices.push_back(dataOutFile.writeOffset());
+            dataOutFile.writeStream(&record, record.length());
+            previousHash = hash;
+        }
+
+        if(!success)
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Invalid snapshot data for set %04x", mID);
+            mLock.writeUnlock();
+            return false;
+        }
+
+        dataOutFile.flush();
+
+        filePathName.writeFormatted("%s%s%04x.index", mFilePath, NextCash::PATH_SEPARATOR, mID);
+        NextCash::FileOutputStream indexOutFile(filePathName, true);
+        if(!indexOutFile.isValid())
+        {
+            NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+              "Failed to create index file for set %04x", mID);
+            mLock.writeUnlock();
+            return false;
+        }
+        indexOutFile.write(indices.data(), indices.size() * sizeof(NextCash::stream_size));
+        indexOutFile.flush();
+
+        // Fingerprints are built from the new index when the set is loaded.
+        mLock.writeUnlock();
+        return true;
+    }
+
+    bool Outputs::SubSet::buildCommitment(OutputsCommitment &pCommitment)
+    {
+        mLock.writeLock("Build Commitment");
+
+        NextCash::FileInputStream *file = NULL;
+        if(mIndexSize > 0 && (file = dataFile()) == NULL)
+        {
+            mLock.writeUnlock();
+            return false;
+        }
+
+        NextCash::Hash hash(TRANSACTION_HASH_SIZE);
+        TransactionOutputs fileItem, *item;
+        SubSetIterator cacheItem;
+        Output output;
+        const NextCash::stream_size *index = mIndex;
+        bool success = true;
+        for(NextCash::stream_size i = 0; i < mIndexSize && success; ++i, ++index)
+        {
+            if(*index == NextCash::INVALID_STREAM_SIZE)
+                continue; // Removed
+
+            if(!pullHash(file, *index, hash) || !fileItem.read(file))
+            {
+                success = false;
+                break;
+            }
+
+            // Cached items can have spends that aren't in the data file yet.
+            item = &fileItem;
+            cacheItem = mCache.find(hash);
+            while(cacheItem != mCache.end() && (*cacheItem)->getHash() == hash)
+            {
+                if(((TransactionOutputs *)*cacheItem)->dataOffset() == *index)
+                {
+                    item = (TransactionOutputs *)*cacheItem;
+                    break;
+                }
+                ++cacheItem;
+            }
+
+            if(item->markedRemove())
+                continue;
+
+            // Unspendable outputs weren't always marked spent in the data file.
+            for(uint32_t j = 0; j < fileItem.outputCount(); ++j)
+            {
+                if(!output.read(file))
+                {
+                    success = false;
+                    break;
+                }
+                if(item->isUnspent(j) && !ScriptInterpreter::isOPReturn(output.script))
+                    pCommitment.add(hash, j, item->blockHeight, output);
+            }
+        }
+
+        mLock.writeUnlock();
+        return success;
+    }
+
+    bool Outputs::test()
+    {
+        NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+          "------------- Starting Outputs Tests -------------");
+
+        bool success = true;
+        NextCash::Hash hash(32);
+        TransactionOutputs *data;
+        NextCash::Digest digest(NextCash::Digest::SHA256);
+        Outputs::Iterator found;
+        TransactionReference transaction;
+        bool checkSuccess;
+        unsigned int markedOldCount = 0;
+        unsigned int removedSize = 0;
+        const unsigned int testSize = 50000;
+        const unsigned int testSizeLarger = 75000;
+        uint32_t dupValue, nonDupValue;
+        NextCash::stream_size cacheTargetSize = 5000000;
+
+        NextCash::removeDirectory("test_outputs");
+
+        if(success)
+        {
+            Outputs testOutputs;
+            TransactionOutputs *lowest = NULL, *highest = NULL;
+            NextCash::Hash lowestHash, highestHash;
+
+            testOutputs.load("test_outputs", 5000000UL, 5000000UL);
+            testOutputs.setTargetCacheSize(cacheTargetSize);
+
+            for(unsigned int i = 0; i < testSize; ++i)
             {
                 // Calculate hash
                 digest.initialize();
@@ -2425,20 +4783,248 @@ namespace BitCoin
                 }
             }
 
-            if(testOutputs.size() == testSize + 1)
+            if(testOutputs.size() == testSize + 1)
+                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed pre-save size : %d", testSize + 1);
+            else
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed pre-save size : %d != %d", testOutputs.size(), testSize + 1);
+                success = false;
+            }
+
+            if(!testOutputs.saveFull(4))
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed multi-threaded save");
+                success = false;
+            }
+        }
+
+        if(success)
+        {
+            Outputs testOutputs;
+
+            testOutputs.load("test_outputs", 5000000UL, 5000000UL);
+            testOutputs.setTargetCacheSize(cacheTargetSize);
+
+            if(testOutputs.size() == testSize + 1)
+                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed load size : %d", testSize + 1);
+            else
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed load size : %d != %d", testOutputs.size(), testSize + 1);
+                success = false;
+            }
+
+            checkSuccess = true;
+            for(unsigned int i = 0; i < testSize; ++i)
+            {
+                // Calculate hash
+                digest.initialize();
+                digest.writeUnsignedInt(i);
+                digest.writeUnsignedInt((i % 10) + 1);
+                digest.getResult(&hash);
+
+                // Create new value
+                data = new TransactionOutputs(hash, i == 0, i, (i % 10) + 1);
+
+                found = testOutputs.get(hash);
+                if(!found)
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed load : %d not found", data->blockHeight);
+                    checkSuccess = false;
+                    success = false;
+                    return false;
+                }
+                else
+                {
+                    if(found.hash() != hash)
+                    {
+                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                          "Failed load : wrong hash : %s", found.hash().hex().text());
+                        checkSuccess = false;
+                        success = false;
+                    }
+                    else if(((TransactionOutputs *)(*found))->blockHeight != data->blockHeight &&
+                      ((TransactionOutputs *)(*found))->blockHeight != dupValue &&
+                      ((TransactionOutputs *)(*found))->blockHeight != nonDupValue)
+                    {
+                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                          "Failed load : wrong value : %d - %s",
+                          ((TransactionOutputs *)(*found))->blockHeight, found.hash().hex().text());
+                        checkSuccess = false;
+                        success = false;
+                    }
+                }
+
+                delete data;
+            }
+
+            if(checkSuccess)
+                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed load check %d lookups", testSize);
+
+            checkSuccess = true;
+            for(unsigned int i = testSizeLarger; i < testSizeLarger + 1000; ++i)
+            {
+                // Calculate hash of a value that was never added
+                digest.initialize();
+                digest.writeUnsignedInt(i);
+                digest.writeUnsignedInt((i % 10) + 1);
+                digest.getResult(&hash);
+
+                if(testOutputs.exists(hash) || testOutputs.hasUnspent(hash))
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed negative lookup : %s", hash.hex().text());
+                    checkSuccess = false;
+                    success = false;
+                }
+            }
+
+            if(checkSuccess)
+                NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed negative lookups");
+
+            for(unsigned int i = testSize; i < testSizeLarger; ++i)
+            {
+                // Calculate hash
+                digest.initialize();
+                digest.writeUnsignedInt(i);
+                digest.writeUnsignedInt((i % 10) + 1);
+                digest.getResult(&hash);
+
+                // Create new value
+                data = new TransactionOutputs(hash, i == 0, i, (i % 10) + 1);
+
+                transaction = new Transaction();
+                while(transaction->outputs.size() < data->outputCount())
+                    transaction->outputs.emplace_back();
+                while(transaction->outputs.size() > data->outputCount())
+                    transaction->outputs.pop_back();
+
+                // Add to set
+                TransactionReference reference(transaction);
+                if(!testOutputs.insert(data, reference, (i % 10) + 1))
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed to insert : %s", data->getHash().hex().text());
+                    success = false;
+                }
+            }
+
+            checkSuccess = true;
+            for(unsigned int i = testSize; i < testSizeLarger; ++i)
+            {
+                // Calculate hash
+                digest.initialize();
+                digest.writeUnsignedInt(i);
+                digest.writeUnsignedInt((i % 10) + 1);
+                digest.getResult(&hash);
+
+                // Create new value
+                data = new TransactionOutputs(hash, i == 0, i, (i % 10) + 1);
+
+                found = testOutputs.get(hash);
+                if(!found)
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed load : %d not found", data->blockHeight);
+                    checkSuccess = false;
+                    success = false;
+                }
+                else
+                {
+                    if(found.hash() != hash)
+                    {
+                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                          "Failed load : wrong hash : %s", found.hash().hex().text());
+                        checkSuccess = false;
+                        success = false;
+                    }
+                    else if(((TransactionOutputs *)(*found))->blockHeight != data->blockHeight &&
+                      ((TransactionOutputs *)(*found))->blockHeight != dupValue &&
+                      ((TransactionOutputs *)(*found))->blockHeight != nonDupValue)
+                    {
+                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                          "Failed load : wrong value : %d - %s",
+                          ((TransactionOutputs *)(*found))->blockHeight, found.hash().hex().text());
+                        checkSuccess = false;
+                        success = false;
+                    }
+                }
+
+                delete data;
+            }
+
+            if(checkSuccess)
+                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed check %d lookups", testSizeLarger);
+
+            NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_OUTPUTS_LOG_NAME,
+              "Original Size : %d", testOutputs.size());
+
+            // Check removing items
+            removedSize = testOutputs.size();
+            for(unsigned int i = 0; i < testSizeLarger; i += (testSize / 10))
+            {
+                // Calculate hash
+                digest.initialize();
+                digest.writeUnsignedInt(i);
+                digest.writeUnsignedInt((i % 10) + 1);
+                digest.getResult(&hash);
+
+                // Mark to remove
+                found = testOutputs.get(hash);
+                if(found)
+                {
+                    (*found)->setRemove();
+                    --removedSize;
+                }
+            }
+
+            // Check marking items as old
+            for(unsigned int i = 50; i < testSizeLarger; i += (testSize / 10))
+            {
+                // Calculate hash
+                digest.initialize();
+                digest.writeUnsignedInt(i);
+                digest.writeUnsignedInt((i % 10) + 1);
+                digest.getResult(&hash);
+
+                // Mark old
+                found = testOutputs.get(hash);
+                if(found && !(*found)->markedRemove())
+                {
+                    (*found)->setOld();
+                    ++markedOldCount;
+                }
+            }
+
+            // This applies the changes to the marked items.
+            testOutputs.saveFull(4, false);
+
+            if(testOutputs.size() == removedSize)
                 NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Passed pre-save size : %d", testSize + 1);
+                  "Passed remove size : %d", removedSize);
             else
             {
                 NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed pre-save size : %d != %d", testOutputs.size(), testSize + 1);
+                  "Failed remove size : %d != %d", testOutputs.size(), removedSize);
                 success = false;
             }
 
-            if(!testOutputs.saveFull(4))
+            if(testOutputs.cacheSize() == testOutputs.size() - markedOldCount)
+                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed old cache size : %d", testOutputs.cacheSize());
+            else
             {
                 NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed multi-threaded save");
+                  "Failed old cache size : %d != %d", testOutputs.cacheSize(),
+                  testOutputs.size() - markedOldCount);
                 success = false;
             }
         }
@@ -2448,20 +5034,41 @@ namespace BitCoin
             Outputs testOutputs;
 
             testOutputs.load("test_outputs", 5000000UL, 5000000UL);
-            testOutputs.setTargetCacheSize(cacheTargetSize);
 
-            if(testOutputs.size() == testSize + 1)
+            // Set max cache data size to 75% of current size
+            uint64_t cacheMaxSize = (uint64_t)((double)testOutputs.cacheDataSize() * 0.75);
+            testOutputs.setTargetCacheSize(cacheMaxSize);
+
+            // Force cache to prune
+            testOutputs.saveFull(4);
+
+            if(testOutputs.size() == removedSize)
                 NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Passed load size : %d", testSize + 1);
+                  "Passed prune size : %d", removedSize);
             else
             {
                 NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed load size : %d != %d", testOutputs.size(), testSize + 1);
+                  "Failed prune size : %d != %d", testOutputs.size(), removedSize);
+                success = false;
+            }
+
+            // Pruning isn't exact so allow a 10% over amount
+            uint64_t bufferDataSize = (uint64_t)((double)cacheMaxSize * 1.1);
+
+            if(testOutputs.cacheDataSize() < bufferDataSize)
+                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed prune cache data size : %d < %d", testOutputs.cacheDataSize(),
+                  bufferDataSize);
+            else
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed prune cache data size : %d >= %d", testOutputs.cacheDataSize(),
+                  bufferDataSize);
                 success = false;
             }
 
             checkSuccess = true;
-            for(unsigned int i = 0; i < testSize; ++i)
+            for(unsigned int i=0;i<testSize;++i)
             {
                 // Calculate hash
                 digest.initialize();
@@ -2473,32 +5080,55 @@ namespace BitCoin
                 data = new TransactionOutputs(hash, i == 0, i, (i % 10) + 1);
 
                 found = testOutputs.get(hash);
-                if(!found)
-                {
-                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                      "Failed load : %d not found", data->blockHeight);
-                    checkSuccess = false;
-                    success = false;
-                    return false;
-                }
-                else
+
+                if(i % (testSize/10) == 0)
                 {
-                    if(found.hash() != hash)
+                    if(found)
                     {
                         NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Failed load : wrong hash : %s", found.hash().hex().text());
+                          "Failed after prune : %d not removed : %s", data->blockHeight,
+                          hash.hex().text());
                         checkSuccess = false;
                         success = false;
+                        break;
                     }
-                    else if(((TransactionOutputs *)(*found))->blockHeight != data->blockHeight &&
-                      ((TransactionOutputs *)(*found))->blockHeight != dupValue &&
-                      ((TransactionOutputs *)(*found))->blockHeight != nonDupValue)
+                }
+                else
+                {
+                    if(!found)
                     {
                         NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Failed load : wrong value : %d - %s",
-                          ((TransactionOutputs *)(*found))->blockHeight, found.hash().hex().text());
+                          "Failed after prune : %d not found : %s", data->blockHeight,
+                          hash.hex().text());
                         checkSuccess = false;
                         success = false;
+                        break;
+                    }
+                    else
+                    {
+                        if(found.hash() != hash)
+                        {
+                            NextCash::Log::addFormatted(NextCash::Log::ERROR,
+                              BITCOIN_OUTPUTS_LOG_NAME,
+                              "Failed after prune : wrong hash : %s", found.hash().hex().text());
+                            checkSuccess = false;
+                            success = false;
+                        }
+                        else if(((TransactionOutputs *)(*found))->blockHeight != data->blockHeight &&
+                          ((TransactionOutputs *)(*found))->blockHeight != dupValue &&
+                          ((TransactionOutputs *)(*found))->blockHeight != nonDupValue)
+                        {
+                            NextCash::Log::addFormatted(NextCash::Log::ERROR,
+                              BITCOIN_OUTPUTS_LOG_NAME, "Failed load : wrong value : %d - %s",
+                              ((TransactionOutputs *)(*found))->blockHeight,
+                              found.hash().hex().text());
+                            checkSuccess = false;
+                            success = false;
+                        }
+                        // else
+                            // NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                              // "Passed load : %d - %s",
+                              // ((TransactionOutputs *)(*found))->blockHeight, found.hash().hex().text());
                     }
                 }
 
@@ -2507,257 +5137,642 @@ namespace BitCoin
 
             if(checkSuccess)
                 NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Passed load check %d lookups", testSize);
+                  "Passed after prune check %d lookups", testSize);
+        }
 
-            for(unsigned int i = testSize; i < testSizeLarger; ++i)
+        if(success)
+        {
+            // Commitments must match for the same outputs no matter the order of changes.
+            OutputsCommitment forward, backward, changes;
+            NextCash::Hash forwardHash, backwardHash;
+            Output output;
+
+            for(unsigned int i = 0; i < 100; ++i)
             {
-                // Calculate hash
                 digest.initialize();
                 digest.writeUnsignedInt(i);
-                digest.writeUnsignedInt((i % 10) + 1);
                 digest.getResult(&hash);
+                output.amount = i * 1000;
+                output.script.clear();
+                output.script.writeUnsignedInt(i);
+                forward.add(hash, i % 3, i, output);
+            }
 
-                // Create new value
-                data = new TransactionOutputs(hash, i == 0, i, (i % 10) + 1);
+            for(unsigned int i = 100; i > 0; --i)
+            {
+                digest.initialize();
+                digest.writeUnsignedInt(i - 1);
+                digest.getResult(&hash);
+                output.amount = (i - 1) * 1000;
+                output.script.clear();
+                output.script.writeUnsignedInt(i - 1);
+                backward.add(hash, (i - 1) % 3, i - 1, output);
+                if(i % 2 == 0)
+                {
+                    // Spend and revert in a separate set of changes.
+                    changes.remove(hash, (i - 1) % 3, i - 1, output);
+                    changes.add(hash, (i - 1) % 3, i - 1, output);
+                }
+            }
+            backward.combine(changes);
+
+            forward.getHash(forwardHash);
+            backward.getHash(backwardHash);
+            if(forwardHash == backwardHash)
+                NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed commitment order");
+            else
+            {
+                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed commitment order : %s != %s", forwardHash.hex().text(),
+                  backwardHash.hex().text());
+                success = false;
+            }
+
+            // Replacing an output with a different amount must change the commitment.
+            backward.remove(hash, 0, 0, output);
+            output.amount += 1;
+            backward.add(hash, 0, 0, output);
+            backward.getHash(backwardHash);
+            if(forwardHash != backwardHash)
+                NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed commitment amount");
+            else
+            {
+                NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed commitment amount");
+                success = false;
+            }
+
+            backward.remove(hash, 0, 0, output);
+            backward.getHash(backwardHash);
+            if(forwardHash != backwardHash)
+                NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed commitment remove");
+            else
+            {
+                NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed commitment remove");
+                success = false;
+            }
+        }
 
+        // Each block has a coinbase with two outputs and a transaction spending the first output
+        //   of the previous block's coinbase.
+        const unsigned int blockCount = 5;
+        TransactionList blocks[blockCount];
+        for(unsigned int height = 0; height < blockCount; ++height)
+        {
+            transaction = new Transaction();
+            transaction->lockTime = height;
+            transaction->inputs.emplace_back();
+            transaction->outputs.resize(2);
+            transaction->outputs[0].amount = 5000000000L;
+            transaction->outputs[1].amount = 1000L;
+            blocks[height].push_back(transaction);
+
+            if(height > 0)
+            {
                 transaction = new Transaction();
-                while(transaction->outputs.size() < data->outputCount())
-                    transaction->outputs.emplace_back();
-                while(transaction->outputs.size() > data->outputCount())
-                    transaction->outputs.pop_back();
+                transaction->lockTime = blockCount + height;
+                transaction->inputs.emplace_back();
+                transaction->inputs.back().outpoint =
+                  Outpoint(blocks[height - 1].front()->hash(), 0);
+                transaction->outputs.resize(1);
+                transaction->outputs[0].amount = 4999990000L;
+                blocks[height].push_back(transaction);
+            }
+        }
 
-                // Add to set
-                TransactionReference reference(transaction);
-                if(!testOutputs.insert(data, reference, (i % 10) + 1))
+        /******************************************************************************************
+         * Journal recovery
+         *****************************************************************************************/
+        if(success)
+        {
+            NextCash::removeDirectory("test_outputs_journal");
+
+            {
+                Outputs testOutputs;
+                testOutputs.load("test_outputs_journal", 5000000UL, 5000000UL);
+
+                uint32_t previousHeight;
+                bool pulled;
+                for(unsigned int height = 0; height < blockCount && success; ++height)
+                {
+                    testOutputs.beginBlock();
+                    if(!testOutputs.add(blocks[height], height))
+                        success = false;
+                    if(height > 0 && !testOutputs.spend(blocks[height - 1].front()->hash(), 0,
+                      height, previousHeight, true, pulled))
+                        success = false;
+
+                    // The last block isn't journaled, as if the process was killed while
+                    //   applying it.
+                    if(height < blockCount - 1 && !testOutputs.journal(blocks[height], height))
+                        success = false;
+                    testOutputs.endBlock();
+
+                    // Flush every subset like the flush threads do without saving the height,
+                    //   so journaled blocks are replayed on top of subsets that include them.
+                    if(height == 2)
+                    {
+                        SubSet *subSet = testOutputs.mSubSets;
+                        for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i, ++subSet)
+                            if(!testOutputs.flushSubSet(subSet))
+                                success = false;
+                    }
+                }
+
+                if(success)
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed journal blocks");
+                else
+                    NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed journal blocks");
+            }
+
+            if(success)
+            {
+                Outputs testOutputs;
+                testOutputs.load("test_outputs_journal", 5000000UL, 5000000UL);
+
+                if(testOutputs.height() == blockCount - 2)
+                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed journal recovery height : %d", testOutputs.height());
+                else
                 {
                     NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                      "Failed to insert : %s", data->getHash().hex().text());
+                      "Failed journal recovery height : %d != %d", testOutputs.height(),
+                      blockCount - 2);
+                    success = false;
+                }
+
+                checkSuccess = true;
+                uint8_t status, expected;
+                for(unsigned int height = 0; height < blockCount; ++height)
+                {
+                    // Output 0 is spent by the next block, which is unapplied for the last
+                    //   journaled block. The block that wasn't journaled is gone.
+                    if(height == blockCount - 1)
+                        expected = 0;
+                    else if(height == blockCount - 2)
+                        expected = UNSPENT_STATUS_EXISTS | UNSPENT_STATUS_UNSPENT;
+                    else
+                        expected = UNSPENT_STATUS_EXISTS;
+
+                    status = testOutputs.unspentStatus(blocks[height].front()->hash(), 0);
+                    if(status != expected)
+                    {
+                        NextCash::Log::addFormatted(NextCash::Log::ERROR,
+                          BITCOIN_OUTPUTS_LOG_NAME,
+                          "Failed journal recovery status : block %d : %02x != %02x", height,
+                          status, expected);
+                        checkSuccess = false;
+                        success = false;
+                    }
+                }
+
+                if(checkSuccess)
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed journal recovery status");
+
+                // The block that wasn't journaled applies cleanly to the recovered outputs.
+                uint32_t previousHeight;
+                bool pulled;
+                if(testOutputs.add(blocks[blockCount - 1], blockCount - 1) &&
+                  testOutputs.spend(blocks[blockCount - 2].front()->hash(), 0, blockCount - 1,
+                  previousHeight, true, pulled) && previousHeight == blockCount - 2)
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed journal recovery reapply");
+                else
+                {
+                    NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed journal recovery reapply");
                     success = false;
                 }
             }
+        }
 
-            checkSuccess = true;
-            for(unsigned int i = testSize; i < testSizeLarger; ++i)
+        /******************************************************************************************
+         * Journal revert recovery
+         *****************************************************************************************/
+        if(success)
+        {
+            NextCash::removeDirectory("test_outputs_journal_revert");
+
+            NextCash::Hash expectedCommitment;
             {
-                // Calculate hash
-                digest.initialize();
-                digest.writeUnsignedInt(i);
-                digest.writeUnsignedInt((i % 10) + 1);
-                digest.getResult(&hash);
+                Outputs testOutputs;
+                testOutputs.load("test_outputs_journal_revert", 5000000UL, 5000000UL);
+
+                OutputsUndo undo;
+                uint32_t previousHeight;
+                bool pulled;
+                for(unsigned int height = 0; height < blockCount && success; ++height)
+                {
+                    testOutputs.beginBlock();
+                    if(!testOutputs.add(blocks[height], height))
+                        success = false;
+                    if(height > 0 && !testOutputs.spend(blocks[height - 1].front()->hash(), 0,
+                      height, previousHeight, true, pulled))
+                        success = false;
+                    if(!testOutputs.journal(blocks[height], height))
+                        success = false;
+                    testOutputs.endBlock();
+                }
+
+                // Flush the last block to the subsets before reverting it, so only the journaled
+                //   revert removes it from them.
+                SubSet *subSet = testOutputs.mSubSets;
+                for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i, ++subSet)
+                    if(!testOutputs.flushSubSet(subSet))
+                        success = false;
+
+                if(!success || !testOutputs.getUndo(blocks[blockCount - 1], undo) ||
+                  !testOutputs.commitment(blockCount - 2, expectedCommitment) ||
+                  !testOutputs.revert(undo, blockCount - 1) || testOutputs.journalNeedsSave())
+                {
+                    NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed journal revert");
+                    success = false;
+                }
+                else
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed journal revert");
+            }
+
+            if(success)
+            {
+                Outputs testOutputs;
+                testOutputs.load("test_outputs_journal_revert", 5000000UL, 5000000UL);
+
+                NextCash::Hash recoveredCommitment;
+                testOutputs.mCommitment.getHash(recoveredCommitment);
+                if(testOutputs.height() == blockCount - 2 &&
+                  recoveredCommitment == expectedCommitment &&
+                  testOutputs.unspentStatus(blocks[blockCount - 1].front()->hash(), 0) == 0 &&
+                  testOutputs.unspentStatus(blocks[blockCount - 2].front()->hash(), 0) ==
+                  (UNSPENT_STATUS_EXISTS | UNSPENT_STATUS_UNSPENT))
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed journal revert recovery");
+                else
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed journal revert recovery : height %d", testOutputs.height());
+                    success = false;
+                }
+
+                // The reverted block applies cleanly again.
+                uint32_t previousHeight;
+                bool pulled;
+                if(testOutputs.add(blocks[blockCount - 1], blockCount - 1) &&
+                  testOutputs.spend(blocks[blockCount - 2].front()->hash(), 0, blockCount - 1,
+                  previousHeight, true, pulled) && previousHeight == blockCount - 2)
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed journal revert reapply");
+                else
+                {
+                    NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed journal revert reapply");
+                    success = false;
+                }
+            }
+        }
+
+        /******************************************************************************************
+         * Defragment
+         *****************************************************************************************/
+        if(success)
+        {
+            NextCash::removeDirectory("test_outputs_defrag");
+
+            const unsigned int defragSize = 20000;
+            Output output;
+            uint32_t previousHeight;
+            bool pulled;
+            const char *stage;
+
+            {
+                Outputs testOutputs;
+                testOutputs.load("test_outputs_defrag", 5000000UL, 5000000UL);
+
+                // Items are appended to the data files in insert order, which isn't hash order.
+                for(unsigned int i = 0; i < defragSize; ++i)
+                {
+                    digest.initialize();
+                    digest.writeUnsignedInt(i);
+                    digest.writeUnsignedInt(0xdef);
+                    digest.getResult(&hash);
+
+                    data = new TransactionOutputs(hash, false, i, 2);
+                    transaction = new Transaction();
+                    transaction->outputs.resize(2);
+                    transaction->outputs[0].amount = i;
+                    transaction->outputs[1].amount = i + 1;
+                    if(!testOutputs.insert(data, transaction, i))
+                    {
+                        NextCash::Log::addFormatted(NextCash::Log::ERROR,
+                          BITCOIN_OUTPUTS_LOG_NAME, "Failed to insert : %s",
+                          data->getHash().hex().text());
+                        success = false;
+                    }
+                }
 
-                // Create new value
-                data = new TransactionOutputs(hash, i == 0, i, (i % 10) + 1);
+                testOutputs.saveFull(4);
 
-                found = testOutputs.get(hash);
-                if(!found)
+                unsigned int defragmentCount = 0;
+                SubSet *subSet = testOutputs.mSubSets;
+                for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i, ++subSet)
+                    if(subSet->needsDefragment())
+                    {
+                        if(testOutputs.compactSubSet(subSet))
+                            ++defragmentCount;
+                        else
+                            success = false;
+                    }
+
+                if(success && defragmentCount > 0)
+                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed defragment of %d sets", defragmentCount);
+                else
                 {
                     NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                      "Failed load : %d not found", data->blockHeight);
-                    checkSuccess = false;
+                      "Failed defragment of %d sets", defragmentCount);
                     success = false;
                 }
-                else
+
+                // Cached items must have the new data offsets.
+                stage = "defragment";
+                checkSuccess = true;
+                for(unsigned int i = 0; i < defragSize; ++i)
                 {
-                    if(found.hash() != hash)
+                    digest.initialize();
+                    digest.writeUnsignedInt(i);
+                    digest.writeUnsignedInt(0xdef);
+                    digest.getResult(&hash);
+
+                    if(!testOutputs.getOutput(hash, 1, 0, 0, output, previousHeight, pulled) ||
+                      previousHeight != i || output.amount != i + 1)
                     {
-                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Failed load : wrong hash : %s", found.hash().hex().text());
+                        NextCash::Log::addFormatted(NextCash::Log::ERROR,
+                          BITCOIN_OUTPUTS_LOG_NAME, "Failed %s lookup %d : %s", stage, i,
+                          hash.hex().text());
                         checkSuccess = false;
                         success = false;
+                        break;
                     }
-                    else if(((TransactionOutputs *)(*found))->blockHeight != data->blockHeight &&
-                      ((TransactionOutputs *)(*found))->blockHeight != dupValue &&
-                      ((TransactionOutputs *)(*found))->blockHeight != nonDupValue)
+                }
+
+                if(checkSuccess)
+                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed %s lookups", stage);
+            }
+
+            if(success)
+            {
+                // The cache file must have been saved with the new data offsets.
+                Outputs testOutputs;
+                testOutputs.load("test_outputs_defrag", 5000000UL, 5000000UL);
+
+                stage = "defragment reload";
+                checkSuccess = true;
+                for(unsigned int i = 0; i < defragSize; ++i)
+                {
+                    digest.initialize();
+                    digest.writeUnsignedInt(i);
+                    digest.writeUnsignedInt(0xdef);
+                    digest.getResult(&hash);
+
+                    if(!testOutputs.getOutput(hash, 1, 0, 0, output, previousHeight, pulled) ||
+                      previousHeight != i || output.amount != i + 1)
                     {
-                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Failed load : wrong value : %d - %s",
-                          ((TransactionOutputs *)(*found))->blockHeight, found.hash().hex().text());
+                        NextCash::Log::addFormatted(NextCash::Log::ERROR,
+                          BITCOIN_OUTPUTS_LOG_NAME, "Failed %s lookup %d : %s", stage, i,
+                          hash.hex().text());
                         checkSuccess = false;
                         success = false;
+                        break;
                     }
                 }
 
-                delete data;
+                if(checkSuccess)
+                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed %s lookups", stage);
             }
+        }
 
-            if(checkSuccess)
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Passed check %d lookups", testSizeLarger);
+        /******************************************************************************************
+         * Undo
+         *****************************************************************************************/
+        if(success)
+        {
+            NextCash::removeDirectory("test_outputs_undo");
 
-            NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_OUTPUTS_LOG_NAME,
-              "Original Size : %d", testOutputs.size());
+            Outputs testOutputs;
+            testOutputs.load("test_outputs_undo", 5000000UL, 5000000UL);
 
-            // Check removing items
-            removedSize = testOutputs.size();
-            for(unsigned int i = 0; i < testSizeLarger; i += (testSize / 10))
+            OutputsUndo undo;
+            uint32_t previousHeight;
+            bool pulled;
+            for(unsigned int height = 0; height < blockCount && success; ++height)
             {
-                // Calculate hash
-                digest.initialize();
-                digest.writeUnsignedInt(i);
-                digest.writeUnsignedInt((i % 10) + 1);
-                digest.getResult(&hash);
-
-                // Mark to remove
-                found = testOutputs.get(hash);
-                if(found)
-                {
-                    (*found)->setRemove();
-                    --removedSize;
-                }
+                if(!testOutputs.add(blocks[height], height))
+                    success = false;
+                if(height > 0 && !testOutputs.spend(blocks[height - 1].front()->hash(), 0,
+                  height, previousHeight, true, pulled))
+                    success = false;
+                if(!testOutputs.journal(blocks[height], height))
+                    success = false;
             }
 
-            // Check marking items as old
-            for(unsigned int i = 50; i < testSizeLarger; i += (testSize / 10))
+            if(!success || !testOutputs.getUndo(blocks[blockCount - 1], undo))
             {
-                // Calculate hash
-                digest.initialize();
-                digest.writeUnsignedInt(i);
-                digest.writeUnsignedInt((i % 10) + 1);
-                digest.getResult(&hash);
-
-                // Mark old
-                found = testOutputs.get(hash);
-                if(found && !(*found)->markedRemove())
+                NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed undo blocks");
+                success = false;
+            }
+            else
+            {
+                // Round trip through the format it is stored in with the block.
+                NextCash::Buffer undoData;
+                undoData.setEndian(NextCash::Endian::LITTLE);
+                undo.write(&undoData);
+                OutputsUndo readUndo;
+                if(readUndo.read(&undoData) && readUndo.insertIDs.size() == 2 &&
+                  readUndo.spends.size() == 1 &&
+                  readUndo.spends.front().transactionID == blocks[blockCount - 2].front()->hash() &&
+                  readUndo.spends.front().index == 0 &&
+                  readUndo.spends.front().previousBlockHeight == blockCount - 2)
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed undo read/write");
+                else
                 {
-                    (*found)->setOld();
-                    ++markedOldCount;
+                    NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed undo read/write");
+                    success = false;
                 }
-            }
 
-            // This applies the changes to the marked items.
-            testOutputs.saveFull(4, false);
+                NextCash::Hash expectedCommitment, revertedCommitment;
+                testOutputs.commitment(blockCount - 2, expectedCommitment);
+                if(testOutputs.revert(readUndo, blockCount - 1) &&
+                  testOutputs.height() == blockCount - 2 &&
+                  testOutputs.unspentStatus(blocks[blockCount - 1].front()->hash(), 0) == 0 &&
+                  testOutputs.unspentStatus(blocks[blockCount - 2].front()->hash(), 0) ==
+                  (UNSPENT_STATUS_EXISTS | UNSPENT_STATUS_UNSPENT))
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed undo revert");
+                else
+                {
+                    NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed undo revert");
+                    success = false;
+                }
 
-            if(testOutputs.size() == removedSize)
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Passed remove size : %d", removedSize);
-            else
-            {
-                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed remove size : %d != %d", testOutputs.size(), removedSize);
-                success = false;
-            }
+                testOutputs.mCommitment.getHash(revertedCommitment);
+                if(revertedCommitment == expectedCommitment)
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed undo commitment");
+                else
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed undo commitment : %s != %s", revertedCommitment.hex().text(),
+                      expectedCommitment.hex().text());
+                    success = false;
+                }
 
-            if(testOutputs.cacheSize() == testOutputs.size() - markedOldCount)
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Passed old cache size : %d", testOutputs.cacheSize());
-            else
-            {
-                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed old cache size : %d != %d", testOutputs.cacheSize(),
-                  testOutputs.size() - markedOldCount);
-                success = false;
+                // A spend that the block didn't make can't be reverted.
+                undo.clear();
+                undo.spends.push_back(OutputsUndo::Spend(blocks[blockCount - 2].front()->hash(),
+                  1, blockCount - 2));
+                if(!testOutputs.revert(undo, blockCount - 2))
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed undo revert failure");
+                else
+                {
+                    NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed undo revert failure");
+                    success = false;
+                }
             }
         }
 
+        /******************************************************************************************
+         * Snapshot
+         *****************************************************************************************/
         if(success)
         {
-            Outputs testOutputs;
-
-            testOutputs.load("test_outputs", 5000000UL, 5000000UL);
+            NextCash::removeDirectory("test_outputs_snapshot");
+            NextCash::removeDirectory("test_outputs_import");
+            NextCash::removeDirectory("test_outputs_import_bad");
 
-            // Set max cache data size to 75% of current size
-            uint64_t cacheMaxSize = (uint64_t)((double)testOutputs.cacheDataSize() * 0.75);
-            testOutputs.setTargetCacheSize(cacheMaxSize);
-
-            // Force cache to prune
-            testOutputs.saveFull(4);
+            Outputs testOutputs;
+            testOutputs.load("test_outputs_snapshot", 5000000UL, 5000000UL);
 
-            if(testOutputs.size() == removedSize)
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Passed prune size : %d", removedSize);
-            else
+            uint32_t previousHeight;
+            bool pulled;
+            for(unsigned int height = 0; height < blockCount && success; ++height)
             {
-                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed prune size : %d != %d", testOutputs.size(), removedSize);
-                success = false;
+                if(!testOutputs.add(blocks[height], height))
+                    success = false;
+                if(height > 0 && !testOutputs.spend(blocks[height - 1].front()->hash(), 0,
+                  height, previousHeight, true, pulled))
+                    success = false;
+                if(!testOutputs.journal(blocks[height], height))
+                    success = false;
             }
 
-            // Pruning isn't exact so allow a 10% over amount
-            uint64_t bufferDataSize = (uint64_t)((double)cacheMaxSize * 1.1);
-
-            if(testOutputs.cacheDataSize() < bufferDataSize)
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Passed prune cache data size : %d < %d", testOutputs.cacheDataSize(),
-                  bufferDataSize);
-            else
+            NextCash::Hash snapshotCommitment;
+            if(!success || !testOutputs.saveFull(4) ||
+              !testOutputs.exportSnapshot("test_outputs.snapshot", snapshotCommitment))
             {
-                NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Failed prune cache data size : %d >= %d", testOutputs.cacheDataSize(),
-                  bufferDataSize);
+                NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Failed snapshot export");
                 success = false;
             }
+            else
+                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Passed snapshot export : %s", snapshotCommitment.hex().text());
 
-            checkSuccess = true;
-            for(unsigned int i=0;i<testSize;++i)
+            if(success)
             {
-                // Calculate hash
-                digest.initialize();
-                digest.writeUnsignedInt(i);
-                digest.writeUnsignedInt((i % 10) + 1);
-                digest.getResult(&hash);
-
-                // Create new value
-                data = new TransactionOutputs(hash, i == 0, i, (i % 10) + 1);
-
-                found = testOutputs.get(hash);
-
-                if(i % (testSize/10) == 0)
+                Outputs importOutputs;
+                unsigned int importHeight;
+                if(importOutputs.importSnapshot("test_outputs.snapshot",
+                  "test_outputs_import", snapshotCommitment, importHeight) &&
+                  importHeight == blockCount - 1)
+                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed snapshot import at height %d", importHeight);
+                else
                 {
-                    if(found)
-                    {
-                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Failed after prune : %d not removed : %s", data->blockHeight,
-                          hash.hex().text());
-                        checkSuccess = false;
-                        success = false;
-                        break;
-                    }
+                    NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed snapshot import");
+                    success = false;
                 }
+            }
+
+            if(success)
+            {
+                Outputs importOutputs;
+                importOutputs.load("test_outputs_import", 5000000UL, 5000000UL);
+
+                NextCash::Hash exportedHash, importedHash;
+                testOutputs.mCommitment.getHash(exportedHash);
+                importOutputs.mCommitment.getHash(importedHash);
+                if(importOutputs.height() == blockCount - 1 && importedHash == exportedHash)
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed snapshot import commitment");
                 else
                 {
-                    if(!found)
-                    {
-                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Failed after prune : %d not found : %s", data->blockHeight,
-                          hash.hex().text());
-                        checkSuccess = false;
-                        success = false;
-                        break;
-                    }
-                    else
-                    {
-                        if(found.hash() != hash)
-                        {
-                            NextCash::Log::addFormatted(NextCash::Log::ERROR,
-                              BITCOIN_OUTPUTS_LOG_NAME,
-                              "Failed after prune : wrong hash : %s", found.hash().hex().text());
-                            checkSuccess = false;
-                            success = false;
-                        }
-                        else if(((TransactionOutputs *)(*found))->blockHeight != data->blockHeight &&
-                          ((TransactionOutputs *)(*found))->blockHeight != dupValue &&
-                          ((TransactionOutputs *)(*found))->blockHeight != nonDupValue)
-                        {
-                            NextCash::Log::addFormatted(NextCash::Log::ERROR,
-                              BITCOIN_OUTPUTS_LOG_NAME, "Failed load : wrong value : %d - %s",
-                              ((TransactionOutputs *)(*found))->blockHeight,
-                              found.hash().hex().text());
-                            checkSuccess = false;
-                            success = false;
-                        }
-                        // else
-                            // NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                              // "Passed load : %d - %s",
-                              // ((TransactionOutputs *)(*found))->blockHeight, found.hash().hex().text());
-                    }
+                    NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed snapshot import commitment : %d : %s != %s", importOutputs.height(),
+                      importedHash.hex().text(), exportedHash.hex().text());
+                    success = false;
                 }
 
-                delete data;
+                checkSuccess = true;
+                for(unsigned int height = 0; height < blockCount; ++height)
+                    for(TransactionList::iterator blockTransaction = blocks[height].begin();
+                      blockTransaction != blocks[height].end(); ++blockTransaction)
+                        for(uint32_t index = 0; index < (*blockTransaction)->outputs.size();
+                          ++index)
+                            if(importOutputs.unspentStatus((*blockTransaction)->hash(), index) !=
+                              testOutputs.unspentStatus((*blockTransaction)->hash(), index))
+                            {
+                                NextCash::Log::addFormatted(NextCash::Log::ERROR,
+                                  BITCOIN_OUTPUTS_LOG_NAME,
+                                  "Failed snapshot import status : %s index %d",
+                                  (*blockTransaction)->hash().hex().text(), index);
+                                checkSuccess = false;
+                                success = false;
+                            }
+
+                if(checkSuccess)
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed snapshot import status");
             }
 
-            if(checkSuccess)
-                NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Passed after prune check %d lookups", testSize);
+            if(success)
+            {
+                // A snapshot that doesn't match the expected commitment leaves no subset files.
+                Outputs importOutputs;
+                unsigned int importHeight;
+                NextCash::Hash wrongCommitment(snapshotCommitment);
+                wrongCommitment.zeroize();
+                NextCash::String filePathName;
+                filePathName.writeFormatted("test_outputs_import_bad%soutputs%s0000.data",
+                  NextCash::PATH_SEPARATOR, NextCash::PATH_SEPARATOR);
+                if(!importOutputs.importSnapshot("test_outputs.snapshot",
+                  "test_outputs_import_bad", wrongCommitment, importHeight) &&
+                  !NextCash::fileExists(filePathName))
+                    NextCash::Log::add(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Passed snapshot import wrong commitment");
+                else
+                {
+                    NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Failed snapshot import wrong commitment");
+                    success = false;
+                }
+            }
         }
 
         return success;
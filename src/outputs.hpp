@@ -9,6 +9,7 @@
 #define BITCOIN_OUTPUTS_HPP
 
 #include "mutex.hpp"
+#include "thread.hpp"
 #include "hash.hpp"
 #include "hash_set.hpp"
 #include "sorted_set.hpp"
@@ -19,8 +20,14 @@
 #include "transaction.hpp"
 #include "forks.hpp"
 #include "profiler_setup.hpp"
+#include "worker_pool.hpp"
+
+#include "secp256k1.h"
+#include "secp256k1_multiset.h"
 
 #include <vector>
+#include <atomic>
+#include <cstring>
 #include <stdlib.h>
 
 #define BITCOIN_OUTPUTS_LOG_NAME "Outputs"
@@ -36,6 +43,7 @@ namespace BitCoin
         TransactionOutputs()
         {
             cacheFlags = 0;
+            mReferenced = false;
             dataFlags = 0;
             mDataOffset = NextCash::INVALID_STREAM_SIZE;
             blockHeight  = 0;
@@ -45,6 +53,7 @@ namespace BitCoin
         TransactionOutputs(const NextCash::Hash &pHash) : mHash(pHash)
         {
             cacheFlags = 0;
+            mReferenced = false;
             dataFlags = 0;
             mDataOffset = NextCash::INVALID_STREAM_SIZE;
             blockHeight  = 0;
@@ -55,24 +64,21 @@ namespace BitCoin
           uint32_t pOutputCount) : mHash(pHash)
         {
             cacheFlags = 0;
+            mReferenced = false;
             if(pIsCoinBase)
                 dataFlags = COINBASE_DATA_FLAG;
             else
                 dataFlags = 0;
             mDataOffset = NextCash::INVALID_STREAM_SIZE;
             blockHeight  = pBlockHeight;
-            mOutputCount = pOutputCount;
-            if(mOutputCount > 0)
-            {
-                mSpentHeights = new uint32_t[mOutputCount];
-                std::memset(mSpentHeights, 0, sizeof(uint32_t) * mOutputCount);
-            }
-            else
-                mSpentHeights = NULL;
+            mOutputCount = 0;
+            mSpentHeights = NULL;
+            if(setOutputCount(pOutputCount))
+                std::memset(spentHeights(), 0, sizeof(uint32_t) * mOutputCount);
         }
         ~TransactionOutputs()
         {
-            if(mSpentHeights != NULL)
+            if(!spentDataInline())
                 delete[] mSpentHeights;
         }
 
@@ -96,7 +102,17 @@ namespace BitCoin
         void clearModified() { cacheFlags &= ~MODIFIED_CACHE_FLAG; }
         void clearNew() { cacheFlags &= ~NEW_CACHE_FLAG; }
         void clearOld() { cacheFlags &= ~OLD_CACHE_FLAG; }
-        void clearFlags() { cacheFlags = 0; }
+        void clearFlags() { cacheFlags &= SPENT_BITMAP_CACHE_FLAG; } // Keep spent format
+
+        // Has changes that aren't in the data and index files yet.
+        bool isUnsaved() const
+          { return cacheFlags & (NEW_CACHE_FLAG | MODIFIED_CACHE_FLAG | REMOVE_CACHE_FLAG); }
+
+        // Used since the last cache sweep. Kept out of the cache flags since lookups set it
+        //   while only holding the shared subset lock.
+        bool isReferenced() const { return mReferenced.load(std::memory_order_relaxed); }
+        void setReferenced() { mReferenced.store(true, std::memory_order_relaxed); }
+        void clearReferenced() { mReferenced.store(false, std::memory_order_relaxed); }
 
         bool wasWritten() const { return mDataOffset != NextCash::INVALID_STREAM_SIZE; }
         NextCash::stream_size dataOffset() const { return mDataOffset; }
@@ -106,40 +122,19 @@ namespace BitCoin
         // Returns the size(bytes) in memory of the object
         NextCash::stream_size memorySize() const;
 
-        // Evaluates the relative age of two objects.
-        // Used to determine which objects to drop from cache
-        // Negative means this object is older than pRight.
-        // Zero means both objects are the same age.
-        // Positive means this object is newer than pRight.
-        int compareAge(TransactionOutputs *pRight)
-        {
-            // Spent transactions are "older" than unspent transactions
-            bool spent = !hasUnspent();
-            bool rightSpent = ((TransactionOutputs *)pRight)->hasUnspent();
-
-            if(spent != rightSpent)
-            {
-                if(spent)
-                    return -1;
-                else
-                    return 1;
-            }
-
-            // If both transactions are spent or both unspent then use block height.
-            if(blockHeight < ((TransactionOutputs *)pRight)->blockHeight)
-                return -1;
-            if(blockHeight > ((TransactionOutputs *)pRight)->blockHeight)
-                return 1;
-            return 0;
-        }
-
         bool read(NextCash::InputStream *pStream);
         void write(NextCash::OutputStream *pStream);
         bool readData(NextCash::InputStream *pStream);
         bool readOutput(NextCash::InputStream *pStream, uint32_t pIndex, Output &pOutput);
         void writeInitialData(const NextCash::Hash &pHash, NextCash::OutputStream *pStream,
           TransactionReference &pTransaction, unsigned int pBlockHeight);
-        void writeModifiedData(NextCash::OutputStream *pStream);
+        // Copy the spent heights that changed to pStream and return the data file offset they
+        //   are written at, so the data file can be updated after the item changes again.
+        NextCash::stream_size copyModifiedData(NextCash::OutputStream *pStream);
+
+        // Same format as write, but every spent output is written as SPENT_BITMAP_HEIGHT so the
+        //   result doesn't depend on when spends were collapsed.
+        void writeSnapshot(NextCash::OutputStream *pStream);
 
         bool spendInternal(uint32_t pBlockHeight, uint32_t pIndex)
         {
@@ -150,23 +145,49 @@ namespace BitCoin
                 return false;
             }
 
-            if(mSpentHeights[pIndex] != 0)
+            if(isSpentBitmap())
+            {
+                if(spentBit(pIndex))
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Output already spent below height %d", SPENT_BITMAP_HEIGHT);
+                    return false;
+                }
+
+                // The exact heights must be read back from the data file first so they are
+                //   written back unchanged with this spend.
+                NextCash::Log::add(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
+                  "Spend of output with spent bitmap");
+                return false;
+            }
+
+            uint32_t *spentHeight = spentHeights() + pIndex;
+            if(*spentHeight != 0)
             {
                 NextCash::Log::addFormatted(NextCash::Log::WARNING, BITCOIN_OUTPUTS_LOG_NAME,
-                  "Output already spent at height %d", mSpentHeights[pIndex]);
+                  "Output already spent at height %d", *spentHeight);
                 return false;
             }
 
-            mSpentHeights[pIndex] = pBlockHeight;
+            *spentHeight = pBlockHeight;
             setModified();
             return true;
         }
 
         bool isUnspent(uint32_t pIndex) const
-          { return mOutputCount > pIndex && mSpentHeights[pIndex] == 0; }
+        {
+            if(mOutputCount <= pIndex)
+                return false;
+            if(isSpentBitmap())
+                return !spentBit(pIndex);
+            return spentHeights()[pIndex] == 0;
+        }
         bool hasUnspent() const
         {
-            uint32_t *spentHeight = mSpentHeights;
+            if(isSpentBitmap())
+                return spentOutputCount() < mOutputCount;
+
+            const uint32_t *spentHeight = spentHeights();
             for(uint32_t i = 0; i < mOutputCount; ++i, ++spentHeight)
                 if(*spentHeight == 0)
                     return true;
@@ -187,9 +208,11 @@ namespace BitCoin
         bool revert(const NextCash::Hash &pHash, uint32_t pBlockHeight);
         bool revertSpend(uint32_t pIndex, uint32_t pBlockHeight)
         {
-            if(mOutputCount > pIndex && mSpentHeights[pIndex] == pBlockHeight)
+            // Spends in a bitmap are all deeper than can be reverted.
+            if(!isSpentBitmap() && mOutputCount > pIndex &&
+              spentHeights()[pIndex] == pBlockHeight)
             {
-                mSpentHeights[pIndex] = 0;
+                spentHeights()[pIndex] = 0;
                 setModified();
                 return true;
             }
@@ -198,6 +221,17 @@ namespace BitCoin
         }
         void clearSpends();
 
+        // Replace spent heights with a bitmap when all spends are below pExactHeight, so they
+        //   are too deep to be reverted. Returns true if the spent heights were replaced.
+        //   Only the cache is collapsed. The data file keeps the exact heights, so items with
+        //   unsaved changes are not collapsed.
+        bool collapseSpends(uint32_t pExactHeight);
+        bool hasSpentBitmap() const { return isSpentBitmap(); }
+
+        // Replace a spent bitmap with the exact spent heights from the data file. This is
+        //   required before the item is modified.
+        bool readSpentHeights(NextCash::InputStream *pStream);
+
         // HashObject virtual functions
         const NextCash::Hash &getHash() { return mHash; }
         bool valueEquals(const NextCash::SortedObject *pRight) const
@@ -227,6 +261,7 @@ namespace BitCoin
         static const uint8_t MODIFIED_CACHE_FLAG      = 0x02; // Modified since last write.
         static const uint8_t REMOVE_CACHE_FLAG        = 0x04; // Needs removed from index and cache.
         static const uint8_t OLD_CACHE_FLAG           = 0x08; // Needs to be dropped from cache.
+        static const uint8_t SPENT_BITMAP_CACHE_FLAG  = 0x10; // Spent data is a bitmap.
 
         // This transaction is a coinbase transaction (first of block).
         static const uint8_t COINBASE_DATA_FLAG = 0x01;
@@ -238,13 +273,15 @@ namespace BitCoin
         //   sizeof(uint32_t) output count
         static const NextCash::stream_size mBaseSize = sizeof(uint8_t) + (2 * sizeof(uint32_t));
 
-        // Base memory size :
-        //   Base size
-        //   sizeof(uint32_t *) spent height pointer
+        // Memory used not counting the hash, which is counted with the cache item size, or a
+        //   spent height array that isn't inline.
+        //   mBaseSize
+        //   sizeof(uint32_t *) spent height pointer or inline spent heights
         //   sizeof(NextCash::stream_size) data offset
         //   sizeof(uint8_t) cacheFlags
+        //   sizeof(bool) referenced
         static const NextCash::stream_size mBaseMemorySize = mBaseSize + sizeof(uint32_t *) +
-          sizeof(NextCash::stream_size) + sizeof(uint8_t);
+          sizeof(NextCash::stream_size) + sizeof(uint8_t) + sizeof(bool);
 
         // The offset in the data file of the hash value, followed by the specific data for the
         //   virtual read/write functions.
@@ -254,8 +291,47 @@ namespace BitCoin
         static const uint32_t MAX_OUTPUT_COUNT = 0x0000ffff;
         static const uint32_t MAX_BLOCK_HEIGHT = 0x00ffffff;
 
+        // Spent heights for up to this many outputs are stored in place of the pointer so most
+        //   transactions don't need a second allocation.
+        static const uint32_t INLINE_OUTPUT_COUNT = sizeof(uint32_t *) / sizeof(uint32_t);
+
+        std::atomic<bool> mReferenced;
+
         uint32_t mOutputCount;
-        uint32_t *mSpentHeights;
+        union
+        {
+            uint32_t *mSpentHeights; // When mOutputCount > INLINE_OUTPUT_COUNT
+            uint32_t mInlineSpentHeights[INLINE_OUTPUT_COUNT];
+        };
+
+        // Spent data is either a height per output, or after collapseSpends a bit per output
+        //   that is set when the output was spent below the exact height.
+        bool isSpentBitmap() const { return cacheFlags & SPENT_BITMAP_CACHE_FLAG; }
+        uint32_t spentDataCount() const
+          { return isSpentBitmap() ? (mOutputCount + 31) / 32 : mOutputCount; }
+        bool spentDataInline() const { return spentDataCount() <= INLINE_OUTPUT_COUNT; }
+        uint32_t *spentData()
+          { return spentDataInline() ? mInlineSpentHeights : mSpentHeights; }
+        const uint32_t *spentData() const
+          { return spentDataInline() ? mInlineSpentHeights : mSpentHeights; }
+
+        // Only valid when spent data is not a bitmap.
+        uint32_t *spentHeights() { return spentData(); }
+        const uint32_t *spentHeights() const { return spentData(); }
+
+        // Only valid when spent data is a bitmap.
+        bool spentBit(uint32_t pIndex) const
+          { return (spentData()[pIndex >> 5] >> (pIndex & 0x1f)) & 0x01; }
+
+        // Height reported for outputs spent in a bitmap and written to snapshots. Below any
+        //   height that can spend.
+        static const uint32_t SPENT_BITMAP_HEIGHT = 1;
+
+        // Write spent heights to a file.
+        void writeSpentHeights(NextCash::OutputStream *pStream);
+
+        // Reallocate spent heights for a new output count. Spent heights are not preserved.
+        bool setOutputCount(uint32_t pCount);
 
         NextCash::Hash mHash;
 
@@ -264,13 +340,149 @@ namespace BitCoin
 
     };
 
+    // Outputs changes made by a block. Saved with the block so it can be reverted without
+    //   reading and parsing the block's transactions.
+    class OutputsUndo
+    {
+    public:
+
+        class Spend
+        {
+        public:
+            Spend() : transactionID(TRANSACTION_HASH_SIZE)
+            {
+                index = 0;
+                previousBlockHeight = 0xffffffff;
+            }
+            Spend(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+              uint32_t pPreviousBlockHeight) : transactionID(pTransactionID)
+            {
+                index = pIndex;
+                previousBlockHeight = pPreviousBlockHeight;
+            }
+
+            NextCash::Hash transactionID;
+            uint32_t index;
+            uint32_t previousBlockHeight; // Height of block containing the spent transaction.
+        };
+
+        std::vector<NextCash::Hash> insertIDs; // Transactions added by the block.
+        std::vector<Spend> spends; // Outputs spent by the block.
+
+        void clear()
+        {
+            insertIDs.clear();
+            spends.clear();
+        }
+
+        void write(NextCash::OutputStream *pStream) const;
+        bool read(NextCash::InputStream *pStream);
+
+    };
+
+    // Rolling multiset hash (ECMH) of unspent outputs. Elements can be added and removed in any
+    //   order, so it is updated with each change instead of scanning the outputs.
+    class OutputsCommitment
+    {
+    public:
+
+        OutputsCommitment() { clear(); }
+
+        void clear();
+
+        // Elements are the transaction ID, output index, block height, amount, and script of
+        //   unspent outputs.
+        void add(const NextCash::Hash &pTransactionID, uint32_t pIndex, uint32_t pBlockHeight,
+          Output &pOutput);
+        void remove(const NextCash::Hash &pTransactionID, uint32_t pIndex, uint32_t pBlockHeight,
+          Output &pOutput);
+
+        // Apply changes collected in another commitment.
+        void combine(const OutputsCommitment &pChanges);
+
+        void getHash(NextCash::Hash &pHash) const;
+
+        // Raw set so it can be continued after a restart.
+        static const NextCash::stream_size SIZE = sizeof(secp256k1_multiset);
+        void write(NextCash::OutputStream *pStream) const;
+        bool read(NextCash::InputStream *pStream);
+
+    private:
+
+        static secp256k1_context *context();
+
+        secp256k1_multiset mSet;
+
+    };
+
+    // Cumulative statistics of outputs lookups, used to size the cache and find hot subsets.
+    class OutputsStats
+    {
+    public:
+
+        // Pull times in microseconds. Buckets are below 16, 64, 256, 1024, 4096, 16384, 65536,
+        //   and the rest.
+        static const unsigned int PULL_TIME_BUCKETS = 8;
+        // Blocks between creation and spend. Buckets are below 1, 6, 144, 1008, 4320, 52560,
+        //   210240, and the rest.
+        static const unsigned int SPENT_AGE_BUCKETS = 8;
+
+        OutputsStats() { clear(); }
+
+        void clear();
+        void operator += (const OutputsStats &pRight);
+
+        void addPull(uint64_t pMicroseconds, NextCash::stream_size pBytesRead);
+        void addSpend(uint32_t pAge);
+
+        // Percent of lookups found in the cache.
+        unsigned int hitPercent() const
+        {
+            if(hits + misses == 0)
+                return 0;
+            return (unsigned int)((hits * 100) / (hits + misses));
+        }
+
+        void write(NextCash::OutputStream *pStream) const;
+
+        void print(NextCash::Log::Level pLevel = NextCash::Log::Level::VERBOSE) const;
+
+        uint64_t hits; // Lookups found in the cache.
+        uint64_t misses; // Lookups not found in the cache.
+        uint64_t pulls; // Lookups that read the data file.
+        uint64_t evictions; // Items removed from the cache to trim it.
+        uint64_t bytesRead; // From data files.
+        uint64_t pullTimes[PULL_TIME_BUCKETS];
+        uint64_t spentAges[SPENT_AGE_BUCKETS];
+
+    };
+
     // Container for all unspent transaction outputs
     class Outputs
     {
     public:
 
-        Outputs() : mLock("OutputsLock") { mNextBlockHeight = 0; mSavedBlockHeight = 0; }
-        ~Outputs() {}
+        Outputs() : mJournalLock("OutputsJournal"), mCommitmentLock("OutputsCommitment"),
+          mLock("OutputsLock"), mFlushLock("OutputsFlush"), mFlushOffsetLock("OutputsFlushOffset"),
+          mCompactLock("OutputsCompact")
+        {
+            mNextBlockHeight = 0;
+            mSavedBlockHeight = 0;
+            mJournalSize = 0;
+            mJournalID = 0;
+            mJournalHeight = 0;
+            mJournalFailed = false;
+            mFlushStopping = false;
+            mFlushThreadCount = 0;
+            mFlushThreads = NULL;
+            mBlockLocked = false;
+            mNextFlushOffset = 0;
+            mCompactBudget = 0;
+            mCompactTime = 0;
+            mNextCompactOffset = 0;
+            mWorkers = NULL;
+        }
+        ~Outputs() { stopFlush(); }
 
         // Returns 0xffffffff if not found.
         unsigned int getBlockHeight(const NextCash::Hash &pTransactionID);
@@ -295,8 +507,8 @@ namespace BitCoin
 
         // BIP-0030 Check if a transaction ID exists with unspent outputs before this block height.
         //   pBlockHash is for exceptions allowed before BIP-0030 was activated.
-        //   This is expensive since it is a negative lookup and has to search a file for every
-        //     transaction.
+        //   This is a negative lookup for almost every transaction, but the subset fingerprint
+        //     tables answer those in memory so the data files are only read on a match.
         bool checkDuplicate(const NextCash::Hash &pTransactionID, unsigned int pBlockHeight,
           const NextCash::Hash &pBlockHash);
 
@@ -307,6 +519,38 @@ namespace BitCoin
         // Revert transactions in a block.
         bool revert(TransactionList &pBlockTransactions, unsigned int pBlockHeight);
 
+        // Build undo data for a block that was just applied.
+        bool getUndo(TransactionList &pBlockTransactions, OutputsUndo &pUndo);
+
+        // Revert a block using its undo data.
+        bool revert(const OutputsUndo &pUndo, unsigned int pBlockHeight);
+
+        // Append the inserts and spends of a block that has been fully applied to the journal.
+        //   Blocks in the journal after the saved height are recovered on load without
+        //   reprocessing them. Reverts are journaled by revert. The journal is cleared whenever
+        //   the block height is saved.
+        bool journal(TransactionList &pBlockTransactions, unsigned int pBlockHeight);
+        // The journal is too large or is missing changes since a record failed to write, so only
+        //   a full save will make them durable.
+        bool journalNeedsSave() const
+          { return mJournalFailed || mJournalSize > OUTPUTS_JOURNAL_MAX_SIZE; }
+
+        // Hold off flushes from the start of applying a block until it is journaled or reverted
+        //   so subsets are never saved with part of a block that isn't in the journal. Replay
+        //   after a crash then only sees changes from journaled blocks. add doesn't lock again
+        //   while this is held.
+        void beginBlock();
+        void endBlock();
+
+        // Multiset hash of the unspent outputs after the block at pHeight was applied. Returns
+        //   false if the height is more than OUTPUTS_COMMITMENT_HISTORY blocks below the tip.
+        bool commitment(unsigned int pHeight, NextCash::Hash &pCommitment);
+
+        // Pull the outputs spent by a block's transactions into the cache before they are
+        //   validated. Outpoints are grouped by subset and each subset reads its data file in
+        //   file order. Returns the number of items pulled.
+        unsigned int prefetch(TransactionList &pBlockTransactions, unsigned int pThreadCount);
+
         // bool revertToHeight(unsigned int pBlockHeight);
 
         // Height of last block
@@ -327,12 +571,34 @@ namespace BitCoin
         // Debug Only
         void markValid() { mIsValid = true; }
 
+        // Multi-threaded load, save, and prefetch run on these threads when set. Otherwise they
+        //   start temporary threads.
+        void setWorkers(WorkerPool *pWorkers) { mWorkers = pWorkers; }
+
+        // Subsets are loaded by pThreadCount threads.
         bool load(const char *pFilePath, NextCash::stream_size pTargetCacheSize,
-          NextCash::stream_size pCacheDelta);
+          NextCash::stream_size pCacheDelta, unsigned int pThreadCount = 1);
 
         bool saveFull(unsigned int pThreadCount, bool pAutoTrimCache = true);
         bool saveCache();
 
+        // Write behind. Background threads continuously save modified subsets and trim the cache
+        //   one subset at a time so block processing doesn't wait for a full save.
+        void startFlush(unsigned int pThreadCount);
+        void stopFlush();
+        bool isFlushing() const { return mFlushThreadCount > 0; }
+
+        // Write the unspent outputs at the current height to a snapshot file used to bootstrap
+        //   new nodes. Everything must be saved first. pCommitment is set to the SHA256 of the
+        //   snapshot contents, which is also stored at the end of the file.
+        bool exportSnapshot(const char *pFileName, NextCash::Hash &pCommitment);
+
+        // Create the outputs files in a data directory that doesn't have any from a snapshot.
+        //   The snapshot must match the commitment stored in it and pCommitment if it isn't
+        //   empty. pHeight is set to the height of the last block in the snapshot.
+        bool importSnapshot(const char *pFileName, const char *pFilePath,
+          const NextCash::Hash &pCommitment, unsigned int &pHeight);
+
         static bool test();
 
     private:
@@ -342,40 +608,98 @@ namespace BitCoin
 
         bool saveBlockHeight();
 
+        // Used by revert with mLock write locked.
+        // pPreviousBlockHeight is 0xffffffff when the height of the spent transaction is unknown.
+        bool revertSpend(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+          uint32_t pBlockHeight, uint32_t pPreviousBlockHeight);
+        bool revertInsert(const NextCash::Hash &pTransactionID, uint32_t pBlockHeight);
+        // Mark subsets dirty, journal the revert, and decrement the height.
+        void revertComplete(const OutputsUndo &pUndo, uint32_t pBlockHeight);
+
         unsigned int mNextBlockHeight, mSavedBlockHeight;
 
+        NextCash::Mutex mJournalLock;
+        NextCash::stream_size mJournalSize;
+        // Saved with the height and written in each record so records left from before the last
+        //   save are not recovered.
+        uint32_t mJournalID;
+        // Next block height after the saved height and journal records. Blocks at or above it
+        //   were never saved or journaled, so reverting them doesn't need a record.
+        uint32_t mJournalHeight;
+        bool mJournalFailed;
+
+        static const uint8_t JOURNAL_ADD_TYPE = 0x01;
+        static const uint8_t JOURNAL_REVERT_TYPE = 0x02;
+
+        // Append a record with data built by journal or revertComplete.
+        bool writeJournal(uint32_t pBlockHeight, uint8_t pType, NextCash::Buffer &pData);
+
+        class CommitmentHeight
+        {
+        public:
+            CommitmentHeight(uint32_t pHeight, const NextCash::Hash &pCommitment) :
+              commitment(pCommitment)
+            {
+                height = pHeight;
+            }
+
+            uint32_t height;
+            NextCash::Hash commitment;
+        };
+
+        NextCash::Mutex mCommitmentLock;
+        OutputsCommitment mCommitment;
+        std::vector<CommitmentHeight> mCommitments; // Recent blocks
+
+        void updateCommitment(const OutputsCommitment &pChanges);
+        // Save the commitment for a block that was just applied.
+        void addCommitmentHeight(uint32_t pBlockHeight);
+        // Build the commitment from the saved sets when it wasn't saved with the height.
+        bool buildCommitment();
+
+        // Apply journaled blocks and reverts after the saved height. Stops at the first invalid
+        //   record.
+        bool recoverJournal();
+        bool truncateJournal(NextCash::stream_size pSize);
+
+        static constexpr const char *SNAPSHOT_START_STRING = "NCOUTS01";
+
         static const uint32_t BIP0030_HASH_COUNT = 2;
         static const uint32_t BIP0030_HEIGHTS[BIP0030_HASH_COUNT];
         static const NextCash::Hash BIP0030_HASHES[BIP0030_HASH_COUNT];
 
-        unsigned int subSetOffset(const NextCash::Hash &pTransactionID)
+        static unsigned int subSetOffset(const NextCash::Hash &pTransactionID)
         {
             return pTransactionID.lookup16() >> 6;
         }
 
-        class SampleEntry
+        // Short piece of the transaction ID used to find items in the data file without
+        //   reading hashes. Uses bytes away from the ones that select the subset.
+        static uint32_t fingerprint(const NextCash::Hash &pTransactionID)
         {
-        public:
-            NextCash::Hash hash;
-            NextCash::stream_size offset;
+            const uint8_t *bytes = pTransactionID.data() + 8;
+            return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) |
+              ((uint32_t)bytes[3] << 24);
+        }
 
-            bool load(NextCash::InputStream *pIndexFile, NextCash::InputStream *pDataFile)
+        class FingerprintEntry
+        {
+        public:
+            FingerprintEntry() {}
+            FingerprintEntry(uint32_t pFingerprint, uint32_t pPosition)
             {
-                if(hash.isEmpty())
-                {
-                    pIndexFile->setReadOffset(offset);
-                    NextCash::stream_size dataOffset;
-                    pIndexFile->read(&dataOffset, sizeof(NextCash::stream_size));
+                fingerprint = pFingerprint;
+                position = pPosition;
+            }
 
-                    pDataFile->setReadOffset(dataOffset);
-                    if(!hash.read(pDataFile, TRANSACTION_HASH_SIZE))
-                    {
-                        NextCash::Log::addFormatted(NextCash::Log::ERROR, BITCOIN_OUTPUTS_LOG_NAME,
-                          "Failed to read sample index hash at offset %llu", offset);
-                        return false;
-                    }
-                }
-                return true;
+            uint32_t fingerprint;
+            uint32_t position; // Position in the index. The index has the data offset.
+
+            bool operator <(const FingerprintEntry &pRight) const
+            {
+                if(fingerprint != pRight.fingerprint)
+                    return fingerprint < pRight.fingerprint;
+                return position < pRight.position;
             }
         };
 
@@ -390,37 +714,69 @@ namespace BitCoin
 
             unsigned int id() const { return mID; }
 
-            NextCash::stream_size size() const { return mIndexSize + mNewSize; }
+            NextCash::stream_size size() const
+              { return mIndexSize - mRemovedCount + mNewSize; }
             NextCash::stream_size cacheSize() const { return mCache.size(); }
             static const NextCash::stream_size staticCacheItemSize =
               NextCash::Hash::memorySize(TRANSACTION_HASH_SIZE) + // Hash in cache.
               sizeof(void *); // Data pointer in cache.
+            // Includes the fingerprints since they are in memory for every item in the index.
             NextCash::stream_size cacheDataSize()
-              { return mCacheRawDataSize + (mCache.size() * staticCacheItemSize); }
+            {
+                return mCacheRawDataSize + (mCache.size() * staticCacheItemSize) +
+                  (mFingerprints.capacity() * sizeof(FingerprintEntry));
+            }
 
             // Returns 0xffffffff if not found.
             unsigned int getBlockHeight(const NextCash::Hash &pTransactionID);
 
             SubSetIterator get(const NextCash::Hash &pTransactionID);
 
+            // Read outputs of a cached item from the data file.
+            bool readOutput(TransactionOutputs *pItem, uint32_t pIndex, Output &pOutput);
+            bool readOutputs(TransactionOutputs *pItem, std::vector<Output> &pOutputs);
+
             // Inserts a new item corresponding to the lookup.
             bool insert(TransactionOutputs *pReference, TransactionReference &pTransaction,
               unsigned int pBlockHeight);
 
+            // Clears the removal of a reverted item matching pReference so it is used again
+            //   when its block is added again.
+            bool reverseRemove(TransactionOutputs *pReference, TransactionReference &pTransaction,
+              unsigned int pBlockHeight);
+
+            // pSpent is set when an output was marked spent.
             bool getOutput(const NextCash::Hash &pTransactionID, uint32_t pIndex, uint8_t pFlags,
               uint32_t pSpentBlockHeight, Output &pOutput, uint32_t &pPreviousBlockHeight,
-              bool &pPulled);
+              bool &pPulled, bool &pSpent);
             bool isUnspent(const NextCash::Hash &pTransactionID, uint32_t pIndex, bool &pPulled);
+            // pOutput is set to the output when it is spent.
             bool spend(const NextCash::Hash &pTransactionID, uint32_t pIndex,
               uint32_t pSpentBlockHeight, uint32_t &pPreviousBlockHeight, bool pRequireUnspent,
-              bool &pPulled);
+              bool &pPulled, bool &pSpent, Output &pOutput);
             bool hasUnspent(const NextCash::Hash &pTransactionID, uint32_t pSpentBlockHeight);
             bool exists(const NextCash::Hash &pTransactionID, bool pPullIfNeeded);
+
+            // Returns INVALID_STREAM_SIZE if not found.
+            NextCash::stream_size dataOffset(const NextCash::Hash &pTransactionID,
+              uint32_t pBlockHeight);
+
+            // Journal recovery. Changes that are already applied are skipped.
+            bool recoverInsert(const NextCash::Hash &pTransactionID,
+              NextCash::stream_size pDataOffset, uint32_t pBlockHeight);
+            bool recoverSpend(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+              uint32_t pBlockHeight);
+            bool recoverRevertSpend(const NextCash::Hash &pTransactionID, uint32_t pIndex,
+              uint32_t pPreviousBlockHeight, uint32_t pBlockHeight);
+            bool recoverRevertInsert(const NextCash::Hash &pTransactionID, uint32_t pBlockHeight);
             uint8_t unspentStatus(const NextCash::Hash &pTransactionID, uint32_t pIndex);
 
             bool checkDuplicate(const NextCash::Hash &pTransactionID, unsigned int pBlockHeight,
               const NextCash::Hash &pBlockHash);
 
+            // Pull any of the transaction IDs that aren't cached. Returns the number pulled.
+            unsigned int prefetch(std::vector<NextCash::Hash> &pTransactionIDs);
+
             SubSetIterator end() { return mCache.end(); }
 
             // Pull all items with matching hashes from the file and put them in the cache.
@@ -429,16 +785,169 @@ namespace BitCoin
             bool pull(const NextCash::Hash &pTransactionID, TransactionOutputs *pMatching = NULL);
 
             bool load(const char *pFilePath, unsigned int pID, unsigned int &pLoadedCount);
+            // Spends below pExactHeight are collapsed to bitmaps in the cache.
+            // Changes are copied under the lock and written to the files after it is released,
+            //   so lookups and block processing only wait for the copy. pFlushLock is given by
+            //   background flushes, which hold it shared, and is released after the copy. The
+            //   cache file is only written by full saves since it has to match the saved block
+            //   height.
             bool save(NextCash::stream_size pMaxCacheDataSize, bool pAutoTrimCache,
-              unsigned int &pSavedCount);
+              uint32_t pExactHeight, unsigned int &pSavedCount,
+              NextCash::ReadersLock *pFlushLock = NULL);
+
+            // Items were added or modified since the last save.
+            bool isDirty() const { return mIsDirty; }
+            void markDirty()
+            {
+                if(!mIsDirty)
+                {
+                    mDirtyTime = getTime();
+                    mIsDirty = true;
+                }
+            }
+            // Time of the first change since the last save.
+            Time dirtyTime() const { return mDirtyTime; }
+
+            // Flush threads claim a subset so only one of them saves or defragments it at a
+            //   time. Full saves don't claim since they exclude the flush threads.
+            bool claim()
+            {
+                bool expected = false;
+                return mClaimed.compare_exchange_strong(expected, true);
+            }
+            void release() { mClaimed = false; }
 
             bool saveCache(unsigned int &pSavedCount);
 
-            // Rewrite data file filling in gaps from removed data.
-            bool defragment();
+            // Add this subset's statistics to pStats.
+            void getStats(OutputsStats &pStats)
+            {
+                mStatsLock.lock();
+                pStats += mStats;
+                mStatsLock.unlock();
+            }
+
+            // Index entries that were appended since the last defragment or removed are enough
+            //   to need defragmented.
+            bool needsDefragment() const
+            {
+                NextCash::stream_size unsortedCount = mIndexSize - mSortedCount + mRemovedCount;
+                return !mIsDirty && unsortedCount > 0 &&
+                  unsortedCount * 100 >= mIndexSize * OUTPUTS_COMPACT_PERCENT;
+            }
+
+            // Rewrite the data and index files with items in hash order, leaving out removed
+            //   entries and gaps from removed data. Changes must be saved first. pDataSize is
+            //   set to the size of the data copied. pReplaced is set when the data file was
+            //   replaced, after which a failure leaves the subset files inconsistent until
+            //   reloaded.
+            bool defragment(NextCash::stream_size &pDataSize, bool &pReplaced);
+
+            // Write the item count and then items with unspent outputs in hash order. Changes
+            //   must be saved first.
+            bool exportSnapshot(NextCash::OutputStream *pStream, uint64_t &pCount);
+
+            // Create data and index files for this set from a snapshot. Everything read from
+            //   the snapshot is also written to pDigest and unspent outputs are added to
+            //   pCommitment.
+            bool importSnapshot(const char *pFilePath, unsigned int pID,
+              NextCash::InputStream *pStream, NextCash::OutputStream *pDigest,
+              OutputsCommitment &pCommitment, uint64_t &pCount);
+
+            // Add the unspent outputs of all saved items to pCommitment.
+            bool buildCommitment(OutputsCommitment &pCommitment);
 
         private:
 
+            // Item change copied by save so the files can be written without the lock.
+            class SaveChange
+            {
+            public:
+                SaveChange(const NextCash::Hash &pTransactionID, NextCash::stream_size pDataOffset,
+                  NextCash::stream_size pPosition = 0, NextCash::stream_size pSize = 0) :
+                  transactionID(pTransactionID)
+                {
+                    dataOffset = pDataOffset;
+                    position = pPosition;
+                    size = pSize;
+                }
+
+                NextCash::Hash transactionID;
+                NextCash::stream_size dataOffset;
+                // Data file offset of modified spent heights or index position of removed item.
+                NextCash::stream_size position;
+                NextCash::stream_size size; // Size of copied spent heights.
+            };
+
+            // Write the changes copied by save. The index file entries of removed items are
+            //   invalidated in place and new items are appended to the index and fingerprint
+            //   files. Doesn't require the lock.
+            bool writeChanges(NextCash::Buffer &pModifiedData,
+              std::vector<SaveChange> &pModified, std::vector<SaveChange> &pAdded,
+              std::vector<SaveChange> &pRemoved, NextCash::stream_size pIndexSize);
+
+            // Returns the cached item with the transaction ID at the data offset, or end().
+            SubSetIterator findItem(const NextCash::Hash &pTransactionID,
+              NextCash::stream_size pDataOffset);
+
+            // Returns the index position of the item at the data offset, or INVALID_STREAM_SIZE
+            //   if it isn't in the index.
+            NextCash::stream_size indexPosition(const NextCash::Hash &pTransactionID,
+              NextCash::stream_size pDataOffset);
+
+            // Read the transaction IDs of the items in the index and sort them with their data
+            //   offsets into hash order.
+            bool readHashOrder(
+              std::vector<std::pair<NextCash::Hash, NextCash::stream_size> > &pItems);
+
+            // False when the transaction ID is definitely not in the data file.
+            bool fingerprintMatches(const NextCash::Hash &pTransactionID) const;
+
+            // Lock the set and find the first cached item with the transaction ID. The lock is
+            //   only taken exclusively when the item isn't cached and may need to be pulled.
+            //   pWriteLocked is set to which lock is held and must be passed to unlock.
+            SubSetIterator lockFind(const NextCash::Hash &pTransactionID, bool pPull,
+              bool &pWriteLocked, bool &pPulled);
+            void unlock(bool pWriteLocked)
+            {
+                if(pWriteLocked)
+                    mLock.writeUnlock();
+                else
+                    mLock.readUnlock();
+            }
+
+            void countLookup(bool pCached)
+            {
+                mStatsLock.lock();
+                if(pCached)
+                    ++mStats.hits;
+                else
+                    ++mStats.misses;
+                mStatsLock.unlock();
+            }
+            void countSpend(uint32_t pSpentBlockHeight, uint32_t pBlockHeight)
+            {
+                mStatsLock.lock();
+                mStats.addSpend(pSpentBlockHeight - pBlockHeight);
+                mStatsLock.unlock();
+            }
+            void countRead(NextCash::stream_size pBytesRead)
+            {
+                mStatsLock.lock();
+                mStats.bytesRead += pBytesRead;
+                mStatsLock.unlock();
+            }
+
+            // Items with no unspent outputs are only needed again for reverts so the next cache
+            //   sweep can remove them.
+            static void referenceSpent(TransactionOutputs *pItem)
+            {
+                if(pItem->hasUnspent())
+                    pItem->setReferenced();
+                else
+                    pItem->clearReferenced();
+            }
+
             bool pullHash(NextCash::InputStream *pDataFile, NextCash::stream_size pFileOffset,
               NextCash::Hash &pHash)
             {
@@ -461,29 +970,74 @@ namespace BitCoin
                 return true;
             }
 
-            void loadSamples(NextCash::InputStream *pIndexFile);
-
-            // Find offsets into indices that contain the specified hash, based on samples
-            bool findSample(const NextCash::Hash &pHash, NextCash::InputStream *pIndexFile,
-              NextCash::InputStream *pDataFile, NextCash::stream_size &pBegin,
-              NextCash::stream_size &pEnd);
+            // Load fingerprints from file, or build them from the index and data files if the
+            //   file doesn't match the current index. Also counts removed and sorted entries.
+            bool loadFingerprints();
+            bool buildFingerprints();
+            // Write the fingerprint of each index entry in index order.
+            bool writeFingerprints(const std::vector<uint32_t> &pFingerprints);
+            // Append fingerprints of entries added to the end of the index.
+            bool appendFingerprints(std::vector<SaveChange> &pAdded,
+              NextCash::stream_size pIndexSize);
+
+            // Apply changes made to the index by save.
+            void updateFingerprints(std::vector<FingerprintEntry> &pAdded,
+              std::vector<FingerprintEntry> &pRemoved);
+
+            // Map the index file into memory read only. Must be called again after the index
+            //   file is appended or rewritten.
+            bool mapIndex();
+            void unmapIndex();
+
+            // Returns the data file, opening it if it isn't already open. The data file stays
+            //   open between lookups and must be closed before anything writes to it.
+            NextCash::FileInputStream *dataFile();
+            void closeDataFile();
+
+            // Spend an output of a cached item. A spent bitmap is first replaced with the exact
+            //   heights from the data file. Requires write lock.
+            bool spendItem(TransactionOutputs *pItem, uint32_t pBlockHeight, uint32_t pIndex);
 
             bool loadCache(unsigned int &pLoadedCount);
 
-            // Mark items in the cache as old until it is under the specified data size.
-            // Only called by trimeCache.
-            void markOld(NextCash::stream_size pDataSize);
-
-            // Remove items from cache based on "age" and data size specified.
-            // Only called by save.
-            bool trimCache(NextCash::stream_size pMaxCacheDataSize, bool pAutoTrimCache);
-
-            NextCash::MutexWithConstantName mLock;
+            // CLOCK eviction. Sweep the cache from where the last sweep stopped, removing items
+            //   that haven't been referenced since the previous pass and clearing the reference
+            //   of those that have, until the cache is under 90% of the specified data size.
+            //   Items with unsaved changes are passed over.
+            // Only called by trimCache.
+            void sweepCache(NextCash::stream_size pDataSize);
+
+            // Remove items marked old, sweep the cache down to the data size specified, and
+            //   collapse spends of remaining items below pExactHeight.
+            // Items changed while save was writing the files are kept. Only called by save.
+            bool trimCache(NextCash::stream_size pMaxCacheDataSize, bool pAutoTrimCache,
+              uint32_t pExactHeight);
+
+            // Lookups of cached items share the lock. Only changes to the cache or items and
+            //   pulling items into the cache need it exclusively.
+            NextCash::ReadersLock mLock;
             const char *mFilePath;
             NextCash::stream_size mIndexSize, mNewSize, mCacheRawDataSize;
+            // Leading index entries that are in hash order in the data file.
+            NextCash::stream_size mSortedCount;
+            // Index entries of removed items. They are INVALID_STREAM_SIZE until defragmented.
+            NextCash::stream_size mRemovedCount;
             unsigned int mID;
             NextCash::HashSet mCache;
-            SampleEntry *mSamples;
+            NextCash::Hash mClockHand; // Item the next cache sweep starts from.
+            // Sorted fingerprints and index positions of every item in the index.
+            std::vector<FingerprintEntry> mFingerprints;
+            const NextCash::stream_size *mIndex; // Memory mapped index file.
+            NextCash::FileInputStream *mDataFile;
+            NextCash::Mutex mDataFileLock; // Data file reads while the lock is shared.
+            // Read by the flush threads without the lock.
+            std::atomic<bool> mIsDirty;
+            std::atomic<Time> mDirtyTime;
+            std::atomic<bool> mClaimed;
+
+            // Updated by lookups that share the lock so it has its own.
+            NextCash::Mutex mStatsLock;
+            OutputsStats mStats;
 
         };
 
@@ -491,7 +1045,7 @@ namespace BitCoin
         NextCash::String mFilePath;
         SubSet mSubSets[OUTPUTS_SET_COUNT];
         NextCash::stream_size mTargetCacheSize, mCacheDelta;
-        bool mIsValid;
+        std::atomic<bool> mIsValid; // Cleared by flush threads when a subset fails.
 
     public:
 
@@ -589,6 +1143,17 @@ namespace BitCoin
             return result;
         }
 
+        // Add statistics of all subsets, or one subset, to pStats.
+        void getStats(OutputsStats &pStats);
+        void getStats(unsigned int pSubSetID, OutputsStats &pStats)
+        {
+            if(pSubSetID < OUTPUTS_SET_COUNT)
+                mSubSets[pSubSetID].getStats(pStats);
+        }
+
+        // Log statistics of all subsets and the subsets with the most misses.
+        void printStats(NextCash::Log::Level pLevel = NextCash::Log::Level::VERBOSE);
+
         NextCash::stream_size cacheDataSize()
         {
             NextCash::stream_size result = 0;
@@ -618,38 +1183,47 @@ namespace BitCoin
         Iterator begin();
         Iterator end();
 
-        bool loadSubSets(const char *pFilePath);
+        bool loadSubSets(const char *pFilePath, unsigned int pThreadCount);
         bool saveSingleThreaded(bool pAutoTrimCache);
         bool saveMultiThreaded(unsigned int pThreadCount, bool pAutoTrimCache);
 
+        // Block height below which spends are no longer kept exact in the cache.
+        uint32_t exactSpentHeight() const
+        {
+            return mNextBlockHeight > OUTPUTS_EXACT_SPENT_DEPTH ?
+              mNextBlockHeight - OUTPUTS_EXACT_SPENT_DEPTH : 0;
+        }
+
         class SaveThreadData
         {
         public:
 
             SaveThreadData(SubSet *pFirstSubSet, NextCash::stream_size pMaxSetCacheDataSize,
-              bool pAutoTrimCache) : mutex("SaveThreadData")
+              bool pAutoTrimCache, uint32_t pExactHeight) : mutex("SaveThreadData")
             {
                 nextSubSet = pFirstSubSet;
                 maxSetCacheDataSize = pMaxSetCacheDataSize;
                 autoTrimCache = pAutoTrimCache;
+                exactHeight = pExactHeight;
                 offset = 0;
+                completeCount = 0;
                 savedCount = 0;
                 success = true;
+                lastReport = getTime();
                 for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
-                {
-                    setComplete[i] = false;
                     setSuccess[i] = true;
-                }
             }
 
             NextCash::Mutex mutex;
             SubSet *nextSubSet;
             NextCash::stream_size maxSetCacheDataSize;
             bool autoTrimCache;
+            uint32_t exactHeight;
             unsigned int offset;
+            std::atomic<unsigned int> completeCount;
             unsigned int savedCount;
             bool success;
-            bool setComplete[OUTPUTS_SET_COUNT];
+            Time lastReport;
             bool setSuccess[OUTPUTS_SET_COUNT];
 
             SubSet *getNext()
@@ -671,10 +1245,17 @@ namespace BitCoin
             {
                 mutex.lock();
                 savedCount += pCount;
-                setComplete[pOffset] = true;
+                ++completeCount;
                 setSuccess[pOffset] = pSuccess;
                 if(!pSuccess)
                     success = false;
+                if(getTime() - lastReport >= 10)
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Save is %2d%% Complete",
+                      (int)(((float)completeCount / (float)OUTPUTS_SET_COUNT) * 100.0f));
+                    lastReport = getTime();
+                }
                 mutex.unlock();
             }
 
@@ -682,6 +1263,157 @@ namespace BitCoin
 
         static void saveThreadRun(void *pParameter); // Thread to process save tasks
 
+        class LoadThreadData
+        {
+        public:
+
+            LoadThreadData(SubSet *pFirstSubSet, const char *pFilePath) : mutex("LoadThreadData")
+            {
+                firstSubSet = pFirstSubSet;
+                filePath = pFilePath;
+                offset = 0;
+                completeCount = 0;
+                loadedCount = 0;
+                success = true;
+                lastReport = getTime();
+            }
+
+            NextCash::Mutex mutex;
+            SubSet *firstSubSet;
+            const char *filePath;
+            unsigned int offset;
+            std::atomic<unsigned int> completeCount;
+            unsigned int loadedCount;
+            bool success;
+            Time lastReport;
+
+            // Returns the next subset to load and sets pID to its ID.
+            SubSet *getNext(unsigned int &pID)
+            {
+                SubSet *result = NULL;
+                mutex.lock();
+                if(offset < OUTPUTS_SET_COUNT)
+                {
+                    pID = offset;
+                    result = firstSubSet + offset;
+                    ++offset;
+                }
+                mutex.unlock();
+                return result;
+            }
+
+            void markComplete(bool pSuccess, unsigned int pCount)
+            {
+                mutex.lock();
+                loadedCount += pCount;
+                ++completeCount;
+                if(!pSuccess)
+                    success = false;
+                if(getTime() - lastReport >= 10)
+                {
+                    NextCash::Log::addFormatted(NextCash::Log::INFO, BITCOIN_OUTPUTS_LOG_NAME,
+                      "Load is %2d%% Complete",
+                      (int)(((float)completeCount / (float)OUTPUTS_SET_COUNT) * 100.0f));
+                    lastReport = getTime();
+                }
+                mutex.unlock();
+            }
+
+        };
+
+        static void loadThreadRun(void *pParameter); // Thread to process load tasks
+
+        class PrefetchThreadData
+        {
+        public:
+
+            PrefetchThreadData(SubSet *pFirstSubSet, std::vector<NextCash::Hash> *pTransactionIDs) :
+              mutex("PrefetchThreadData")
+            {
+                firstSubSet = pFirstSubSet;
+                transactionIDs = pTransactionIDs;
+                offset = 0;
+                completeCount = 0;
+                pulledCount = 0;
+            }
+
+            NextCash::Mutex mutex;
+            SubSet *firstSubSet;
+            std::vector<NextCash::Hash> *transactionIDs; // One list per subset
+            unsigned int offset;
+            std::atomic<unsigned int> completeCount;
+            unsigned int pulledCount;
+
+            // Returns the next subset that has transaction IDs to pull.
+            SubSet *getNext(std::vector<NextCash::Hash> *&pTransactionIDs)
+            {
+                SubSet *result = NULL;
+                mutex.lock();
+                while(offset < OUTPUTS_SET_COUNT)
+                {
+                    if(transactionIDs[offset].size() > 0)
+                    {
+                        result = firstSubSet + offset;
+                        pTransactionIDs = transactionIDs + offset;
+                        ++offset;
+                        break;
+                    }
+
+                    ++offset;
+                    ++completeCount; // Nothing to pull
+                }
+                mutex.unlock();
+                return result;
+            }
+
+            void markComplete(unsigned int pCount)
+            {
+                mutex.lock();
+                pulledCount += pCount;
+                ++completeCount;
+                mutex.unlock();
+            }
+
+        };
+
+        static void prefetchThreadRun(void *pParameter); // Thread to process prefetch tasks
+
+        // Held for read while a flush copies a subset's changes and for write by add, which
+        //   uses cache iterators without holding the subset lock, and from beginBlock to
+        //   endBlock.
+        NextCash::ReadersLock mFlushLock;
+        bool mBlockLocked; // Only used by the thread applying blocks.
+        NextCash::Mutex mFlushOffsetLock;
+        std::atomic<bool> mFlushStopping; // Read by the flush threads.
+        std::atomic<unsigned int> mFlushThreadCount;
+        unsigned int mNextFlushOffset; // Protected by mFlushOffsetLock.
+        NextCash::Thread **mFlushThreads;
+
+        // Returns the next subset that has had changes for OUTPUTS_FLUSH_DELAY or needs
+        //   trimmed, claimed for the calling thread. NULL if there are none.
+        SubSet *nextFlushSubSet();
+        bool flushSubSet(SubSet *pSubSet);
+
+        static void flushThreadRun(void *pParameter); // Thread to save modified subsets
+
+        // Online compaction is done by the flush threads when there is nothing to flush. The
+        //   budget is bytes that can be copied and refills at OUTPUTS_COMPACT_RATE.
+        NextCash::Mutex mCompactLock;
+        int64_t mCompactBudget;
+        Time mCompactTime;
+        unsigned int mNextCompactOffset;
+
+        // Returns the next subset that needs defragmented when the budget allows it, claimed
+        //   for the calling thread. NULL if there are none.
+        SubSet *nextCompactSubSet();
+        bool compactSubSet(SubSet *pSubSet);
+
+        WorkerPool *mWorkers;
+
+        // Run pFunction on pThreadCount threads, including this one, and wait for them.
+        void runWorkers(WorkerPool::Function pFunction, void *pParameter,
+          unsigned int pThreadCount);
+
     };
 }
 
@@ -15,8 +15,6 @@
 
     static const unsigned int PROFILER_OUTPUTS_PULL_ID = sNextID++;
     static const char *PROFILER_OUTPUTS_PULL_NAME __attribute__ ((unused)) = "Outputs::pull";
-    static const unsigned int PROFILER_OUTPUTS_SAMPLE_ID = sNextID++;
-    static const char *PROFILER_OUTPUTS_SAMPLE_NAME __attribute__ ((unused)) = "Outputs::findSample";
     static const unsigned int PROFILER_OUTPUTS_ADD_ID = sNextID++;
     static const char *PROFILER_OUTPUTS_ADD_NAME __attribute__ ((unused)) = "Outputs::add";
     static const unsigned int PROFILER_OUTPUTS_INSERT_ID = sNextID++;
@@ -39,6 +37,8 @@
     static const char *PROFILER_OUTPUTS_HAS_UNSPENT_NAME __attribute__ ((unused)) = "Outputs::hasUnspent";
     static const unsigned int PROFILER_OUTPUTS_EXISTS_ID = sNextID++;
     static const char *PROFILER_OUTPUTS_EXISTS_NAME __attribute__ ((unused)) = "Outputs::exists";
+    static const unsigned int PROFILER_OUTPUTS_PREFETCH_ID = sNextID++;
+    static const char *PROFILER_OUTPUTS_PREFETCH_NAME __attribute__ ((unused)) = "Outputs::prefetch";
 
     static const unsigned int PROFILER_INTERP_PROCESS_ID = sNextID++;
     static const char *PROFILER_INTERP_PROCESS_NAME __attribute__ ((unused)) = "Interpreter::process";
@@ -701,6 +701,33 @@ namespace BitCoin
             NextCash::Log::addFormatted(NextCash::Log::VERBOSE, mName,
               "Sending mempool data : %d trans (%d KB)", requestData.count, requestData.size / 1000L);
         }
+        else if(command == "outs")
+        {
+            NextCash::Log::add(NextCash::Log::VERBOSE, mName,
+              "Received outputs statistics request");
+
+            Outputs &outputs = mChain->outputs();
+            OutputsStats stats;
+            outputs.getStats(stats);
+
+            sendData.writeString("outs:");
+            sendData.writeUnsignedLong(outputs.cacheSize()); // Cached item count
+            sendData.writeUnsignedLong(outputs.cacheDataSize()); // Cached data size
+            sendData.writeUnsignedLong(outputs.targetCacheSize()); // Target cache data size
+            stats.write(&sendData); // Totals
+
+            // Hits and misses of each subset
+            sendData.writeUnsignedInt(OUTPUTS_SET_COUNT);
+            for(unsigned int i = 0; i < OUTPUTS_SET_COUNT; ++i)
+            {
+                stats.clear();
+                outputs.getStats(i, stats);
+                sendData.writeUnsignedLong(stats.hits);
+                sendData.writeUnsignedLong(stats.misses);
+            }
+
+            NextCash::Log::add(NextCash::Log::VERBOSE, mName, "Sending outputs statistics");
+        }
         else if(command == "tran")
         {
             // Return transaction for specified hash
@@ -0,0 +1,114 @@
+/**************************************************************************
+ * Copyright 2019 NextCash, LLC                                           *
+ * Contributors :                                                         *
+ *   Curtis Ellis <curtis@nextcash.tech>                                  *
+ * Distributed under the MIT software license, see the accompanying       *
+ * file license.txt or http://www.opensource.org/licenses/mit-license.php *
+ **************************************************************************/
+#include "signature_cache.hpp"
+
+#include "digest.hpp"
+#include "key.hpp"
+
+#include <cstring>
+
+
+namespace BitCoin
+{
+    SignatureCache &SignatureCache::instance()
+    {
+        static SignatureCache sInstance;
+        return sInstance;
+    }
+
+    SignatureCache::SignatureCache()
+    {
+        // The salt must not be predictable or entries could be chosen to collide.
+        Key::getEntropy(mSalt, 32);
+
+        mShardCapacity = SIGNATURE_CACHE_COUNT / SHARD_COUNT;
+        if(mShardCapacity == 0)
+            mShardCapacity = 1;
+        for(unsigned int i = 0; i < SHARD_COUNT; ++i)
+        {
+            mShards[i].entries.reserve(mShardCapacity);
+            mShards[i].added.reserve(mShardCapacity);
+            mShards[i].removed.reserve(mShardCapacity);
+        }
+
+        mHits = 0;
+        mMisses = 0;
+    }
+
+    void SignatureCache::calculate(const NextCash::Hash &pSignatureHash,
+      const uint8_t *pPublicKeyData, unsigned int pPublicKeyDataSize,
+      const uint8_t *pSignatureData, unsigned int pSignatureDataSize, bool pStrictSignatures,
+      Entry &pEntry) const
+    {
+        NextCash::Digest digest(NextCash::Digest::SHA256);
+        NextCash::Hash result;
+
+        digest.write(mSalt, 32);
+        digest.write(pSignatureHash.data(), pSignatureHash.size());
+        digest.writeByte(pStrictSignatures ? 1 : 0);
+        digest.writeUnsignedInt(pPublicKeyDataSize);
+        digest.write(pPublicKeyData, pPublicKeyDataSize);
+        digest.writeUnsignedInt(pSignatureDataSize);
+        digest.write(pSignatureData, pSignatureDataSize);
+        digest.getResult(&result);
+
+        std::memcpy(pEntry.values, result.data(), 32);
+    }
+
+    bool SignatureCache::contains(const Entry &pEntry, bool pRemove)
+    {
+        Shard &shard = mShards[pEntry.values[0] & 0xff];
+        bool result;
+
+        shard.mutex.lock();
+        std::unordered_map<Entry, unsigned int, EntryHasher>::iterator entry =
+          shard.entries.find(pEntry);
+        result = entry != shard.entries.end();
+        if(result && pRemove)
+        {
+            // Free the slot so replacing it later doesn't remove the entry if it is added again.
+            shard.removed[entry->second] = true;
+            shard.entries.erase(entry);
+        }
+        shard.mutex.unlock();
+
+        if(result)
+            ++mHits;
+        else
+            ++mMisses;
+        return result;
+    }
+
+    void SignatureCache::add(const Entry &pEntry)
+    {
+        Shard &shard = mShards[pEntry.values[0] & 0xff];
+
+        shard.mutex.lock();
+        if(shard.entries.find(pEntry) == shard.entries.end())
+        {
+            if(shard.added.size() < mShardCapacity)
+            {
+                shard.entries[pEntry] = shard.added.size();
+                shard.added.push_back(pEntry);
+                shard.removed.push_back(false);
+            }
+            else
+            {
+                // Replace the oldest, unless it was already removed.
+                if(!shard.removed[shard.next])
+                    shard.entries.erase(shard.added[shard.next]);
+                shard.entries[pEntry] = shard.next;
+                shard.added[shard.next] = pEntry;
+                shard.removed[shard.next] = false;
+                if(++shard.next == shard.added.size())
+                    shard.next = 0;
+            }
+        }
+        shard.mutex.unlock();
+    }
+}
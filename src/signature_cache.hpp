@@ -0,0 +1,99 @@
+/**************************************************************************
+ * Copyright 2019 NextCash, LLC                                           *
+ * Contributors :                                                         *
+ *   Curtis Ellis <curtis@nextcash.tech>                                  *
+ * Distributed under the MIT software license, see the accompanying       *
+ * file license.txt or http://www.opensource.org/licenses/mit-license.php *
+ **************************************************************************/
+#ifndef BITCOIN_SIGNATURE_CACHE_HPP
+#define BITCOIN_SIGNATURE_CACHE_HPP
+
+#include "mutex.hpp"
+#include "hash.hpp"
+#include "base.hpp"
+
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+
+
+namespace BitCoin
+{
+    // Remembers signatures that verified so the same signature isn't verified again when a
+    //   transaction accepted into the mempool is later validated in a block. Entries are a salted
+    //   SHA256 of the signature hash, public key, and signature so they can't be forged.
+    class SignatureCache
+    {
+    public:
+
+        static SignatureCache &instance();
+
+        class Entry
+        {
+        public:
+
+            uint64_t values[4];
+
+            bool operator == (const Entry &pRight) const
+            {
+                return values[0] == pRight.values[0] && values[1] == pRight.values[1] &&
+                  values[2] == pRight.values[2] && values[3] == pRight.values[3];
+            }
+        };
+
+        // Calculate the entry for a signature.
+        void calculate(const NextCash::Hash &pSignatureHash, const uint8_t *pPublicKeyData,
+          unsigned int pPublicKeyDataSize, const uint8_t *pSignatureData,
+          unsigned int pSignatureDataSize, bool pStrictSignatures, Entry &pEntry) const;
+
+        // Returns true if the entry is in the cache. The entry is removed when pRemove is true
+        //   because signatures in blocks aren't verified again.
+        bool contains(const Entry &pEntry, bool pRemove);
+
+        // Add an entry for a signature that verified. The oldest entry in its shard is replaced
+        //   when the shard is full.
+        void add(const Entry &pEntry);
+
+        uint64_t hits() const { return mHits; }
+        uint64_t misses() const { return mMisses; }
+
+    private:
+
+        SignatureCache();
+
+        static const unsigned int SHARD_COUNT = 256;
+
+        class EntryHasher
+        {
+        public:
+            // Entries are uniformly random so part of one is a good hash.
+            size_t operator()(const Entry &pEntry) const { return (size_t)pEntry.values[1]; }
+        };
+
+        // Split by the first byte of the entry so threads rarely wait for each other.
+        class Shard
+        {
+        public:
+
+            Shard() : mutex("SignatureCacheShard") { next = 0; }
+
+            NextCash::Mutex mutex;
+            std::unordered_map<Entry, unsigned int, EntryHasher> entries; // Slot in added.
+            std::vector<Entry> added; // Order entries were added in, for replacement.
+            std::vector<bool> removed; // Slots in added whose entry was removed.
+            unsigned int next;
+
+        };
+
+        uint8_t mSalt[32];
+        unsigned int mShardCapacity;
+        Shard mShards[SHARD_COUNT];
+        std::atomic<uint64_t> mHits, mMisses;
+
+        SignatureCache(const SignatureCache &pCopy);
+        SignatureCache &operator = (const SignatureCache &pRight);
+
+    };
+}
+
+#endif
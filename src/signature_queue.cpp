@@ -0,0 +1,131 @@
+/**************************************************************************
+ * Copyright 2019 NextCash, LLC                                           *
+ * Contributors :                                                         *
+ *   Curtis Ellis <curtis@nextcash.tech>                                  *
+ * Distributed under the MIT software license, see the accompanying       *
+ * file license.txt or http://www.opensource.org/licenses/mit-license.php *
+ **************************************************************************/
+#include "signature_queue.hpp"
+
+#include "log.hpp"
+#include "key.hpp"
+#include "transaction.hpp"
+
+#include <algorithm>
+
+#define BITCOIN_SIGNATURE_QUEUE_LOG_NAME "SigQueue"
+
+
+namespace BitCoin
+{
+    bool SignatureQueue::Entry::set(Transaction *pTransaction, unsigned int pInputOffset,
+      const NextCash::Hash &pSignatureHash, const uint8_t *pPublicKeyData,
+      unsigned int pPublicKeyDataSize, const uint8_t *pSignatureData,
+      unsigned int pSignatureDataSize, bool pStrictSignatures)
+    {
+        if(pSignatureHash.size() != 32 || pPublicKeyDataSize > MAX_PUBLIC_KEY_SIZE ||
+          pSignatureDataSize > MAX_SIGNATURE_SIZE)
+            return false;
+
+        transaction = pTransaction;
+        inputOffset = pInputOffset;
+        std::memcpy(signatureHash, pSignatureHash.data(), 32);
+        std::memcpy(publicKey, pPublicKeyData, pPublicKeyDataSize);
+        publicKeySize = pPublicKeyDataSize;
+        std::memcpy(signature, pSignatureData, pSignatureDataSize);
+        signatureSize = pSignatureDataSize;
+        strictSignatures = pStrictSignatures;
+        failed = false;
+        return true;
+    }
+
+    void SignatureQueue::add(EntryList &pEntries)
+    {
+        if(pEntries.size() == 0)
+            return;
+
+        mMutex.lock();
+        if(mEntries.size() == 0)
+            mEntries.swap(pEntries);
+        else
+            mEntries.insert(mEntries.end(), pEntries.begin(), pEntries.end());
+        mMutex.unlock();
+
+        pEntries.clear();
+    }
+
+    void SignatureQueue::verifyThreadRun(void *pParameter)
+    {
+        SignatureQueue *queue = (SignatureQueue *)pParameter;
+        if(queue == NULL)
+        {
+            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_SIGNATURE_QUEUE_LOG_NAME,
+              "Thread parameter is null. Stopping");
+            return;
+        }
+
+        EntryList::iterator entry, end, parsedEntry;
+        secp256k1_pubkey publicKey;
+        bool parsed = false;
+        unsigned int offset;
+        while(queue->mSuccess)
+        {
+            offset = queue->mNext.fetch_add(BATCH_SIZE);
+            if(offset >= queue->mEntries.size())
+                break;
+
+            entry = queue->mEntries.begin() + offset;
+            if(offset + BATCH_SIZE < queue->mEntries.size())
+                end = entry + BATCH_SIZE;
+            else
+                end = queue->mEntries.end();
+            parsedEntry = end;
+
+            for(; entry != end; ++entry)
+            {
+                // Entries are sorted by public key so reuse the last one parsed when it matches.
+                if(parsedEntry == end || !entry->samePublicKey(*parsedEntry))
+                {
+                    parsed = Key::parsePublicKey(entry->publicKey, entry->publicKeySize,
+                      publicKey);
+                    parsedEntry = entry;
+                }
+
+                if(!parsed || !Key::verify(publicKey, entry->signature, entry->signatureSize,
+                  entry->strictSignatures, entry->signatureHash))
+                {
+                    entry->failed = true;
+                    queue->mSuccess = false;
+                }
+            }
+        }
+    }
+
+    bool SignatureQueue::verify(WorkerPool &pWorkers, unsigned int pThreadCount)
+    {
+        if(mEntries.size() == 0)
+            return true;
+
+        std::sort(mEntries.begin(), mEntries.end());
+
+        mNext = 0;
+        mSuccess = true;
+        pWorkers.run(verifyThreadRun, this, pThreadCount);
+
+        if(mSuccess)
+            return true;
+
+        // Entries not checked after the failure aren't verified either.
+        for(EntryList::iterator entry = mEntries.begin(); entry != mEntries.end(); ++entry)
+        {
+            if(entry->failed)
+                NextCash::Log::addFormatted(NextCash::Log::WARNING,
+                  BITCOIN_SIGNATURE_QUEUE_LOG_NAME,
+                  "Input %d signature is not valid : trans %s", entry->inputOffset,
+                  entry->transaction->hash().hex().text());
+            entry->transaction->clearSignatureVerified(entry->inputOffset);
+        }
+
+        return false;
+    }
+}
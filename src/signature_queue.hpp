@@ -0,0 +1,100 @@
+/**************************************************************************
+ * Copyright 2019 NextCash, LLC                                           *
+ * Contributors :                                                         *
+ *   Curtis Ellis <curtis@nextcash.tech>                                  *
+ * Distributed under the MIT software license, see the accompanying       *
+ * file license.txt or http://www.opensource.org/licenses/mit-license.php *
+ **************************************************************************/
+#ifndef BITCOIN_SIGNATURE_QUEUE_HPP
+#define BITCOIN_SIGNATURE_QUEUE_HPP
+
+#include "mutex.hpp"
+#include "hash.hpp"
+#include "worker_pool.hpp"
+
+#include <atomic>
+#include <vector>
+#include <cstring>
+
+
+namespace BitCoin
+{
+    class Transaction;
+
+    // Signature checks deferred from script processing during block validation so they can be
+    //   verified together after all of the block's scripts are processed.
+    class SignatureQueue
+    {
+    public:
+
+        class Entry
+        {
+        public:
+
+            static const unsigned int MAX_PUBLIC_KEY_SIZE = 65;
+            static const unsigned int MAX_SIGNATURE_SIZE = 80;
+
+            // Returns false if the public key or signature is too large to defer.
+            bool set(Transaction *pTransaction, unsigned int pInputOffset,
+              const NextCash::Hash &pSignatureHash, const uint8_t *pPublicKeyData,
+              unsigned int pPublicKeyDataSize, const uint8_t *pSignatureData,
+              unsigned int pSignatureDataSize, bool pStrictSignatures);
+
+            Transaction *transaction;
+            unsigned int inputOffset;
+            uint8_t signatureHash[32];
+            uint8_t publicKey[MAX_PUBLIC_KEY_SIZE];
+            uint8_t publicKeySize;
+            uint8_t signature[MAX_SIGNATURE_SIZE];
+            uint8_t signatureSize;
+            bool strictSignatures;
+            bool failed;
+
+            bool samePublicKey(const Entry &pRight) const
+            {
+                return publicKeySize == pRight.publicKeySize &&
+                  std::memcmp(publicKey, pRight.publicKey, publicKeySize) == 0;
+            }
+
+            // Sorted by public key so each key is only parsed once per batch.
+            bool operator <(const Entry &pRight) const
+            {
+                if(publicKeySize != pRight.publicKeySize)
+                    return publicKeySize < pRight.publicKeySize;
+                return std::memcmp(publicKey, pRight.publicKey, publicKeySize) < 0;
+            }
+
+        };
+
+        typedef std::vector<Entry> EntryList;
+
+        SignatureQueue() : mMutex("SignatureQueue") { mNext = 0; mSuccess = true; }
+
+        // Move entries deferred by one thread into the queue.
+        void add(EntryList &pEntries);
+
+        unsigned int size() const { return mEntries.size(); }
+
+        // Verify all entries in batches on pThreadCount threads. Returns false if any failed, in
+        //   which case the inputs of all entries and their transactions are marked as not
+        //   verified.
+        bool verify(WorkerPool &pWorkers, unsigned int pThreadCount);
+
+    private:
+
+        static const unsigned int BATCH_SIZE = 256;
+
+        NextCash::Mutex mMutex;
+        EntryList mEntries;
+        std::atomic<unsigned int> mNext;
+        std::atomic<bool> mSuccess;
+
+        static void verifyThreadRun(void *pParameter);
+
+        SignatureQueue(const SignatureQueue &pCopy);
+        SignatureQueue &operator = (const SignatureQueue &pRight);
+
+    };
+}
+
+#endif
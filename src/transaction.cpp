@@ -809,7 +809,8 @@ namespace BitCoin
     }
 
     void Transaction::check(Chain *pChain, const NextCash::Hash &pBlockHash, unsigned int pHeight,
-      bool pCoinBase, int32_t pBlockVersion, CheckStats &pStats)
+      bool pCoinBase, int32_t pBlockVersion, CheckStats &pStats,
+      SignatureQueue::EntryList *pDeferredSignatures)
     {
         mStatus |= WAS_CHECKED | IS_STANDARD;
 
@@ -849,15 +850,15 @@ namespace BitCoin
 #ifdef TRANS_ID_DUP_CHECK
         if(!(mStatus & DUP_CHECKED))
         {
-            pStats.checkDupTimer.start();
-            if(!pChain->outputs().checkDuplicate(hash, pHeight, pBlockHash))
+            pStats.outputsTimer.start();
+            if(!pChain->outputs().checkDuplicate(hash(), pHeight, pBlockHash))
             {
+                pStats.outputsTimer.stop();
                 NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_TRANSACTION_LOG_NAME,
                   "Duplicate hash : trans %s", hash().hex().text());
                 return;
             }
-            pStats.checkDupTimer.stop();
-            pStats.checkDupTime += pStats.checkDupTimer.microseconds();
+            pStats.outputsTimer.stop();
         }
 
         mStatus |= DUP_CHECKED;
@@ -971,6 +972,11 @@ namespace BitCoin
             Output output;
             bool outputPulled; // File "pull" performed.
             index = 0;
+
+            // The signature hashes of all inputs share these so calculate them once up front.
+            if(pChain->forks().cashActive(pHeight))
+                precomputeSignatureHashes();
+
             if(mStatus & OUTPOINTS_FOUND)
             {
                 // Verify outpoints are still unspent
@@ -1198,7 +1204,9 @@ namespace BitCoin
                         continue;
                     }
 
-                    // Check outpoint script
+                    // Check outpoint script. It is processed last so its signature checks can
+                    //   be deferred.
+                    interpreter.setDeferredSignatures(pDeferredSignatures);
                     output.script.setReadOffset(0);
                     if(!interpreter.process(output.script, pBlockVersion, pChain->forks(),
                       pHeight) || !interpreter.isValid())
@@ -1586,8 +1594,9 @@ namespace BitCoin
 
             // BIP-0143 Signature Hash Algorithm
             static const NextCash::Hash zeroHash(32);
-            NextCash::Digest digest(NextCash::Digest::SHA256_SHA256);
-            digest.setOutputEndian(NextCash::Endian::LITTLE);
+
+            if(mOutpointHash.isEmpty() || mSequenceHash.isEmpty() || mOutputHash.isEmpty())
+                precomputeSignatureHashes();
 
             // Version
             pStream->writeUnsignedInt(version);
@@ -1596,39 +1605,13 @@ namespace BitCoin
             if(anyoneCanPay)
                 zeroHash.write(pStream);
             else
-            {
-                if(!mOutpointHash.isEmpty())
-                    mOutpointHash.write(pStream);
-                else
-                {
-                    // All input outpoints
-                    digest.initialize();
-                    for(std::vector<Input>::iterator input = inputs.begin(); input != inputs.end();
-                      ++input)
-                        input->outpoint.write(&digest);
-                    digest.getResult(&mOutpointHash);
-                    mOutpointHash.write(pStream);
-                }
-            }
+                mOutpointHash.write(pStream);
 
             // Hash Sequence
             if(anyoneCanPay || hashType == Signature::SINGLE || hashType == Signature::NONE)
                 zeroHash.write(pStream);
             else
-            {
-                if(!mSequenceHash.isEmpty())
-                    mSequenceHash.write(pStream);
-                else
-                {
-                    // All input sequences
-                    digest.initialize();
-                    for(std::vector<Input>::iterator input = inputs.begin(); input != inputs.end();
-                      ++input)
-                        digest.writeUnsignedInt(input->sequence);
-                    digest.getResult(&mSequenceHash);
-                    mSequenceHash.write(pStream);
-                }
-            }
+                mSequenceHash.write(pStream);
 
             // Outpoint
             if(pInputOffset < inputs.size())
@@ -1661,7 +1644,8 @@ namespace BitCoin
                 {
                     // Only output corresponding to this input
                     NextCash::Hash singleOutputHash(32);
-                    digest.initialize();
+                    NextCash::Digest digest(NextCash::Digest::SHA256_SHA256);
+                    digest.setOutputEndian(NextCash::Endian::LITTLE);
                     outputs[pInputOffset].write(&digest);
                     digest.getResult(&singleOutputHash);
                     singleOutputHash.write(pStream);
@@ -1672,20 +1656,7 @@ namespace BitCoin
             else if(hashType == Signature::NONE)
                 zeroHash.write(pStream);
             else
-            {
-                if(!mOutputHash.isEmpty())
-                    mOutputHash.write(pStream);
-                else
-                {
-                    // All outputs
-                    digest.initialize();
-                    for(std::vector<Output>::iterator output = outputs.begin();
-                      output != outputs.end(); ++output)
-                        output->write(&digest);
-                    digest.getResult(&mOutputHash);
-                    mOutputHash.write(pStream);
-                }
-            }
+                mOutputHash.write(pStream);
 
             // Lock Time
             pStream->writeUnsignedInt(lockTime);
@@ -1821,13 +1792,50 @@ namespace BitCoin
         return true;
     }
 
+    void Transaction::precomputeSignatureHashes()
+    {
+        NextCash::Digest digest(NextCash::Digest::SHA256_SHA256);
+        digest.setOutputEndian(NextCash::Endian::LITTLE);
+
+        if(mOutpointHash.isEmpty())
+        {
+            // All input outpoints
+            for(std::vector<Input>::iterator input = inputs.begin(); input != inputs.end();
+              ++input)
+                input->outpoint.write(&digest);
+            digest.getResult(&mOutpointHash);
+        }
+
+        if(mSequenceHash.isEmpty())
+        {
+            // All input sequences
+            digest.initialize();
+            for(std::vector<Input>::iterator input = inputs.begin(); input != inputs.end();
+              ++input)
+                digest.writeUnsignedInt(input->sequence);
+            digest.getResult(&mSequenceHash);
+        }
+
+        if(mOutputHash.isEmpty())
+        {
+            // All outputs
+            digest.initialize();
+            for(std::vector<Output>::iterator output = outputs.begin(); output != outputs.end();
+              ++output)
+                output->write(&digest);
+            digest.getResult(&mOutputHash);
+        }
+    }
+
     void Transaction::getSignatureHash(const Forks &pForks, unsigned int pHeight,
       NextCash::Hash &pHash, unsigned int pInputOffset, NextCash::Buffer &pOutputScript,
       int64_t pOutputAmount, uint8_t pHashType)
     {
-        // Write appropriate data to a digest
-        NextCash::Digest digest(NextCash::Digest::SHA256_SHA256);
+        // Write appropriate data to a digest. Each thread reuses its own digest so one isn't
+        //   allocated for every signature.
+        static thread_local NextCash::Digest digest(NextCash::Digest::SHA256_SHA256);
         NextCash::stream_size previousReadOffset = pOutputScript.readOffset();
+        digest.initialize();
         digest.setOutputEndian(NextCash::Endian::LITTLE);
         if(writeSignatureData(pForks, pHeight, &digest, pInputOffset, pOutputScript,
           pOutputAmount, pHashType))
@@ -19,6 +19,7 @@
 #include "forks.hpp"
 #include "key.hpp"
 #include "output.hpp"
+#include "signature_queue.hpp"
 #include "timer.hpp"
 
 #include <vector>
@@ -288,8 +289,12 @@ namespace BitCoin
         };
 
         // Check validity
+        // When pDeferredSignatures is provided, signature checks whose failure would make the
+        //   script fail are added to it instead of verified and must be verified before the
+        //   transaction is considered valid.
         void check(Chain *pChain, const NextCash::Hash &pBlockHash, unsigned int pHeight, bool pCoinBase,
-          int32_t pBlockVersion, CheckStats &pStats);
+          int32_t pBlockVersion, CheckStats &pStats,
+          SignatureQueue::EntryList *pDeferredSignatures = NULL);
 
         // Re-check that outpoints are unspent.
         bool checkOutpoints(Chain *pChain, bool pMemPoolIsLocked);
@@ -300,6 +305,11 @@ namespace BitCoin
           NextCash::Hash &pHash, unsigned int pInputOffset, NextCash::Buffer &pOutputScript,
           int64_t pOutputAmount, uint8_t pHashType);
 
+        // Calculate the BIP-0143 hashes of all outpoints, sequences, and outputs that are shared
+        //   by the signature hashes of all inputs. After this signature hashes only read them, so
+        //   inputs can be checked on separate threads.
+        void precomputeSignatureHashes();
+
         /***********************************************************************************************
          * Transaction building
          *
@@ -342,6 +352,17 @@ namespace BitCoin
         // Run unit tests
         static bool test();
 
+        // Mark an input and the transaction as not having a verified signature after a deferred
+        //   signature check failed.
+        void clearSignatureVerified(unsigned int pInputOffset)
+        {
+            if(pInputOffset < inputs.size() &&
+              (inputs[pInputOffset].signatureStatus & Input::VERIFIED))
+                inputs[pInputOffset].signatureStatus ^= Input::VERIFIED;
+            if(mStatus & SIGS_VERIFIED)
+                mStatus ^= SIGS_VERIFIED;
+        }
+
         void setInMemPool() { mStatus |= IN_MEMPOOL; }
         void clearInMemPool() { if(mStatus & IN_MEMPOOL) mStatus ^= IN_MEMPOOL; }
         bool inMemPool() const { return mStatus & IN_MEMPOOL; }
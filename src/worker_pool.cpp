@@ -0,0 +1,128 @@
+/**************************************************************************
+ * Copyright 2018 NextCash, LLC                                           *
+ * Contributors :                                                         *
+ *   Curtis Ellis <curtis@nextcash.tech>                                  *
+ * Distributed under the MIT software license, see the accompanying       *
+ * file license.txt or http://www.opensource.org/licenses/mit-license.php *
+ **************************************************************************/
+#include "worker_pool.hpp"
+
+#include "log.hpp"
+#include "string.hpp"
+
+
+namespace BitCoin
+{
+    WorkerPool::WorkerPool(const char *pName)
+    {
+        mName = pName;
+        mStopping = false;
+        mThreadCount = 0;
+        mThreads = NULL;
+    }
+
+    void WorkerPool::start(unsigned int pThreadCount)
+    {
+        if(mThreads != NULL || pThreadCount == 0)
+            return;
+
+        mStopping = false;
+        mThreadCount = pThreadCount;
+        mThreads = new NextCash::Thread*[mThreadCount];
+        NextCash::String threadName;
+        for(unsigned int i = 0; i < mThreadCount; ++i)
+        {
+            threadName.writeFormatted("%s Worker %d", mName, i);
+            mThreads[i] = new NextCash::Thread(threadName, threadRun, this);
+        }
+
+        NextCash::Log::addFormatted(NextCash::Log::VERBOSE, BITCOIN_WORKER_POOL_LOG_NAME,
+          "Started %d %s workers", mThreadCount, mName);
+    }
+
+    void WorkerPool::stop()
+    {
+        if(mThreads == NULL)
+            return;
+
+        // Threads finish the tasks that are already queued before returning.
+        mMutex.lock();
+        mStopping = true;
+        mMutex.unlock();
+        mTaskCondition.notify_all();
+
+        for(unsigned int i = 0; i < mThreadCount; ++i)
+            delete mThreads[i];
+        delete[] mThreads;
+        mThreads = NULL;
+        mThreadCount = 0;
+    }
+
+    void WorkerPool::run(Function pFunction, void *pParameter, unsigned int pCount)
+    {
+        if(pCount == 0)
+            return;
+
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        if(mStopping || pCount > mThreadCount + 1)
+            pCount = mStopping ? 1 : mThreadCount + 1;
+
+        unsigned int remaining = pCount - 1;
+        for(unsigned int i = 1; i < pCount; ++i)
+            mTasks.push_back(Task(pFunction, pParameter, &remaining));
+
+        lock.unlock();
+        if(pCount > 1)
+            mTaskCondition.notify_all();
+
+        // Work in this thread too, so it completes even if all the workers are busy.
+        pFunction(pParameter);
+
+        // The function only returns when there is no work left, so tasks that haven't started
+        //   don't need to run.
+        lock.lock();
+        for(std::deque<Task>::iterator task = mTasks.begin(); task != mTasks.end();)
+            if(task->remaining == &remaining)
+            {
+                task = mTasks.erase(task);
+                --remaining;
+            }
+            else
+                ++task;
+
+        while(remaining > 0)
+            mCompleteCondition.wait(lock);
+    }
+
+    void WorkerPool::threadRun(void *pParameter)
+    {
+        WorkerPool *pool = (WorkerPool *)pParameter;
+        if(pool == NULL)
+        {
+            NextCash::Log::add(NextCash::Log::WARNING, BITCOIN_WORKER_POOL_LOG_NAME,
+              "Thread parameter is null. Stopping");
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(pool->mMutex);
+        while(true)
+        {
+            while(!pool->mStopping && pool->mTasks.empty())
+                pool->mTaskCondition.wait(lock);
+
+            if(pool->mTasks.empty())
+                break; // Stopping
+
+            Task task = pool->mTasks.front();
+            pool->mTasks.pop_front();
+
+            lock.unlock();
+            task.function(task.parameter);
+            lock.lock();
+
+            if(--*task.remaining == 0)
+                pool->mCompleteCondition.notify_all();
+        }
+    }
+}
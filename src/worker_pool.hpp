@@ -0,0 +1,82 @@
+/**************************************************************************
+ * Copyright 2018 NextCash, LLC                                           *
+ * Contributors :                                                         *
+ *   Curtis Ellis <curtis@nextcash.tech>                                  *
+ * Distributed under the MIT software license, see the accompanying       *
+ * file license.txt or http://www.opensource.org/licenses/mit-license.php *
+ **************************************************************************/
+#ifndef BITCOIN_WORKER_POOL_HPP
+#define BITCOIN_WORKER_POOL_HPP
+
+#include "thread.hpp"
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#define BITCOIN_WORKER_POOL_LOG_NAME "Workers"
+
+
+namespace BitCoin
+{
+    // Long lived threads that run the thread functions of multi-threaded operations so threads
+    //   aren't created and deleted for each block. Thread functions take work from their
+    //   parameter until there is none left, so the threads running them balance the load.
+    class WorkerPool
+    {
+    public:
+
+        typedef void (*Function)(void *pParameter);
+
+        WorkerPool(const char *pName);
+        ~WorkerPool() { stop(); }
+
+        // Start pThreadCount threads. The thread calling run also runs the function so
+        //   pThreadCount is usually one less than the number of threads wanted.
+        void start(unsigned int pThreadCount);
+        void stop();
+
+        unsigned int threadCount() const { return mThreadCount; }
+
+        // Run pFunction(pParameter) on up to pCount threads, including the calling thread, and
+        //   return when they have all returned. pFunction must only return when there is no work
+        //   left because copies that haven't started when the calling thread's copy returns are
+        //   skipped. Multiple threads can call run at the same time.
+        void run(Function pFunction, void *pParameter, unsigned int pCount);
+
+    private:
+
+        class Task
+        {
+        public:
+
+            Task(Function pFunction, void *pParameter, unsigned int *pRemaining)
+            {
+                function = pFunction;
+                parameter = pParameter;
+                remaining = pRemaining;
+            }
+
+            Function function;
+            void *parameter;
+            unsigned int *remaining; // Tasks of the same run that haven't returned.
+
+        };
+
+        const char *mName;
+        std::mutex mMutex;
+        std::condition_variable mTaskCondition, mCompleteCondition;
+        std::deque<Task> mTasks;
+        bool mStopping;
+        unsigned int mThreadCount;
+        NextCash::Thread **mThreads;
+
+        static void threadRun(void *pParameter);
+
+        WorkerPool(const WorkerPool &pCopy);
+        WorkerPool &operator = (const WorkerPool &pRight);
+
+    };
+}
+
+#endif